@@ -14,14 +14,18 @@
 
 #include <busybus.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 
 static char* method = NULL;
 static char* argdescr = NULL;
+static char* retdescr = NULL;
 static char** argstart = NULL;
 static char** argend = NULL;
 static char* cliname = "bbus-call";
+static char* timeout = NULL;
+static char* compress = NULL;
 
 static void BBUS_PRINTF_FUNC(1, 2) BBUS_NORETURN die(const char* format, ...)
 {
@@ -54,6 +58,31 @@ static struct bbus_option cmdopts[] = {
 		.action = BBUS_OPTACT_GETOPTARG,
 		.actdata = &cliname,
 		.descr = "name by which the program shall identify itself",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "retdescr",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_GETOPTARG,
+		.actdata = &retdescr,
+		.descr = "description of the returned object "
+			 "(default: same as the argument)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "timeout",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_GETOPTARG,
+		.actdata = &timeout,
+		.descr = "give up after this many milliseconds",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "compress",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_GETOPTARG,
+		.actdata = &compress,
+		.descr = "compress arguments at least this many bytes long",
 	}
 };
 
@@ -91,6 +120,10 @@ int main(int argc, char** argv)
 	char reprbuf[BUFSIZ];
 	char* descr;
 	struct bbus_nonopts* nonopts;
+	struct bbus_timeval tv;
+	unsigned long ms;
+	unsigned long thr;
+	char* end;
 
 	r = bbus_parse_args(argc, argv, &optlist, &nonopts);
 	if (r == BBUS_ARGS_HELP)
@@ -109,6 +142,16 @@ int main(int argc, char** argv)
 	if (conn == NULL)
 		goto err_conn;
 
+	if (compress != NULL) {
+		thr = strtoul(compress, &end, 10);
+		if ((*end != '\0') || (thr == 0)) {
+			bbus_closeconn(conn);
+			die("Invalid compression threshold: %s\n", compress);
+		}
+
+		bbus_setcomprthreshold(conn, thr);
+	}
+
 	arg = bbus_obj_alloc();
 	if (arg == NULL)
 		goto err_arg;
@@ -131,7 +174,20 @@ int main(int argc, char** argv)
 		}
 	}
 
-	ret = bbus_callmethod(conn, method, arg);
+	if (timeout != NULL) {
+		ms = strtoul(timeout, &end, 10);
+		if ((*end != '\0') || (ms == 0)) {
+			bbus_closeconn(conn);
+			bbus_obj_free(arg);
+			die("Invalid timeout: %s\n", timeout);
+		}
+
+		tv.sec = ms / 1000;
+		tv.usec = (ms % 1000) * 1000;
+		ret = bbus_callmethod_timeout(conn, method, arg, &tv);
+	} else {
+		ret = bbus_callmethod(conn, method, arg);
+	}
 	if (ret == NULL) {
 		if (bbus_lasterror() == BBUS_ENOMETHOD) {
 			/*
@@ -145,7 +201,8 @@ int main(int argc, char** argv)
 	}
 
 	memset(reprbuf, 0, BUFSIZ);
-	r = bbus_obj_repr(ret, descr, reprbuf, BUFSIZ);
+	r = bbus_obj_repr(ret, retdescr != NULL ? retdescr : descr,
+						reprbuf, BUFSIZ);
 	if (r < 0)
 		goto err_repr;
 	fprintf(stdout, "%s\n", reprbuf);
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <busybus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+static char* command = NULL;
+
+static void BBUS_PRINTF_FUNC(1, 2) BBUS_NORETURN die(const char* format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	vfprintf(stderr, format, va);
+	va_end(va);
+	exit(EXIT_FAILURE);
+}
+
+static void opt_setsockpath(const char* path)
+{
+	bbus_prot_setsockpath(path);
+}
+
+static struct bbus_option cmdopts[] = {
+	{
+		.shortopt = 0,
+		.longopt = "sockpath",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setsockpath,
+		.descr = "path to the busybus socket",
+	}
+};
+
+static struct bbus_posarg posargs[] = {
+	{
+		.action = BBUS_OPTACT_GETOPTARG,
+		.actdata = &command,
+		.descr = "control command: stats, methods [PREFIX], "
+			 "get, set NAME VALUE, tracepoints or allocs",
+	}
+};
+
+static struct bbus_opt_list optlist = {
+	.opts = cmdopts,
+	.numopts = BBUS_ARRAY_SIZE(cmdopts),
+	.pargs = posargs,
+	.numpargs = BBUS_ARRAY_SIZE(posargs),
+	.progname = "Busybus",
+	.version = "ALPHA",
+	.progdescr = "bbus-ctl: inspect and tune a running busybus daemon",
+};
+
+static int print_values(bbus_object* obj)
+{
+	bbus_size num, i;
+	bbus_uint32 val;
+	char* name;
+
+	if (bbus_obj_extrarray(obj, &num) < 0)
+		return -1;
+
+	for (i = 0; i < num; ++i) {
+		if ((bbus_obj_extrstr(obj, &name) < 0)
+				|| (bbus_obj_extruint(obj, &val) < 0))
+			return -1;
+
+		fprintf(stdout, "%s\t%u\n", name, val);
+	}
+
+	return 0;
+}
+
+static int print_methods(bbus_object* obj)
+{
+	bbus_uint32 vals[7];
+	bbus_size num, i;
+	char* name;
+	int j;
+
+	if (bbus_obj_extrarray(obj, &num) < 0)
+		return -1;
+
+	fprintf(stdout, "%-32s %8s %8s %8s %8s %8s %8s %8s\n", "method",
+			"calls", "errors", "mean", "p50", "p90", "p99", "max");
+	for (i = 0; i < num; ++i) {
+		if (bbus_obj_extrstr(obj, &name) < 0)
+			return -1;
+
+		for (j = 0; j < 7; ++j) {
+			if (bbus_obj_extruint(obj, &vals[j]) < 0)
+				return -1;
+		}
+
+		fprintf(stdout, "%-32s %8u %8u %8u %8u %8u %8u %8u\n", name,
+				vals[0], vals[1], vals[2], vals[3],
+				vals[4], vals[5], vals[6]);
+	}
+
+	return 0;
+}
+
+static int print_tracepoints(bbus_object* obj)
+{
+	bbus_uint32 vals[6];
+	bbus_size num, i;
+	char* event;
+	int j;
+
+	if (bbus_obj_extrarray(obj, &num) < 0)
+		return -1;
+
+	for (i = 0; i < num; ++i) {
+		for (j = 0; j < 3; ++j) {
+			if (bbus_obj_extruint(obj, &vals[j]) < 0)
+				return -1;
+		}
+
+		if (bbus_obj_extrstr(obj, &event) < 0)
+			return -1;
+
+		for (j = 3; j < 6; ++j) {
+			if (bbus_obj_extruint(obj, &vals[j]) < 0)
+				return -1;
+		}
+
+		fprintf(stdout, "%u.%09u %2u %-8s %u %u %u\n", vals[0],
+				vals[1], vals[2], event, vals[3],
+				vals[4], vals[5]);
+	}
+
+	return 0;
+}
+
+static int print_allocs(bbus_object* obj)
+{
+	bbus_uint32 allocs, bytes;
+	bbus_size num, i;
+	char* site;
+
+	if (bbus_obj_extrarray(obj, &num) < 0)
+		return -1;
+
+	fprintf(stdout, "%-40s %10s %12s\n", "site", "allocs", "bytes");
+	for (i = 0; i < num; ++i) {
+		if ((bbus_obj_extrstr(obj, &site) < 0)
+				|| (bbus_obj_extruint(obj, &allocs) < 0)
+				|| (bbus_obj_extruint(obj, &bytes) < 0))
+			return -1;
+
+		fprintf(stdout, "%-40s %10u %12u\n", site, allocs, bytes);
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	bbus_client_connection* conn;
+	struct bbus_nonopts* nonopts;
+	bbus_object* arg = NULL;
+	bbus_object* ret;
+	unsigned long val;
+	char* end;
+	int r;
+
+	r = bbus_parse_args(argc, argv, &optlist, &nonopts);
+	if (r == BBUS_ARGS_HELP)
+		return EXIT_SUCCESS;
+	else if (r == BBUS_ARGS_ERR)
+		return EXIT_FAILURE;
+
+	if (strcmp(command, "set") == 0) {
+		if (nonopts->numargs != 2)
+			die("Usage: bbus-ctl set NAME VALUE\n");
+
+		val = strtoul(nonopts->args[1], &end, 0);
+		if ((*end != '\0') || (val > UINT32_MAX))
+			die("Invalid value: %s\n", nonopts->args[1]);
+
+		arg = bbus_obj_build("su", nonopts->args[0],
+						(bbus_uint32)val);
+	} else
+	if ((strcmp(command, "methods") == 0) && (nonopts->numargs > 0)) {
+		arg = bbus_obj_build("s", nonopts->args[0]);
+	} else
+	if (nonopts->numargs > 0) {
+		die("Too many arguments for '%s'\n", command);
+	}
+
+	if ((nonopts->numargs > 0) && (arg == NULL))
+		die("Error creating the argument object: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	conn = bbus_ctl_connect();
+	if (conn == NULL)
+		die("Error connecting to bbusd: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	ret = bbus_ctl_request(conn, command, arg);
+	bbus_obj_free(arg);
+	if (ret == NULL) {
+		bbus_closeconn(conn);
+		die("Control request '%s' failed: %s\n", command,
+				bbus_strerror(bbus_lasterror()));
+	}
+
+	if (strcmp(command, "methods") == 0)
+		r = print_methods(ret);
+	else if (strcmp(command, "tracepoints") == 0)
+		r = print_tracepoints(ret);
+	else if (strcmp(command, "allocs") == 0)
+		r = print_allocs(ret);
+	else
+		r = print_values(ret);
+
+	bbus_obj_free(ret);
+	bbus_closeconn(conn);
+	if (r < 0)
+		die("Malformed reply from bbusd: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	return EXIT_SUCCESS;
+}
@@ -13,6 +13,16 @@
  */
 
 #include <busybus.h>
+
+#define BBUS_STUB_PREFIX	echod
+#define BBUS_STUB_SERVICE	"echod"
+#define BBUS_STUB_SERVER
+#define BBUS_STUB_METHODS(METHOD)					\
+	METHOD(echo, echo_args, echo_ret)
+#define echo_args(FIELD)	FIELD(STR, msg)
+#define echo_ret(FIELD)		FIELD(STR, msg)
+#include <busybus-stub.h>
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
@@ -49,25 +59,14 @@ static void sighandler(int signum)
 	}
 }
 
-static bbus_object* rm_echo(bbus_object* arg)
+int echod_echo_impl(const struct echod_echo_args* args,
+				struct echod_echo_ret* ret)
 {
-	char* msg;
-	int ret;
+	ret->msg = args->msg;
 
-	ret = bbus_obj_parse(arg, "s", &msg);
-	if (ret < 0)
-		return NULL;
-	else
-		return bbus_obj_build("s", msg);
+	return 0;
 }
 
-struct bbus_method echo_method = {
-	.name = "echo",
-	.argdscr = "s",
-	.retdscr = "s",
-	.func = rm_echo,
-};
-
 static struct bbus_opt_list optlist = {
 	.opts = NULL,
 	.numopts = 0,
@@ -97,9 +96,9 @@ int main(int argc BBUS_UNUSED, char** argv BBUS_UNUSED)
 				bbus_strerror(bbus_lasterror()));
 	}
 
-	ret = bbus_srvc_regmethod(conn, &echo_method);
+	ret = echod_register(conn);
 	if (ret < 0) {
-		die("Error registering method: %s\n",
+		die("Error registering methods: %s\n",
 				bbus_strerror(bbus_lasterror()));
 	}
 
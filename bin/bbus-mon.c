@@ -16,10 +16,15 @@
 #include <stdio.h>
 #include <signal.h>
 #include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
 
 static unsigned char __msgbuf[BBUS_MAXMSGSIZE];
 static struct bbus_msg* msgbuf = (struct bbus_msg*)__msgbuf;
 static volatile int run;
+static struct bbus_mon_filter filter;
+static int usefilter;
+static const char* replaypath;
 
 static void BBUS_PRINTF_FUNC(1, 2) BBUS_NORETURN die(const char* format, ...)
 {
@@ -31,6 +36,111 @@ static void BBUS_PRINTF_FUNC(1, 2) BBUS_NORETURN die(const char* format, ...)
 	exit(EXIT_FAILURE);
 }
 
+static unsigned parse_uint(const char* str, const char* what)
+{
+	char* end;
+	long val;
+
+	val = strtol(str, &end, 0);
+	if ((end == str) || (val < 0))
+		die("Invalid %s: '%s'\n", what, str);
+
+	return (unsigned)val;
+}
+
+static void opt_settypes(const char* arg)
+{
+	const char* pos = arg;
+	char* end;
+	long type;
+
+	do {
+		type = strtol(pos, &end, 0);
+		if ((end == pos) || (type < 0) || (type >= 32)
+				|| ((*end != ',') && (*end != '\0')))
+			die("Invalid message type list: '%s'\n", arg);
+		filter.msgtypes |= 1u << type;
+		pos = end + 1;
+	} while (*end == ',');
+
+	usefilter = 1;
+}
+
+static void opt_setprefix(const char* arg)
+{
+	filter.prefix = arg;
+	usefilter = 1;
+}
+
+static void opt_setregex(const char* arg)
+{
+	filter.regex = arg;
+	usefilter = 1;
+}
+
+static void opt_setsample(const char* arg)
+{
+	filter.sample = parse_uint(arg, "sampling rate");
+	usefilter = 1;
+}
+
+static void opt_setreplay(const char* arg)
+{
+	replaypath = arg;
+}
+
+static struct bbus_option cmdopts[] = {
+	{
+		.shortopt = 't',
+		.longopt = "types",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_settypes,
+		.descr = "comma-separated list of message types to show",
+	},
+	{
+		.shortopt = 'p',
+		.longopt = "prefix",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setprefix,
+		.descr = "only show messages with meta starting with this",
+	},
+	{
+		.shortopt = 'r',
+		.longopt = "regex",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setregex,
+		.descr = "only show messages with meta matching this pattern",
+	},
+	{
+		.shortopt = 's',
+		.longopt = "sample",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setsample,
+		.descr = "only show every n-th matching message",
+	},
+	{
+		.shortopt = 'f',
+		.longopt = "replay",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setreplay,
+		.descr = "decode a trace file written by bbusd --capture "
+			 "instead of connecting to bbusd",
+	}
+};
+
+static struct bbus_opt_list optlist = {
+	.opts = cmdopts,
+	.numopts = BBUS_ARRAY_SIZE(cmdopts),
+	.progname = "bbus-mon",
+	.version = "ALPHA",
+	.progdescr = "Busybus bus monitor."
+};
+
 static int do_run(void)
 {
 	return BBUS_ATOMIC_GET(run);
@@ -65,11 +175,16 @@ static const char* str_msgtype(unsigned char msgtype)
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SRVACK);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_CLICALL);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_CLIREPLY);
+	PRES_CASE_PROPVAL(BBUS_MSGTYPE_CLISIG);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SRVCALL);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SRVREPLY);
+	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SRVSIG);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_CLOSE);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_CTRL);
 	PRES_CASE_PROPVAL(BBUS_MSGTYPE_MON);
+	PRES_CASE_PROPVAL(BBUS_MSGTYPE_MONFLTR);
+	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SIGSUB);
+	PRES_CASE_PROPVAL(BBUS_MSGTYPE_SIGUNSUB);
 	PRES_DEF_WRONGVAL;
 	}
 }
@@ -112,6 +227,29 @@ static const char* str_flags(unsigned char flags)
 	return "<no flags set>";
 }
 
+/* Every monitor message has the same layout - compile it once. */
+static bbus_obj_prog* msgprog;
+
+static void print_fields(unsigned char msgtype, unsigned char sotype,
+		unsigned char errcode, unsigned token, unsigned psize,
+		unsigned char flags, const char* msgmeta)
+{
+	printf("{\n");
+	printf("\tmsgtype\t=\t%s\n", str_msgtype(msgtype));
+	printf("\tsotype\t=\t%s\n", str_sotype(sotype));
+	printf("\terrcode\t=\t%s\n", str_errcode(errcode));
+	printf("\ttoken\t=\t%u\n", token);
+	printf("\tpsize\t=\t%u\n", psize);
+	printf("\tflags\t=\t%s\n", str_flags(flags));
+	printf("\tmeta\t=\t");
+	if (strlen(msgmeta) == 0) {
+		printf("<no meta>");
+	} else {
+		printf("\"%s\"", msgmeta);
+	}
+	printf("\n}\n");
+}
+
 static void print_msg_info(const char* meta, bbus_object* obj)
 {
 	unsigned char msgtype;
@@ -123,7 +261,7 @@ static void print_msg_info(const char* meta, bbus_object* obj)
 	char* msgmeta;
 	int ret;
 
-	ret = bbus_obj_parse(obj, "bbbuubs", &msgtype, &sotype, &errcode,
+	ret = bbus_obj_parse_prog(obj, msgprog, &msgtype, &sotype, &errcode,
 					&token, &psize, &flags, &msgmeta);
 	if (ret < 0) {
 		die("Error extracting message data from object: %s\n",
@@ -131,23 +269,96 @@ static void print_msg_info(const char* meta, bbus_object* obj)
 	}
 
 	printf("Message %s\n", meta);
-	printf("{\n");
-	printf("\tmsgtype\t=\t%s\n", str_msgtype(msgtype));
-	printf("\tsotype\t=\t%s\n", str_sotype(sotype));
-	printf("\terrcode\t=\t%s\n", str_errcode(errcode));
-	printf("\ttoken\t=\t%u\n", token);
-	printf("\tpsize\t=\t%u\n", psize);
-	printf("\tflags\t=\t%s\n", str_flags(flags));
-	printf("\tmeta\t=\t");
-	if (strlen(msgmeta) == 0) {
-		printf("<no meta>");
-	} else {
-		printf("\"%s\"", msgmeta);
+	print_fields(msgtype, sotype, errcode, token, psize, flags, msgmeta);
+}
+
+static void print_dropped(bbus_object* obj)
+{
+	bbus_uint32 dropped;
+	int ret;
+
+	ret = bbus_obj_parse(obj, "u", &dropped);
+	if (ret < 0) {
+		die("Error extracting the drop counter from object: %s\n",
+					bbus_strerror(bbus_lasterror()));
 	}
-	printf("\n}\n");
+
+	printf("<%u messages dropped>\n", dropped);
+}
+
+/* Same rules bbusd applies to live monitors. */
+static int replay_matches(const struct bbus_msg_hdr* hdr, const char* meta)
+{
+	static unsigned skipped;
+
+	if (filter.msgtypes != 0) {
+		if ((hdr->msgtype >= 32)
+				|| !(filter.msgtypes & (1u << hdr->msgtype)))
+			return 0;
+	}
+
+	if (filter.prefix && (strncmp(meta, filter.prefix,
+					strlen(filter.prefix)) != 0))
+		return 0;
+
+	if (filter.regex) {
+		switch (bbus_regex_match(filter.regex, meta)) {
+		case BBUS_TRUE:
+			break;
+		case BBUS_FALSE:
+			return 0;
+		default:
+			die("Invalid regex pattern: '%s'\n", filter.regex);
+		}
+	}
+
+	if (filter.sample > 1) {
+		if (++skipped < filter.sample)
+			return 0;
+		skipped = 0;
+	}
+
+	return 1;
 }
 
-int main(int argc BBUS_UNUSED, char** argv BBUS_UNUSED)
+static int replay(void)
+{
+	struct bbus_trace_event ev;
+	bbus_trace* trace;
+	const char* meta;
+	int ret;
+
+	trace = bbus_trace_open(replaypath);
+	if (trace == NULL) {
+		die("Error opening the trace file '%s': %s\n", replaypath,
+					bbus_strerror(bbus_lasterror()));
+	}
+
+	while ((ret = bbus_trace_next(trace, &ev)) > 0) {
+		meta = ev.meta == NULL ? "" : ev.meta;
+		if (!replay_matches(&ev.hdr, meta))
+			continue;
+
+		printf("Message %s at %" PRIu64 ".%09" PRIu64
+			" (thread %u)\n",
+			ev.direction == BBUS_TRACE_SENT ? "sent" : "received",
+			ev.tstamp / 1000000000, ev.tstamp % 1000000000,
+			ev.shard);
+		print_fields(ev.hdr.msgtype, ev.hdr.sotype, ev.hdr.errcode,
+				bbus_hdr_gettoken(&ev.hdr),
+				bbus_hdr_getpsize(&ev.hdr), ev.hdr.flags, meta);
+	}
+
+	bbus_trace_close(trace);
+	if (ret < 0) {
+		die("Malformed record in the trace file: %s\n",
+					bbus_strerror(bbus_lasterror()));
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv)
 {
 	bbus_client_connection* conn;
 	int ret;
@@ -155,12 +366,35 @@ int main(int argc BBUS_UNUSED, char** argv BBUS_UNUSED)
 	bbus_object* obj;
 	const char* meta;
 
+	ret = bbus_parse_args(argc, argv, &optlist, NULL);
+	if (ret == BBUS_ARGS_HELP)
+		return EXIT_SUCCESS;
+	else if (ret == BBUS_ARGS_ERR)
+		return EXIT_FAILURE;
+
+	if (replaypath != NULL)
+		return replay();
+
+	msgprog = bbus_obj_compile("bbbuubs");
+	if (msgprog == NULL) {
+		die("Error compiling the message description: %s\n",
+			bbus_strerror(bbus_lasterror()));
+	}
+
 	conn = bbus_mon_connect();
 	if (conn == NULL) {
 		die("Error connecting to bbusd: %s\n",
 			bbus_strerror(bbus_lasterror()));
 	}
 
+	if (usefilter) {
+		ret = bbus_mon_setfilter(conn, &filter);
+		if (ret < 0) {
+			die("Error setting the monitor filter: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		}
+	}
+
 	(void)signal(SIGTERM, sighandler);
 	(void)signal(SIGINT, sighandler);
 
@@ -183,11 +417,16 @@ int main(int argc BBUS_UNUSED, char** argv BBUS_UNUSED)
 			/* Timeout. */
 			continue;
 		} else {
-			print_msg_info(meta, obj);
+			if (meta && (strcmp(meta, "dropped") == 0))
+				print_dropped(obj);
+			else
+				print_msg_info(meta, obj);
+			bbus_obj_free(obj);
 		}
 	}
 
 	bbus_closeconn(conn);
+	bbus_obj_prog_free(msgprog);
 
 	return 0;
 }
@@ -19,6 +19,10 @@
 #include <signal.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 #include "bbusd/log.h"
 #include "bbusd/common.h"
 #include "bbusd/service.h"
@@ -29,14 +33,194 @@
 #include "bbusd/callers.h"
 #include "bbusd/monitor.h"
 #include "bbusd/auth.h"
+#include "bbusd/shard.h"
+#include "bbusd/capture.h"
+#include "bbusd/stats.h"
+#include "bbusd/control.h"
+#include "bbusd/timer.h"
+#include "bbusd/signals.h"
+#include "bbusd/tracepoint.h"
+#include "bbusd/bridge.h"
+#include "bbusd/plugins.h"
+#include "bbusd/replycache.h"
 
 static volatile int run;
+/* Woken up from the signal handler - the main loop has no poll timeout. */
+static bbus_pollset* mainpollset;
+static unsigned numthreads = 1;
+static unsigned monqueuelen = BBUSD_MON_DEFQUEUELEN;
+static enum bbusd_mon_drop mondrop = BBUSD_MON_DROPOLDEST;
+static const char* capturepath;
+/* Sizing hints, 0 if not given. */
+static unsigned expclients;
+static unsigned expmethods;
+/* Spin time in microseconds for shards serving busy-polling clients. */
+static unsigned busypoll = BBUS_BUSYPOLL_DEFUSEC;
+/* Number of clients of this shard that connected with BBUS_CONN_BUSYPOLL. */
+static BBUS_THREAD_LOCAL unsigned busypollers;
+static unsigned tpentries = BBUSD_TP_DEFENTRIES;
+static int usesyslog;
+static int allocstats;
+/* Addresses listened on apart from the socket path. */
+static const char* listenaddrs[BBUS_POLLSET_MAXSRVS - 1];
+static unsigned numlisten;
+static const char* pluginpaths[BBUSD_MAXPLUGINS];
+static unsigned numplugins;
+static unsigned pluginworkers = BBUSD_PLUGIN_DEFWORKERS;
+static unsigned rcacheentries = BBUSD_RCACHE_DEFENTRIES;
 
 static void opt_setsockpath(const char* path)
 {
 	bbus_prot_setsockpath(path);
 }
 
+static void opt_setthreads(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > BBUSD_MAXSHARDS))
+		bbusd_die("Number of threads must be between 1 and %d\n",
+							BBUSD_MAXSHARDS);
+
+	numthreads = (unsigned)val;
+}
+
+static void opt_setmonqueue(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > 65536))
+		bbusd_die("Monitor queue length must be between 1 and 65536\n");
+
+	monqueuelen = (unsigned)val;
+}
+
+static void opt_setmondrop(const char* policy)
+{
+	if (strcmp(policy, "oldest") == 0)
+		mondrop = BBUSD_MON_DROPOLDEST;
+	else if (strcmp(policy, "newest") == 0)
+		mondrop = BBUSD_MON_DROPNEWEST;
+	else
+		bbusd_die("Monitor drop policy must be 'oldest' or 'newest'\n");
+}
+
+static void opt_setbalance(const char* policy)
+{
+	if (strcmp(policy, "least") == 0)
+		bbusd_set_balance(BBUSD_BALANCE_LEAST);
+	else if (strcmp(policy, "rr") == 0)
+		bbusd_set_balance(BBUSD_BALANCE_RR);
+	else
+		bbusd_die("Balancing policy must be 'least' or 'rr'\n");
+}
+
+static unsigned parse_hint(const char* num, const char* what)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 0) || (val > 1000000))
+		bbusd_die("Number of %s must be between 0 and 1000000\n", what);
+
+	return (unsigned)val;
+}
+
+static void opt_setexpclients(const char* num)
+{
+	expclients = parse_hint(num, "clients");
+}
+
+static void opt_setexpmethods(const char* num)
+{
+	expmethods = parse_hint(num, "methods");
+}
+
+static void opt_setbusypoll(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 0) || (val > 1000000))
+		bbusd_die("Busy-poll time must be between 0 and 1000000 us\n");
+
+	busypoll = (unsigned)val;
+}
+
+static void opt_settracepoints(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > 1048576))
+		bbusd_die("Tracepoint buffer must hold between 1 and "
+						"1048576 records\n");
+
+	tpentries = (unsigned)val;
+	bbusd_tp_setenabled(1);
+}
+
+static void opt_setcapture(const char* path)
+{
+	capturepath = path;
+}
+
+static void opt_addlisten(const char* addr)
+{
+	if (numlisten == BBUS_ARRAY_SIZE(listenaddrs))
+		bbusd_die("At most %u additional addresses can be listened on\n",
+				(unsigned)BBUS_ARRAY_SIZE(listenaddrs));
+
+	listenaddrs[numlisten++] = addr;
+}
+
+static void opt_addexport(const char* spec)
+{
+	if (bbusd_bridge_export(spec) < 0)
+		bbusd_die("Invalid export: '%s', PREFIX@ADDR expected\n", spec);
+}
+
+static void opt_addplugin(const char* path)
+{
+	if (numplugins == BBUS_ARRAY_SIZE(pluginpaths))
+		bbusd_die("At most %u plugins can be loaded\n",
+				(unsigned)BBUS_ARRAY_SIZE(pluginpaths));
+
+	pluginpaths[numplugins++] = path;
+}
+
+static void opt_setpluginworkers(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 1) || (val > BBUSD_PLUGIN_MAXWORKERS))
+		bbusd_die("Number of plugin workers must be between 1 and "
+					"%d\n", BBUSD_PLUGIN_MAXWORKERS);
+
+	pluginworkers = (unsigned)val;
+}
+
+static void opt_setreplycache(const char* num)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < 0) || (val > 65536))
+		bbusd_die("Reply cache size must be between 0 and 65536\n");
+
+	rcacheentries = (unsigned)val;
+}
+
 static struct bbus_option cmdopts[] = {
 	{
 		.shortopt = 0,
@@ -45,6 +229,147 @@ static struct bbus_option cmdopts[] = {
 		.action = BBUS_OPTACT_CALLFUNC,
 		.actdata = &opt_setsockpath,
 		.descr = "path to the busybus socket",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "listen",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_addlisten,
+		.descr = "also accept clients on this address, e.g. "
+			 "'tcp:HOST:PORT' or 'vsock:CID:PORT' (can be "
+			 "repeated)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "export",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_addexport,
+		.descr = "export the methods under PREFIX (e.g. "
+			 "'bbus.sensors') to the daemon at ADDR, given as "
+			 "PREFIX@ADDR (can be repeated)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "plugin",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_addplugin,
+		.descr = "load local methods from this plugin (can be "
+			 "repeated)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "plugin-workers",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setpluginworkers,
+		.descr = "number of threads running plugin methods "
+			 "(default: 2)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "reply-cache",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setreplycache,
+		.descr = "replies of cacheable methods kept per reactor "
+			 "thread, 0 disables (default: 256)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "threads",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setthreads,
+		.descr = "number of reactor threads (default: 1)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "monqueue",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setmonqueue,
+		.descr = "notifications queued per monitor (default: 256)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "mondrop",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setmondrop,
+		.descr = "notifications dropped from full monitor queues: "
+			 "'oldest' (default) or 'newest'",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "balance",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setbalance,
+		.descr = "how calls are spread across services providing "
+			 "the same method: 'least' outstanding calls "
+			 "(default) or 'rr' for round-robin",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "capture",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setcapture,
+		.descr = "write every message passing through bbusd to "
+			 "this trace file",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "expect-clients",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setexpclients,
+		.descr = "number of clients to size the routing state for",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "expect-methods",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setexpmethods,
+		.descr = "number of methods to size the service map for",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "busy-poll",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setbusypoll,
+		.descr = "microseconds to spin before sleeping while serving "
+			 "busy-polling clients, 0 disables (default: 50)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "tracepoints",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_settracepoints,
+		.descr = "record the last ENTRIES tracepoint hits of every "
+			 "thread from startup (default: 4096, off)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "syslog",
+		.hasarg = BBUS_OPT_NOARG,
+		.action = BBUS_OPTACT_SETFLAG,
+		.actdata = &usesyslog,
+		.descr = "log to syslog instead of the console",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "alloc-stats",
+		.hasarg = BBUS_OPT_NOARG,
+		.action = BBUS_OPTACT_SETFLAG,
+		.actdata = &allocstats,
+		.descr = "account every allocation from startup",
 	}
 };
 
@@ -56,6 +381,12 @@ static struct bbus_opt_list optlist = {
 	.progdescr = "Tiny message bus daemon."
 };
 
+/* Clients are spread evenly over the shards. */
+static unsigned shard_clients(void)
+{
+	return (expclients + numthreads - 1) / numthreads;
+}
+
 static int do_run(void)
 {
 	return BBUS_ATOMIC_GET(run);
@@ -72,6 +403,8 @@ static void sighandler(int signum)
 	case SIGINT:
 	case SIGTERM:
 		do_stop();
+		/* Only writes to a pipe - safe in a signal handler. */
+		(void)bbus_pollset_wakeup(mainpollset);
 		break;
 	}
 }
@@ -86,6 +419,28 @@ static char* mname_from_srvcname(const char* srvc)
 	return found;
 }
 
+/*
+ * Every message passing through bbusd goes to the capture file, if any,
+ * and the monitors.
+ */
+static void notify_recvd(const struct bbus_msg* msg)
+{
+	bbusd_capture_recvd(msg);
+	bbusd_mon_notify_recvd(msg);
+}
+
+static void notify_sent(const struct bbus_msg_hdr* hdr, const char* meta,
+			bbus_object* obj, const void* raw, size_t rawsize)
+{
+	if (obj != NULL) {
+		raw = bbus_obj_rawdata(obj);
+		rawsize = bbus_obj_rawsize(obj);
+	}
+
+	bbusd_capture_sent(hdr, meta, raw, rawsize);
+	bbusd_mon_notify_sent(hdr, meta, obj);
+}
+
 /*
  * Send the message to client and notify the monitors if succeeded.
  */
@@ -96,27 +451,458 @@ static int send_message(bbus_client* cli, struct bbus_msg_hdr* hdr,
 
 	ret = bbus_client_sendmsg(cli, hdr, meta, obj);
 	if (ret == 0)
-		bbusd_mon_notify_sent(hdr, meta, obj);
+		notify_sent(hdr, meta, obj, NULL, 0);
 
 	return ret;
 }
 
+/*
+ * Same as send_message(), but the object is passed as raw data, usually
+ * pointing straight into the message buffer.
+ */
+static int forward_message(bbus_client* cli, struct bbus_msg_hdr* hdr,
+			char* meta, const void* obj, size_t objsize)
+{
+	int ret;
+
+	ret = bbus_client_sendbuf(cli, hdr, meta, obj, objsize);
+	if (ret == 0)
+		notify_sent(hdr, meta, NULL, obj, objsize);
+
+	return ret;
+}
+
+/*
+ * Same as forward_message(), but the object is passed as a descriptor
+ * received from another client.
+ */
+static int forward_fd(bbus_client* cli, struct bbus_msg_hdr* hdr,
+					char* meta, int fd)
+{
+	int ret;
+
+	ret = bbus_client_sendfd(cli, hdr, meta, fd);
+	if (ret == 0)
+		notify_sent(hdr, meta, NULL, NULL, 0);
+
+	return ret;
+}
+
+/*
+ * Peers get the replies to the calls they passed on the same way
+ * services send them.
+ */
+static uint8_t reply_msgtype(bbus_client* cli)
+{
+	return bbus_client_gettype(cli) == BBUS_CLIENT_PEER
+			? BBUS_MSGTYPE_SRVREPLY : BBUS_MSGTYPE_CLIREPLY;
+}
+
+/* Biggest object bbusd takes in a memfd. */
+#define BBUSD_MAXFDOBJSIZE	(256 * 1024 * 1024)
+
+/*
+ * Even descriptors bbusd only passes on must be safe to map - a memfd the
+ * sender can still shrink would bring down whoever maps it.
+ */
+static int check_memfd(bbus_client* cli, int fd)
+{
+	size_t size;
+	int ret;
+
+	ret = bbus_obj_checkfd(fd, &size);
+	if (ret < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Refusing the object passed in memory by '%s': %s\n",
+			bbus_client_getname(cli),
+			bbus_strerror(bbus_lasterror()));
+		return -1;
+	} else
+	if (size > BBUSD_MAXFDOBJSIZE) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Refusing the object passed in memory by '%s': "
+			"%zu bytes is too big\n",
+			bbus_client_getname(cli), size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Descriptors can't be passed over network transports - the object is
+ * sent straight from the mapped memfd instead. The descriptor is always
+ * consumed.
+ */
+static bbus_object* map_memfd(int fd)
+{
+	bbus_object* obj;
+
+	obj = bbus_obj_fromfd(fd);
+	close(fd);
+	if (obj == NULL) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error mapping the object passed in memory: %s\n",
+			bbus_strerror(bbus_lasterror()));
+	}
+
+	return obj;
+}
+
+/*
+ * Forward a call to a service owned by this shard. The descriptor, if
+ * any, is always consumed.
+ */
+static int forward_call(struct bbusd_clientlist_elem* srvc,
+			const struct bbusd_pending_call* call,
+			const char* meta, const void* obj,
+			size_t objsize, int fd)
+{
+	struct bbus_msg_hdr hdr;
+	struct bbusd_pending_call pending;
+	bbus_object* fdobj = NULL;
+	unsigned calltok;
+	unsigned left;
+	int ret;
+
+	if ((fd >= 0) && !bbus_client_passfds(srvc->cli)) {
+		fdobj = map_memfd(fd);
+		fd = -1;
+		if (fdobj == NULL)
+			return -1;
+		obj = bbus_obj_rawdata(fdobj);
+		objsize = bbus_obj_rawsize(fdobj);
+	}
+
+	/* Bridges pass the call on to another daemon, which routes it. */
+	if (bbus_client_isbridge(srvc->cli))
+		meta = ((struct bbusd_remote_method*)call->method)->path;
+
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_SRVCALL, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, strlen(meta) + 1 + objsize);
+	if (bbus_client_acceptsobj(srvc->cli, call->objflags) < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Can't pass the call to '%s': %s\n",
+			bbus_client_getname(srvc->cli),
+			bbus_strerror(bbus_lasterror()));
+		if (fd >= 0)
+			close(fd);
+		bbus_obj_free(fdobj);
+		return -1;
+	}
+	hdr.flags |= call->objflags;
+	/* Let the service know how much time it has left. */
+	if (call->deadline > 0) {
+		left = bbusd_deadline_left(call->deadline);
+		bbus_hdr_settimeout(&hdr, left > 0 ? left : 1);
+	}
+
+	/*
+	 * Many calls from a single caller can be in flight - the
+	 * service sees a unique token identifying this call.
+	 */
+	calltok = bbusd_make_token();
+	ret = bbusd_add_pending_call(calltok, call);
+	if (ret < 0) {
+		if (fd >= 0)
+			close(fd);
+		bbus_obj_free(fdobj);
+		return -1;
+	}
+	bbus_hdr_settoken(&hdr, calltok);
+
+	if (fd >= 0) {
+		/* The memfd is passed on - bbusd never maps it. */
+		ret = forward_fd(srvc->cli, &hdr, (char*)meta, fd);
+	} else {
+		ret = forward_message(srvc->cli, &hdr, (char*)meta,
+							obj, objsize);
+	}
+	bbus_obj_free(fdobj);
+	if (ret < 0) {
+		(void)bbusd_take_pending_call(calltok, &pending);
+		return -1;
+	}
+	BBUSD_TP(FORWARD, call->srvctok, calltok, objsize);
+
+	return 0;
+}
+
+/*
+ * Route a call to one of the providers of the called method, possibly
+ * owned by another shard. Providers found gone are dropped and the call
+ * fails over to the next one. The descriptor, if any, is always consumed.
+ */
+static int route_call(struct bbusd_pending_call* call, const char* meta,
+			const void* obj, size_t objsize, int fd)
+{
+	struct bbusd_remote_method* mthd;
+	struct bbusd_clientlist_elem* srvc;
+	struct bbusd_job* job;
+	unsigned shard;
+
+	mthd = (struct bbusd_remote_method*)call->method;
+
+	while ((call->provider = bbusd_pick_provider(mthd,
+					&call->srvctok)) != NULL) {
+		BBUSD_TP(ROUTE, call->caller, call->callid, call->srvctok);
+		shard = bbusd_token_shard(call->srvctok);
+		if (shard != bbusd_shard_self()) {
+			job = bbusd_job_new(BBUSD_JOB_SRVCALL, meta,
+					fd >= 0 ? NULL : obj,
+					fd >= 0 ? 0 : objsize);
+			if (job == NULL)
+				break;
+
+			job->target = call->srvctok;
+			job->caller = call->caller;
+			job->callid = call->callid;
+			job->method = call->method;
+			job->start = call->start;
+			job->deadline = call->deadline;
+			job->provider = call->provider;
+			job->objflags = call->objflags;
+			job->cachehash = call->cachehash;
+			job->cacheticket = call->cacheticket;
+			job->fd = fd;
+			bbusd_shard_push(shard, job);
+			return 0;
+		}
+
+		srvc = bbusd_get_client(call->srvctok);
+		if (srvc != NULL) {
+			if (forward_call(srvc, call, meta, obj,
+						objsize, fd) == 0)
+				return 0;
+
+			fd = -1;
+			break;
+		}
+
+		/* Gone, but its shard hasn't dropped it yet. */
+		bbusd_logmsg(BBUSD_LOG_INFO,
+			"Provider gone, trying the next one.\n");
+		bbusd_drop_provider(mthd, call->srvctok);
+	}
+
+	if (call->provider != NULL) {
+		bbusd_provider_done(call->provider, call->srvctok);
+		call->provider = NULL;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	return -1;
+}
+
+/*
+ * Pass a reply on to the caller, possibly owned by another shard. The
+ * descriptor, if any, is always consumed. The call is accounted once
+ * the reply is actually sent, then the reference to the method is
+ * dropped.
+ */
+static int reply_to_caller(const struct bbusd_pending_call* call,
+			uint8_t errcode, const void* obj, size_t objsize,
+			int fd)
+{
+	struct bbusd_clientlist_elem* cli;
+	struct bbusd_job* job;
+	struct bbus_msg_hdr hdr;
+	bbus_object* fdobj = NULL;
+	int ret;
+
+	if (call->provider != NULL)
+		bbusd_provider_done(call->provider, call->srvctok);
+
+	if (bbusd_token_shard(call->caller) != bbusd_shard_self()) {
+		job = bbusd_job_new(BBUSD_JOB_CLIREPLY, NULL, obj, objsize);
+		if (job == NULL) {
+			if (call->method != NULL)
+				bbusd_method_put(call->method);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+
+		job->target = call->caller;
+		job->callid = call->callid;
+		job->errcode = errcode;
+		job->method = call->method;
+		job->start = call->start;
+		job->objflags = call->objflags;
+		job->cachehash = call->cachehash;
+		job->cacheticket = call->cacheticket;
+		job->fd = fd;
+		bbusd_shard_push(bbusd_token_shard(call->caller), job);
+		return 0;
+	}
+
+	/* The cache the call was looked up in belongs to this shard. */
+	if ((call->cacheticket != 0) && (errcode == BBUS_PROT_EGOOD)
+							&& (fd < 0))
+		bbusd_rcache_fill(call->cachehash, call->cacheticket,
+					obj, objsize, call->objflags);
+
+	cli = bbusd_get_client(call->caller);
+	if (cli == NULL) {
+		bbusd_logmsg(BBUSD_LOG_WARN,
+			"Caller gone before receiving the reply.\n");
+		if (call->method != NULL)
+			bbusd_method_put(call->method);
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	if ((errcode == BBUS_PROT_EGOOD)
+		&& (bbus_client_acceptsobj(cli->cli, call->objflags) < 0)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Can't pass the reply to '%s': %s\n",
+			bbus_client_getname(cli->cli),
+			bbus_strerror(bbus_lasterror()));
+		errcode = BBUS_PROT_EMETHODERR;
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if ((fd >= 0) && !bbus_client_passfds(cli->cli)) {
+		fdobj = map_memfd(fd);
+		fd = -1;
+		if (fdobj == NULL) {
+			errcode = BBUS_PROT_EMETHODERR;
+		} else {
+			obj = bbus_obj_rawdata(fdobj);
+			objsize = bbus_obj_rawsize(fdobj);
+		}
+	}
+
+	bbus_hdr_build(&hdr, reply_msgtype(cli->cli), errcode);
+	bbus_hdr_settoken(&hdr, call->callid);
+	if (errcode == BBUS_PROT_EGOOD) {
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		hdr.flags |= call->objflags;
+		if (fd < 0)
+			bbus_hdr_setpsize(&hdr, objsize);
+	}
+
+	if (fd >= 0)
+		ret = forward_fd(cli->cli, &hdr, NULL, fd);
+	else
+		ret = forward_message(cli->cli, &hdr, NULL, obj, objsize);
+	bbus_obj_free(fdobj);
+	if (call->method != NULL) {
+		bbusd_stats_record(&call->method->stats, call->start,
+				(ret < 0) || (errcode != BBUS_PROT_EGOOD));
+		bbusd_method_put(call->method);
+	}
+	if (ret < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error sending server reply to client: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		return -1;
+	}
+	BBUSD_TP(REPLY, call->caller, call->callid, errcode);
+
+	return 0;
+}
+
+/*
+ * The service didn't reply in time - fail the call. The reply, if it ever
+ * comes, will be dropped.
+ */
+static void call_timed_out(const struct bbusd_pending_call* call)
+{
+	bbusd_logmsg(BBUSD_LOG_WARN,
+			"Call timed out waiting for the service.\n");
+	(void)reply_to_caller(call, BBUS_PROT_ETIMEDOUT, NULL, 0, -1);
+}
+
+/*
+ * The argument is copied, the reply is passed on to the caller's shard
+ * by the worker.
+ */
+static int offload_call(bbus_client* cli, struct bbusd_method* mthd,
+			unsigned callid, uint64_t start, uint64_t deadline,
+			bbus_object* argobj, int objflags)
+{
+	struct bbusd_job* job;
+
+	job = bbusd_job_new(BBUSD_JOB_PLUGINCALL, NULL,
+			bbus_obj_rawdata(argobj), bbus_obj_rawsize(argobj));
+	if (job == NULL)
+		return -1;
+
+	job->target = bbus_client_gettoken(cli);
+	job->callid = callid;
+	job->method = mthd;
+	job->start = start;
+	job->deadline = deadline;
+	job->objflags = objflags & BBUS_PROT_OBJFLAGS;
+	bbusd_plugin_call(job);
+
+	return 0;
+}
+
 static int handle_clientcall(bbus_client* cli, struct bbus_msg* msg)
 {
 	struct bbusd_method* mthd;
+	struct bbusd_pending_call call;
 	const char* mname;
 	int ret;
+	unsigned callid;
+	uint64_t start;
+	uint64_t deadline = 0;
 	bbus_object* argobj = NULL;
 	bbus_object* retobj = NULL;
+	const void* rawarg;
+	size_t rawsize;
 	struct bbus_msg_hdr hdr;
 	char* meta;
+	int fd = -1;
+	int shmcall;
+	unsigned route;
+	const void* cached = NULL;
+	size_t cachedsize;
+	int cachedflags;
+
+	start = bbusd_stats_now();
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASTIMEOUT)) {
+		deadline = start
+			+ (uint64_t)bbus_hdr_gettimeout(&msg->hdr) * 1000000ULL;
+	}
+	/* Calls by route id carry no method name. */
+	route = bbus_hdr_getroute(&msg->hdr);
+	if (route == 0) {
+		mname = bbus_prot_extractmeta(msg);
+		if (mname == NULL)
+			return -1;
+	} else {
+		mname = NULL;
+	}
 
-	mname = bbus_prot_extractmeta(msg);
-	if (mname == NULL)
-		return -1;
+	/* Big arguments are passed in shared memory. */
+	shmcall = BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASFD);
+	if (shmcall)
+		fd = bbus_client_takefd(cli);
 
+	/* Replies must carry the id the caller assigned to this call. */
+	callid = bbus_hdr_gettoken(&msg->hdr);
 	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
-	mthd = bbusd_locate_method(mname);
+	memset(&call, 0, sizeof(struct bbusd_pending_call));
+	mthd = route != 0 ? bbusd_locate_route(route)
+				: bbusd_locate_method(mname);
+	if ((mthd == NULL) && (route != 0)) {
+		/* The caller resolves the method again. */
+		bbusd_logmsg(BBUSD_LOG_INFO, "Stale route: %u\n", route);
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
+					BBUS_PROT_ESTALEROUTE);
+		ret = -1;
+		goto respond;
+	} else
 	if (mthd == NULL) {
 		bbusd_logmsg(BBUSD_LOG_ERR, "No such method: %s\n", mname);
 		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
@@ -125,11 +911,50 @@ static int handle_clientcall(bbus_client* cli, struct bbus_msg* msg)
 		goto respond;
 	}
 
-	argobj = bbus_prot_extractobj(msg);
-	if (argobj == NULL)
-		return -1;
+	if (shmcall && (check_memfd(cli, fd) < 0)) {
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
+					BBUS_PROT_EMETHODERR);
+		ret = -1;
+		goto respond;
+	}
 
 	if (mthd->type == BBUSD_METHOD_LOCAL) {
+		if (fd >= 0) {
+			argobj = bbus_obj_fromfd(fd);
+			close(fd);
+			fd = -1;
+		} else
+		if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_COMPRESSED)) {
+			/*
+			 * Clients compress big arguments whatever the method,
+			 * only the local ones ever need them decompressed.
+			 */
+			argobj = bbus_prot_extractobj(msg);
+		} else {
+			rawarg = bbus_prot_extractrawobj(msg, &rawsize);
+			argobj = rawarg == NULL ? NULL : bbus_obj_view_from(
+					bbusd_getobjpool(), rawarg, rawsize);
+		}
+		if (argobj == NULL)
+			return -1;
+		bbus_obj_setorder(argobj, bbus_hdr_getobjorder(&msg->hdr));
+
+		if (((struct bbusd_local_method*)mthd)->offload) {
+			/* A slow plugin must not hold up routing. */
+			ret = offload_call(cli, mthd, callid, start, deadline,
+					argobj, msg->hdr.flags
+						& ~BBUS_PROT_COMPRESSED);
+			if (ret == 0)
+				goto dontrespond;
+
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error passing call to the plugin workers: "
+				"%s\n", bbus_strerror(bbus_lasterror()));
+			bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
+						BBUS_PROT_EMETHODERR);
+			goto respond;
+		}
+
 		retobj = ((struct bbusd_local_method*)mthd)->func(argobj);
 		if (retobj == NULL) {
 			bbusd_logmsg(BBUSD_LOG_ERR, "Error calling method.\n");
@@ -140,27 +965,62 @@ static int handle_clientcall(bbus_client* cli, struct bbus_msg* msg)
 					BBUS_PROT_EGOOD);
 			BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
 			bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(retobj));
+			bbus_hdr_setobjorder(&hdr, retobj);
 		}
 
 		goto respond;
 	} else
 	if (mthd->type == BBUSD_METHOD_REMOTE) {
-		meta = mname_from_srvcname(mname);
+		/*
+		 * We never look inside the argument of a remote call - pass
+		 * it on straight from the message buffer.
+		 */
+		rawarg = bbus_prot_extractrawobj(msg, &rawsize);
+		if (rawarg == NULL) {
+			ret = -1;
+			goto dontrespond;
+		}
+
+		meta = route != 0
+			? ((struct bbusd_remote_method*)mthd)->name
+			: mname_from_srvcname(mname);
 		if (meta == NULL) {
 			bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
 					BBUS_PROT_EMETHODERR);
 			goto respond;
 		}
-		bbus_hdr_build(&hdr, BBUS_MSGTYPE_SRVCALL, BBUS_PROT_EGOOD);
-		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
-		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
-		bbus_hdr_setpsize(&hdr, (uint16_t)(strlen(meta) + 1
-						+ bbus_obj_rawsize(argobj)));
-		bbus_hdr_settoken(&hdr, bbus_client_gettoken(cli));
 
-		ret = send_message(
-				((struct bbusd_remote_method*)mthd)->srvc->cli,
-				&hdr, meta, argobj);
+		if ((((struct bbusd_remote_method*)mthd)->cachettl > 0)
+							&& !shmcall) {
+			cached = bbusd_rcache_lookup(
+				(struct bbusd_remote_method*)mthd,
+				rawarg, rawsize,
+				msg->hdr.flags & BBUS_PROT_OBJFLAGS,
+				&cachedsize, &cachedflags,
+				&call.cachehash, &call.cacheticket);
+			if ((cached != NULL) && (bbus_client_acceptsobj(cli,
+						cachedflags) == 0)) {
+				bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
+							BBUS_PROT_EGOOD);
+				BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+				bbus_hdr_setpsize(&hdr, cachedsize);
+				hdr.flags |= cachedflags;
+				goto respond;
+			}
+			/* The caller can't take it as it is - pass it on. */
+			cached = NULL;
+		}
+
+		call.caller = bbus_client_gettoken(cli);
+		call.callid = callid;
+		call.method = mthd;
+		call.start = start;
+		call.deadline = deadline;
+		call.objflags = msg->hdr.flags & BBUS_PROT_OBJFLAGS;
+		/* The pending call keeps the method even if it's removed. */
+		bbusd_method_get(mthd);
+		ret = route_call(&call, meta, rawarg, rawsize, fd);
+		fd = -1;
 		if (ret < 0) {
 			bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
 					BBUS_PROT_EMETHODERR);
@@ -174,7 +1034,29 @@ static int handle_clientcall(bbus_client* cli, struct bbus_msg* msg)
 	goto dontrespond;
 
 respond:
-	ret = send_message(cli, &hdr, NULL, retobj);
+	hdr.msgtype = reply_msgtype(cli);
+	bbus_hdr_settoken(&hdr, callid);
+	if (shmcall && (retobj != NULL)) {
+		/* The caller uses shared memory - reply the same way. */
+		bbus_hdr_setpsize(&hdr, 0);
+		ret = bbus_obj_tofd(retobj);
+		if (ret >= 0)
+			ret = forward_fd(cli, &hdr, NULL, ret);
+	} else
+	if (cached != NULL) {
+		ret = forward_message(cli, &hdr, NULL, cached, cachedsize);
+	} else {
+		ret = send_message(cli, &hdr, NULL, retobj);
+	}
+	if (mthd != NULL) {
+		bbusd_stats_record(&mthd->stats, start, (ret < 0)
+				|| (hdr.errcode != BBUS_PROT_EGOOD));
+	}
+	/* Routing failed, the call was never made pending. */
+	if (call.method != NULL)
+		bbusd_method_put(call.method);
+	if (ret == 0)
+		BBUSD_TP(REPLY, bbus_client_gettoken(cli), callid, hdr.errcode);
 	if (ret < 0) {
 		bbusd_logmsg(BBUSD_LOG_ERR,
 				"Error sending reply to client: %s\n",
@@ -185,10 +1067,41 @@ respond:
 	bbus_obj_free(retobj);
 
 dontrespond:
+	if (fd >= 0)
+		close(fd);
 	bbus_obj_free(argobj);
 	return ret;
 }
 
+/* 'descr' points past the name of a registration. */
+static int parse_cachettl(const char* descr, unsigned* ttl)
+{
+	const char* comma;
+	char* end;
+	unsigned long val;
+
+	*ttl = 0;
+	comma = index(descr, ',');
+	if (comma != NULL)
+		comma = index(comma + 1, ',');
+	if (comma == NULL)
+		return 0;
+
+	val = strtoul(comma + 1, &end, 10);
+	if ((*end != '\0') || (end == comma + 1) || (val > UINT_MAX)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Invalid reply cache ttl: %s\n", comma + 1);
+		return -1;
+	}
+	*ttl = (unsigned)val;
+
+	return 0;
+}
+
+/*
+ * The meta holds one or more "name,argdscr,retdscr[,ttl]" registrations
+ * separated by newlines. A single ack is sent for all of them.
+ */
 static int register_service(struct bbusd_clientlist_elem* cli,
 						struct bbus_msg* msg)
 {
@@ -196,8 +1109,12 @@ static int register_service(struct bbusd_clientlist_elem* cli,
 	char* meta;
 	int ret;
 	char* comma;
-	char* path;
-	struct bbusd_remote_method* mthd;
+	char* entry;
+	char* next;
+	char** paths = NULL;
+	unsigned* ttls = NULL;
+	unsigned numpaths = 0;
+	unsigned i;
 	struct bbus_msg_hdr hdr;
 
 	extrmeta = bbus_prot_extractmeta(msg);
@@ -212,44 +1129,71 @@ static int register_service(struct bbusd_clientlist_elem* cli,
 		goto metafree;
 	}
 
-	comma = index(meta, ',');
-	if (comma == NULL) {
-		ret = -1;
-		goto metafree;
-	}
-	*comma = '\0';
+	for (entry = meta, i = 1; (entry = index(entry, '\n')) != NULL; ++i)
+		++entry;
 
-	path = bbus_str_build("bbus.%s", meta);
-	if (path == NULL) {
+	paths = bbus_malloc0(i * sizeof(char*));
+	ttls = bbus_malloc0(i * sizeof(unsigned));
+	if ((paths == NULL) || (ttls == NULL)) {
 		ret = -1;
-		goto metafree;
+		goto pathsfree;
 	}
 
-	mthd = bbus_malloc0(sizeof(struct bbusd_remote_method));
-	if (mthd == NULL) {
-		ret = -1;
-		goto pathfree;
-	}
+	for (entry = meta; entry != NULL; entry = next) {
+		next = index(entry, '\n');
+		if (next != NULL)
+			*next++ = '\0';
 
-	mthd->type = BBUSD_METHOD_REMOTE;
-	mthd->srvc = cli;
+		comma = index(entry, ',');
+		if (comma == NULL) {
+			ret = -1;
+			goto pathsfree;
+		}
+		*comma = '\0';
 
-	ret = bbusd_insert_method(path, (struct bbusd_method*)mthd);
-	if (ret < 0) {
-		ret = -1;
-		goto mthdfree;
-	} else {
-		bbusd_logmsg(BBUSD_LOG_INFO,
-			"Method '%s' successfully registered.\n", path);
-		ret = 0;
-		goto pathfree;
+		/* Descriptions never contain commas, the ttl is optional. */
+		ret = parse_cachettl(comma + 1, &ttls[numpaths]);
+		if (ret < 0)
+			goto pathsfree;
+
+		paths[numpaths] = bbus_str_build("bbus.%s", entry);
+		if (paths[numpaths] == NULL) {
+			ret = -1;
+			goto pathsfree;
+		}
+		++numpaths;
 	}
 
-mthdfree:
-	bbus_free(mthd);
+	/* Methods provided are removed when the service goes away. */
+	if (cli->data == NULL) {
+		cli->data = bbus_malloc0(sizeof(struct bbusd_provided));
+		if (cli->data == NULL) {
+			ret = -1;
+			goto pathsfree;
+		}
+	}
 
-pathfree:
-	bbus_str_free(path);
+	/* Other instances of the service may provide them already. */
+	ret = bbusd_insert_providers(cli->data, (const char* const*)paths,
+			ttls, numpaths, bbus_client_gettoken(cli->cli));
+	if (ret == 0) {
+		bbusd_bridge_notify();
+		if (numpaths == 1) {
+			bbusd_logmsg(BBUSD_LOG_INFO,
+				"Method '%s' successfully registered.\n",
+				paths[0]);
+		} else {
+			bbusd_logmsg(BBUSD_LOG_INFO,
+				"%u methods successfully registered.\n",
+				numpaths);
+		}
+	}
+
+pathsfree:
+	for (i = 0; i < numpaths; ++i)
+		bbus_str_free(paths[i]);
+	bbus_free(paths);
+	bbus_free(ttls);
 
 metafree:
 	bbus_str_free(meta);
@@ -268,66 +1212,249 @@ respond:
 	return ret;
 }
 
-static int unregister_service(bbus_client* cli BBUS_UNUSED,
-		const struct bbus_msg* msg BBUS_UNUSED)
+/*
+ * Not acknowledged - the service may be receiving calls to the method
+ * at the same time. No meta means all of the service's methods.
+ */
+static int unregister_service(struct bbusd_clientlist_elem* cli,
+					struct bbus_msg* msg)
 {
-	return 0;
+	const char* meta = NULL;
+	char* path = NULL;
+	int ret;
+
+	if (cli->data == NULL)
+		return 0;
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASMETA)) {
+		meta = bbus_prot_extractmeta(msg);
+		if (meta == NULL)
+			return -1;
+
+		path = bbus_str_build("bbus.%s", meta);
+		if (path == NULL)
+			return -1;
+	}
+
+	ret = bbusd_remove_provider(cli->data, path,
+					bbus_client_gettoken(cli->cli));
+	if (ret == 0) {
+		bbusd_bridge_notify();
+		bbusd_logmsg(BBUSD_LOG_INFO, "Method '%s' unregistered.\n",
+					path != NULL ? path : "(all)");
+	}
+	bbus_str_free(path);
+
+	return ret;
 }
 
-static int handle_control_message(bbus_client* cli BBUS_UNUSED,
-		const struct bbus_msg* msg BBUS_UNUSED)
+/* The service is gone and won't ever reply. */
+static void service_gone(const struct bbusd_pending_call* call)
 {
-	return 0;
+	(void)reply_to_caller(call, BBUS_PROT_EMETHODERR, NULL, 0, -1);
 }
 
-static int pass_srvc_reply(bbus_client* srvc BBUS_UNUSED, struct bbus_msg* msg)
+static int handle_control_message(bbus_client* cli,
+		const struct bbus_msg* msg)
 {
+	bbus_object* argobj = NULL;
+	bbus_object* retobj;
 	struct bbus_msg_hdr hdr;
-	struct bbusd_clientlist_elem* cli;
-	bbus_object* obj;
+	const void* rawarg;
+	size_t rawsize;
+	const char* cmd;
 	int ret;
 
-	cli = bbusd_get_caller(bbus_hdr_gettoken(&msg->hdr));
-	if (cli == NULL) {
-		bbusd_logmsg(BBUSD_LOG_ERR, "Caller not found for reply.\n");
+	cmd = bbus_prot_extractmeta(msg);
+	if (cmd == NULL)
 		return -1;
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASOBJECT)) {
+		rawarg = bbus_prot_extractrawobj(msg, &rawsize);
+		argobj = rawarg == NULL ? NULL : bbus_obj_view_from(
+				bbusd_getobjpool(), rawarg, rawsize);
+		if (argobj == NULL)
+			return -1;
+		bbus_obj_setorder(argobj, bbus_hdr_getobjorder(&msg->hdr));
+	}
+
+	retobj = bbusd_ctl_exec(cmd, argobj);
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	if (retobj == NULL) {
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CTRL, BBUS_PROT_EMETHODERR);
+	} else {
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CTRL, BBUS_PROT_EGOOD);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(retobj));
+		bbus_hdr_setobjorder(&hdr, retobj);
+	}
+
+	ret = send_message(cli, &hdr, NULL, retobj);
+	if (ret < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error sending reply to client: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		ret = -1;
 	}
 
-	obj = bbus_prot_extractobj(msg);
+	bbus_obj_free(retobj);
+	bbus_obj_free(argobj);
+
+	return ret;
+}
+
+static int pass_srvc_reply(bbus_client* srvc, struct bbus_msg* msg)
+{
+	struct bbusd_pending_call call;
+	const void* obj;
+	size_t objsize;
+	int ret;
+	int fd;
+
+	ret = bbusd_take_pending_call(bbus_hdr_gettoken(&msg->hdr), &call);
+	if (ret < 0) {
+		/* Most likely the call has already timed out. */
+		bbusd_logmsg(BBUSD_LOG_INFO,
+			"Dropping reply to a call no longer pending.\n");
+		if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASFD))
+			close(bbus_client_takefd(srvc));
+		return 0;
+	}
+	call.objflags = msg->hdr.flags & BBUS_PROT_OBJFLAGS;
+
+	if (msg->hdr.errcode != BBUS_PROT_EGOOD) {
+		/* Pass the service's error on to the caller. */
+		return reply_to_caller(&call, msg->hdr.errcode,
+							NULL, 0, -1);
+	}
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASFD)) {
+		fd = bbus_client_takefd(srvc);
+		if (check_memfd(srvc, fd) < 0) {
+			close(fd);
+			return reply_to_caller(&call, BBUS_PROT_EMETHODERR,
+							NULL, 0, -1);
+		}
+
+		return reply_to_caller(&call, BBUS_PROT_EGOOD, NULL, 0, fd);
+	}
+
+	obj = bbus_prot_extractrawobj(msg, &objsize);
 	if (obj == NULL) {
 		bbusd_logmsg(BBUSD_LOG_ERR,
 			"Error extracting the object from message: %s\n",
 			bbus_strerror(bbus_lasterror()));
-		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY,
-					BBUS_PROT_EMETHODERR);
-		goto respond;
+		return reply_to_caller(&call, BBUS_PROT_EMETHODERR,
+							NULL, 0, -1);
 	}
 
-	bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLIREPLY, BBUS_PROT_EGOOD);
-	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
-	bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(obj));
+	return reply_to_caller(&call, BBUS_PROT_EGOOD, obj, objsize, -1);
+}
 
-respond:
-	ret = send_message(cli->cli, &hdr, NULL, obj);
-	if (ret < 0) {
+/*
+ * A service asked for the cached replies of its methods to be dropped.
+ * Every shard's cache sees the methods invalidated on the next lookup.
+ */
+static void invalidate_replies(const struct bbus_msg* msg,
+				const void* obj, size_t objsize)
+{
+	bbus_object* argobj;
+	char* method;
+	char* path;
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_COMPRESSED))
+		goto err;
+
+	argobj = bbus_obj_view_from(bbusd_getobjpool(), obj, objsize);
+	if (argobj == NULL)
+		goto err;
+
+	bbus_obj_setorder(argobj, bbus_hdr_getobjorder(&msg->hdr));
+	if (bbus_obj_parse(argobj, "s", &method) < 0) {
+		bbus_obj_free(argobj);
+		goto err;
+	}
+
+	path = bbus_str_build("bbus.%s", method);
+	bbus_obj_free(argobj);
+	if (path == NULL)
+		goto err;
+
+	bbusd_invalidate_methods(path);
+	bbus_str_free(path);
+	return;
+
+err:
+	bbusd_logmsg(BBUSD_LOG_ERR, "Invalid reply cache invalidation.\n");
+}
+
+/*
+ * Fan a signal out to the subscribers. The payload is never decoded,
+ * except for the reply cache invalidations - every shard with
+ * subscribers gets a single copy of it.
+ */
+static int emit_signal(bbus_client* cli, struct bbus_msg* msg)
+{
+	struct bbusd_job* job;
+	const char* path;
+	const void* obj;
+	size_t objsize;
+	unsigned shard;
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASFD)) {
+		close(bbus_client_takefd(cli));
 		bbusd_logmsg(BBUSD_LOG_ERR,
-			"Error sending server reply to client: %s\n",
-			bbus_strerror(bbus_lasterror()));
-		ret = -1;
+			"Signals can't be passed in shared memory.\n");
+		return -1;
+	}
+
+	path = bbus_prot_extractmeta(msg);
+	if (path == NULL)
+		return -1;
+
+	obj = bbus_prot_extractrawobj(msg, &objsize);
+	if (obj == NULL)
+		return -1;
+
+	if ((bbus_client_gettype(cli) == BBUS_CLIENT_SERVICE)
+			&& (strcmp(path, BBUS_SRVC_INVALIDATESIG) == 0))
+		invalidate_replies(msg, obj, objsize);
+
+	for (shard = 0; shard < bbusd_numshards(); ++shard) {
+		if ((shard == bbusd_shard_self())
+				|| !bbusd_sig_shard_subscribed(shard))
+			continue;
+
+		job = bbusd_job_new(BBUSD_JOB_SIGNAL, path, obj, objsize);
+		if (job == NULL) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error passing a signal to another thread: "
+				"%s\n", bbus_strerror(bbus_lasterror()));
+			continue;
+		}
+		job->objflags = msg->hdr.flags & BBUS_PROT_OBJFLAGS;
+
+		bbusd_shard_push(shard, job);
 	}
 
-	bbus_obj_free(obj);
-	return ret;
+	bbusd_sig_deliver(path, obj, objsize,
+				msg->hdr.flags & BBUS_PROT_OBJFLAGS);
+
+	return 0;
 }
 
-static unsigned make_token(void)
+static int handle_subscription(bbus_client* cli, const struct bbus_msg* msg)
 {
-	static unsigned curtok = 0;
+	const char* prefix;
 
-	if (curtok == UINT_MAX)
-		curtok = 0;
+	prefix = bbus_prot_extractmeta(msg);
+	if (prefix == NULL)
+		return -1;
 
-	return ++curtok;
+	if (msg->hdr.msgtype == BBUS_MSGTYPE_SIGSUB)
+		return bbusd_sig_subscribe(cli, prefix);
+	else
+		return bbusd_sig_unsubscribe(cli, prefix);
 }
 
 static int client_auth(const struct bbus_client_cred* cred)
@@ -338,13 +1465,13 @@ static int client_auth(const struct bbus_client_cred* cred)
 
 static void accept_msg_rcvd(const struct bbus_msg* msg)
 {
-	bbusd_mon_notify_recvd(msg);
+	notify_recvd(msg);
 }
 
 static void accept_msg_sent(const struct bbus_msg_hdr* hdr,
 				const char* meta, bbus_object* obj)
 {
-	bbusd_mon_notify_sent(hdr, meta, obj);
+	notify_sent(hdr, meta, obj, NULL, 0);
 }
 
 static struct bbus_accept_callbacks accept_funcs = {
@@ -353,42 +1480,98 @@ static struct bbus_accept_callbacks accept_funcs = {
 	.sent = accept_msg_sent,
 };
 
-static void accept_client(bbus_server* server)
+/* Connections not opening their session within this time are dropped. */
+#define HANDSHAKE_TIMEOUTMS	2000
+
+/*
+ * Accepted connection waiting for its session open request. These are
+ * all handled by the first shard, which owns the listening sockets.
+ */
+struct handshake
 {
+	struct handshake* next;
+	struct handshake* prev;
 	bbus_client* cli;
+	struct bbusd_timer timer;
+	/* Set once added to the pollset. */
+	int polled;
+};
+
+static struct bbus_list handshakes = { NULL, NULL };
+
+static enum bbusd_counter client_counter(bbus_client* cli)
+{
+	switch (bbus_client_gettype(cli)) {
+	case BBUS_CLIENT_SERVICE:	return BBUSD_CNT_SERVICES;
+	case BBUS_CLIENT_MON:		return BBUSD_CNT_MONITORS;
+	case BBUS_CLIENT_CTL:		return BBUSD_CNT_CONTROLLERS;
+	default:			return BBUSD_CNT_CALLERS;
+	}
+}
+
+/*
+ * Make the client part of this shard. Clients which can't be added are
+ * freed.
+ */
+static int adopt_client(bbus_client* cli)
+{
+	struct bbusd_clientlist_elem* cli_elem;
 	int r;
-	unsigned token;
+	unsigned token = 0;
 
-	/* TODO Client credentials verification. */
-	cli = bbus_srv_accept(server, &accept_funcs);
-	if (cli == NULL) {
+	cli_elem = bbusd_clientlist_add(cli);
+	if (cli_elem == NULL) {
 		bbusd_logmsg(BBUSD_LOG_ERR,
-			"Error accepting incoming client "
-			"connection: %s\n",
+			"Error adding new client to the list: %s\n",
 			bbus_strerror(bbus_lasterror()));
-		return;
+		bbus_client_close(cli);
+		bbus_client_free(cli);
+		return -1;
 	}
-	bbusd_logmsg(BBUSD_LOG_INFO, "Client '%s' connected.\n",
-					bbus_client_getname(cli));
+	bbus_client_setpriv(cli, cli_elem);
+	bbus_client_setmaxwrqueue(cli, bbusd_ctl_cliqueue());
+	bbusd_count(client_counter(cli), 1);
 
-	r = bbusd_clientlist_add(cli);
+	/*
+	 * A single slow peer must never block the whole daemon. Everything
+	 * sent to a client in one loop iteration goes out in one write.
+	 */
+	r = bbus_client_setnonblock(cli);
+	if (r == 0)
+		r = bbus_client_setcork(cli, 1);
+	if (r == 0)
+		r = bbus_pollset_addcli(
+			bbusd_shard_pollset(bbusd_shard_self()), cli);
 	if (r < 0) {
 		bbusd_logmsg(BBUSD_LOG_ERR,
-			"Error adding new client to the list: %s\n",
+			"Error adding new client to the pollset: %s\n",
 			bbus_strerror(bbus_lasterror()));
-		return;
+		bbusd_count(client_counter(cli), -1);
+		bbus_client_close(cli);
+		bbus_client_free(cli);
+		bbusd_clientlist_rm(&cli_elem);
+		return -1;
 	}
 
+	if (bbus_client_busypoll(cli))
+		++busypollers;
+
 	switch (bbus_client_gettype(cli)) {
 	case BBUS_CLIENT_CALLER:
-		token = make_token();
-		bbus_client_settoken(cli, token);
-		/* This client is the list's tail at this point. */
-		r = bbusd_add_caller(token, bbusd_clientlist_getlast());
+	case BBUS_CLIENT_SERVICE:
+	case BBUS_CLIENT_PEER:
+		/*
+		 * Calls and replies are routed to callers and services
+		 * by their tokens. Peers call methods on behalf of their
+		 * own callers.
+		 */
+		r = bbusd_add_client(cli_elem, &token);
+		if (r == 0)
+			bbus_client_settoken(cli, token);
 		if (r < 0) {
 			bbusd_logmsg(BBUSD_LOG_ERR,
 				"Error adding new client to "
-				"the caller map: %s\n",
+				"the client map: %s\n",
 				bbus_strerror(bbus_lasterror()));
 		}
 		break;
@@ -399,10 +1582,9 @@ static void accept_client(bbus_server* server)
 				"Error adding new monitor to "
 				"the list: %s\n",
 				bbus_strerror(bbus_lasterror()));
-			return;
+			return 0;
 		}
 		break;
-	case BBUS_CLIENT_SERVICE:
 	case BBUS_CLIENT_CTL:
 		/*
 		 * Don't do anything else other than adding these
@@ -412,11 +1594,254 @@ static void accept_client(bbus_server* server)
 	default:
 		break;
 	}
+
+	BBUSD_TP(ACCEPT, bbus_client_gettype(cli), token,
+					bbus_client_busypoll(cli));
+
+	return 0;
+}
+
+static void dispatch_client(bbus_client* cli)
+{
+	static unsigned nextshard = 0;
+	struct bbusd_job* job;
+	unsigned shard;
+
+	bbusd_logmsg(BBUSD_LOG_INFO, "Client '%s' connected.\n",
+					bbus_client_getname(cli));
+
+	/* Monitors always live in the first shard. */
+	if (bbus_client_gettype(cli) == BBUS_CLIENT_MON) {
+		shard = 0;
+	} else {
+		shard = nextshard;
+		nextshard = (nextshard + 1) % bbusd_numshards();
+	}
+
+	if (shard == bbusd_shard_self()) {
+		(void)adopt_client(cli);
+		return;
+	}
+
+	job = bbusd_job_new(BBUSD_JOB_NEWCLI, NULL, NULL, 0);
+	if (job == NULL) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error passing new client to another thread: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		bbus_client_close(cli);
+		bbus_client_free(cli);
+		return;
+	}
+
+	job->cli = cli;
+	bbusd_shard_push(shard, job);
+}
+
+static void drop_handshake(struct handshake* hs)
+{
+	bbusd_timer_cancel(&hs->timer);
+	if (hs->polled)
+		bbus_pollset_rmcli(mainpollset, hs->cli);
+	bbus_list_rm(&handshakes, hs);
+	bbus_free(hs);
+}
+
+static void handshake_timeout(void* arg)
+{
+	struct handshake* hs = arg;
+	bbus_client* cli = hs->cli;
+
+	bbusd_logmsg(BBUSD_LOG_WARN,
+		"Client didn't open its session in time, dropping.\n");
+	drop_handshake(hs);
+	bbus_client_close(cli);
+	bbus_client_free(cli);
+}
+
+/*
+ * Session open requests are handled when they arrive so that a client
+ * which connects and then stalls can't hold up everyone else. Returns
+ * 1 if the client has been passed on, 0 if it's still waiting and -1 if
+ * it's gone.
+ */
+static int continue_handshake(struct handshake* hs)
+{
+	bbus_client* cli = hs->cli;
+	int ret;
+
+	ret = bbus_srv_handshake(cli, &accept_funcs);
+	if (ret == 0)
+		return 0;
+
+	drop_handshake(hs);
+	if (ret < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error opening client session: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		bbus_client_close(cli);
+		bbus_client_free(cli);
+		return -1;
+	}
+
+	bbus_client_setpriv(cli, NULL);
+	dispatch_client(cli);
+	return 1;
+}
+
+static void accept_clients(bbus_server* server)
+{
+	struct handshake* hs;
+	bbus_client* cli;
+	int ret;
+
+	/* Take every connection queued since the last poll. */
+	for (;;) {
+		cli = bbus_srv_acceptnb(server, &accept_funcs);
+		if (cli == NULL) {
+			if (bbus_lasterror() == BBUS_EAGAIN)
+				return;
+
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error accepting incoming client "
+				"connection: %s\n",
+				bbus_strerror(bbus_lasterror()));
+			/*
+			 * Rejected clients don't stop the batch, running out
+			 * of descriptors or memory does until the next poll.
+			 */
+			if (bbus_lasterror() == BBUS_ECLIUNAUTH)
+				continue;
+			return;
+		}
+
+		hs = bbus_malloc0(sizeof(struct handshake));
+		if (hs == NULL) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error accepting incoming client "
+				"connection: %s\n",
+				bbus_strerror(bbus_lasterror()));
+			bbus_client_close(cli);
+			bbus_client_free(cli);
+			continue;
+		}
+		hs->cli = cli;
+		bbus_client_setpriv(cli, hs);
+		bbus_list_push(&handshakes, hs);
+		bbusd_timer_init(&hs->timer, handshake_timeout, hs);
+		bbusd_timer_arm(&hs->timer, HANDSHAKE_TIMEOUTMS);
+
+		/* The request usually arrives along with the connection. */
+		if (continue_handshake(hs) != 0)
+			continue;
+
+		ret = bbus_pollset_addcli(mainpollset, cli);
+		if (ret < 0) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error adding new client to the pollset: %s\n",
+				bbus_strerror(bbus_lasterror()));
+			drop_handshake(hs);
+			bbus_client_close(cli);
+			bbus_client_free(cli);
+			continue;
+		}
+		hs->polled = 1;
+	}
+}
+
+static void close_handshakes(void)
+{
+	struct handshake* hs;
+	bbus_client* cli;
+
+	while ((hs = (struct handshake*)handshakes.head) != NULL) {
+		cli = hs->cli;
+		drop_handshake(hs);
+		bbus_client_close(cli);
+		bbus_client_free(cli);
+	}
+}
+
+static void handle_job(struct bbusd_job* job)
+{
+	struct bbusd_clientlist_elem* srvc;
+	struct bbusd_pending_call call;
+	const void* obj;
+	size_t objsize;
+	bbus_client* cli;
+	int fd;
+	int ret;
+
+	obj = bbusd_job_obj(job, &objsize);
+	fd = job->fd;
+	job->fd = -1;
+	call.callid = job->callid;
+	call.method = job->method;
+	call.start = job->start;
+	call.deadline = job->deadline;
+	call.provider = NULL;
+	call.objflags = job->objflags;
+	call.cachehash = job->cachehash;
+	call.cacheticket = job->cacheticket;
+
+	switch (job->type) {
+	case BBUSD_JOB_NEWCLI:
+		cli = job->cli;
+		job->cli = NULL;
+		(void)adopt_client(cli);
+		break;
+	case BBUSD_JOB_SRVCALL:
+		call.caller = job->caller;
+		call.provider = job->provider;
+		call.srvctok = job->target;
+		if ((job->deadline > 0)
+				&& (bbusd_deadline_left(job->deadline) == 0)) {
+			/* Expired while waiting in the queue. */
+			if (fd >= 0)
+				close(fd);
+			(void)reply_to_caller(&call, BBUS_PROT_ETIMEDOUT,
+							NULL, 0, -1);
+			break;
+		}
+
+		srvc = bbusd_get_client(job->target);
+		if (srvc == NULL) {
+			/* Disconnected in the meantime - fail over. */
+			bbusd_drop_provider(
+				(struct bbusd_remote_method*)job->method,
+				job->target);
+			ret = route_call(&call, job->meta, obj, objsize, fd);
+		} else {
+			ret = forward_call(srvc, &call, job->meta,
+						obj, objsize, fd);
+		}
+		if (ret < 0) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error passing the call to service\n");
+			(void)reply_to_caller(&call, BBUS_PROT_EMETHODERR,
+							NULL, 0, -1);
+		}
+		break;
+	case BBUSD_JOB_CLIREPLY:
+		call.caller = job->target;
+		(void)reply_to_caller(&call, job->errcode, obj, objsize, fd);
+		break;
+	case BBUSD_JOB_MON:
+		bbusd_mon_handle_job(job);
+		break;
+	case BBUSD_JOB_SIGNAL:
+		bbusd_sig_deliver(job->meta, obj, objsize, job->objflags);
+		break;
+	default:
+		bbusd_die("Internal logic error, invalid job type\n");
+	}
+
+	bbusd_job_free(job);
 }
 
 /*
  * Returns -1 if client connection shall be closed after the function call,
- * and 0 if it must be kept active.
+ * 0 if it must be kept active and 1 if there are no more complete messages
+ * to handle at the moment.
  */
 static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 {
@@ -424,16 +1849,23 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 	int r;
 
 	cli = cli_elem->cli;
-	bbusd_zeromsgbuf();
-	r = bbus_client_rcvmsg(cli, bbusd_getmsgbuf(), bbusd_msgbufsize());
+	r = bbusd_rcvmsg(cli);
 	if (r < 0) {
+		if (bbus_lasterror() == BBUS_EAGAIN)
+			return 1;
+		else if (bbus_lasterror() == BBUS_ECONNCLOSED)
+			goto cli_close;
+
 		bbusd_logmsg(BBUSD_LOG_ERR,
 			"Error receiving message from client: %s\n",
 			bbus_strerror(bbus_lasterror()));
 		goto cli_close;
 	}
 
-	bbusd_mon_notify_recvd(bbusd_getmsgbuf());
+	BBUSD_TP(RECV, bbusd_getmsgbuf()->hdr.msgtype,
+			bbus_hdr_gettoken(&bbusd_getmsgbuf()->hdr),
+			bbus_hdr_getpsize(&bbusd_getmsgbuf()->hdr));
+	notify_recvd(bbusd_getmsgbuf());
 
 	/* TODO Common function for error reporting. */
 	switch (bbus_client_gettype(cli)) {
@@ -447,6 +1879,22 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 				goto cli_close;
 			}
 			break;
+		case BBUS_MSGTYPE_CLISIG:
+			r = emit_signal(cli, bbusd_getmsgbuf());
+			if (r < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Error emitting a signal\n");
+			}
+			break;
+		case BBUS_MSGTYPE_SIGSUB:
+		case BBUS_MSGTYPE_SIGUNSUB:
+			r = handle_subscription(cli, bbusd_getmsgbuf());
+			if (r < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Error changing signal "
+					"subscriptions\n");
+			}
+			break;
 		case BBUS_MSGTYPE_CLOSE:
 			goto cli_close;
 			break;
@@ -468,7 +1916,7 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 			}
 			break;
 		case BBUS_MSGTYPE_SRVUNREG:
-			r = unregister_service(cli, bbusd_getmsgbuf());
+			r = unregister_service(cli_elem, bbusd_getmsgbuf());
 			if (r < 0) {
 				bbusd_logmsg(BBUSD_LOG_ERR,
 					"Error unregistering a service: %s\n",
@@ -485,6 +1933,13 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 				goto out;
 			}
 			break;
+		case BBUS_MSGTYPE_CLISIG:
+			r = emit_signal(cli, bbusd_getmsgbuf());
+			if (r < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Error emitting a signal\n");
+			}
+			break;
 		case BBUS_MSGTYPE_CLOSE:
 			goto cli_close;
 			break;
@@ -495,6 +1950,26 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 			goto out;
 		}
 		break;
+	case BBUS_CLIENT_PEER:
+		switch (bbusd_getmsgbuf()->hdr.msgtype) {
+		case BBUS_MSGTYPE_SRVCALL:
+			/* Calls from the peer's callers carry full paths. */
+			r = handle_clientcall(cli, bbusd_getmsgbuf());
+			if (r < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Error on a call from the peer\n");
+				goto cli_close;
+			}
+			break;
+		case BBUS_MSGTYPE_SRVACK:
+			bbusd_bridge_ack(cli, bbusd_getmsgbuf());
+			break;
+		default:
+			bbusd_logmsg(BBUSD_LOG_ERR,
+					"Unexpected message received.\n");
+			goto cli_close;
+		}
+		break;
 	case BBUS_CLIENT_CTL:
 		switch (bbusd_getmsgbuf()->hdr.msgtype) {
 		case BBUS_MSGTYPE_CTRL:
@@ -511,8 +1986,15 @@ static int handle_client(struct bbusd_clientlist_elem* cli_elem)
 		break;
 	case BBUS_CLIENT_MON:
 		switch (bbusd_getmsgbuf()->hdr.msgtype) {
+		case BBUS_MSGTYPE_MONFLTR:
+			r = bbusd_mon_setfilter(cli, bbusd_getmsgbuf());
+			if (r < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Invalid monitor filter received, "
+					"keeping the previous one.\n");
+			}
+			break;
 		case BBUS_MSGTYPE_CLOSE:
-			bbusd_monlist_rm(cli);
 			goto cli_close;
 			break;
 		default:
@@ -536,75 +2018,276 @@ cli_close:
 	return -1;
 }
 
-static void poll_and_handle_inbound_traffic(bbus_server* server,
-						bbus_pollset* pollset)
+static void close_client(bbus_pollset* pollset,
+				struct bbusd_clientlist_elem* cli_elem)
+{
+	bbus_client* cli;
+
+	cli = cli_elem->cli;
+	bbus_pollset_rmcli(pollset, cli);
+	/*
+	 * Monitors must be removed from the monitor list regardless of
+	 * whether they sent the close message or simply hung up.
+	 */
+	if (bbus_client_gettype(cli) == BBUS_CLIENT_MON)
+		bbusd_monlist_rm(cli);
+	else if ((bbus_client_gettype(cli) == BBUS_CLIENT_CALLER)
+			|| (bbus_client_gettype(cli) == BBUS_CLIENT_SERVICE)
+			|| (bbus_client_gettype(cli) == BBUS_CLIENT_PEER))
+		bbusd_rm_client(bbus_client_gettoken(cli));
+	/*
+	 * Calls to its methods go to the remaining providers from now on,
+	 * methods left without providers are removed. Calls it didn't
+	 * answer yet fail right away instead of waiting for the deadline.
+	 */
+	if (bbus_client_gettype(cli) == BBUS_CLIENT_SERVICE) {
+		if (cli_elem->data != NULL) {
+			(void)bbusd_remove_provider(cli_elem->data, NULL,
+						bbus_client_gettoken(cli));
+			bbusd_free_provided(cli_elem->data);
+			cli_elem->data = NULL;
+			bbusd_bridge_notify();
+		}
+		(void)bbusd_fail_pending_calls(bbus_client_gettoken(cli),
+							service_gone);
+	} else if (bbus_client_gettype(cli) == BBUS_CLIENT_CALLER)
+		bbusd_sig_rmclient(cli);
+	else if (bbus_client_gettype(cli) == BBUS_CLIENT_PEER)
+		bbusd_bridge_down(cli);
+	if (bbus_client_busypoll(cli))
+		--busypollers;
+	bbusd_count(client_counter(cli), -1);
+	bbus_client_close(cli);
+	bbus_client_free(cli);
+	bbusd_clientlist_rm(&cli_elem);
+	bbusd_logmsg(BBUSD_LOG_INFO, "Client disconnected.\n");
+}
+
+/*
+ * Apply the tunables changed over the control channel to clients
+ * owned by this shard.
+ */
+static void apply_client_tunables(void)
+{
+	static BBUS_THREAD_LOCAL unsigned long seen = 0;
+	struct bbusd_clientlist_elem* elem;
+	unsigned long gen;
+	size_t maxwrqueue;
+	int type;
+
+	gen = bbusd_ctl_generation();
+	if (gen == seen)
+		return;
+
+	seen = gen;
+	maxwrqueue = bbusd_ctl_cliqueue();
+	for (type = 0; type < BBUSD_NUMCLITYPES; ++type) {
+		for (elem = bbusd_clientlist_getfirst(type);
+				elem != NULL; elem = elem->next)
+			bbus_client_setmaxwrqueue(elem->cli, maxwrqueue);
+	}
+}
+
+/*
+ * Polls without sleeping for up to 'busypoll' microseconds, but no longer
+ * than 'timeout' milliseconds. Returns 0 if nothing happened in that time.
+ */
+static int spin_poll(bbus_pollset* pollset, int timeout)
 {
+	struct bbus_timeval tv;
+	uint64_t start;
+	uint64_t budget;
 	int retval;
-	int numclients;
-	struct bbusd_clientlist_elem* tmpcli;
-	struct bbusd_clientlist_elem* cli_rm;
+
+	budget = (uint64_t)busypoll * 1000;
+	if ((timeout >= 0) && ((uint64_t)timeout * 1000000 < budget))
+		budget = (uint64_t)timeout * 1000000;
+
+	start = bbusd_stats_now();
+	do {
+		memset(&tv, 0, sizeof(struct bbus_timeval));
+		retval = bbus_poll(pollset, &tv);
+		if (retval != 0)
+			return retval;
+		/* The peer we're waiting for may need this CPU. */
+		(void)sched_yield();
+	} while ((bbusd_stats_now() - start) < budget);
+
+	return 0;
+}
+
+/*
+ * Send out the replies, signals and notifications queued for corked
+ * clients during this iteration.
+ */
+static void flush_clients(bbus_pollset* pollset)
+{
+	bbus_client* cli;
+	int retval;
+
+	while ((cli = bbus_pollset_nextdirty(pollset)) != NULL) {
+		retval = bbus_client_flush(cli);
+		if (retval < 0) {
+			/* The hangup will be reported by the next poll. */
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error sending queued data to client: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		} else
+		if (bbus_client_gettype(cli) == BBUS_CLIENT_MON) {
+			/* Makes the monitor dirty again if there's more. */
+			bbusd_mon_drain(cli);
+		}
+	}
+}
+
+static void poll_and_handle_inbound_traffic(bbus_server** servers,
+				unsigned numservers, bbus_pollset* pollset)
+{
+	unsigned i;
+	int retval;
+	bbus_client* cli;
+	struct bbusd_clientlist_elem* cli_elem;
+	struct bbusd_job* job;
 	struct bbus_timeval tv;
+	unsigned maxsleep;
+	int timeout;
+
+	/* Nothing from the previous iteration refers to the service tree. */
+	bbusd_quiesce_service_map();
+	apply_client_tunables();
+
+	/* Sleep until the nearest deadline or until there's I/O. */
+	timeout = bbusd_timers_timeout();
+	maxsleep = bbusd_ctl_polltimeout();
+	if ((maxsleep > 0) && ((timeout < 0) || ((unsigned)timeout > maxsleep)))
+		timeout = maxsleep;
 
 	memset(&tv, 0, sizeof(struct bbus_timeval));
-	bbus_pollset_clear(pollset);
-	bbus_pollset_addsrv(pollset, server);
-	for (tmpcli = bbusd_clientlist_getfirst(); tmpcli != NULL;
-			tmpcli = tmpcli->next) {
-		bbus_pollset_addcli(pollset, tmpcli->cli);
-	}
-	tv.sec = 0;
-	tv.usec = 500000;
-	retval = bbus_poll(pollset, &tv);
+	tv.sec = timeout / 1000;
+	tv.usec = (timeout % 1000) * 1000;
+	bbusd_offline_service_map();
+	retval = 0;
+	/* Catch the replies to busy-polling callers before falling asleep. */
+	if ((busypollers > 0) && (busypoll > 0) && (timeout != 0))
+		retval = spin_poll(pollset, timeout);
+	if (retval == 0)
+		retval = bbus_poll(pollset, timeout < 0 ? NULL : &tv);
+	bbusd_quiesce_service_map();
+	bbusd_timers_run();
 	if (retval < 0) {
-		if (bbus_lasterror() == BBUS_EPOLLINTR) {
-			return;
-		} else {
+		if (bbus_lasterror() != BBUS_EPOLLINTR) {
 			bbusd_die("Error polling connections: %s",
 					bbus_strerror(bbus_lasterror()));
 		}
 	} else
 	if (retval == 0) {
-		/* Timeout. */
-		return;
+		/* Timeout - the expired timers have already been handled. */
 	} else {
 		/* Incoming data. */
-		numclients = retval;
-		if (bbus_pollset_srvisset(pollset, server)) {
-			while (bbus_srv_clientpending(server)) {
-				accept_client(server);
-			}
-			--numclients;
+		if (bbus_pollset_woken(pollset)) {
+			while ((job = bbusd_shard_pop()) != NULL)
+				handle_job(job);
 		}
 
-		tmpcli = bbusd_clientlist_getfirst();
-		while (numclients > 0) {
-			retval = 0;
-			if (bbus_pollset_cliisset(pollset, tmpcli->cli)) {
-				retval = handle_client(tmpcli);
-				--numclients;
+		for (i = 0; i < numservers; ++i) {
+			if (!bbus_pollset_srvisset(pollset, servers[i]))
+				continue;
+			accept_clients(servers[i]);
+		}
+
+		while ((cli = bbus_pollset_nextcli(pollset)) != NULL) {
+			if (bbus_client_gettype(cli) == BBUS_CLIENT_OPENING) {
+				(void)continue_handshake(
+					bbus_client_getpriv(cli));
+				continue;
 			}
 
-			if (retval == 0) {
-				tmpcli = tmpcli->next;
-			} else {
-				bbus_client_close(tmpcli->cli);
-				bbus_client_free(tmpcli->cli);
-				cli_rm = tmpcli;
-				tmpcli = tmpcli->next;
-				bbusd_clientlist_rm(&cli_rm);
-				bbusd_logmsg(BBUSD_LOG_INFO,
-						"Client disconnected.\n");
+			cli_elem = bbus_client_getpriv(cli);
+			retval = bbus_client_flush(cli);
+			if (retval < 0) {
+				bbusd_logmsg(BBUSD_LOG_ERR,
+					"Error sending queued data to "
+					"client: %s\n",
+					bbus_strerror(bbus_lasterror()));
+			} else
+			if (bbus_client_gettype(cli) == BBUS_CLIENT_MON) {
+				bbusd_mon_drain(cli);
 			}
+
+			/*
+			 * Clients are reported only once per incoming batch
+			 * of data - handle every message already waiting.
+			 */
+			while (retval == 0)
+				retval = handle_client(cli_elem);
+
+			if (retval < 0)
+				close_client(pollset, cli_elem);
+		}
+	}
+
+	/* The links are owned by the first shard. */
+	if (bbusd_shard_self() == 0)
+		bbusd_bridge_sync();
+	flush_clients(pollset);
+}
+
+static void close_all_clients(void)
+{
+	struct bbusd_clientlist_elem* tmpcli;
+	int type;
+
+	for (type = 0; type < BBUSD_NUMCLITYPES; ++type) {
+		while ((tmpcli = bbusd_clientlist_getfirst(type)) != NULL) {
+			if ((type == BBUS_CLIENT_SERVICE)
+					&& (tmpcli->data != NULL))
+				bbusd_free_provided(tmpcli->data);
+			bbus_client_close(tmpcli->cli);
+			bbus_client_free(tmpcli->cli);
+			bbusd_clientlist_rm(&tmpcli);
 		}
 	}
+	bbusd_clientlist_free();
+}
+
+static void* shard_main(void* arg)
+{
+	unsigned shard = (unsigned)(uintptr_t)arg;
+	sigset_t sigmask;
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+	bbusd_shard_setself(shard);
+	bbusd_init_msgbuf();
+	bbusd_init_caller_map(call_timed_out, shard_clients());
+	bbusd_init_signals(forward_message);
+	bbusd_init_rcache(rcacheentries);
+
+	while (do_run()) {
+		poll_and_handle_inbound_traffic(NULL, 0,
+					bbusd_shard_pollset(shard));
+	}
+
+	close_all_clients();
+	bbusd_free_rcache();
+	bbusd_free_signals();
+	bbusd_clean_caller_map();
+	bbusd_free_msgbuf();
+	bbusd_capture_release();
+
+	return NULL;
 }
 
 int main(int argc, char** argv)
 {
 	int retval;
-	struct bbusd_clientlist_elem* tmpcli;
-	static bbus_pollset* pollset;
-	bbus_server* server;
+	pthread_t threads[BBUSD_MAXSHARDS];
+	bbus_pollset* pollset;
+	bbus_server* servers[BBUS_POLLSET_MAXSRVS];
+	unsigned numservers;
+	unsigned i;
 
 	retval = bbus_parse_args(argc, argv, &optlist, NULL);
 	if (retval == BBUS_ARGS_HELP)
@@ -612,54 +2295,98 @@ int main(int argc, char** argv)
 	else if (retval == BBUS_ARGS_ERR)
 		return EXIT_FAILURE;
 
-	bbusd_init_caller_map();
-	bbusd_init_service_map();
+	bbus_alloc_setaccounting(allocstats);
+	bbusd_log_start(usesyslog);
+	/* The main thread is the first shard. */
+	bbusd_shards_init(numthreads);
+	bbusd_tp_init(numthreads, tpentries);
+	bbusd_mon_configure(monqueuelen, mondrop);
+	if ((capturepath != NULL) && (bbusd_capture_open(capturepath) < 0))
+		bbusd_die("Error enabling the message capture\n");
+	bbusd_init_msgbuf();
+	bbusd_init_caller_map(call_timed_out, shard_clients());
+	bbusd_init_signals(forward_message);
+	bbusd_init_rcache(rcacheentries);
+	bbusd_init_service_map(expmethods);
 	bbusd_register_local_methods();
+	for (i = 0; i < numplugins; ++i)
+		bbusd_load_plugin(pluginpaths[i]);
+	bbusd_start_plugins(pluginworkers);
+
+	pollset = bbusd_shard_pollset(0);
+	mainpollset = pollset;
+	/* The socket path first, then any additional addresses. */
+	for (numservers = 0; numservers <= numlisten; ++numservers) {
+		servers[numservers] = numservers == 0 ? bbus_srv_create()
+			: bbus_srv_create_addr(listenaddrs[numservers - 1]);
+		if (servers[numservers] == NULL) {
+			bbusd_die("Error creating the server object: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		}
 
-	/* Creating the server object. */
-	server = bbus_srv_create();
-	if (server == NULL) {
-		bbusd_die("Error creating the server object: %s\n",
-			bbus_strerror(bbus_lasterror()));
-	}
-
-	retval = bbus_srv_listen(server);
-	if (retval < 0) {
-		bbusd_die("Error opening server for connections: %s\n",
-			bbus_strerror(bbus_lasterror()));
-	}
+		retval = bbus_srv_listen(servers[numservers]);
+		if (retval < 0) {
+			bbusd_die("Error opening server for connections: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		}
 
-	pollset = bbus_pollset_make();
-	if (pollset == NULL) {
-		bbusd_die("Error creating the poll_set: %s\n",
-			bbus_strerror(bbus_lasterror()));
+		retval = bbus_pollset_addsrv(pollset, servers[numservers]);
+		if (retval < 0) {
+			bbusd_die("Error adding the server to the poll_set: "
+				"%s\n", bbus_strerror(bbus_lasterror()));
+		}
 	}
+	bbusd_init_bridges(adopt_client, send_message);
 
 	bbusd_logmsg(BBUSD_LOG_INFO, "Busybus daemon starting!\n");
+	bbusd_logmsg(BBUSD_LOG_INFO, "Polling with %s.\n",
+					bbus_pollset_backend(pollset));
 	run = 1;
 	(void)signal(SIGTERM, sighandler);
 	(void)signal(SIGINT, sighandler);
 
+	for (i = 1; i < numthreads; ++i) {
+		retval = pthread_create(&threads[i], NULL, shard_main,
+						(void*)(uintptr_t)i);
+		if (retval != 0) {
+			bbusd_die("Error creating a reactor thread: %s\n",
+						bbus_strerror(retval));
+		}
+	}
+
 	/*
 	 * MAIN LOOP
 	 */
 	while (do_run()) {
-		poll_and_handle_inbound_traffic(server, pollset);
+		poll_and_handle_inbound_traffic(servers, numservers, pollset);
 	}
 
-	/* Cleanup. */
-	bbus_srv_close(server);
-
-	for (tmpcli = bbusd_clientlist_getfirst(); tmpcli != NULL;
-					tmpcli = tmpcli->next) {
-		bbus_client_close(tmpcli->cli);
-		bbus_client_free(tmpcli->cli);
-		bbus_free(tmpcli);
+	/* The other shards sleep until woken up. */
+	for (i = 1; i < numthreads; ++i) {
+		(void)bbus_pollset_wakeup(bbusd_shard_pollset(i));
+		pthread_join(threads[i], NULL);
 	}
+	bbusd_stop_plugins();
 
+	/* Cleanup. */
+	for (i = 0; i < numservers; ++i) {
+		bbus_srv_close(servers[i]);
+		bbus_srv_free(servers[i]);
+	}
+	close_handshakes();
+	close_all_clients();
+	bbusd_free_bridges();
+	bbusd_shards_free();
+	bbusd_free_rcache();
 	bbusd_free_service_map();
+	bbusd_free_plugins();
+	bbusd_free_signals();
+	bbusd_clean_caller_map();
+	bbusd_free_msgbuf();
+	bbusd_capture_release();
+	bbusd_capture_close();
+	bbusd_tp_free();
 
 	bbusd_logmsg(BBUSD_LOG_INFO, "Busybus daemon exiting!\n");
 	return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bridge.h"
+#include "service.h"
+#include "shard.h"
+#include "timer.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Links that can't be connected are retried this often. */
+#define BRIDGE_RETRYMS		1000
+/* Registrations are sent in messages of up to this size. */
+#define BRIDGE_REGSIZE		4096
+#define BRIDGE_NAME		"bbusd-bridge"
+/* Every method path starts with it, registrations don't carry it. */
+#define PATH_ROOT		"bbus."
+#define PATH_ROOTLEN		(sizeof(PATH_ROOT) - 1)
+
+struct path_list
+{
+	char** paths;
+	unsigned num;
+	unsigned max;
+};
+
+struct bridge
+{
+	char* addr;
+	struct path_list prefixes;
+	/* NULL while the link is down. */
+	bbus_client* cli;
+	/* Paths registered with the peer, sorted. */
+	struct path_list exported;
+	/* Service map epoch the peer last got the methods for. */
+	unsigned long epoch;
+	int synced;
+	/* Set after a failed attempt, so that retries don't flood the log. */
+	int failing;
+	struct bbusd_timer retry;
+	struct bridge* next;
+};
+
+/* Registration meta being built. */
+struct reg_buf
+{
+	char meta[BRIDGE_REGSIZE];
+	size_t len;
+};
+
+struct collect_ctx
+{
+	const struct bridge* br;
+	struct path_list* list;
+};
+
+static struct bridge* bridges;
+static bbusd_bridge_adoptfunc adoptfunc;
+static bbusd_bridge_sendfunc sendfunc;
+
+/* Takes ownership of the path. */
+static int list_add(struct path_list* list, char* path)
+{
+	char** newpaths;
+	unsigned newmax;
+
+	if (list->num == list->max) {
+		newmax = list->max == 0 ? 16 : list->max * 2;
+		newpaths = bbus_realloc(list->paths, newmax * sizeof(char*));
+		if (newpaths == NULL)
+			return -1;
+		list->paths = newpaths;
+		list->max = newmax;
+	}
+
+	list->paths[list->num++] = path;
+	return 0;
+}
+
+static void list_free(struct path_list* list)
+{
+	unsigned i;
+
+	for (i = 0; i < list->num; ++i)
+		bbus_str_free(list->paths[i]);
+	bbus_free(list->paths);
+	memset(list, 0, sizeof(struct path_list));
+}
+
+static int cmp_paths(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static struct bridge* find_bridge(bbus_client* cli)
+{
+	struct bridge* br;
+
+	for (br = bridges; br != NULL; br = br->next) {
+		if (br->cli == cli)
+			return br;
+	}
+
+	return NULL;
+}
+
+static void bridge_connect(struct bridge* br)
+{
+	bbus_client* cli;
+
+	cli = bbus_srv_connectpeer(br->addr, BRIDGE_NAME);
+	if (cli == NULL) {
+		if (!br->failing) {
+			bbusd_logmsg(BBUSD_LOG_WARN,
+				"Error connecting the bridge to '%s': %s, "
+				"retrying.\n", br->addr,
+				bbus_strerror(bbus_lasterror()));
+		}
+		br->failing = 1;
+		bbusd_timer_arm(&br->retry, BRIDGE_RETRYMS);
+		return;
+	}
+
+	/* The client is freed if this fails. */
+	if (adoptfunc(cli) < 0) {
+		bbusd_timer_arm(&br->retry, BRIDGE_RETRYMS);
+		return;
+	}
+
+	bbusd_logmsg(BBUSD_LOG_INFO, "Bridge to '%s' connected.\n", br->addr);
+	br->cli = cli;
+	br->failing = 0;
+	br->synced = 0;
+}
+
+static void bridge_retry(void* arg)
+{
+	bridge_connect(arg);
+}
+
+int bbusd_bridge_export(const char* spec)
+{
+	struct bridge* br;
+	const char* at;
+	char* prefix;
+
+	at = index(spec, '@');
+	if ((at == NULL) || (at == spec) || (at[1] == '\0'))
+		return -1;
+
+	for (br = bridges; br != NULL; br = br->next) {
+		if (strcmp(br->addr, at + 1) == 0)
+			break;
+	}
+
+	if (br == NULL) {
+		br = bbus_malloc0(sizeof(struct bridge));
+		if (br == NULL)
+			return -1;
+
+		br->addr = bbus_str_cpy(at + 1);
+		if (br->addr == NULL) {
+			bbus_free(br);
+			return -1;
+		}
+
+		bbusd_timer_init(&br->retry, bridge_retry, br);
+		br->next = bridges;
+		bridges = br;
+	}
+
+	prefix = bbus_str_build("%.*s", (int)(at - spec), spec);
+	if ((prefix == NULL) || (list_add(&br->prefixes, prefix) < 0)) {
+		bbus_str_free(prefix);
+		return -1;
+	}
+
+	return 0;
+}
+
+void bbusd_init_bridges(bbusd_bridge_adoptfunc adopt,
+				bbusd_bridge_sendfunc send)
+{
+	struct bridge* br;
+
+	adoptfunc = adopt;
+	sendfunc = send;
+	for (br = bridges; br != NULL; br = br->next)
+		bridge_connect(br);
+}
+
+void bbusd_free_bridges(void)
+{
+	struct bridge* br;
+
+	while ((br = bridges) != NULL) {
+		bridges = br->next;
+		bbusd_timer_cancel(&br->retry);
+		list_free(&br->prefixes);
+		list_free(&br->exported);
+		bbus_str_free(br->addr);
+		bbus_free(br);
+	}
+}
+
+/* The path is the prefix or the prefix is one of its parent services. */
+static int path_exported(const struct bridge* br,
+				const char* path, size_t len)
+{
+	const char* prefix;
+	size_t prefixlen;
+	unsigned i;
+
+	for (i = 0; i < br->prefixes.num; ++i) {
+		prefix = br->prefixes.paths[i];
+		prefixlen = strlen(prefix);
+		if ((len >= prefixlen) && (memcmp(path, prefix, prefixlen) == 0)
+				&& ((len == prefixlen) || (path[prefixlen] == '.')))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int collect_exported(const void* key, size_t keysize,
+					void* val, void* arg)
+{
+	struct bbusd_method* mthd = val;
+	struct collect_ctx* ctx = arg;
+	char* path;
+
+	if (((mthd->type != BBUSD_METHOD_LOCAL)
+			&& (mthd->type != BBUSD_METHOD_REMOTE))
+			|| (keysize <= PATH_ROOTLEN)
+			|| (memcmp(key, PATH_ROOT, PATH_ROOTLEN) != 0)
+			|| !path_exported(ctx->br, key, keysize))
+		return 0;
+
+	path = bbus_str_build("%.*s", (int)keysize, (const char*)key);
+	if ((path == NULL) || (list_add(ctx->list, path) < 0)) {
+		bbus_str_free(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void send_reg(struct bridge* br, struct reg_buf* reg)
+{
+	struct bbus_msg_hdr hdr;
+
+	if (reg->len == 0)
+		return;
+
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_SRVREG, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	bbus_hdr_setpsize(&hdr, reg->len + 1);
+	if (sendfunc(br->cli, &hdr, reg->meta, NULL) < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error registering methods with '%s': %s\n",
+			br->addr, bbus_strerror(bbus_lasterror()));
+	}
+
+	reg->len = 0;
+}
+
+/*
+ * Registrations going in one message are separated by newlines. The
+ * peer never looks at the descriptions, so they're left empty.
+ */
+static void add_reg(struct bridge* br, struct reg_buf* reg, const char* path)
+{
+	size_t len;
+
+	path += PATH_ROOTLEN;
+	/* Separator, two commas and the terminating null. */
+	len = strlen(path) + 4;
+	if (len > BRIDGE_REGSIZE) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Path too long to export: %s\n", path);
+		return;
+	}
+
+	if (reg->len + len > BRIDGE_REGSIZE)
+		send_reg(br, reg);
+
+	reg->len += sprintf(reg->meta + reg->len, "%s%s,,",
+				reg->len > 0 ? "\n" : "", path);
+}
+
+static void send_unreg(struct bridge* br, const char* path)
+{
+	struct bbus_msg_hdr hdr;
+
+	path += PATH_ROOTLEN;
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_SRVUNREG, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	bbus_hdr_setpsize(&hdr, strlen(path) + 1);
+	if (sendfunc(br->cli, &hdr, (char*)path, NULL) < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error unregistering a method from '%s': %s\n",
+			br->addr, bbus_strerror(bbus_lasterror()));
+	}
+}
+
+static int bridge_sync(struct bridge* br)
+{
+	struct path_list current;
+	struct collect_ctx ctx;
+	struct reg_buf reg;
+	unsigned i = 0;
+	unsigned j = 0;
+	int cmp;
+
+	memset(&current, 0, sizeof(struct path_list));
+	ctx.br = br;
+	ctx.list = &current;
+	if (bbusd_foreach_method(collect_exported, &ctx) != 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error listing the methods exported to '%s'\n",
+			br->addr);
+		list_free(&current);
+		return -1;
+	}
+	qsort(current.paths, current.num, sizeof(char*), cmp_paths);
+
+	/* Both lists are sorted - new paths are registered, gone removed. */
+	reg.len = 0;
+	while ((i < current.num) || (j < br->exported.num)) {
+		if (j == br->exported.num)
+			cmp = -1;
+		else if (i == current.num)
+			cmp = 1;
+		else
+			cmp = strcmp(current.paths[i], br->exported.paths[j]);
+
+		if (cmp < 0) {
+			add_reg(br, &reg, current.paths[i++]);
+		} else
+		if (cmp > 0) {
+			send_unreg(br, br->exported.paths[j++]);
+		} else {
+			++i;
+			++j;
+		}
+	}
+	send_reg(br, &reg);
+
+	list_free(&br->exported);
+	memcpy(&br->exported, &current, sizeof(struct path_list));
+
+	return 0;
+}
+
+void bbusd_bridge_sync(void)
+{
+	struct bridge* br;
+	unsigned long epoch;
+
+	epoch = bbusd_service_map_epoch();
+	for (br = bridges; br != NULL; br = br->next) {
+		if ((br->cli == NULL) || (br->synced && (br->epoch == epoch)))
+			continue;
+
+		/* Changes made meanwhile are caught by the next call. */
+		if (bridge_sync(br) == 0) {
+			br->epoch = epoch;
+			br->synced = 1;
+		}
+	}
+}
+
+void bbusd_bridge_notify(void)
+{
+	if ((bridges != NULL) && (bbusd_shard_self() != 0))
+		(void)bbus_pollset_wakeup(bbusd_shard_pollset(0));
+}
+
+void bbusd_bridge_ack(bbus_client* cli, const struct bbus_msg* msg)
+{
+	struct bridge* br;
+
+	br = find_bridge(cli);
+	if ((br != NULL) && (msg->hdr.errcode != BBUS_PROT_EGOOD)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Peer '%s' failed to register the exported methods.\n",
+			br->addr);
+	}
+}
+
+void bbusd_bridge_down(bbus_client* cli)
+{
+	struct bridge* br;
+
+	br = find_bridge(cli);
+	if (br == NULL)
+		return;
+
+	bbusd_logmsg(BBUSD_LOG_WARN, "Bridge to '%s' lost, reconnecting.\n",
+								br->addr);
+	br->cli = NULL;
+	list_free(&br->exported);
+	bbusd_timer_arm(&br->retry, BRIDGE_RETRYMS);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_BRIDGE__
+#define __BBUSD_BRIDGE__
+
+#include <busybus.h>
+
+/*
+ * Bridges export service subtrees of this daemon to peer daemons. Every
+ * peer gets a single link on which this daemon registers as a provider
+ * of all the methods found under the prefixes exported to it. The calls
+ * of all the peer's callers are multiplexed over the link by their tokens
+ * and everything sent in one loop iteration goes out in one batch.
+ *
+ * Links are owned by the first shard. A subtree must not be exported back
+ * to the daemon it's been imported from.
+ */
+
+/* Makes a connected link part of this shard. */
+typedef int (*bbusd_bridge_adoptfunc)(bbus_client*);
+typedef int (*bbusd_bridge_sendfunc)(bbus_client*, struct bbus_msg_hdr*,
+						char*, bbus_object*);
+
+/* Takes 'PREFIX@ADDR', prefixes exported to the same address share a link. */
+int bbusd_bridge_export(const char* spec);
+/* Connects the links, must be called by the first shard. */
+void bbusd_init_bridges(bbusd_bridge_adoptfunc adopt,
+				bbusd_bridge_sendfunc send);
+void bbusd_free_bridges(void);
+/*
+ * Called by the first shard on every iteration - tells the peers about
+ * the methods inserted and removed meanwhile.
+ */
+void bbusd_bridge_sync(void);
+/* Called by any shard after changing the service map. */
+void bbusd_bridge_notify(void);
+/* The peer acknowledged a registration sent on the link. */
+void bbusd_bridge_ack(bbus_client* cli, const struct bbus_msg* msg);
+/* The link is being closed, it will be connected again after a while. */
+void bbusd_bridge_down(bbus_client* cli);
+
+#endif /* __BBUSD_BRIDGE__ */
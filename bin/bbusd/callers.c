@@ -14,36 +14,323 @@
 
 #include "callers.h"
 #include "common.h"
+#include "shard.h"
+#include "log.h"
+#include "timer.h"
+#include <string.h>
 
 /*
- * Caller map:
- * 	keys -> tokens,
- * 	values -> pointers to caller objects.
+ * Client table (per shard). Callers and services are looked up by their
+ * token on every reply, so tokens index a dense array of slots directly.
+ * Slots are reused when clients disconnect - the generation stored in
+ * both the slot and the token makes sure a stale token never resolves
+ * to a different client.
+ *
+ * Token layout: | shard | generation | slot index |
+ */
+#define CLIENT_INDEX_BITS	16
+#define CLIENT_INDEX_MASK	((1U << CLIENT_INDEX_BITS) - 1)
+#define CLIENT_GEN_MASK		(BBUSD_TOKEN_MASK >> CLIENT_INDEX_BITS)
+#define CLIENT_MINSLOTS		32
+
+struct client_slot
+{
+	struct bbusd_clientlist_elem* cli;
+	unsigned gen;
+	/* Index of the next free slot if this one is free. */
+	unsigned nextfree;
+};
+
+static BBUS_THREAD_LOCAL struct client_slot* slots;
+static BBUS_THREAD_LOCAL unsigned numslots;
+static BBUS_THREAD_LOCAL unsigned freeslot;
+
+/*
+ * Pending call map (per shard):
+ * 	keys -> tokens of calls forwarded to services,
+ * 	values -> pointers to struct pending_call.
+ */
+static BBUS_THREAD_LOCAL bbus_hashmap* pending_map;
+static bbusd_call_expired_func call_expired;
+
+struct pending_call
+{
+	struct bbusd_pending_call call;
+	unsigned token;
+	struct bbusd_timer timer;
+	/* Next cached entry if this one is free. */
+	struct pending_call* nextfree;
+};
+
+/*
+ * Every forwarded call needs an entry, which lives until the reply comes
+ * back - freed entries are kept (per shard) for the following calls so
+ * that routing doesn't hit the allocator in the steady state.
  */
-static bbus_hashmap* caller_map;
+#define PENDING_MAXCACHED	1024
+
+static BBUS_THREAD_LOCAL struct pending_call* freecalls;
+static BBUS_THREAD_LOCAL unsigned numfreecalls;
+
+static int grow_slots(void)
+{
+	struct client_slot* newslots;
+	unsigned newsize;
+	unsigned i;
+
+	newsize = numslots == 0 ? CLIENT_MINSLOTS : numslots * 2;
+	if (newsize > CLIENT_INDEX_MASK + 1) {
+		bbusd_logmsg(BBUSD_LOG_ERR, "Client table is full.\n");
+		return -1;
+	}
+
+	newslots = bbus_realloc(slots, newsize * sizeof(struct client_slot));
+	if (newslots == NULL)
+		return -1;
+
+	/* New slots are put on the free list in order. */
+	for (i = numslots; i < newsize; ++i) {
+		newslots[i].cli = NULL;
+		newslots[i].gen = 1;
+		newslots[i].nextfree = i + 1;
+	}
+	newslots[newsize - 1].nextfree = freeslot;
+	freeslot = numslots;
+	slots = newslots;
+	numslots = newsize;
+
+	return 0;
+}
 
-void bbusd_init_caller_map(void)
+static struct client_slot* token_slot(unsigned token)
 {
-	caller_map = bbus_hmap_create(BBUS_HMAP_KEYUINT);
-	if (caller_map == NULL) {
-		bbusd_die("Error creating the caller hashmap: %s\n",
+	unsigned ind;
+
+	ind = token & CLIENT_INDEX_MASK;
+	if ((bbusd_token_shard(token) != bbusd_shard_self())
+			|| (ind >= numslots) || (slots[ind].cli == NULL)
+			|| (slots[ind].gen != ((token & BBUSD_TOKEN_MASK)
+						>> CLIENT_INDEX_BITS)))
+		return NULL;
+
+	return &slots[ind];
+}
+
+void bbusd_init_caller_map(bbusd_call_expired_func expired,
+						unsigned expclients)
+{
+	call_expired = expired;
+	slots = NULL;
+	numslots = 0;
+	freeslot = 0;
+
+	while (numslots < expclients) {
+		if (grow_slots() < 0) {
+			bbusd_die("Error creating the client table: %s\n",
+					bbus_strerror(bbus_lasterror()));
+		}
+	}
+
+	pending_map = expclients > 0
+		? bbus_hmap_create_sized(BBUS_HMAP_KEYUINT, expclients)
+		: bbus_hmap_create(BBUS_HMAP_KEYUINT);
+	if (pending_map == NULL) {
+		bbusd_die("Error creating the pending call hashmap: %s\n",
 					bbus_strerror(bbus_lasterror()));
 	}
 }
 
 void bbusd_clean_caller_map(void)
 {
-	bbus_hmap_free(caller_map);
+	struct pending_call* pending;
+
+	bbus_free(slots);
+	slots = NULL;
+	numslots = 0;
+	bbus_hmap_free(pending_map);
+	while (freecalls != NULL) {
+		pending = freecalls;
+		freecalls = pending->nextfree;
+		bbus_free(pending);
+	}
+	numfreecalls = 0;
+}
+
+struct bbusd_clientlist_elem* bbusd_get_client(unsigned token)
+{
+	struct client_slot* slot;
+
+	slot = token_slot(token);
+	return slot == NULL ? NULL : slot->cli;
+}
+
+int bbusd_add_client(struct bbusd_clientlist_elem* cli, unsigned* token)
+{
+	struct client_slot* slot;
+	unsigned ind;
+
+	if (freeslot >= numslots) {
+		if (grow_slots() < 0)
+			return -1;
+	}
+
+	ind = freeslot;
+	slot = &slots[ind];
+	freeslot = slot->nextfree;
+	slot->cli = cli;
+	*token = (bbusd_shard_self() << BBUSD_SHARD_SHIFT)
+			| (slot->gen << CLIENT_INDEX_BITS) | ind;
+
+	return 0;
+}
+
+void bbusd_rm_client(unsigned token)
+{
+	struct client_slot* slot;
+
+	slot = token_slot(token);
+	if (slot == NULL)
+		return;
+
+	slot->cli = NULL;
+	slot->gen = (slot->gen + 1) & CLIENT_GEN_MASK;
+	/* Generation 0 is never used, so a valid token is never 0. */
+	if (slot->gen == 0)
+		slot->gen = 1;
+	slot->nextfree = freeslot;
+	freeslot = slot - slots;
+}
+
+static struct pending_call* pending_alloc(void)
+{
+	struct pending_call* pending;
+
+	pending = freecalls;
+	if (pending == NULL)
+		return bbus_malloc(sizeof(struct pending_call));
+
+	freecalls = pending->nextfree;
+	numfreecalls--;
+
+	return pending;
+}
+
+static void pending_free(struct pending_call* pending)
+{
+	if (numfreecalls >= PENDING_MAXCACHED) {
+		bbus_free(pending);
+		return;
+	}
+
+	pending->nextfree = freecalls;
+	freecalls = pending;
+	numfreecalls++;
+}
+
+static void pending_expired(void* arg)
+{
+	struct pending_call* pending = arg;
+
+	(void)bbus_hmap_rmuint(pending_map, pending->token);
+	bbusd_count(BBUSD_CNT_PENDING, -1);
+	call_expired(&pending->call);
+	pending_free(pending);
+}
+
+int bbusd_add_pending_call(unsigned token,
+			const struct bbusd_pending_call* call)
+{
+	struct pending_call* pending;
+	int ret;
+
+	pending = pending_alloc();
+	if (pending == NULL)
+		return -1;
+
+	pending->call = *call;
+	pending->token = token;
+	ret = bbus_hmap_setuint(pending_map, token, pending);
+	if (ret < 0) {
+		pending_free(pending);
+		return -1;
+	}
+	bbusd_count(BBUSD_CNT_PENDING, 1);
+
+	bbusd_timer_init(&pending->timer, pending_expired, pending);
+	if (call->deadline > 0) {
+		bbusd_timer_arm(&pending->timer,
+				bbusd_deadline_left(call->deadline));
+	}
+
+	return 0;
 }
 
-struct bbusd_clientlist_elem* bbusd_get_caller(unsigned token)
+int bbusd_take_pending_call(unsigned token, struct bbusd_pending_call* call)
 {
-	return (struct bbusd_clientlist_elem*)bbus_hmap_finduint(caller_map,
-									token);
+	struct pending_call* found;
+
+	found = bbus_hmap_rmuint(pending_map, token);
+	if (found == NULL)
+		return -1;
+
+	bbusd_timer_cancel(&found->timer);
+	*call = found->call;
+	pending_free(found);
+	bbusd_count(BBUSD_CNT_PENDING, -1);
+
+	return 0;
 }
 
-int bbusd_add_caller(unsigned token, struct bbusd_clientlist_elem* caller)
+struct token_list
+{
+	unsigned srvctok;
+	unsigned num;
+	unsigned max;
+	unsigned* tokens;
+};
+
+static int collect_calls(const void* key, size_t keysize BBUS_UNUSED,
+						void* val, void* arg)
 {
-	return bbus_hmap_setuint(caller_map, (unsigned)token, caller);
+	struct pending_call* pending = val;
+	struct token_list* list = arg;
+	unsigned* newtokens;
+	unsigned newmax;
+
+	if (pending->call.srvctok != list->srvctok)
+		return 0;
+
+	if (list->num == list->max) {
+		newmax = list->max == 0 ? 16 : list->max * 2;
+		newtokens = bbus_realloc(list->tokens,
+					newmax * sizeof(unsigned));
+		if (newtokens == NULL)
+			return -1;
+		list->tokens = newtokens;
+		list->max = newmax;
+	}
+	list->tokens[list->num++] = *(const unsigned*)key;
+
+	return 0;
 }
 
+int bbusd_fail_pending_calls(unsigned srvctok, bbusd_call_expired_func func)
+{
+	struct bbusd_pending_call call;
+	struct token_list list;
+	unsigned i;
+	int ret;
+
+	memset(&list, 0, sizeof(struct token_list));
+	list.srvctok = srvctok;
+
+	/* The map can't be modified while iterating over it. */
+	ret = bbus_hmap_foreach(pending_map, collect_calls, &list);
+	for (i = 0; i < list.num; ++i) {
+		if (bbusd_take_pending_call(list.tokens[i], &call) == 0)
+			func(&call);
+	}
+	bbus_free(list.tokens);
+
+	return ret == 0 ? 0 : -1;
+}
@@ -17,12 +17,58 @@
 
 #include <busybus.h>
 #include "clients.h"
+#include "stats.h"
+#include "service.h"
 
-void bbusd_init_caller_map(void);
+/*
+ * Call forwarded to a service for which we haven't received the reply yet.
+ */
+struct bbusd_pending_call
+{
+	unsigned caller;	/* Token of the calling client. */
+	unsigned callid;	/* Call id assigned by the caller. */
+	/*
+	 * Method called, NULL if the reply shouldn't be accounted. Holds
+	 * a reference to the method.
+	 */
+	struct bbusd_method* method;
+	uint64_t start;		/* When bbusd received the call. */
+	uint64_t deadline;	/* Same clock as 'start', 0 if none. */
+	/* Provider the call was routed to, NULL if not accounted. */
+	struct bbusd_provider* provider;
+	unsigned srvctok;	/* Token of the provider. */
+	/* BBUS_PROT_OBJFLAGS of the object being passed on. */
+	int objflags;
+	/* Reply cache entry to store the reply in, see bbusd_rcache_fill(). */
+	uint32_t cachehash;
+	unsigned cacheticket;	/* 0 if the reply isn't cached. */
+};
+
+/* Called with the call already removed from the pending call map. */
+typedef void (*bbusd_call_expired_func)(const struct bbusd_pending_call*);
+
+/*
+ * The client table and the pending call map are sized for 'expclients'
+ * clients up front, 0 means no hint.
+ */
+void bbusd_init_caller_map(bbusd_call_expired_func expired,
+						unsigned expclients);
 void bbusd_clean_caller_map(void);
 
-struct bbusd_clientlist_elem* bbusd_get_caller(unsigned token);
-int bbusd_add_caller(unsigned token, struct bbusd_clientlist_elem* caller);
+struct bbusd_clientlist_elem* bbusd_get_client(unsigned token);
+/* Stores the client and assigns it a new token. */
+int bbusd_add_client(struct bbusd_clientlist_elem* cli, unsigned* token);
+void bbusd_rm_client(unsigned token);
+
+/* Calls with a deadline expire on their own if not taken in time. */
+int bbusd_add_pending_call(unsigned token,
+			const struct bbusd_pending_call* pending);
+int bbusd_take_pending_call(unsigned token, struct bbusd_pending_call* call);
+/*
+ * Takes every call routed to the service and passes it to 'func', used
+ * when the service is gone and won't ever reply.
+ */
+int bbusd_fail_pending_calls(unsigned srvctok, bbusd_call_expired_func func);
 
 
 #endif /* __BBUSD_CALLERS__ */
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "capture.h"
+#include "shard.h"
+#include "log.h"
+#include "timer.h"
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static int capfd = -1;
+/* Keeps the chunks written by different threads from interleaving. */
+static pthread_mutex_t caplock = PTHREAD_MUTEX_INITIALIZER;
+static BBUS_THREAD_LOCAL char* capbuf;
+static BBUS_THREAD_LOCAL size_t capused;
+/* Writes out records buffered by an otherwise idle thread. */
+static BBUS_THREAD_LOCAL struct bbusd_timer flushtimer;
+
+static const char padding[BBUS_TRACE_ALIGN];
+
+static size_t align_rec(size_t size)
+{
+	return (size + BBUS_TRACE_ALIGN - 1) & ~(size_t)(BBUS_TRACE_ALIGN - 1);
+}
+
+static int write_all(const void* buf, size_t size)
+{
+	const char* pos = buf;
+	ssize_t r;
+
+	while (size > 0) {
+		r = write(capfd, pos, size);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error writing the capture file: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		pos += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+int bbusd_capture_open(const char* path)
+{
+	struct bbus_trace_filehdr filehdr;
+
+	capfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+									0644);
+	if (capfd < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error opening the capture file '%s': %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	memset(&filehdr, 0, sizeof(filehdr));
+	memcpy(filehdr.magic, BBUS_TRACE_MAGIC, sizeof(filehdr.magic));
+	filehdr.byteorder = BBUS_TRACE_BYTEORDER;
+	if (write_all(&filehdr, sizeof(filehdr)) < 0) {
+		close(capfd);
+		capfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void bbusd_capture_close(void)
+{
+	if (capfd < 0)
+		return;
+
+	close(capfd);
+	capfd = -1;
+}
+
+int bbusd_capture_enabled(void)
+{
+	return capfd >= 0;
+}
+
+void bbusd_capture_flush(void)
+{
+	bbusd_timer_cancel(&flushtimer);
+	if (capused == 0)
+		return;
+
+	pthread_mutex_lock(&caplock);
+	(void)write_all(capbuf, capused);
+	pthread_mutex_unlock(&caplock);
+	capused = 0;
+}
+
+static void flush_expired(void* arg BBUS_UNUSED)
+{
+	bbusd_capture_flush();
+}
+
+void bbusd_capture_release(void)
+{
+	bbusd_capture_flush();
+	bbus_free(capbuf);
+	capbuf = NULL;
+}
+
+/*
+ * Records which don't fit in the buffer at all are written directly,
+ * everything else is only copied to the thread's buffer.
+ */
+static void capture(int direction, const struct bbus_msg_hdr* hdr,
+		const void* data1, size_t size1,
+		const void* data2, size_t size2)
+{
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	struct bbus_trace_rechdr rec;
+	struct timespec ts;
+	size_t wiresize;
+	size_t recsize;
+	size_t padsize;
+
+	if (capbuf == NULL) {
+		capbuf = bbus_malloc(BBUSD_CAPTURE_BUFSIZE);
+		if (capbuf == NULL) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Error allocating the capture buffer\n");
+			return;
+		}
+
+		bbusd_timer_init(&flushtimer, flush_expired, NULL);
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	wiresize = bbus_hdr_pack(hdr, wire);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.tstamp = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec.size = wiresize + size1 + size2;
+	rec.direction = direction;
+	rec.shard = bbusd_shard_self();
+	recsize = align_rec(sizeof(rec) + rec.size);
+	padsize = recsize - sizeof(rec) - rec.size;
+
+	if (recsize > BBUSD_CAPTURE_BUFSIZE - capused)
+		bbusd_capture_flush();
+
+	if (recsize > BBUSD_CAPTURE_BUFSIZE) {
+		pthread_mutex_lock(&caplock);
+		if ((write_all(&rec, sizeof(rec)) == 0)
+				&& (write_all(wire, wiresize) == 0)
+				&& (write_all(data1, size1) == 0)
+				&& (write_all(data2, size2) == 0))
+			(void)write_all(padding, padsize);
+		pthread_mutex_unlock(&caplock);
+		return;
+	}
+
+	memcpy(capbuf + capused, &rec, sizeof(rec));
+	capused += sizeof(rec);
+	memcpy(capbuf + capused, wire, wiresize);
+	capused += wiresize;
+	if (size1 > 0)
+		memcpy(capbuf + capused, data1, size1);
+	capused += size1;
+	if (size2 > 0)
+		memcpy(capbuf + capused, data2, size2);
+	capused += size2;
+	memset(capbuf + capused, 0, padsize);
+	capused += padsize;
+
+	if (!bbusd_timer_pending(&flushtimer))
+		bbusd_timer_arm(&flushtimer, BBUSD_CAPTURE_FLUSHMS);
+}
+
+void bbusd_capture_recvd(const struct bbus_msg* msg)
+{
+	if (capfd < 0)
+		return;
+
+	capture(BBUS_TRACE_RECVD, &msg->hdr, msg->payload,
+			bbus_hdr_getpsize(&msg->hdr), NULL, 0);
+}
+
+void bbusd_capture_sent(const struct bbus_msg_hdr* hdr, const char* meta,
+					const void* obj, size_t objsize)
+{
+	if (capfd < 0)
+		return;
+
+	capture(BBUS_TRACE_SENT, hdr, meta,
+			meta == NULL ? 0 : strlen(meta) + 1, obj, objsize);
+}
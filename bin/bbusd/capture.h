@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_CAPTURE__
+#define __BBUSD_CAPTURE__
+
+#include <busybus.h>
+
+/*
+ * Binary capture of every message received or sent by bbusd. Records are
+ * buffered per reactor thread and written out in large chunks. The trace
+ * format is described in busybus.h and can be read with bbus_trace_open().
+ */
+
+#define BBUSD_CAPTURE_BUFSIZE	(1024 * 1024)
+/* Maximum time a record stays in the buffer. */
+#define BBUSD_CAPTURE_FLUSHMS	500
+
+/* Must be called before the reactor threads are started. */
+int bbusd_capture_open(const char* path);
+void bbusd_capture_close(void);
+int bbusd_capture_enabled(void);
+void bbusd_capture_recvd(const struct bbus_msg* msg);
+void bbusd_capture_sent(const struct bbus_msg_hdr* hdr, const char* meta,
+					const void* obj, size_t objsize);
+/* Writes out the calling thread's buffer. */
+void bbusd_capture_flush(void);
+/* Flushes and frees the calling thread's buffer, called on thread exit. */
+void bbusd_capture_release(void);
+
+#endif /* __BBUSD_CAPTURE__ */
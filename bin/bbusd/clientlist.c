@@ -14,18 +14,20 @@
 
 #include "clientlist.h"
 
-int __bbusd_clientlist_add(bbus_client* cli, struct bbusd_clientlist* list)
+struct bbusd_clientlist_elem* __bbusd_clientlist_add(bbus_client* cli,
+					struct bbusd_clientlist* list)
 {
 	struct bbusd_clientlist_elem* el;
 
-	el = bbus_malloc(sizeof(struct bbusd_clientlist_elem));
+	el = bbus_malloc0(sizeof(struct bbusd_clientlist_elem));
 	if (el == NULL)
-		return -1;
+		return NULL;
 
 	el->cli = cli;
+	el->fd = bbus_client_getsock(cli);
 	bbus_list_push(list, el);
 
-	return 0;
+	return el;
 }
 
 void __bbusd_clientlist_rm(struct bbusd_clientlist_elem** elem,
@@ -22,6 +22,11 @@ struct bbusd_clientlist_elem
 	struct bbusd_clientlist_elem* next;
 	struct bbusd_clientlist_elem* prev;
 	bbus_client* cli;
+	/* Cached - the client may already be freed when it's removed. */
+	int fd;
+	int type;
+	/* Owned by the code handling this type of clients, ie. monitors. */
+	void* data;
 };
 
 struct bbusd_clientlist
@@ -30,7 +35,8 @@ struct bbusd_clientlist
 	struct bbusd_clientlist_elem* tail;
 };
 
-int __bbusd_clientlist_add(bbus_client* cli, struct bbusd_clientlist* list);
+struct bbusd_clientlist_elem* __bbusd_clientlist_add(bbus_client* cli,
+					struct bbusd_clientlist* list);
 void __bbusd_clientlist_rm(struct bbusd_clientlist_elem** elem,
 				struct bbusd_clientlist* list);
 
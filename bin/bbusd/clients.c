@@ -13,26 +13,96 @@
  */
 
 #include "clients.h"
+#include "log.h"
+#include <string.h>
 
-static struct bbusd_clientlist clients = { NULL, NULL };
+#define FDTABLE_MINSIZE		64
 
-int bbusd_clientlist_add(bbus_client* cli)
+/* Every shard only ever sees the clients it owns. */
+static BBUS_THREAD_LOCAL struct bbusd_clientlist lists[BBUSD_NUMCLITYPES];
+/* Dense table indexed by socket descriptors. */
+static BBUS_THREAD_LOCAL struct bbusd_clientlist_elem** fdtable;
+static BBUS_THREAD_LOCAL unsigned fdtablesize;
+
+static int client_list(bbus_client* cli)
+{
+	int type;
+
+	type = bbus_client_gettype(cli);
+	return (type > 0) && (type < BBUSD_NUMCLITYPES)
+					? type : BBUSD_CLITYPE_OTHER;
+}
+
+static int grow_fdtable(int fd)
+{
+	struct bbusd_clientlist_elem** newtable;
+	unsigned newsize;
+
+	newsize = fdtablesize == 0 ? FDTABLE_MINSIZE : fdtablesize;
+	while (newsize <= (unsigned)fd)
+		newsize *= 2;
+
+	newtable = bbus_realloc(fdtable,
+			newsize * sizeof(struct bbusd_clientlist_elem*));
+	if (newtable == NULL)
+		return -1;
+
+	memset(newtable + fdtablesize, 0, (newsize - fdtablesize)
+				* sizeof(struct bbusd_clientlist_elem*));
+	fdtable = newtable;
+	fdtablesize = newsize;
+
+	return 0;
+}
+
+struct bbusd_clientlist_elem* bbusd_clientlist_add(bbus_client* cli)
 {
-	return __bbusd_clientlist_add(cli, &clients);
+	struct bbusd_clientlist_elem* elem;
+	int fd;
+
+	fd = bbus_client_getsock(cli);
+	if (bbusd_clientlist_byfd(fd) != NULL) {
+		/* Descriptors are only reused after the client is gone. */
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Stale client registered for descriptor %d.\n", fd);
+		return NULL;
+	}
+
+	if (((unsigned)fd >= fdtablesize) && (grow_fdtable(fd) < 0))
+		return NULL;
+
+	elem = __bbusd_clientlist_add(cli, &lists[client_list(cli)]);
+	if (elem == NULL)
+		return NULL;
+
+	elem->type = client_list(cli);
+	fdtable[fd] = elem;
+
+	return elem;
 }
 
 void bbusd_clientlist_rm(struct bbusd_clientlist_elem** elem)
 {
-	__bbusd_clientlist_rm(elem, &clients);
+	fdtable[(*elem)->fd] = NULL;
+	__bbusd_clientlist_rm(elem, &lists[(*elem)->type]);
 }
 
-struct bbusd_clientlist_elem* bbusd_clientlist_getfirst(void)
+struct bbusd_clientlist_elem* bbusd_clientlist_byfd(int fd)
 {
-	return clients.head;
+	if ((fd < 0) || ((unsigned)fd >= fdtablesize))
+		return NULL;
+
+	return fdtable[fd];
 }
 
-struct bbusd_clientlist_elem* bbusd_clientlist_getlast(void)
+struct bbusd_clientlist_elem* bbusd_clientlist_getfirst(int type)
 {
-	return clients.tail;
+	return lists[type].head;
 }
 
+void bbusd_clientlist_free(void)
+{
+	bbus_free(fdtable);
+	fdtable = NULL;
+	fdtablesize = 0;
+}
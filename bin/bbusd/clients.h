@@ -18,10 +18,22 @@
 #include <busybus.h>
 #include "clientlist.h"
 
-int bbusd_clientlist_add(bbus_client* cli);
+/*
+ * Client registry (per shard). Every client is linked into the list of
+ * its type and indexed by its socket descriptor, so adding, removing and
+ * finding a client never walks the other clients.
+ */
+
+/* Index of the list of clients of unknown type. */
+#define BBUSD_CLITYPE_OTHER	0
+#define BBUSD_NUMCLITYPES	(BBUS_CLIENT_PEER + 1)
+
+struct bbusd_clientlist_elem* bbusd_clientlist_add(bbus_client* cli);
 void bbusd_clientlist_rm(struct bbusd_clientlist_elem** elem);
-struct bbusd_clientlist_elem* bbusd_clientlist_getfirst(void);
-struct bbusd_clientlist_elem* bbusd_clientlist_getlast(void);
+struct bbusd_clientlist_elem* bbusd_clientlist_byfd(int fd);
+/* First client of given type, the rest follow through 'next'. */
+struct bbusd_clientlist_elem* bbusd_clientlist_getfirst(int type);
+void bbusd_clientlist_free(void);
 
 #endif /* __BBUSD_CLIENTS__ */
 
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "control.h"
+#include "log.h"
+#include "monitor.h"
+#include "methods.h"
+#include "service.h"
+#include "shard.h"
+#include "tracepoint.h"
+#include <string.h>
+
+static unsigned polltimeout = BBUSD_CTL_DEFPOLLTIMEOUT;
+static size_t cliqueue = BBUS_CLIENT_DEFWRQUEUE;
+static unsigned long generation;
+
+unsigned bbusd_ctl_polltimeout(void)
+{
+	return __atomic_load_n(&polltimeout, __ATOMIC_RELAXED);
+}
+
+size_t bbusd_ctl_cliqueue(void)
+{
+	return __atomic_load_n(&cliqueue, __ATOMIC_RELAXED);
+}
+
+unsigned long bbusd_ctl_generation(void)
+{
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+static bbus_uint32 get_loglevel(void)
+{
+	return bbusd_log_getlevel();
+}
+
+static int set_loglevel(bbus_uint32 val)
+{
+	if (val > BBUSD_LOG_DEBUG)
+		return -1;
+
+	bbusd_log_setlevel((enum bbusd_loglevel)val);
+	return 0;
+}
+
+static bbus_uint32 get_monsample(void)
+{
+	return bbusd_mon_getsample();
+}
+
+static int set_monsample(bbus_uint32 val)
+{
+	bbusd_mon_setsample(val);
+	return 0;
+}
+
+static bbus_uint32 get_cliqueue(void)
+{
+	return bbusd_ctl_cliqueue();
+}
+
+static int set_cliqueue(bbus_uint32 val)
+{
+	/* Every regular message must still fit. */
+	if (val < BBUS_MAXMSGSIZE)
+		return -1;
+
+	__atomic_store_n(&cliqueue, (size_t)val, __ATOMIC_RELAXED);
+	(void)__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static bbus_uint32 get_polltimeout(void)
+{
+	return bbusd_ctl_polltimeout();
+}
+
+static int set_polltimeout(bbus_uint32 val)
+{
+	if (val > 60000)
+		return -1;
+
+	__atomic_store_n(&polltimeout, val, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static bbus_uint32 get_tracepoints(void)
+{
+	return bbusd_tp_getenabled();
+}
+
+static int set_tracepoints(bbus_uint32 val)
+{
+	if (val > 1)
+		return -1;
+
+	bbusd_tp_setenabled(val);
+	return 0;
+}
+
+static bbus_uint32 get_allocstats(void)
+{
+	return bbus_alloc_getaccounting();
+}
+
+static int set_allocstats(bbus_uint32 val)
+{
+	if (val > 1)
+		return -1;
+
+	bbus_alloc_setaccounting(val);
+	return 0;
+}
+
+static const struct tunable
+{
+	const char* name;
+	bbus_uint32 (*get)(void);
+	int (*set)(bbus_uint32);
+} tunables[] = {
+	{ "loglevel",		get_loglevel,		set_loglevel	},
+	{ "monsample",		get_monsample,		set_monsample	},
+	{ "cliqueue",		get_cliqueue,		set_cliqueue	},
+	{ "polltimeout",	get_polltimeout,	set_polltimeout	},
+	{ "tracepoints",	get_tracepoints,	set_tracepoints	},
+	{ "allocstats",		get_allocstats,		set_allocstats	},
+};
+
+static const struct counter
+{
+	const char* name;
+	enum bbusd_counter cnt;
+} counters[] = {
+	{ "callers",		BBUSD_CNT_CALLERS	},
+	{ "services",		BBUSD_CNT_SERVICES	},
+	{ "monitors",		BBUSD_CNT_MONITORS	},
+	{ "controllers",	BBUSD_CNT_CONTROLLERS	},
+	{ "pending_calls",	BBUSD_CNT_PENDING	},
+	{ "queued_jobs",	BBUSD_CNT_JOBS		},
+	{ "reply_cache_hits",	BBUSD_CNT_CACHEHITS	},
+};
+
+static int insert_pair(bbus_object* obj, const char* name, unsigned long val)
+{
+	if ((bbus_obj_insstr(obj, name) < 0)
+			|| (bbus_obj_insuint(obj, BBUS_MIN(val, UINT32_MAX)) < 0))
+		return -1;
+
+	return 0;
+}
+
+static bbus_object* ctl_stats(void)
+{
+	struct bbus_alloc_stats allocs;
+	bbus_object* obj;
+	unsigned i;
+
+	obj = bbus_obj_alloc();
+	if (obj == NULL)
+		return NULL;
+
+	if (bbus_obj_insarray(obj, BBUS_ARRAY_SIZE(counters) + 6) < 0)
+		goto err;
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(counters); ++i) {
+		if (insert_pair(obj, counters[i].name,
+				bbusd_counter_get(counters[i].cnt)) < 0)
+			goto err;
+	}
+
+	if ((insert_pair(obj, "monitor_events", bbusd_mon_queued()) < 0)
+			|| (insert_pair(obj, "methods",
+					bbusd_num_methods()) < 0)
+			|| (insert_pair(obj, "threads",
+					bbusd_numshards()) < 0))
+		goto err;
+
+	bbus_alloc_getstats(&allocs);
+	if ((insert_pair(obj, "allocs", allocs.allocs) < 0)
+			|| (insert_pair(obj, "frees", allocs.frees) < 0)
+			|| (insert_pair(obj, "alloc_kbytes",
+					allocs.bytes / 1024) < 0))
+		goto err;
+
+	return obj;
+
+err:
+	bbus_obj_free(obj);
+	return NULL;
+}
+
+static bbus_object* ctl_allocs(void)
+{
+	struct bbus_alloc_site sites[BBUSD_CTL_MAXSITES];
+	char name[128];
+	bbus_object* obj;
+	size_t num;
+	size_t i;
+
+	num = bbus_alloc_getsites(sites, BBUSD_CTL_MAXSITES);
+	obj = bbus_obj_alloc();
+	if ((obj == NULL) || (bbus_obj_insarray(obj, num) < 0))
+		goto err;
+
+	for (i = 0; i < num; ++i) {
+		bbus_alloc_sitename(sites[i].addr, name, sizeof(name));
+		if ((insert_pair(obj, name, sites[i].allocs) < 0)
+				|| (bbus_obj_insuint(obj, BBUS_MIN(
+					sites[i].bytes, UINT32_MAX)) < 0))
+			goto err;
+	}
+
+	return obj;
+
+err:
+	bbus_obj_free(obj);
+	return NULL;
+}
+
+static bbus_object* ctl_get(void)
+{
+	bbus_object* obj;
+	unsigned i;
+
+	obj = bbus_obj_alloc();
+	if (obj == NULL)
+		return NULL;
+
+	if (bbus_obj_insarray(obj, BBUS_ARRAY_SIZE(tunables)) < 0)
+		goto err;
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(tunables); ++i) {
+		if (insert_pair(obj, tunables[i].name,
+					tunables[i].get()) < 0)
+			goto err;
+	}
+
+	return obj;
+
+err:
+	bbus_obj_free(obj);
+	return NULL;
+}
+
+static bbus_object* ctl_set(bbus_object* arg)
+{
+	bbus_uint32 val;
+	char* name;
+	unsigned i;
+
+	if ((arg == NULL) || (bbus_obj_parse(arg, "su", &name, &val) < 0))
+		return NULL;
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(tunables); ++i) {
+		if (strcmp(name, tunables[i].name) != 0)
+			continue;
+
+		if (tunables[i].set(val) < 0) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Invalid value for '%s': %u\n", name, val);
+			return NULL;
+		}
+
+		bbusd_logmsg(BBUSD_LOG_INFO,
+			"Tunable '%s' set to %u.\n", name, val);
+		return ctl_get();
+	}
+
+	bbusd_logmsg(BBUSD_LOG_ERR, "No such tunable: '%s'\n", name);
+	return NULL;
+}
+
+static bbus_object* ctl_methods(bbus_object* arg)
+{
+	char* prefix = "";
+
+	if ((arg != NULL) && (bbus_obj_parse(arg, "s", &prefix) < 0))
+		return NULL;
+
+	return bbusd_method_stats(prefix);
+}
+
+bbus_object* bbusd_ctl_exec(const char* cmd, bbus_object* arg)
+{
+	if (strcmp(cmd, "stats") == 0)
+		return ctl_stats();
+	else if (strcmp(cmd, "methods") == 0)
+		return ctl_methods(arg);
+	else if (strcmp(cmd, "get") == 0)
+		return ctl_get();
+	else if (strcmp(cmd, "set") == 0)
+		return ctl_set(arg);
+	else if (strcmp(cmd, "tracepoints") == 0)
+		return bbusd_tp_dump();
+	else if (strcmp(cmd, "allocs") == 0)
+		return ctl_allocs();
+
+	bbusd_logmsg(BBUSD_LOG_ERR, "Unknown control command: '%s'\n", cmd);
+	return NULL;
+}
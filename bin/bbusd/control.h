@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_CONTROL__
+#define __BBUSD_CONTROL__
+
+#include <busybus.h>
+
+/*
+ * Requests sent by control clients and the tunables they can change at
+ * runtime. See bbus_ctl_request() for the list of commands.
+ */
+
+#define BBUSD_CTL_DEFPOLLTIMEOUT	0
+/* Allocation call sites reported by the "allocs" command. */
+#define BBUSD_CTL_MAXSITES		32
+
+/* Upper bound on a reactor's sleep in milliseconds, 0 if unlimited. */
+unsigned bbusd_ctl_polltimeout(void);
+/* Limit of data queued per client. */
+size_t bbusd_ctl_cliqueue(void);
+/* Changes every time a tunable applied to each client is modified. */
+unsigned long bbusd_ctl_generation(void);
+/* Returns the reply object or NULL if the request is invalid. */
+bbus_object* bbusd_ctl_exec(const char* cmd, bbus_object* arg);
+
+#endif /* __BBUSD_CONTROL__ */
@@ -13,13 +13,73 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include "log.h"
 #include "common.h"
 
-/* TODO Setters for logmask and maybe log levels. */
 #define LOG_CONSOLE	(1 << 0)
 #define LOG_SYSL	(1 << 1)
 static int logmask = LOG_CONSOLE;
+/* Messages less important than this are discarded. */
+static int loglevel = BBUSD_LOG_DEBUG;
+
+/*
+ * Once the logger thread is running, messages are formatted into a bounded
+ * queue and written out by that thread only - a slow console never stalls
+ * a reactor. If the queue is full, the message is dropped and counted.
+ *
+ * Each slot's sequence number tells the producers whether it's free (equal
+ * to the position they're claiming) and the logger whether it's filled
+ * (one past the position it's reading).
+ */
+#define LOG_QUEUELEN	256
+#define LOG_MSGMAX	512
+/* Messages written per second, the rest is counted and dropped. */
+#define LOG_BURST	100
+#define LOG_WINDOWMS	1000
+
+struct log_slot
+{
+	unsigned long seq;
+	int lvl;
+	char msg[LOG_MSGMAX];
+};
+
+static struct log_slot queue[LOG_QUEUELEN];
+static unsigned long qtail;
+static unsigned long qhead;
+static unsigned long dropped;
+static int running;
+/* Set by the logger before it goes to sleep on the pipe. */
+static int sleeping;
+static int wakefd[2] = { -1, -1 };
+static pthread_t logthread;
+
+/* Logger thread state used to squash repeats and limit the rate. */
+static char lastmsg[LOG_MSGMAX];
+static int lastlvl = -1;
+static unsigned repeated;
+static unsigned suppressed;
+static unsigned inwindow;
+static uint64_t windowstart;
+
+void bbusd_log_setlevel(enum bbusd_loglevel lvl)
+{
+	__atomic_store_n(&loglevel, (int)lvl, __ATOMIC_RELAXED);
+}
+
+enum bbusd_loglevel bbusd_log_getlevel(void)
+{
+	return (enum bbusd_loglevel)__atomic_load_n(&loglevel,
+						__ATOMIC_RELAXED);
+}
 
 static inline int loglvl_to_sysloglvl(enum bbusd_loglevel lvl)
 {
@@ -28,38 +88,274 @@ static inline int loglvl_to_sysloglvl(enum bbusd_loglevel lvl)
 
 #define SYSLOG_IDENT "bbusd"
 
-void bbusd_logmsg(enum bbusd_loglevel lvl, const char* fmt, ...)
+static FILE* console_stream(int lvl)
 {
+	switch (lvl) {
+	case BBUSD_LOG_EMERG:
+	case BBUSD_LOG_ALERT:
+	case BBUSD_LOG_CRIT:
+	case BBUSD_LOG_ERR:
+	case BBUSD_LOG_WARN:
+		return stderr;
+	case BBUSD_LOG_NOTICE:
+	case BBUSD_LOG_INFO:
+	case BBUSD_LOG_DEBUG:
+		return stdout;
+	default:
+		bbusd_die("Invalid log level\n");
+	}
+}
+
+static void write_msg(int lvl, const char* msg)
+{
+	if (logmask & LOG_CONSOLE)
+		fputs(msg, console_stream(lvl));
+	if (logmask & LOG_SYSL)
+		syslog(loglvl_to_sysloglvl(lvl), "%s", msg);
+}
+
+static void write_fmt(int lvl, const char* fmt, ...) BBUS_PRINTF_FUNC(2, 3);
+
+static void write_fmt(int lvl, const char* fmt, ...)
+{
+	char msg[LOG_MSGMAX];
 	va_list va;
 
-	if (logmask & LOG_CONSOLE) {
-		va_start(va, fmt);
-		switch (lvl) {
-		case BBUSD_LOG_EMERG:
-		case BBUSD_LOG_ALERT:
-		case BBUSD_LOG_CRIT:
-		case BBUSD_LOG_ERR:
-		case BBUSD_LOG_WARN:
-			vfprintf(stderr, fmt, va);
-			break;
-		case BBUSD_LOG_NOTICE:
-		case BBUSD_LOG_INFO:
-		case BBUSD_LOG_DEBUG:
-			vfprintf(stdout, fmt, va);
-			break;
-		default:
-			bbusd_die("Invalid log level\n");
-			break;
+	va_start(va, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, va);
+	va_end(va);
+	write_msg(lvl, msg);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void flush_repeated(void)
+{
+	if (repeated > 0) {
+		write_fmt(lastlvl, "Last message repeated %u time%s\n",
+					repeated, repeated > 1 ? "s" : "");
+		repeated = 0;
+	}
+}
+
+static void flush_suppressed(void)
+{
+	if (suppressed > 0) {
+		write_fmt(BBUSD_LOG_WARN,
+			"Suppressed %u messages over the rate limit\n",
+			suppressed);
+		suppressed = 0;
+	}
+}
+
+/* Summaries are written at the end of every rate limiting window. */
+static void check_window(uint64_t now)
+{
+	if (now - windowstart < LOG_WINDOWMS)
+		return;
+
+	flush_repeated();
+	flush_suppressed();
+	windowstart = now;
+	inwindow = 0;
+}
+
+static void process_msg(int lvl, const char* msg)
+{
+	check_window(now_ms());
+
+	if ((lvl == lastlvl) && (strcmp(msg, lastmsg) == 0)) {
+		++repeated;
+		return;
+	}
+
+	flush_repeated();
+	strcpy(lastmsg, msg);
+	lastlvl = lvl;
+
+	if (inwindow >= LOG_BURST) {
+		++suppressed;
+		return;
+	}
+
+	++inwindow;
+	write_msg(lvl, msg);
+}
+
+static int queue_empty(void)
+{
+	return __atomic_load_n(&queue[qhead % LOG_QUEUELEN].seq,
+					__ATOMIC_ACQUIRE) != qhead + 1;
+}
+
+static void enqueue_msg(int lvl, const char* fmt, va_list va)
+{
+	struct log_slot* slot;
+	unsigned long pos;
+	unsigned long seq;
+
+	pos = __atomic_load_n(&qtail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue[pos % LOG_QUEUELEN];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&qtail, &pos, pos + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0) {
+			/* Still holds a message the logger hasn't taken. */
+			(void)__atomic_add_fetch(&dropped, 1,
+						__ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&qtail, __ATOMIC_RELAXED);
 		}
-		va_end(va);
 	}
 
-	if (logmask & LOG_SYSL) {
-		va_start(va, fmt);
-		openlog(SYSLOG_IDENT, LOG_PID, LOG_DAEMON);
-		vsyslog(loglvl_to_sysloglvl(lvl), fmt, va);
+	slot->lvl = lvl;
+	vsnprintf(slot->msg, LOG_MSGMAX, fmt, va);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+		(void)write(wakefd[1], "", 1);
+}
+
+static void drain_queue(void)
+{
+	struct log_slot* slot;
+	unsigned long num;
+
+	while (!queue_empty()) {
+		slot = &queue[qhead % LOG_QUEUELEN];
+		process_msg(slot->lvl, slot->msg);
+		__atomic_store_n(&slot->seq, qhead + LOG_QUEUELEN,
+						__ATOMIC_RELEASE);
+		++qhead;
+	}
+
+	num = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+	if (num > 0) {
+		write_fmt(BBUSD_LOG_WARN,
+			"Dropped %lu messages, the log queue was full\n", num);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+static void wait_for_msgs(void)
+{
+	struct pollfd pfd;
+	char buf[64];
+	int timeout = -1;
+	uint64_t elapsed;
+
+	__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!queue_empty() || !__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Wake up in time to write the summaries. */
+	if ((repeated > 0) || (suppressed > 0)) {
+		elapsed = now_ms() - windowstart;
+		timeout = elapsed < LOG_WINDOWMS
+				? (int)(LOG_WINDOWMS - elapsed) : 0;
+	}
+
+	pfd.fd = wakefd[0];
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) > 0) {
+		while (read(wakefd[0], buf, sizeof(buf)) > 0)
+			;
+	}
+	__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void* log_main(void* arg BBUS_UNUSED)
+{
+	sigset_t sigmask;
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		drain_queue();
+		check_window(now_ms());
+		wait_for_msgs();
+	}
+
+	drain_queue();
+	flush_repeated();
+	flush_suppressed();
+	fflush(stdout);
+	fflush(stderr);
+
+	return NULL;
+}
+
+static void log_stop(void)
+{
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	(void)write(wakefd[1], "", 1);
+	pthread_join(logthread, NULL);
+	if (logmask & LOG_SYSL)
 		closelog();
-		va_end(va);
+	close(wakefd[0]);
+	close(wakefd[1]);
+}
+
+void bbusd_log_start(int usesyslog)
+{
+	unsigned i;
+	int ret;
+
+	if (usesyslog) {
+		logmask = LOG_SYSL;
+		openlog(SYSLOG_IDENT, LOG_PID, LOG_DAEMON);
 	}
+
+	for (i = 0; i < LOG_QUEUELEN; ++i)
+		queue[i].seq = i;
+
+	if (pipe2(wakefd, O_NONBLOCK | O_CLOEXEC) < 0)
+		bbusd_die("Error creating the logger pipe: %s\n",
+							strerror(errno));
+
+	windowstart = now_ms();
+	running = 1;
+	ret = pthread_create(&logthread, NULL, log_main, NULL);
+	if (ret != 0)
+		bbusd_die("Error creating the logger thread: %s\n",
+							strerror(ret));
+
+	/* Whatever is queued is written out before exiting, bbusd_die too. */
+	if (atexit(log_stop) != 0)
+		bbusd_die("Error registering the logger exit handler\n");
 }
 
+void bbusd_logmsg(enum bbusd_loglevel lvl, const char* fmt, ...)
+{
+	va_list va;
+
+	if ((int)lvl > __atomic_load_n(&loglevel, __ATOMIC_RELAXED))
+		return;
+
+	va_start(va, fmt);
+	if (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		enqueue_msg(lvl, fmt, va);
+	} else {
+		/* Not started yet - write synchronously. */
+		if (logmask & LOG_CONSOLE)
+			vfprintf(console_stream(lvl), fmt, va);
+	}
+	va_end(va);
+}
@@ -30,8 +30,19 @@ enum bbusd_loglevel
 	BBUSD_LOG_DEBUG = LOG_DEBUG
 };
 
+/*
+ * Starts the logger thread, messages logged before are written right
+ * away. From then on bbusd_logmsg() never blocks: repeated messages are
+ * squashed, the rate is limited and whatever doesn't fit in the queue is
+ * dropped and counted. With 'usesyslog' messages go to syslog instead of
+ * the console.
+ */
+void bbusd_log_start(int usesyslog);
 void bbusd_logmsg(enum bbusd_loglevel lvl, const char* fmt, ...)
 						BBUS_PRINTF_FUNC(2, 3);
+/* Can be changed at any time from any thread. */
+void bbusd_log_setlevel(enum bbusd_loglevel lvl);
+enum bbusd_loglevel bbusd_log_getlevel(void);
 
 #endif /* __BBUSD_LOG__ */
 
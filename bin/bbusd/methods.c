@@ -14,6 +14,10 @@
 
 #include <busybus.h>
 #include "service.h"
+#include "stats.h"
+#include "methods.h"
+#include "msgbuf.h"
+#include <string.h>
 
 #define DEF_LOCAL_METHOD(FUNC)						\
 	static struct bbusd_local_method __m_##FUNC##__ = {		\
@@ -41,12 +45,136 @@ static bbus_object* lm_echo(bbus_object* arg)
 	if (ret < 0)
 		return NULL;
 	else
-		return bbus_obj_build("s", msg);
+		return bbus_obj_build_from(bbusd_getobjpool(), "s", msg);
 }
 DEF_LOCAL_METHOD(lm_echo);
 
+struct stats_list
+{
+	const char* prefix;
+	size_t prefixlen;
+	struct stats_entry
+	{
+		char* path;
+		struct bbusd_method_stats* stats;
+	}* entries;
+	unsigned numentries;
+	unsigned maxentries;
+};
+
+static int collect_stats(const void* key, size_t keysize,
+					void* val, void* arg)
+{
+	struct bbusd_method* mthd = val;
+	struct stats_list* list = arg;
+	struct stats_entry* newentries;
+	unsigned newmax;
+	char* path;
+
+	if ((mthd->type != BBUSD_METHOD_LOCAL)
+			&& (mthd->type != BBUSD_METHOD_REMOTE))
+		return 0;
+
+	if ((keysize < list->prefixlen)
+			|| (memcmp(key, list->prefix, list->prefixlen) != 0))
+		return 0;
+
+	if (list->numentries == list->maxentries) {
+		newmax = list->maxentries == 0 ? 16 : list->maxentries * 2;
+		newentries = bbus_realloc(list->entries,
+				newmax * sizeof(struct stats_entry));
+		if (newentries == NULL)
+			return -1;
+		list->entries = newentries;
+		list->maxentries = newmax;
+	}
+
+	path = bbus_str_build("%.*s", (int)keysize, (const char*)key);
+	if (path == NULL)
+		return -1;
+
+	list->entries[list->numentries].path = path;
+	list->entries[list->numentries].stats = &mthd->stats;
+	++list->numentries;
+
+	return 0;
+}
+
+bbus_object* bbusd_method_stats(const char* prefix)
+{
+	bbus_uint32 summary[BBUSD_STATS_NUMSUMMARY];
+	struct stats_list list;
+	bbus_object* ret = NULL;
+	unsigned i;
+	unsigned j;
+
+	memset(&list, 0, sizeof(list));
+	list.prefix = prefix;
+	list.prefixlen = strlen(prefix);
+	if (bbusd_foreach_method(collect_stats, &list) != 0)
+		goto out;
+
+	ret = bbus_obj_alloc();
+	if ((ret == NULL) || (bbus_obj_insarray(ret, list.numentries) < 0))
+		goto err;
+
+	for (i = 0; i < list.numentries; ++i) {
+		bbusd_stats_summary(list.entries[i].stats, summary);
+		if (bbus_obj_insstr(ret, list.entries[i].path) < 0)
+			goto err;
+		for (j = 0; j < BBUSD_STATS_NUMSUMMARY; ++j) {
+			if (bbus_obj_insuint(ret, summary[j]) < 0)
+				goto err;
+		}
+	}
+
+	goto out;
+
+err:
+	bbus_obj_free(ret);
+	ret = NULL;
+
+out:
+	for (i = 0; i < list.numentries; ++i)
+		bbus_str_free(list.entries[i].path);
+	bbus_free(list.entries);
+
+	return ret;
+}
+
+static bbus_object* lm_stats(bbus_object* arg)
+{
+	char* prefix;
+
+	if (bbus_obj_parse(arg, "s", &prefix) < 0)
+		return NULL;
+
+	return bbusd_method_stats(prefix);
+}
+DEF_LOCAL_METHOD(lm_stats);
+
+/* Returns the route id of the method, 0 if there's no such method. */
+static bbus_object* lm_resolve(bbus_object* arg)
+{
+	struct bbusd_method* mthd;
+	char* path;
+	unsigned route = 0;
+
+	if (bbus_obj_parse(arg, "s", &path) < 0)
+		return NULL;
+
+	mthd = bbusd_locate_method(path);
+	if (mthd != NULL)
+		route = bbusd_method_route(mthd, path);
+
+	return bbus_obj_build_from(bbusd_getobjpool(), "u", route);
+}
+DEF_LOCAL_METHOD(lm_resolve);
+
 void bbusd_register_local_methods(void)
 {
 	REG_LOCAL_METHOD("bbus.bbusd.echo", lm_echo);
+	REG_LOCAL_METHOD("bbus.bbusd.stats", lm_stats);
+	REG_LOCAL_METHOD("bbus.bbusd.resolve", lm_resolve);
 }
 
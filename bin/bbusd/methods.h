@@ -15,7 +15,15 @@
 #ifndef __BBUSD_METHODS__
 #define __BBUSD_METHODS__
 
+#include <busybus.h>
+
 void bbusd_register_local_methods(void);
+/*
+ * Takes a method path prefix ("" for all methods) and returns
+ * A(suuuuuuu): path, calls, errors, mean, p50, p90, p99 and max latency
+ * in microseconds for every matching method.
+ */
+bbus_object* bbusd_method_stats(const char* prefix);
 
 #endif /* __BBUSD_METHODS__ */
 
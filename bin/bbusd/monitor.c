@@ -14,87 +14,461 @@
 
 #include "monitor.h"
 #include "log.h"
+#include "shard.h"
+#include "msgbuf.h"
+#include "tracepoint.h"
 #include <string.h>
+#include <arpa/inet.h>
 
-static struct bbusd_clientlist monitors = { NULL, NULL };
+/*
+ * Monitors are corked - this much can be queued in the write buffer
+ * before the notifications start waiting in the monitor's own queue.
+ */
+#define MON_WRBATCH	(16 * 1024)
+
+/* Packed notification waiting to be sent. */
+struct mon_event
+{
+	int sent;
+	size_t size;
+	size_t bufsize;
+	char* buf;
+};
+
+struct monitor
+{
+	struct monitor* next;
+	struct monitor* prev;
+	bbus_client* cli;
+	/* Filter - see struct bbus_mon_filter. */
+	unsigned msgtypes;
+	char* prefix;
+	size_t prefixlen;
+	bbus_regex* regex;
+	unsigned sample;
+	unsigned skipped;
+	/*
+	 * Ring buffer of notifications - monitors never get more than one
+	 * batch queued in the socket's write buffer, the rest waits here.
+	 */
+	struct mon_event* events;
+	unsigned head;
+	unsigned count;
+	unsigned dropped;
+};
+
+/*
+ * Monitors are always owned by the first shard, other shards pass their
+ * notifications on to it.
+ */
+static struct bbus_list monitors = { NULL, NULL };
+/* Lets other shards skip building notifications if nobody listens. */
+static int nummonitors;
+
+static unsigned queuelen = BBUSD_MON_DEFQUEUELEN;
+static enum bbusd_mon_drop droppolicy = BBUSD_MON_DROPOLDEST;
+/* Notifications queued in all monitors, only for statistics. */
+static unsigned long numqueued;
+/* Only every n-th message is passed on to the monitors at all. */
+static unsigned globalsample;
+static BBUS_THREAD_LOCAL unsigned globalskipped;
+
+static void count_queued(long delta)
+{
+	(void)__atomic_fetch_add(&numqueued, delta, __ATOMIC_RELAXED);
+}
+
+unsigned long bbusd_mon_queued(void)
+{
+	return __atomic_load_n(&numqueued, __ATOMIC_RELAXED);
+}
+
+void bbusd_mon_setsample(unsigned sample)
+{
+	__atomic_store_n(&globalsample, sample, __ATOMIC_RELAXED);
+}
+
+unsigned bbusd_mon_getsample(void)
+{
+	return __atomic_load_n(&globalsample, __ATOMIC_RELAXED);
+}
+
+void bbusd_mon_configure(unsigned len, enum bbusd_mon_drop policy)
+{
+	queuelen = len;
+	droppolicy = policy;
+}
+
+static void clear_filter(struct monitor* mon)
+{
+	bbus_str_free(mon->prefix);
+	bbus_regex_free(mon->regex);
+	mon->msgtypes = 0;
+	mon->prefix = NULL;
+	mon->prefixlen = 0;
+	mon->regex = NULL;
+	mon->sample = 0;
+	mon->skipped = 0;
+}
+
+/* Every monitor is attached to the registry entry of its client. */
+static struct monitor* find_monitor(bbus_client* cli)
+{
+	struct bbusd_clientlist_elem* elem;
+
+	elem = bbus_client_getpriv(cli);
+	return elem == NULL ? NULL : elem->data;
+}
 
 int bbusd_monlist_add(bbus_client* cli)
 {
-	return __bbusd_clientlist_add(cli, &monitors);
+	struct monitor* mon;
+
+	mon = bbus_malloc0(sizeof(struct monitor));
+	if (mon == NULL)
+		return -1;
+
+	mon->events = bbus_malloc0(queuelen * sizeof(struct mon_event));
+	if (mon->events == NULL) {
+		bbus_free(mon);
+		return -1;
+	}
+
+	mon->cli = cli;
+	((struct bbusd_clientlist_elem*)bbus_client_getpriv(cli))->data = mon;
+	bbus_list_push(&monitors, mon);
+	(void)__sync_fetch_and_add(&nummonitors, 1);
+
+	return 0;
 }
 
 void bbusd_monlist_rm(bbus_client* cli)
 {
-	struct bbusd_clientlist_elem* mon;
+	struct monitor* mon;
+	unsigned i;
 
-	for (mon = monitors.head; mon != NULL; mon = mon->next) {
-		if (mon->cli == cli) {
-			__bbusd_clientlist_rm(&mon, &monitors);
-			return;
+	mon = find_monitor(cli);
+	if (mon == NULL) {
+		bbusd_logmsg(BBUSD_LOG_WARN,
+			"Monitor not found in the list, "
+			"this should not happen.\n");
+		return;
+	}
+
+	((struct bbusd_clientlist_elem*)bbus_client_getpriv(cli))->data = NULL;
+	bbus_list_rm(&monitors, mon);
+	(void)__sync_fetch_and_sub(&nummonitors, 1);
+	count_queued(-(long)mon->count);
+	clear_filter(mon);
+	for (i = 0; i < queuelen; ++i)
+		bbus_free(mon->events[i].buf);
+	bbus_free(mon->events);
+	bbus_free(mon);
+}
+
+int bbusd_mon_setfilter(bbus_client* cli, const struct bbus_msg* msg)
+{
+	struct monitor* mon;
+	bbus_object* obj;
+	const void* raw;
+	size_t rawsize;
+	bbus_uint32 msgtypes;
+	bbus_uint32 sample;
+	char* prefix;
+	char* regex;
+	bbus_regex* compiled = NULL;
+	int ret;
+
+	mon = find_monitor(cli);
+	if (mon == NULL)
+		return -1;
+
+	raw = bbus_prot_extractrawobj(msg, &rawsize);
+	if (raw == NULL)
+		return -1;
+
+	obj = bbus_obj_view_from(bbusd_getobjpool(), raw, rawsize);
+	if (obj == NULL)
+		return -1;
+	bbus_obj_setorder(obj, bbus_hdr_getobjorder(&msg->hdr));
+
+	ret = bbus_obj_parse(obj, "ussu", &msgtypes, &prefix, &regex, &sample);
+	if (ret < 0)
+		goto out;
+
+	/* Reject broken patterns before touching the current filter. */
+	if (*regex != '\0') {
+		compiled = bbus_regex_compile(regex);
+		if (compiled == NULL) {
+			ret = -1;
+			goto out;
 		}
 	}
 
-	bbusd_logmsg(BBUSD_LOG_WARN,
-		"Monitor not found in the list, "
-		"this should not happen.\n");
+	clear_filter(mon);
+	mon->msgtypes = msgtypes;
+	mon->sample = sample;
+	if (*prefix != '\0') {
+		mon->prefix = bbus_str_cpy(prefix);
+		mon->prefixlen = strlen(prefix);
+	}
+	mon->regex = compiled;
+	if ((*prefix != '\0') && (mon->prefix == NULL)) {
+		clear_filter(mon);
+		ret = -1;
+	}
+
+out:
+	bbus_obj_free(obj);
+	return ret;
+}
+
+static int filter_matches(struct monitor* mon,
+			const struct bbus_msg_hdr* hdr, const char* meta)
+{
+	if (mon->msgtypes != 0) {
+		if ((hdr->msgtype >= 32)
+				|| !(mon->msgtypes & (1u << hdr->msgtype)))
+			return 0;
+	}
+
+	if (mon->prefix && (strncmp(meta, mon->prefix, mon->prefixlen) != 0))
+		return 0;
+
+	if (mon->regex && (bbus_regex_exec(mon->regex, meta) != BBUS_TRUE))
+		return 0;
+
+	if (mon->sample > 1) {
+		if (++mon->skipped < mon->sample)
+			return 0;
+		mon->skipped = 0;
+	}
+
+	return 1;
 }
 
 static bbus_object* pack_msg(const struct bbus_msg_hdr* hdr, const char* meta)
 {
 	bbus_object* obj;
 
-	obj = bbus_obj_build("bbbuubs",
-				hdr->msgtype,
-				hdr->sotype,
-				hdr->errcode,
-				bbus_hdr_gettoken(hdr),
-				bbus_hdr_getpsize(hdr),
-				hdr->flags,
-				meta);
-	if (obj == NULL) {
-		bbusd_logmsg(BBUSD_LOG_ERR,
-			"Error creating the message for monitors: %s\n",
-			bbus_strerror(bbus_lasterror()));
-	}
+	obj = bbus_obj_build_from(bbusd_getobjpool(), "bbbuubs",
+				hdr->msgtype, hdr->sotype, hdr->errcode,
+				bbus_hdr_gettoken(hdr), bbus_hdr_getpsize(hdr),
+				hdr->flags, meta);
+	if (obj == NULL)
+		goto err;
 
 	return obj;
+
+err:
+	bbusd_logmsg(BBUSD_LOG_ERR,
+		"Error creating the message for monitors: %s\n",
+		bbus_strerror(bbus_lasterror()));
+	return NULL;
+}
+
+static void enqueue_event(struct monitor* mon, int sent, bbus_object* obj)
+{
+	struct mon_event* ev;
+	size_t size;
+	char* buf;
+
+	if (mon->count == queuelen) {
+		mon->dropped++;
+		if (droppolicy == BBUSD_MON_DROPNEWEST)
+			return;
+
+		mon->head = (mon->head + 1) % queuelen;
+		mon->count--;
+		count_queued(-1);
+	}
+
+	ev = &mon->events[(mon->head + mon->count) % queuelen];
+	size = bbus_obj_rawsize(obj);
+	if (ev->bufsize < size) {
+		buf = bbus_realloc(ev->buf, size);
+		if (buf == NULL) {
+			mon->dropped++;
+			return;
+		}
+		ev->buf = buf;
+		ev->bufsize = size;
+	}
+
+	memcpy(ev->buf, bbus_obj_rawdata(obj), size);
+	ev->size = size;
+	ev->sent = sent;
+	mon->count++;
+	count_queued(1);
+}
+
+static int send_dropped(struct monitor* mon)
+{
+	static const char* const meta = "dropped";
+	struct bbus_msg_hdr hdr;
+	bbus_uint32 dropped;
+	int ret;
+
+	/* A single marshalled uint32 - see bbus_mon_recvmsg(). */
+	dropped = htonl(mon->dropped);
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_MON, BBUS_PROT_EGOOD);
+	bbus_hdr_setpsize(&hdr, strlen(meta) + 1 + sizeof(dropped));
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	ret = bbus_client_sendbuf(mon->cli, &hdr, meta,
+					&dropped, sizeof(dropped));
+	if (ret == 0)
+		mon->dropped = 0;
+
+	return ret;
 }
 
 /*
- * Send a prepared message to all monitors. Deletes the object before
- * returning.
+ * Moves queued notifications to the client's write buffer until it holds
+ * a full batch. They're sent when the shard flushes its corked clients.
  */
-static void send_to_monitors(const char* meta, bbus_object* obj)
+static void drain_events(struct monitor* mon)
 {
 	struct bbus_msg_hdr hdr;
+	struct mon_event* ev;
+	const char* meta;
 	int ret;
-	struct bbusd_clientlist_elem* mon;
 
-	bbus_hdr_build(&hdr, BBUS_MSGTYPE_MON, BBUS_PROT_EGOOD);
-	bbus_hdr_setpsize(&hdr, (meta == NULL ? 0 : strlen(meta)+1) +
-						bbus_obj_rawsize(obj));
-	if (meta)
+	while (bbus_client_wrqueued(mon->cli) < MON_WRBATCH) {
+		if (mon->dropped > 0) {
+			ret = send_dropped(mon);
+			if (ret < 0)
+				goto err;
+			continue;
+		}
+
+		if (mon->count == 0)
+			break;
+
+		ev = &mon->events[mon->head];
+		meta = ev->sent ? "sent" : "received";
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_MON, BBUS_PROT_EGOOD);
+		bbus_hdr_setpsize(&hdr, strlen(meta) + 1 + ev->size);
 		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
-	if (obj)
 		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		ret = bbus_client_sendbuf(mon->cli, &hdr, meta,
+						ev->buf, ev->size);
+		if (ret < 0)
+			goto err;
 
-	for (mon = monitors.head; mon != NULL; mon = mon->next) {
-		ret = bbus_client_sendmsg(mon->cli, &hdr, meta, obj);
-		if (ret < 0) {
-			bbusd_logmsg(BBUSD_LOG_ERR,
-				"Error sending a message to monitor: %s\n",
-				bbus_strerror(bbus_lasterror()));
+		mon->head = (mon->head + 1) % queuelen;
+		mon->count--;
+		count_queued(-1);
+	}
+
+	return;
+
+err:
+	bbusd_logmsg(BBUSD_LOG_ERR,
+		"Error sending a message to monitor: %s\n",
+		bbus_strerror(bbus_lasterror()));
+	count_queued(-(long)mon->count);
+	mon->head = mon->count = 0;
+}
+
+void bbusd_mon_drain(bbus_client* cli)
+{
+	struct monitor* mon;
+
+	mon = find_monitor(cli);
+	if (mon != NULL)
+		drain_events(mon);
+}
+
+/*
+ * Passes a message on to all interested monitors. The notification is
+ * only built once the first monitor accepting the message is found.
+ * Nothing here ever waits for a monitor - events are queued and sent
+ * when the socket becomes writable.
+ */
+static void send_to_monitors(const struct bbus_msg_hdr* msghdr,
+					const char* msgmeta, int sent)
+{
+	struct monitor* mon;
+	bbus_object* obj = NULL;
+	unsigned notified = 0;
+
+	for (mon = (struct monitor*)monitors.head;
+				mon != NULL; mon = mon->next) {
+		if (!filter_matches(mon, msghdr, msgmeta))
+			continue;
+
+		if (obj == NULL) {
+			obj = pack_msg(msghdr, msgmeta);
+			if (obj == NULL)
+				return;
 		}
+
+		enqueue_event(mon, sent, obj);
+		drain_events(mon);
+		++notified;
 	}
 
+	BBUSD_TP(MONITOR, msghdr->msgtype, sent, notified);
 	bbus_obj_free(obj);
 }
 
+static void notify(const struct bbus_msg_hdr* hdr, const char* meta, int sent)
+{
+	struct bbusd_job* job;
+	unsigned sample;
+
+	sample = __atomic_load_n(&globalsample, __ATOMIC_RELAXED);
+	if (sample > 1) {
+		if (++globalskipped < sample)
+			return;
+		globalskipped = 0;
+	}
+
+	if (bbusd_shard_self() == 0) {
+		send_to_monitors(hdr, meta, sent);
+		return;
+	}
+
+	/* Only the header and meta travel - the first shard filters. */
+	job = bbusd_job_new(BBUSD_JOB_MON, meta, hdr,
+					sizeof(struct bbus_msg_hdr));
+	if (job == NULL) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error passing a message to monitors: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		return;
+	}
+
+	job->monsent = sent;
+	bbusd_shard_push(0, job);
+}
+
+void bbusd_mon_handle_job(struct bbusd_job* job)
+{
+	struct bbus_msg_hdr hdr;
+	const void* raw;
+	size_t rawsize;
+
+	raw = bbusd_job_obj(job, &rawsize);
+	if (rawsize != sizeof(struct bbus_msg_hdr)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Invalid monitor notification passed between "
+			"threads.\n");
+		return;
+	}
+
+	memcpy(&hdr, raw, sizeof(struct bbus_msg_hdr));
+	send_to_monitors(&hdr, job->meta, job->monsent);
+}
+
 void bbusd_mon_notify_recvd(const struct bbus_msg* msg)
 {
-	bbus_object* obj;
 	const char* meta;
 
+	if (BBUS_ATOMIC_GET(nummonitors) == 0)
+		return;
+
 	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASMETA)) {
 		meta = bbus_prot_extractmeta(msg);
 		if (meta == NULL) {
@@ -108,20 +482,14 @@ void bbusd_mon_notify_recvd(const struct bbus_msg* msg)
 		meta = "";
 	}
 
-	obj = pack_msg(&msg->hdr, meta);
-	if (obj == NULL)
-		return;
-
-	send_to_monitors("received", obj);
+	notify(&msg->hdr, meta, 0);
 }
 
 void bbusd_mon_notify_sent(const struct bbus_msg_hdr* hdr,
-				const char* meta, bbus_object* obj)
+				const char* meta, bbus_object* obj BBUS_UNUSED)
 {
-	obj = pack_msg(hdr, meta == NULL ? "" : meta);
-	if (obj == NULL)
+	if (BBUS_ATOMIC_GET(nummonitors) == 0)
 		return;
 
-	send_to_monitors("sent", obj);
+	notify(hdr, meta == NULL ? "" : meta, 1);
 }
-
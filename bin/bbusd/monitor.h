@@ -17,12 +17,35 @@
 
 #include <busybus.h>
 #include "clientlist.h"
+#include "shard.h"
 
+#define BBUSD_MON_DEFQUEUELEN	256
+
+/* What to do with new notifications if a monitor's queue is full. */
+enum bbusd_mon_drop
+{
+	BBUSD_MON_DROPOLDEST = 0,
+	BBUSD_MON_DROPNEWEST,
+};
+
+/* Must be called before any monitor connects. */
+void bbusd_mon_configure(unsigned queuelen, enum bbusd_mon_drop policy);
+/* Can be changed at any time from any thread, 0 or 1 disables it. */
+void bbusd_mon_setsample(unsigned sample);
+unsigned bbusd_mon_getsample(void);
+/* Number of notifications waiting in all monitor queues. */
+unsigned long bbusd_mon_queued(void);
+/* The client must already be in the client registry. */
 int bbusd_monlist_add(bbus_client* cli);
 void bbusd_monlist_rm(bbus_client* cli);
+int bbusd_mon_setfilter(bbus_client* cli, const struct bbus_msg* msg);
+/* Queues more notifications once the monitor's write buffer drains. */
+void bbusd_mon_drain(bbus_client* cli);
 void bbusd_mon_notify_recvd(const struct bbus_msg* msg);
 void bbusd_mon_notify_sent(const struct bbus_msg_hdr* hdr,
 			const char* meta, bbus_object* obj);
+/* Sends a notification passed on by another shard. */
+void bbusd_mon_handle_job(struct bbusd_job* job);
 
 #endif /* __BBUSD_MONITOR__ */
 
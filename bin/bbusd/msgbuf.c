@@ -13,23 +13,54 @@
  */
 
 #include "msgbuf.h"
-#include <string.h>
+#include "common.h"
 
-static unsigned char __msgbuf[2*BBUS_MAXPLOADSIZE];
-static struct bbus_msg* msgbuf = (struct bbus_msg*)__msgbuf;
+/* Regular messages always fit in the initial buffer. */
+#define MSGBUF_BASESIZE (2*BBUS_MAXPLOADSIZE)
+
+static BBUS_THREAD_LOCAL struct bbus_msg* msgbuf;
+static BBUS_THREAD_LOCAL size_t msgbufsize;
+/* Objects built or extracted while handling messages come from here. */
+static BBUS_THREAD_LOCAL bbus_obj_pool* objpool;
+
+void bbusd_init_msgbuf(void)
+{
+	msgbuf = bbus_malloc(MSGBUF_BASESIZE);
+	if (msgbuf == NULL)
+		bbusd_die("Error allocating the message buffer: %s\n",
+					bbus_strerror(bbus_lasterror()));
+	msgbufsize = MSGBUF_BASESIZE;
+	objpool = bbus_obj_pool_create();
+	if (objpool == NULL)
+		bbusd_die("Error allocating the object pool: %s\n",
+					bbus_strerror(bbus_lasterror()));
+}
+
+void bbusd_free_msgbuf(void)
+{
+	bbus_free(msgbuf);
+	msgbuf = NULL;
+	msgbufsize = 0;
+	bbus_obj_pool_free(objpool);
+	objpool = NULL;
+}
 
 struct bbus_msg* bbusd_getmsgbuf(void)
 {
 	return msgbuf;
 }
 
-void bbusd_zeromsgbuf(void)
+bbus_obj_pool* bbusd_getobjpool(void)
 {
-	memset(msgbuf, 0, sizeof(__msgbuf));
+	return objpool;
 }
 
 size_t bbusd_msgbufsize(void)
 {
-	return sizeof(__msgbuf);
+	return msgbufsize;
 }
 
+int bbusd_rcvmsg(bbus_client* cli)
+{
+	return bbus_client_rcvmsg_dyn(cli, &msgbuf, &msgbufsize);
+}
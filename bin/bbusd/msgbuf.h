@@ -17,9 +17,13 @@
 
 #include <busybus.h>
 
+void bbusd_init_msgbuf(void);
+void bbusd_free_msgbuf(void);
 struct bbus_msg* bbusd_getmsgbuf(void);
-void bbusd_zeromsgbuf(void);
 size_t bbusd_msgbufsize(void);
+bbus_obj_pool* bbusd_getobjpool(void);
+/* Receives a message into the buffer, which is grown if needed. */
+int bbusd_rcvmsg(bbus_client* cli);
 
 #endif /* __BBUSD_MSGBUF__ */
 
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "plugins.h"
+#include "service.h"
+#include "timer.h"
+#include "log.h"
+#include <busybus-plugin.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#define PATH_ROOT		"bbus."
+
+struct plugin
+{
+	struct plugin* next;
+	void* handle;
+	const struct bbusd_plugin* info;
+};
+
+/* The method inserted into the service map comes first. */
+struct plugin_method
+{
+	struct bbusd_local_method base;
+	struct plugin_method* next;
+};
+
+static struct plugin* plugins;
+static struct plugin_method* methods;
+/* Plugin whose init function is running. */
+static struct plugin* loading;
+static int needworkers;
+
+/* Calls waiting for a worker. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct bbusd_job* queue_head;
+static struct bbusd_job* queue_tail;
+static int stopping;
+static pthread_t workers[BBUSD_PLUGIN_MAXWORKERS];
+static unsigned numworkers;
+
+static int register_method(const char* name,
+				bbus_method_func func, int flags)
+{
+	struct plugin_method* mthd;
+	char* path;
+	int ret;
+
+	if ((loading == NULL) || (func == NULL) || (*name == '\0')
+					|| (strchr(name, '.') != NULL)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Invalid plugin method: '%s'\n", name);
+		return -1;
+	}
+
+	path = bbus_str_build(PATH_ROOT "%s.%s", loading->info->name, name);
+	if (path == NULL)
+		return -1;
+
+	mthd = bbus_malloc0(sizeof(struct plugin_method));
+	if (mthd == NULL) {
+		bbus_str_free(path);
+		return -1;
+	}
+
+	mthd->base.type = BBUSD_METHOD_LOCAL;
+	mthd->base.func = func;
+	mthd->base.offload = !(flags & BBUSD_PLUGIN_INLINE);
+	ret = bbusd_insert_method(path, (struct bbusd_method*)&mthd->base);
+	if (ret < 0) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error inserting method: '%s'\n", path);
+		bbus_str_free(path);
+		bbus_free(mthd);
+		return -1;
+	}
+
+	bbusd_logmsg(BBUSD_LOG_INFO,
+		"Method '%s' registered by a plugin.\n", path);
+	mthd->next = methods;
+	methods = mthd;
+	if (mthd->base.offload)
+		needworkers = 1;
+	bbus_str_free(path);
+
+	return 0;
+}
+
+void bbusd_load_plugin(const char* path)
+{
+	struct plugin* plugin;
+
+	plugin = bbus_malloc0(sizeof(struct plugin));
+	if (plugin == NULL)
+		bbusd_die("Out of memory loading plugin '%s'\n", path);
+
+	plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (plugin->handle == NULL)
+		bbusd_die("Error loading plugin: %s\n", dlerror());
+
+	plugin->info = dlsym(plugin->handle, BBUSD_PLUGIN_SYMBOL);
+	if (plugin->info == NULL)
+		bbusd_die("'%s' is not a bbusd plugin\n", path);
+
+	if ((plugin->info->version != BBUSD_PLUGIN_VERSION)
+			|| (plugin->info->name == NULL)
+			|| (*plugin->info->name == '\0')
+			|| (plugin->info->init == NULL))
+		bbusd_die("Plugin '%s' is invalid or built for another "
+				"bbusd version\n", path);
+
+	loading = plugin;
+	if (plugin->info->init(register_method) < 0)
+		bbusd_die("Plugin '%s' failed to initialize\n", path);
+	loading = NULL;
+
+	plugin->next = plugins;
+	plugins = plugin;
+	bbusd_logmsg(BBUSD_LOG_INFO, "Plugin '%s' loaded.\n",
+						plugin->info->name);
+}
+
+/*
+ * The job becomes the reply and is passed on to the shard owning the
+ * caller.
+ */
+static void run_call(struct bbusd_job* job)
+{
+	struct bbusd_local_method* mthd;
+	struct bbusd_job* reply;
+	struct bbus_msg_hdr hdr;
+	bbus_object* argobj;
+	bbus_object* retobj = NULL;
+	const void* raw;
+	size_t rawsize;
+	uint8_t errcode;
+
+	mthd = (struct bbusd_local_method*)job->method;
+	if ((job->deadline > 0) && (bbusd_deadline_left(job->deadline) == 0)) {
+		/* Expired while waiting for a worker. */
+		errcode = BBUS_PROT_ETIMEDOUT;
+	} else {
+		raw = bbusd_job_obj(job, &rawsize);
+		argobj = bbus_obj_view(raw, rawsize);
+		if (argobj != NULL) {
+			memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+			hdr.flags = job->objflags;
+			bbus_obj_setorder(argobj, bbus_hdr_getobjorder(&hdr));
+			retobj = mthd->func(argobj);
+			bbus_obj_free(argobj);
+		}
+		if (retobj == NULL) {
+			bbusd_logmsg(BBUSD_LOG_ERR, "Error calling method.\n");
+			errcode = BBUS_PROT_EMETHODERR;
+		} else {
+			errcode = BBUS_PROT_EGOOD;
+		}
+	}
+
+	reply = bbusd_job_new(BBUSD_JOB_CLIREPLY, NULL,
+			retobj == NULL ? NULL : bbus_obj_rawdata(retobj),
+			retobj == NULL ? 0 : bbus_obj_rawsize(retobj));
+	if (reply == NULL) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error passing the reply on: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	if (retobj != NULL)
+		bbus_hdr_setobjorder(&hdr, retobj);
+	reply->target = job->target;
+	reply->callid = job->callid;
+	reply->errcode = errcode;
+	reply->method = job->method;
+	reply->start = job->start;
+	reply->objflags = hdr.flags & BBUS_PROT_OBJFLAGS;
+	reply->fd = -1;
+	bbusd_shard_push(bbusd_token_shard(job->target), reply);
+
+out:
+	bbus_obj_free(retobj);
+	bbusd_job_free(job);
+}
+
+static void* worker_main(void* arg BBUS_UNUSED)
+{
+	struct bbusd_job* job;
+
+	for (;;) {
+		pthread_mutex_lock(&queue_lock);
+		while ((queue_head == NULL) && !stopping)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (stopping) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		job = queue_head;
+		queue_head = job->next;
+		if (queue_head == NULL)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		run_call(job);
+	}
+
+	return NULL;
+}
+
+void bbusd_start_plugins(unsigned num)
+{
+	int ret;
+
+	if (!needworkers)
+		return;
+
+	for (numworkers = 0; numworkers < num; ++numworkers) {
+		ret = pthread_create(&workers[numworkers], NULL,
+						worker_main, NULL);
+		if (ret != 0) {
+			bbusd_die("Error creating a plugin worker: %s\n",
+							bbus_strerror(ret));
+		}
+	}
+}
+
+void bbusd_plugin_call(struct bbusd_job* job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail != NULL)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+void bbusd_stop_plugins(void)
+{
+	struct bbusd_job* job;
+	unsigned i;
+
+	pthread_mutex_lock(&queue_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	for (i = 0; i < numworkers; ++i)
+		pthread_join(workers[i], NULL);
+	numworkers = 0;
+
+	while ((job = queue_head) != NULL) {
+		queue_head = job->next;
+		bbusd_job_free(job);
+	}
+	queue_tail = NULL;
+}
+
+void bbusd_free_plugins(void)
+{
+	struct plugin_method* mthd;
+	struct plugin* plugin;
+
+	while ((mthd = methods) != NULL) {
+		methods = mthd->next;
+		bbus_free(mthd);
+	}
+
+	while ((plugin = plugins) != NULL) {
+		plugins = plugin->next;
+		if (plugin->info->exit != NULL)
+			plugin->info->exit();
+		dlclose(plugin->handle);
+		bbus_free(plugin);
+	}
+}
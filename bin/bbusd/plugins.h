@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_PLUGINS__
+#define __BBUSD_PLUGINS__
+
+#include <busybus.h>
+#include "shard.h"
+
+/*
+ * Plugins are shared objects providing local methods, see busybus-plugin.h.
+ * They're loaded at startup, before any other thread is running. Methods
+ * not registered as inline run on a pool of worker threads, the replies
+ * are passed on to the callers' shards as BBUSD_JOB_CLIREPLY jobs.
+ */
+
+#define BBUSD_MAXPLUGINS		16
+#define BBUSD_PLUGIN_DEFWORKERS		2
+#define BBUSD_PLUGIN_MAXWORKERS		64
+
+/* Loads the plugin and registers its methods, dies on errors. */
+void bbusd_load_plugin(const char* path);
+/* Starts the worker pool if any method needs it. */
+void bbusd_start_plugins(unsigned numworkers);
+/*
+ * Queues a BBUSD_JOB_PLUGINCALL job for the worker pool. Can be called
+ * from any thread.
+ */
+void bbusd_plugin_call(struct bbusd_job* job);
+/* Waits for the calls being run, the ones still queued are dropped. */
+void bbusd_stop_plugins(void);
+/* Must be called after the service map has been freed. */
+void bbusd_free_plugins(void);
+
+#endif /* __BBUSD_PLUGINS__ */
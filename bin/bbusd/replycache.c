@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "replycache.h"
+#include "common.h"
+#include "shard.h"
+#include "stats.h"
+#include <string.h>
+
+/*
+ * Entries are keyed by the method, the byte order and the bytes of the
+ * argument. An entry is created on the first call and filled in when
+ * its reply comes back - the call carries the ticket it was issued.
+ * Calls made while the ticket is outstanding go through uncached, so
+ * that the reply on its way still finds the ticket it was issued.
+ * Replies older than the method's ttl, or cached before the service
+ * last invalidated the method, are never used: the entry is issued a
+ * new ticket instead and filled in again. So is an entry whose ticket
+ * has been outstanding for longer than the ttl - the call may have
+ * failed and never will fill it in.
+ */
+struct rcache_entry
+{
+	/* LRU list - the head is the least recently used entry. */
+	struct rcache_entry* next;
+	struct rcache_entry* prev;
+	struct rcache_entry* chain;	/* Next entry in the same bucket. */
+	struct bbusd_remote_method* mthd; /* Holds a reference. */
+	uint32_t hash;
+	unsigned ticket;	/* 0 once filled in. */
+	unsigned gen;		/* Method's cachegen when issued the ticket. */
+	/* When the reply or, until filled in, the ticket goes stale. */
+	uint64_t expires;
+	int argflags;
+	int objflags;
+	void* obj;
+	size_t objsize;
+	size_t argsize;
+	char arg[0];
+};
+
+static BBUS_THREAD_LOCAL struct bbus_list lru;
+static BBUS_THREAD_LOCAL struct rcache_entry** buckets;
+static BBUS_THREAD_LOCAL unsigned mask;
+static BBUS_THREAD_LOCAL unsigned numentries;
+static BBUS_THREAD_LOCAL unsigned maxentries;
+static BBUS_THREAD_LOCAL unsigned lastticket;
+
+void bbusd_init_rcache(unsigned entries)
+{
+	unsigned size;
+
+	lru.head = lru.tail = NULL;
+	numentries = 0;
+	maxentries = entries;
+	lastticket = 0;
+	if (entries == 0) {
+		buckets = NULL;
+		return;
+	}
+
+	for (size = 1; size < entries; size <<= 1);
+	buckets = bbus_malloc0(size * sizeof(struct rcache_entry*));
+	if (buckets == NULL) {
+		bbusd_die("Error creating the reply cache: %s\n",
+				bbus_strerror(bbus_lasterror()));
+	}
+	mask = size - 1;
+}
+
+static void entry_free(struct rcache_entry* entry)
+{
+	bbusd_method_put((struct bbusd_method*)entry->mthd);
+	bbus_free(entry->obj);
+	bbus_free(entry);
+}
+
+void bbusd_free_rcache(void)
+{
+	struct rcache_entry* entry;
+
+	while ((entry = (struct rcache_entry*)lru.head) != NULL) {
+		bbus_list_rm(&lru, entry);
+		entry_free(entry);
+	}
+	bbus_free(buckets);
+	buckets = NULL;
+	numentries = 0;
+}
+
+static void evict_oldest(void)
+{
+	struct rcache_entry* entry;
+	struct rcache_entry** pos;
+
+	entry = (struct rcache_entry*)lru.head;
+	for (pos = &buckets[entry->hash & mask];
+			*pos != entry; pos = &(*pos)->chain);
+	*pos = entry->chain;
+	bbus_list_rm(&lru, entry);
+	entry_free(entry);
+	--numentries;
+}
+
+static uint64_t ttl_from(uint64_t now, struct bbusd_remote_method* mthd)
+{
+	return now + (uint64_t)mthd->cachettl * 1000000ULL;
+}
+
+static unsigned issue_ticket(struct rcache_entry* entry, unsigned gen,
+							uint64_t now)
+{
+	if (++lastticket == 0)
+		++lastticket;
+
+	entry->ticket = lastticket;
+	entry->gen = gen;
+	entry->expires = ttl_from(now, entry->mthd);
+	bbus_free(entry->obj);
+	entry->obj = NULL;
+	entry->objsize = 0;
+
+	return lastticket;
+}
+
+const void* bbusd_rcache_lookup(struct bbusd_remote_method* mthd,
+			const void* arg, size_t argsize, int argflags,
+			size_t* objsize, int* objflags,
+			uint32_t* hash, unsigned* ticket)
+{
+	struct rcache_entry* entry;
+	uint64_t now;
+	unsigned gen;
+
+	*ticket = 0;
+	if ((buckets == NULL) || (argsize > BBUSD_RCACHE_MAXOBJ))
+		return NULL;
+
+	*hash = bbus_hmap_hash(arg, argsize)
+		^ (uint32_t)((uintptr_t)mthd >> 4) * 0x9e3779b1U;
+	gen = __atomic_load_n(&mthd->cachegen, __ATOMIC_ACQUIRE);
+	now = bbusd_stats_now();
+
+	for (entry = buckets[*hash & mask]; entry != NULL;
+						entry = entry->chain) {
+		if ((entry->mthd == mthd) && (entry->hash == *hash)
+				&& (entry->argflags == argflags)
+				&& (entry->argsize == argsize)
+				&& (memcmp(entry->arg, arg, argsize) == 0))
+			break;
+	}
+
+	if (entry != NULL) {
+		bbus_list_rm(&lru, entry);
+		bbus_list_push(&lru, entry);
+		if ((entry->gen != gen) || (now >= entry->expires)) {
+			*ticket = issue_ticket(entry, gen, now);
+			return NULL;
+		}
+
+		/* Still waiting for the reply to another call. */
+		if (entry->ticket != 0)
+			return NULL;
+
+		*objsize = entry->objsize;
+		*objflags = entry->objflags;
+		bbusd_count(BBUSD_CNT_CACHEHITS, 1);
+		return entry->obj;
+	}
+
+	if (numentries == maxentries)
+		evict_oldest();
+
+	entry = bbus_malloc0(sizeof(struct rcache_entry) + argsize);
+	if (entry == NULL)
+		return NULL;
+
+	bbusd_method_get((struct bbusd_method*)mthd);
+	entry->mthd = mthd;
+	entry->hash = *hash;
+	entry->argflags = argflags;
+	entry->argsize = argsize;
+	memcpy(entry->arg, arg, argsize);
+	entry->chain = buckets[*hash & mask];
+	buckets[*hash & mask] = entry;
+	bbus_list_push(&lru, entry);
+	++numentries;
+	*ticket = issue_ticket(entry, gen, now);
+
+	return NULL;
+}
+
+void bbusd_rcache_fill(uint32_t hash, unsigned ticket, const void* obj,
+					size_t objsize, int objflags)
+{
+	struct rcache_entry* entry;
+
+	if ((buckets == NULL) || (objsize > BBUSD_RCACHE_MAXOBJ))
+		return;
+
+	for (entry = buckets[hash & mask]; entry != NULL;
+						entry = entry->chain) {
+		if (entry->ticket == ticket)
+			break;
+	}
+
+	/* Invalidated while the call was in flight. */
+	if ((entry == NULL) || (entry->gen != __atomic_load_n(
+			&entry->mthd->cachegen, __ATOMIC_ACQUIRE)))
+		return;
+
+	entry->obj = bbus_malloc(objsize > 0 ? objsize : 1);
+	if (entry->obj == NULL)
+		return;
+
+	if (objsize > 0)
+		memcpy(entry->obj, obj, objsize);
+	entry->objsize = objsize;
+	entry->objflags = objflags;
+	entry->ticket = 0;
+	entry->expires = ttl_from(bbusd_stats_now(), entry->mthd);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_REPLYCACHE__
+#define __BBUSD_REPLYCACHE__
+
+#include <busybus.h>
+#include "service.h"
+
+#define BBUSD_RCACHE_DEFENTRIES	256
+/* Bigger arguments and replies are never cached. */
+#define BBUSD_RCACHE_MAXOBJ	4096
+
+/*
+ * Replies of methods registered with a ttl, one least recently used
+ * cache of at most 'entries' encoded replies per shard. 0 disables it.
+ */
+void bbusd_init_rcache(unsigned entries);
+void bbusd_free_rcache(void);
+
+/*
+ * Looks up the reply to a call of 'mthd' with the argument given. Returns
+ * the cached reply, valid until the next call to any of these functions,
+ * or NULL if there's none. Then 'ticket' is set to a non-zero value if
+ * the reply to this call should be passed to bbusd_rcache_fill(), along
+ * with 'hash', or to 0 if the reply to another call is awaited.
+ */
+const void* bbusd_rcache_lookup(struct bbusd_remote_method* mthd,
+			const void* arg, size_t argsize, int argflags,
+			size_t* objsize, int* objflags,
+			uint32_t* hash, unsigned* ticket);
+/*
+ * Stores the reply, unless the entry the ticket was issued for has
+ * been evicted, invalidated or issued another ticket meanwhile.
+ */
+void bbusd_rcache_fill(uint32_t hash, unsigned ticket, const void* obj,
+					size_t objsize, int objflags);
+
+#endif /* __BBUSD_REPLYCACHE__ */
@@ -16,165 +16,1026 @@
 #include "common.h"
 #include "log.h"
 #include "service.h"
+#include "shard.h"
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
+/*
+ * The service tree is shared by all shards and looked up on every call,
+ * but only modified when services register. Readers never take a lock:
+ * the tree is read-copy-update protected. Writers copy every node on the
+ * path to the modified method, link the copies to the unmodified parts
+ * of the tree and atomically publish the new root. Replaced nodes are
+ * freed once every shard has passed through a quiescent state, i.e.
+ * called bbusd_quiesce_service_map(), after the update was published.
+ *
+ * The root node also holds a flat index of full method paths, which is
+ * what lookups actually use - a single hash probe and no allocation.
+ */
 struct service_tree
 {
 	/* Values are pointers to struct service_map. */
 	bbus_hashmap* subsrvc;
 	/* Values are pointers to struct method. */
 	bbus_hashmap* methods;
+	/*
+	 * Root only: keys are full paths, values are pointers to struct
+	 * method.
+	 */
+	bbus_hashmap* index;
+	/* Links retired nodes, or nodes replaced during an update. */
+	struct service_tree* next;
+	/* Update after which a retired node is no longer reachable. */
+	unsigned long epoch;
+	/* Links the copies made during an update. */
+	struct service_tree* fresh;
+	/* Copies can be modified in place until the update is published. */
+	int inupdate;
+	/* Copy made during an update, but unlinked again before publishing. */
+	int unlinked;
+};
+
+/*
+ * Removed methods can still be referenced by readers and by calls in
+ * flight. The tree's reference is dropped once the readers are done.
+ */
+struct retired_method
+{
+	struct retired_method* next;
+	struct bbusd_method* mthd;
+	unsigned long epoch;
+};
+
+/* Changes made to the tree under the lock and published at once. */
+struct tree_update
+{
+	struct service_tree* root;
+	struct service_tree* fresh;
+	struct service_tree* replaced;
+	struct retired_method* removed;
+	long nummethods;
 };
 
 static struct service_tree* srvc_tree;
+static unsigned long nummethods;
+
+/* Serializes the writers and protects the lists of retired objects. */
+static pthread_mutex_t srvc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct service_tree* retired;
+static struct retired_method* retired_methods;
+/* Number of the last update published. */
+static unsigned long srvc_epoch;
+/* Last update seen by each shard in a quiescent state. */
+static unsigned long quiescent_epoch[BBUSD_MAXSHARDS];
+static enum bbusd_balance balance = BBUSD_BALANCE_LEAST;
+/* Number of methods the index is created for. */
+static size_t indexhint = 32;
+
+/*
+ * Route table. Callers can resolve a method once and then call it by a
+ * numeric id instead of the full path. Ids are only assigned when asked
+ * for and released when the method is removed. Slots are reused, so the
+ * id also carries a generation number - a stale id never reaches a
+ * different method.
+ *
+ * Readers don't take a lock: pages are never freed and the methods they
+ * point to are retired just like the nodes of the tree.
+ *
+ * Route id layout: | generation | slot index |
+ */
+#define ROUTE_INDEX_BITS	16
+#define ROUTE_INDEX_MASK	((1U << ROUTE_INDEX_BITS) - 1)
+#define ROUTE_PAGE_SHIFT	10
+#define ROUTE_PAGE_SIZE		(1U << ROUTE_PAGE_SHIFT)
+#define ROUTE_MAXPAGES		((ROUTE_INDEX_MASK + 1) / ROUTE_PAGE_SIZE)
+#define ROUTE_NONE		UINT_MAX
+
+struct route_slot
+{
+	struct bbusd_method* mthd;	/* NULL if the slot is free. */
+	unsigned gen;
+	unsigned nextfree;
+};
+
+/* Protected by srvc_lock, except for lookups. */
+static struct route_slot* route_pages[ROUTE_MAXPAGES];
+static unsigned numroutes;
+static unsigned freeroute = ROUTE_NONE;
+
+/*
+ * Most nodes are leaves holding a handful of methods, so the maps are
+ * small and only created once something is put in them.
+ */
+#define NODE_MAP_SIZE	4
+
+static int copy_map(bbus_hashmap** dst, bbus_hashmap* src)
+{
+	if (src == NULL)
+		return 0;
+
+	*dst = bbus_hmap_dup(src);
+	return *dst == NULL ? -1 : 0;
+}
+
+static void* map_find(bbus_hashmap* map, const char* key)
+{
+	return map == NULL ? NULL : bbus_hmap_findstr(map, key);
+}
+
+static int map_set(bbus_hashmap** map, const char* key, void* val)
+{
+	if (*map == NULL) {
+		*map = bbus_hmap_create_sized(BBUS_HMAP_KEYSTR, NODE_MAP_SIZE);
+		if (*map == NULL)
+			return -1;
+	}
+
+	return bbus_hmap_setstr(*map, key, val);
+}
+
+static void map_rm(bbus_hashmap* map, const char* key)
+{
+	if (map != NULL)
+		(void)bbus_hmap_rmstr(map, key);
+}
 
-static int do_insert_method(const char* path, struct bbusd_method* mthd,
-					struct service_tree* node)
+static struct service_tree* node_new(struct service_tree* orig, int root)
+{
+	struct service_tree* node;
+
+	node = bbus_malloc0(sizeof(struct service_tree));
+	if (node == NULL)
+		return NULL;
+
+	if (orig == NULL) {
+		if (root) {
+			/* The index is sized for the expected methods. */
+			node->index = bbus_hmap_create_sized(BBUS_HMAP_KEYSTR,
+								indexhint);
+			if (node->index == NULL)
+				goto err;
+		}
+
+		return node;
+	}
+
+	if ((copy_map(&node->subsrvc, orig->subsrvc) < 0)
+			|| (copy_map(&node->methods, orig->methods) < 0)
+			|| (root && (copy_map(&node->index, orig->index) < 0)))
+		goto err;
+
+	return node;
+
+err:
+	bbus_hmap_free(node->index);
+	bbus_hmap_free(node->methods);
+	bbus_hmap_free(node->subsrvc);
+	bbus_free(node);
+	return NULL;
+}
+
+/*
+ * Frees only this node - its children may still be used by other
+ * versions of the tree.
+ */
+static void node_free(struct service_tree* node)
+{
+	bbus_hmap_free(node->index);
+	bbus_hmap_free(node->methods);
+	bbus_hmap_free(node->subsrvc);
+	bbus_free(node);
+}
+
+static void node_free_list(struct service_tree* node)
 {
-	char* found;
 	struct service_tree* next;
-	int ret;
-	void* mval;
-
-	found = index(path, '.');
-	if (found == NULL) {
-		/* Path is the method name. */
-		mval = bbus_hmap_findstr(node->methods, path);
-		if (mval != NULL) {
-			bbusd_logmsg(BBUSD_LOG_ERR,
-				"Method already exists for this value: %s\n",
-				path);
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		node_free(node);
+	}
+}
+
+static int nonempty(const void* key BBUS_UNUSED, size_t keysize BBUS_UNUSED,
+				void* val BBUS_UNUSED, void* arg BBUS_UNUSED)
+{
+	return 1;
+}
+
+static int node_empty(struct service_tree* node)
+{
+	return ((node->methods == NULL)
+			|| (bbus_hmap_foreach(node->methods,
+					nonempty, NULL) == 0))
+		&& ((node->subsrvc == NULL)
+			|| (bbus_hmap_foreach(node->subsrvc,
+					nonempty, NULL) == 0));
+}
+
+/*
+ * Returns a node of the new version of the tree that can be modified in
+ * place - 'node' itself if it has already been copied during this update.
+ * NULL 'node' means a new, empty one.
+ */
+static struct service_tree* update_node(struct tree_update* upd,
+				struct service_tree* node, int root)
+{
+	struct service_tree* copy;
+
+	if ((node != NULL) && node->inupdate)
+		return node;
+
+	copy = node_new(node, root);
+	if (copy == NULL)
+		return NULL;
+
+	copy->inupdate = 1;
+	copy->fresh = upd->fresh;
+	upd->fresh = copy;
+	if (node != NULL) {
+		node->next = upd->replaced;
+		upd->replaced = node;
+	}
+
+	return copy;
+}
+
+static void update_begin(struct tree_update* upd)
+{
+	memset(upd, 0, sizeof(struct tree_update));
+	pthread_mutex_lock(&srvc_lock);
+}
+
+static int update_root(struct tree_update* upd)
+{
+	if (upd->root == NULL)
+		upd->root = update_node(upd, srvc_tree, 1);
+
+	return upd->root == NULL ? -1 : 0;
+}
+
+static int update_insert(struct tree_update* upd, const char* path,
+						struct bbusd_method* mthd)
+{
+	struct service_tree* node;
+	struct service_tree* next;
+	char* name;
+	char* comp;
+	char* dot;
+	int ret = -1;
+
+	if (update_root(upd) < 0)
+		return -1;
+
+	name = bbus_str_cpy(path);
+	if (name == NULL)
+		return -1;
+
+	/* Every component but the last one is a subservice. */
+	node = upd->root;
+	for (comp = name; (dot = index(comp, '.')) != NULL; comp = dot + 1) {
+		*dot = '\0';
+		next = update_node(upd,
+				map_find(node->subsrvc, comp), 0);
+		if ((next == NULL)
+				|| (map_set(&node->subsrvc, comp, next) < 0))
+			goto out;
+		node = next;
+	}
+
+	if (map_find(node->methods, comp) != NULL) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Method already exists for this value: %s\n", path);
+		goto out;
+	}
+
+	if ((map_set(&node->methods, comp, mthd) < 0)
+			|| (bbus_hmap_setstr(upd->root->index,
+						path, mthd) < 0)) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Error registering new method: %s\n",
+			bbus_strerror(bbus_lasterror()));
+		goto out;
+	}
+
+	upd->nummethods++;
+	ret = 0;
+
+out:
+	bbus_str_free(name);
+	return ret;
+}
+
+/*
+ * Removes the method from the subtree of 'node' and returns its new
+ * version. Subservices left empty are unlinked.
+ */
+static struct service_tree* remove_from(struct tree_update* upd,
+			struct service_tree* node, char* path, int root)
+{
+	struct service_tree* copy;
+	struct service_tree* child;
+	char* dot;
+
+	copy = root ? upd->root : update_node(upd, node, 0);
+	if (copy == NULL)
+		return NULL;
+
+	dot = index(path, '.');
+	if (dot == NULL) {
+		map_rm(copy->methods, path);
+		return copy;
+	}
+
+	*dot = '\0';
+	child = map_find(copy->subsrvc, path);
+	if (child == NULL)
+		return copy;
+
+	child = remove_from(upd, child, dot + 1, 0);
+	if (child == NULL)
+		return NULL;
+
+	if (node_empty(child)) {
+		map_rm(copy->subsrvc, path);
+		child->unlinked = 1;
+	} else
+	if (map_set(&copy->subsrvc, path, child) < 0) {
+		return NULL;
+	}
+
+	return copy;
+}
+
+static int update_remove(struct tree_update* upd, const char* path)
+{
+	struct retired_method* grave;
+	struct bbusd_method* mthd;
+	char* name;
+	int ret = -1;
+
+	if (update_root(upd) < 0)
+		return -1;
+
+	mthd = bbus_hmap_findstr(upd->root->index, path);
+	if (mthd == NULL)
+		return 0;
+
+	grave = bbus_malloc0(sizeof(struct retired_method));
+	if (grave == NULL)
+		return -1;
+
+	name = bbus_str_cpy(path);
+	if (name == NULL)
+		goto out;
+
+	if (remove_from(upd, upd->root, name, 1) == NULL)
+		goto out;
+
+	(void)bbus_hmap_rmstr(upd->root->index, path);
+	grave->mthd = mthd;
+	grave->next = upd->removed;
+	upd->removed = grave;
+	grave = NULL;
+	upd->nummethods--;
+	ret = 0;
+
+out:
+	bbus_str_free(name);
+	bbus_free(grave);
+	return ret;
+}
+
+static void update_abort(struct tree_update* upd)
+{
+	struct service_tree* node;
+	struct service_tree* next;
+	struct retired_method* grave;
+
+	/* Nothing has been published - the old tree is untouched. */
+	for (node = upd->fresh; node != NULL; node = next) {
+		next = node->fresh;
+		node_free(node);
+	}
+	while ((grave = upd->removed) != NULL) {
+		upd->removed = grave->next;
+		bbus_free(grave);
+	}
+	pthread_mutex_unlock(&srvc_lock);
+}
+
+static struct route_slot* route_slot(unsigned ind)
+{
+	struct route_slot* page;
+
+	page = __atomic_load_n(&route_pages[ind >> ROUTE_PAGE_SHIFT],
+							__ATOMIC_ACQUIRE);
+	return page == NULL ? NULL : &page[ind & (ROUTE_PAGE_SIZE - 1)];
+}
+
+static int route_assign(struct bbusd_method* mthd)
+{
+	struct route_slot* page;
+	struct route_slot* slot;
+	unsigned ind;
+
+	if (freeroute != ROUTE_NONE) {
+		ind = freeroute;
+		slot = route_slot(ind);
+		freeroute = slot->nextfree;
+	} else {
+		if (numroutes > ROUTE_INDEX_MASK) {
+			bbusd_logmsg(BBUSD_LOG_ERR, "Route table is full.\n");
 			return -1;
 		}
-		ret = bbus_hmap_setstr(node->methods, path, mthd);
-		if (ret < 0) {
+
+		ind = numroutes;
+		if (route_pages[ind >> ROUTE_PAGE_SHIFT] == NULL) {
+			page = bbus_malloc0(ROUTE_PAGE_SIZE
+					* sizeof(struct route_slot));
+			if (page == NULL)
+				return -1;
+			__atomic_store_n(&route_pages[ind >> ROUTE_PAGE_SHIFT],
+						page, __ATOMIC_RELEASE);
+		}
+		slot = route_slot(ind);
+		slot->gen = 1;
+		++numroutes;
+	}
+
+	__atomic_store_n(&mthd->route, (slot->gen << ROUTE_INDEX_BITS) | ind,
+							__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->mthd, mthd, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void route_release(struct bbusd_method* mthd)
+{
+	struct route_slot* slot;
+	unsigned ind;
+
+	if (mthd->route == 0)
+		return;
+
+	ind = mthd->route & ROUTE_INDEX_MASK;
+	slot = route_slot(ind);
+	__atomic_store_n(&slot->mthd, NULL, __ATOMIC_RELEASE);
+	/* Generation 0 is never used, so a valid route is never 0. */
+	slot->gen = (slot->gen + 1) & (UINT_MAX >> ROUTE_INDEX_BITS);
+	if (slot->gen == 0)
+		slot->gen = 1;
+	slot->nextfree = freeroute;
+	freeroute = ind;
+}
+
+static void update_commit(struct tree_update* upd)
+{
+	struct service_tree* node;
+	struct service_tree* next;
+	struct service_tree* last;
+	struct retired_method* grave;
+	unsigned long epoch;
+
+	if (upd->root == NULL) {
+		/* Nothing changed. */
+		pthread_mutex_unlock(&srvc_lock);
+		return;
+	}
+
+	/* Copies unlinked again have never been visible to the readers. */
+	for (node = upd->fresh; node != NULL; node = next) {
+		next = node->fresh;
+		if (node->unlinked)
+			node_free(node);
+		else
+			node->inupdate = 0;
+	}
+
+	/* Readers can only see the new tree after the new epoch. */
+	__atomic_store_n(&srvc_tree, upd->root, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&nummethods, upd->nummethods, __ATOMIC_RELAXED);
+	epoch = __atomic_add_fetch(&srvc_epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (last = upd->replaced; last != NULL; last = last->next) {
+		last->epoch = epoch;
+		if (last->next == NULL) {
+			last->next = retired;
+			break;
+		}
+	}
+	if (upd->replaced != NULL)
+		__atomic_store_n(&retired, upd->replaced, __ATOMIC_RELEASE);
+
+	while ((grave = upd->removed) != NULL) {
+		upd->removed = grave->next;
+		route_release(grave->mthd);
+		grave->epoch = epoch;
+		grave->next = retired_methods;
+		retired_methods = grave;
+	}
+	pthread_mutex_unlock(&srvc_lock);
+}
+
+int bbusd_insert_method(const char* path, struct bbusd_method* mthd)
+{
+	struct tree_update upd;
+
+	update_begin(&upd);
+	if (update_insert(&upd, path, mthd) < 0) {
+		update_abort(&upd);
+		return -1;
+	}
+	update_commit(&upd);
+
+	return 0;
+}
+
+void bbusd_method_get(struct bbusd_method* mthd)
+{
+	if (mthd->type == BBUSD_METHOD_REMOTE)
+		__atomic_add_fetch(&mthd->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void remote_free(struct bbusd_remote_method* mthd)
+{
+	bbus_str_free(mthd->path);
+	bbus_free(mthd);
+}
+
+void bbusd_method_put(struct bbusd_method* mthd)
+{
+	if ((mthd->type == BBUSD_METHOD_REMOTE)
+			&& (__atomic_sub_fetch(&mthd->refs, 1,
+					__ATOMIC_ACQ_REL) == 0))
+		remote_free((struct bbusd_remote_method*)mthd);
+}
+
+static int add_provider(struct bbusd_remote_method* mthd, unsigned srvctok)
+{
+	struct bbusd_provider* prov;
+	unsigned free = 0;
+	unsigned i;
+
+	for (i = 0; i < BBUSD_MAXPROVIDERS; ++i) {
+		prov = &mthd->providers[i];
+		if (__atomic_load_n(&prov->srvctok,
+					__ATOMIC_ACQUIRE) == srvctok) {
 			bbusd_logmsg(BBUSD_LOG_ERR,
-				"Error registering new method: %s\n",
-				bbus_strerror(bbus_lasterror()));
+				"Service already provides this method.\n");
 			return -1;
 		}
+	}
 
-		return 0;
-	} else {
-		/* Path is the subservice name. */
-		*found = '\0';
-		next = bbus_hmap_findstr(node->subsrvc, path);
-		if (next == NULL) {
-			/* Insert new service. */
-			next = bbus_malloc(sizeof(struct service_tree));
-			if (next == NULL)
-				goto err_mknext;
-
-			next->subsrvc = bbus_hmap_create(BBUS_HMAP_KEYSTR);
-			if (next->subsrvc == NULL)
-				goto err_mksubsrvc;
-
-			next->methods = bbus_hmap_create(BBUS_HMAP_KEYSTR);
-			if (next->subsrvc == NULL)
-				goto err_mkmethods;
-
-			ret = bbus_hmap_setstr(node->subsrvc, path, next);
-			if (ret < 0)
-				goto err_setsrvc;
+	for (i = 0; i < BBUSD_MAXPROVIDERS; ++i) {
+		prov = &mthd->providers[i];
+		if (__atomic_compare_exchange_n(&prov->srvctok, &free,
+				srvctok, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED)) {
+			__atomic_store_n(&prov->inflight, 0, __ATOMIC_RELAXED);
+			return 0;
 		}
+		free = 0;
+	}
+
+	bbusd_logmsg(BBUSD_LOG_ERR,
+		"Method already has %d providers.\n", BBUSD_MAXPROVIDERS);
+	return -1;
+}
+
+static int remember_path(struct bbusd_provided* provided, const char* path)
+{
+	char** newpaths;
+	unsigned newmax;
 
-		return do_insert_method(found+1, mthd, next);
+	if (provided->num == provided->max) {
+		newmax = provided->max == 0 ? 8 : provided->max * 2;
+		newpaths = bbus_realloc(provided->paths,
+					newmax * sizeof(char*));
+		if (newpaths == NULL)
+			return -1;
+		provided->paths = newpaths;
+		provided->max = newmax;
 	}
 
-err_setsrvc:
-	bbus_hmap_free(next->methods);
+	provided->paths[provided->num] = bbus_str_cpy(path);
+	if (provided->paths[provided->num] == NULL)
+		return -1;
+	provided->num++;
 
-err_mkmethods:
-	bbus_hmap_free(next->subsrvc);
+	return 0;
+}
 
-err_mksubsrvc:
-	bbus_free(next);
+static int providers_left(struct bbusd_remote_method* mthd)
+{
+	unsigned i;
 
-err_mknext:
-	return -1;
+	for (i = 0; i < BBUSD_MAXPROVIDERS; ++i) {
+		if (__atomic_load_n(&mthd->providers[i].srvctok,
+						__ATOMIC_ACQUIRE) != 0)
+			return 1;
+	}
+
+	return 0;
 }
 
-int bbusd_insert_method(const char* path, struct bbusd_method* mthd)
+/* Undo log of a batch of insertions. */
+struct provided_undo
 {
-	char* mname;
-	int ret;
+	struct bbusd_remote_method* mthd;
+	int created;	/* Not published yet, can simply be freed. */
+};
+
+static int provide(struct tree_update* upd, const char* path,
+			unsigned ttl, unsigned srvctok,
+			struct provided_undo* undo)
+{
+	struct bbusd_remote_method* rmthd;
+	struct bbusd_method* mthd;
 
-	mname = bbus_str_cpy(path);
-	if (mname == NULL)
+	/* Methods inserted earlier in this batch are only in the copy. */
+	mthd = bbus_hmap_findstr(upd->root != NULL
+			? upd->root->index : srvc_tree->index, path);
+	if (mthd != NULL) {
+		if (mthd->type != BBUSD_METHOD_REMOTE) {
+			bbusd_logmsg(BBUSD_LOG_ERR,
+				"Method already exists for this value: %s\n",
+				path);
+			return -1;
+		}
+
+		rmthd = (struct bbusd_remote_method*)mthd;
+		if (add_provider(rmthd, srvctok) < 0)
+			return -1;
+
+		undo->mthd = rmthd;
+		return 0;
+	}
+
+	rmthd = bbus_malloc0(sizeof(struct bbusd_remote_method));
+	if (rmthd == NULL)
 		return -1;
 
-	ret = do_insert_method(mname, mthd, srvc_tree);
-	bbus_str_free(mname);
+	rmthd->type = BBUSD_METHOD_REMOTE;
+	rmthd->refs = 1;
+	rmthd->cachettl = ttl;
+	rmthd->providers[0].srvctok = srvctok;
+	undo->mthd = rmthd;
+	undo->created = 1;
+
+	/* Calls by route id don't carry the name the service expects. */
+	rmthd->path = bbus_str_cpy(path);
+	if (rmthd->path == NULL)
+		return -1;
+	rmthd->name = rindex(rmthd->path, '.') + 1;
+
+	return update_insert(upd, path, (struct bbusd_method*)rmthd);
+}
+
+int bbusd_insert_providers(struct bbusd_provided* provided,
+		const char* const* paths, const unsigned* ttls,
+		unsigned num, unsigned srvctok)
+{
+	struct provided_undo* undo;
+	struct tree_update upd;
+	unsigned oldnum;
+	unsigned i;
+
+	undo = bbus_malloc0(num * sizeof(struct provided_undo));
+	if (undo == NULL)
+		return -1;
+
+	oldnum = provided->num;
+	/* Under the lock, so that the methods can't be removed meanwhile. */
+	update_begin(&upd);
+	for (i = 0; i < num; ++i) {
+		if ((remember_path(provided, paths[i]) < 0)
+				|| (provide(&upd, paths[i],
+					ttls != NULL ? ttls[i] : 0,
+					srvctok, &undo[i]) < 0))
+			goto err;
+	}
+	/* All the new methods become visible at once. */
+	update_commit(&upd);
+	bbus_free(undo);
+
+	return 0;
+
+err:
+	update_abort(&upd);
+	for (i = 0; i < num; ++i) {
+		if (undo[i].created)
+			remote_free(undo[i].mthd);
+		else if (undo[i].mthd != NULL)
+			bbusd_drop_provider(undo[i].mthd, srvctok);
+	}
+	while (provided->num > oldnum)
+		bbus_str_free(provided->paths[--provided->num]);
+	bbus_free(undo);
+	return -1;
+}
+
+int bbusd_insert_provider(struct bbusd_provided* provided,
+				const char* path, unsigned srvctok)
+{
+	return bbusd_insert_providers(provided, &path, NULL, 1, srvctok);
+}
+
+int bbusd_remove_provider(struct bbusd_provided* provided,
+				const char* path, unsigned srvctok)
+{
+	struct bbusd_remote_method* mthd;
+	struct tree_update upd;
+	unsigned i = 0;
+	int ret = 0;
+
+	update_begin(&upd);
+	while (i < provided->num) {
+		if ((path != NULL) && (strcmp(provided->paths[i], path) != 0)) {
+			++i;
+			continue;
+		}
+
+		mthd = bbus_hmap_findstr(srvc_tree->index, provided->paths[i]);
+		if ((mthd != NULL) && (mthd->type == BBUSD_METHOD_REMOTE)) {
+			bbusd_drop_provider(mthd, srvctok);
+			/* The last provider takes the method with it. */
+			if (!providers_left(mthd)
+					&& (update_remove(&upd,
+						provided->paths[i]) < 0))
+				ret = -1;
+		}
+
+		bbus_str_free(provided->paths[i]);
+		provided->paths[i] = provided->paths[--provided->num];
+	}
+	update_commit(&upd);
 
 	return ret;
 }
 
-static struct bbusd_method* do_locate_method(char* path, struct service_tree* node)
+void bbusd_free_provided(struct bbusd_provided* provided)
 {
-	char* found;
-	struct service_tree* next;
+	unsigned i;
+
+	for (i = 0; i < provided->num; ++i)
+		bbus_str_free(provided->paths[i]);
+	bbus_free(provided->paths);
+	bbus_free(provided);
+}
 
-	found = index(path, '.');
-	if (found == NULL) {
-		/* This is a method. */
-		return bbus_hmap_findstr(node->methods, path);
+void bbusd_set_balance(enum bbusd_balance policy)
+{
+	balance = policy;
+}
+
+struct bbusd_provider* bbusd_pick_provider(struct bbusd_remote_method* mthd,
+						unsigned* srvctok)
+{
+	struct bbusd_provider* avail[BBUSD_MAXPROVIDERS];
+	unsigned toks[BBUSD_MAXPROVIDERS];
+	struct bbusd_provider* prov;
+	unsigned num = 0;
+	unsigned load;
+	unsigned best;
+	unsigned first;
+	unsigned i;
+	unsigned j;
+
+	for (i = 0; i < BBUSD_MAXPROVIDERS; ++i) {
+		toks[num] = __atomic_load_n(&mthd->providers[i].srvctok,
+							__ATOMIC_ACQUIRE);
+		if (toks[num] != 0)
+			avail[num++] = &mthd->providers[i];
+	}
+	if (num == 0)
+		return NULL;
+
+	first = __atomic_fetch_add(&mthd->next, 1, __ATOMIC_RELAXED) % num;
+	if (balance == BBUSD_BALANCE_RR) {
+		j = first;
 	} else {
-		*found = '\0';
-		/* This is a sub-service. */
-		next = bbus_hmap_findstr(node->subsrvc, path);
-		if (next == NULL) {
-			return NULL;
+		/* Ties go to whoever's next in the round-robin order. */
+		best = UINT_MAX;
+		for (i = 0, j = first; i < num; ++i) {
+			load = __atomic_load_n(&avail[(first + i) % num]->inflight,
+							__ATOMIC_RELAXED);
+			if (load < best) {
+				best = load;
+				j = (first + i) % num;
+			}
 		}
+	}
+
+	prov = avail[j];
+	*srvctok = toks[j];
+	__atomic_add_fetch(&prov->inflight, 1, __ATOMIC_RELAXED);
+
+	return prov;
+}
 
-		return do_locate_method(found+1, next);
+void bbusd_provider_done(struct bbusd_provider* prov, unsigned srvctok)
+{
+	unsigned cur;
+
+	/* The slot may have been taken over by another service since. */
+	if (__atomic_load_n(&prov->srvctok, __ATOMIC_ACQUIRE) != srvctok)
+		return;
+
+	cur = __atomic_load_n(&prov->inflight, __ATOMIC_RELAXED);
+	while ((cur > 0) && !__atomic_compare_exchange_n(&prov->inflight,
+			&cur, cur - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void bbusd_drop_provider(struct bbusd_remote_method* mthd, unsigned srvctok)
+{
+	unsigned tok;
+	unsigned i;
+
+	for (i = 0; i < BBUSD_MAXPROVIDERS; ++i) {
+		tok = srvctok;
+		if (__atomic_compare_exchange_n(&mthd->providers[i].srvctok,
+				&tok, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return;
 	}
 }
 
-struct bbusd_method* bbusd_locate_method(const char* path)
+unsigned bbusd_method_route(struct bbusd_method* mthd, const char* path)
 {
-	char* mname;
-	struct bbusd_method* ret;
+	unsigned route;
+
+	route = __atomic_load_n(&mthd->route, __ATOMIC_ACQUIRE);
+	if (route != 0)
+		return route;
 
-	mname = bbus_str_cpy(path);
-	if (mname == NULL)
+	pthread_mutex_lock(&srvc_lock);
+	/* Only methods still in the tree can get a route. */
+	if ((mthd->route == 0)
+			&& (bbus_hmap_findstr(srvc_tree->index, path) == mthd))
+		(void)route_assign(mthd);
+	route = mthd->route;
+	pthread_mutex_unlock(&srvc_lock);
+
+	return route;
+}
+
+struct bbusd_method* bbusd_locate_route(unsigned route)
+{
+	struct route_slot* slot;
+	struct bbusd_method* mthd;
+
+	slot = route_slot(route & ROUTE_INDEX_MASK);
+	if (slot == NULL)
 		return NULL;
 
-	ret = do_locate_method(mname, srvc_tree);
-	bbus_str_free(mname);
+	mthd = __atomic_load_n(&slot->mthd, __ATOMIC_ACQUIRE);
+	if ((mthd == NULL)
+		|| (__atomic_load_n(&mthd->route, __ATOMIC_ACQUIRE) != route))
+		return NULL;
 
-	return ret;
+	return mthd;
 }
 
-void bbusd_init_service_map(void)
+struct bbusd_method* bbusd_locate_method(const char* path)
 {
-	srvc_tree = bbus_malloc(sizeof(struct service_tree));
-	if (srvc_tree == NULL)
-		goto err;
+	return bbusd_locate_methodn(path, strlen(path));
+}
 
-	srvc_tree->subsrvc = bbus_hmap_create(BBUS_HMAP_KEYSTR);
-	if (srvc_tree->subsrvc == NULL) {
-		bbus_free(srvc_tree);
-		goto err;
+struct bbusd_method* bbusd_locate_methodn(const char* path, size_t len)
+{
+	struct service_tree* tree;
+
+	tree = __atomic_load_n(&srvc_tree, __ATOMIC_ACQUIRE);
+	return bbus_hmap_findstrn(tree->index, path, len);
+}
+
+unsigned long bbusd_num_methods(void)
+{
+	return __atomic_load_n(&nummethods, __ATOMIC_RELAXED);
+}
+
+unsigned long bbusd_service_map_epoch(void)
+{
+	return __atomic_load_n(&srvc_epoch, __ATOMIC_ACQUIRE);
+}
+
+int bbusd_foreach_method(bbus_hmap_iterfunc func, void* arg)
+{
+	struct service_tree* tree;
+
+	tree = __atomic_load_n(&srvc_tree, __ATOMIC_ACQUIRE);
+	return bbus_hmap_foreach(tree->index, func, arg);
+}
+
+static int invalidate(const void* key, size_t keysize, void* val, void* arg)
+{
+	struct bbusd_remote_method* mthd = val;
+	const char* path = arg;
+	size_t len = strlen(path);
+
+	/* The path itself or anything under it, never a mere prefix. */
+	if ((mthd->type == BBUSD_METHOD_REMOTE) && (mthd->cachettl > 0)
+			&& (keysize >= len)
+			&& (memcmp(key, path, len) == 0)
+			&& ((keysize == len)
+				|| (((const char*)key)[len] == '.')))
+		__atomic_add_fetch(&mthd->cachegen, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void bbusd_invalidate_methods(const char* path)
+{
+	(void)bbusd_foreach_method(invalidate, (void*)path);
+}
+
+void bbusd_quiesce_service_map(void)
+{
+	struct service_tree** node;
+	struct service_tree* tmp;
+	struct retired_method** grave;
+	struct retired_method* dead;
+	unsigned long oldest;
+	unsigned i;
+
+	__atomic_store_n(&quiescent_epoch[bbusd_shard_self()],
+			__atomic_load_n(&srvc_epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+
+	/* Never wait for the writers. */
+	if (((__atomic_load_n(&retired, __ATOMIC_ACQUIRE) == NULL)
+			&& (__atomic_load_n(&retired_methods,
+					__ATOMIC_ACQUIRE) == NULL))
+			|| (pthread_mutex_trylock(&srvc_lock) != 0))
+		return;
+
+	oldest = ULONG_MAX;
+	for (i = 0; i < bbusd_numshards(); ++i) {
+		oldest = BBUS_MIN(oldest, __atomic_load_n(&quiescent_epoch[i],
+							__ATOMIC_SEQ_CST));
 	}
 
-	srvc_tree->methods = bbus_hmap_create(BBUS_HMAP_KEYSTR);
-	if (srvc_tree->methods == NULL) {
-		bbus_hmap_free(srvc_tree->subsrvc);
-		bbus_free(srvc_tree);
-		goto err;
+	for (node = &retired; *node != NULL;) {
+		if ((*node)->epoch <= oldest) {
+			tmp = *node;
+			*node = tmp->next;
+			node_free(tmp);
+		} else {
+			node = &(*node)->next;
+		}
 	}
 
-	return;
+	for (grave = &retired_methods; *grave != NULL;) {
+		if ((*grave)->epoch <= oldest) {
+			dead = *grave;
+			*grave = dead->next;
+			bbusd_method_put(dead->mthd);
+			bbus_free(dead);
+		} else {
+			grave = &(*grave)->next;
+		}
+	}
+	pthread_mutex_unlock(&srvc_lock);
+}
 
-err:
-	bbusd_die("Error creating the service map: %s\n",
-		bbus_strerror(bbus_lasterror()));
+void bbusd_offline_service_map(void)
+{
+	/* A shard that's not looking at the tree never holds back frees. */
+	__atomic_store_n(&quiescent_epoch[bbusd_shard_self()],
+					ULONG_MAX, __ATOMIC_SEQ_CST);
 }
 
-void bbusd_free_service_map(void)
+void bbusd_init_service_map(unsigned expmethods)
 {
-	bbus_hmap_free(srvc_tree->methods);
-	bbus_hmap_free(srvc_tree->subsrvc);
-	bbus_free(srvc_tree);
+	if (expmethods > 0)
+		indexhint = expmethods;
+
+	srvc_tree = node_new(NULL, 1);
+	if (srvc_tree == NULL) {
+		bbusd_die("Error creating the service map: %s\n",
+			bbus_strerror(bbus_lasterror()));
+	}
 }
 
+void bbusd_free_service_map(void)
+{
+	struct retired_method* dead;
+	unsigned i;
+
+	node_free(srvc_tree);
+	srvc_tree = NULL;
+	node_free_list(retired);
+	retired = NULL;
+	while ((dead = retired_methods) != NULL) {
+		retired_methods = dead->next;
+		bbusd_method_put(dead->mthd);
+		bbus_free(dead);
+	}
+	for (i = 0; i < ROUTE_MAXPAGES; ++i) {
+		bbus_free(route_pages[i]);
+		route_pages[i] = NULL;
+	}
+	numroutes = 0;
+	freeroute = ROUTE_NONE;
+}
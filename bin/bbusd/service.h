@@ -17,38 +17,156 @@
 
 #include "common.h"
 #include "clientlist.h"
+#include "stats.h"
 
 #define BBUSD_METHOD_LOCAL	0x01
 #define BBUSD_METHOD_REMOTE	0x02
-#define BBUSD_METHOD_SIGNAL	0x03
 
+/*
+ * Local and remote methods all start with the type, the reference count
+ * and the stats. Local methods are static and never counted.
+ */
 struct bbusd_method
 {
 	int type;
+	unsigned refs;
+	unsigned route;		/* 0 until a caller resolves the method. */
+	struct bbusd_method_stats stats;
 	char data[0];
 };
 
 struct bbusd_local_method
 {
 	int type;
+	unsigned refs;
+	unsigned route;
+	struct bbusd_method_stats stats;
 	bbus_method_func func;
+	/* Plugin methods run on the worker pool unless they're inline. */
+	int offload;
+};
+
+/* Maximum number of services registering the same method. */
+#define BBUSD_MAXPROVIDERS	16
+
+/*
+ * Slots are claimed and released by any shard, so every field is only
+ * ever accessed atomically.
+ */
+struct bbusd_provider
+{
+	/* Token of the service, also tells which shard owns it. */
+	unsigned srvctok;	/* 0 if the slot is free. */
+	unsigned inflight;	/* Calls passed on, but not answered yet. */
 };
 
 struct bbusd_remote_method
 {
 	int type;
-	struct bbusd_clientlist_elem* srvc;
+	unsigned refs;		/* Starts at 1 - held by the tree. */
+	unsigned route;
+	struct bbusd_method_stats stats;
+	char* path;		/* Full path, passed to bridges. */
+	char* name;		/* Last component of the path. */
+	/* Rotates the choice between equally loaded providers. */
+	unsigned next;
+	/* Milliseconds replies may be cached for, 0 if they can't. */
+	unsigned cachettl;
+	/* Bumped to invalidate the cached replies, accessed atomically. */
+	unsigned cachegen;
+	struct bbusd_provider providers[BBUSD_MAXPROVIDERS];
 };
 
-struct bbusd_signal
+enum bbusd_balance
 {
-	int type;
-	struct bbusd_clientlist handlers;
+	BBUSD_BALANCE_LEAST = 0,	/* Fewest calls in flight. */
+	BBUSD_BALANCE_RR,		/* Round-robin. */
+};
+
+/* Paths of the methods a service provides. */
+struct bbusd_provided
+{
+	unsigned num;
+	unsigned max;
+	char** paths;
 };
 
 int bbusd_insert_method(const char* path, struct bbusd_method* mthd);
+/*
+ * Remote methods found in the tree are freed once they're removed and
+ * the last call in flight is done with them. Calls take a reference.
+ */
+void bbusd_method_get(struct bbusd_method* mthd);
+void bbusd_method_put(struct bbusd_method* mthd);
+/*
+ * Makes the service a provider of the remote method, inserting the
+ * method if it's not there yet. The path is added to 'provided'.
+ */
+int bbusd_insert_provider(struct bbusd_provided* provided,
+				const char* path, unsigned srvctok);
+/*
+ * Same as above for a number of methods, inserted in a single update.
+ * Either all of them are inserted or none. Methods inserted take their
+ * reply cache ttl from 'ttls', which can be NULL if none is cacheable -
+ * later providers don't change it.
+ */
+int bbusd_insert_providers(struct bbusd_provided* provided,
+		const char* const* paths, const unsigned* ttls,
+		unsigned num, unsigned srvctok);
+/*
+ * Removes the service from the method or, if 'path' is NULL, from every
+ * method it provides. Methods left without providers are removed from
+ * the tree together with the subservices left empty.
+ */
+int bbusd_remove_provider(struct bbusd_provided* provided,
+				const char* path, unsigned srvctok);
+void bbusd_free_provided(struct bbusd_provided* provided);
+void bbusd_set_balance(enum bbusd_balance policy);
+/*
+ * Chooses the provider the next call to 'mthd' goes to and accounts
+ * the call as in flight. Stores the provider's token in 'srvctok'.
+ * Returns NULL if the method has no providers left.
+ */
+struct bbusd_provider* bbusd_pick_provider(struct bbusd_remote_method* mthd,
+						unsigned* srvctok);
+/* The call picked for the provider was answered or failed. */
+void bbusd_provider_done(struct bbusd_provider* prov, unsigned srvctok);
+void bbusd_drop_provider(struct bbusd_remote_method* mthd, unsigned srvctok);
 struct bbusd_method* bbusd_locate_method(const char* path);
-void bbusd_init_service_map(void);
+/*
+ * Returns the route id of a method found at 'path', assigning one if it
+ * has none yet. Returns 0 if the method has been removed meanwhile.
+ */
+unsigned bbusd_method_route(struct bbusd_method* mthd, const char* path);
+/* Same rules as for bbusd_locate_method() apply. */
+struct bbusd_method* bbusd_locate_route(unsigned route);
+/* Same as above, but 'path' doesn't need to be null-terminated. */
+struct bbusd_method* bbusd_locate_methodn(const char* path, size_t len);
+/*
+ * Must be called periodically by every shard at a point where it doesn't
+ * use any data returned by bbusd_locate_method() other than the methods.
+ */
+void bbusd_quiesce_service_map(void);
+/*
+ * Tells the writers not to wait for this shard until its next call to
+ * bbusd_quiesce_service_map(). Used before blocking in bbus_poll().
+ */
+void bbusd_offline_service_map(void);
+/*
+ * Calls 'func' for every method with the full path as the key. Same
+ * rules as for bbusd_locate_method() apply to the methods passed.
+ */
+int bbusd_foreach_method(bbus_hmap_iterfunc func, void* arg);
+/*
+ * Invalidates the cached replies of the method at 'path' and of all the
+ * methods below it. Same rules as for bbusd_locate_method() apply.
+ */
+void bbusd_invalidate_methods(const char* path);
+unsigned long bbusd_num_methods(void);
+/* Changes whenever methods are inserted or removed. */
+unsigned long bbusd_service_map_epoch(void);
+/* 0 means no hint on the number of methods to expect. */
+void bbusd_init_service_map(unsigned expmethods);
 void bbusd_free_service_map(void);
 
 #endif /* __BBUSD_SERVICE__ */
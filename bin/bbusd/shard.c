@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "shard.h"
+#include "common.h"
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Intrusive multi-producer, single-consumer queue. Producers only ever
+ * swap the head pointer, the consumer owns the tail.
+ */
+struct jobqueue
+{
+	struct bbusd_job* head;
+	struct bbusd_job* tail;
+	struct bbusd_job stub;
+};
+
+struct shard
+{
+	struct jobqueue queue;
+	bbus_pollset* pset;
+	unsigned long counters[BBUSD_NUMCOUNTERS];
+};
+
+static struct shard shards[BBUSD_MAXSHARDS];
+static unsigned numshards;
+static BBUS_THREAD_LOCAL unsigned self;
+static BBUS_THREAD_LOCAL unsigned curtok;
+
+static void queue_init(struct jobqueue* q)
+{
+	memset(&q->stub, 0, sizeof(struct bbusd_job));
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static void queue_push(struct jobqueue* q, struct bbusd_job* job)
+{
+	struct bbusd_job* prev;
+
+	__atomic_store_n(&job->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, job, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, job, __ATOMIC_RELEASE);
+}
+
+static struct bbusd_job* queue_pop(struct jobqueue* q)
+{
+	struct bbusd_job* tail;
+	struct bbusd_job* next;
+
+	tail = q->tail;
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	/*
+	 * A producer is in the middle of pushing a job - it will wake us
+	 * up again once it's done.
+	 */
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	queue_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+void bbusd_shards_init(unsigned num)
+{
+	unsigned i;
+
+	if ((num == 0) || (num > BBUSD_MAXSHARDS))
+		bbusd_die("Invalid number of threads: %u\n", num);
+
+	for (i = 0; i < num; ++i) {
+		queue_init(&shards[i].queue);
+		memset(shards[i].counters, 0, sizeof(shards[i].counters));
+		shards[i].pset = bbus_pollset_make();
+		if (shards[i].pset == NULL) {
+			bbusd_die("Error creating the poll_set: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		}
+	}
+
+	numshards = num;
+}
+
+void bbusd_shards_free(void)
+{
+	struct bbusd_job* job;
+	unsigned i;
+
+	for (i = 0; i < numshards; ++i) {
+		self = i;
+		while ((job = bbusd_shard_pop()) != NULL)
+			bbusd_job_free(job);
+		bbus_pollset_free(shards[i].pset);
+	}
+
+	self = 0;
+	numshards = 0;
+}
+
+unsigned bbusd_numshards(void)
+{
+	return numshards;
+}
+
+void bbusd_shard_setself(unsigned shard)
+{
+	self = shard;
+}
+
+unsigned bbusd_shard_self(void)
+{
+	return self;
+}
+
+bbus_pollset* bbusd_shard_pollset(unsigned shard)
+{
+	return shards[shard].pset;
+}
+
+unsigned bbusd_make_token(void)
+{
+	if (curtok == BBUSD_TOKEN_MASK)
+		curtok = 0;
+
+	return (self << BBUSD_SHARD_SHIFT) | ++curtok;
+}
+
+unsigned bbusd_token_shard(unsigned token)
+{
+	return token >> BBUSD_SHARD_SHIFT;
+}
+
+struct bbusd_job* bbusd_job_new(enum bbusd_job_type type, const char* meta,
+					const void* obj, size_t objsize)
+{
+	struct bbusd_job* job;
+	size_t metasize;
+
+	metasize = meta == NULL ? 0 : strlen(meta) + 1;
+	job = bbus_malloc0(sizeof(struct bbusd_job) + metasize + objsize);
+	if (job == NULL)
+		return NULL;
+
+	job->type = type;
+	job->fd = -1;
+	job->datasize = metasize + objsize;
+	if (meta != NULL) {
+		memcpy(job->data, meta, metasize);
+		job->meta = job->data;
+	}
+	if (obj != NULL)
+		memcpy(job->data + metasize, obj, objsize);
+
+	return job;
+}
+
+void bbusd_job_free(struct bbusd_job* job)
+{
+	if (job->fd >= 0)
+		close(job->fd);
+	if (job->cli != NULL) {
+		bbus_client_close(job->cli);
+		bbus_client_free(job->cli);
+	}
+	bbus_free(job);
+}
+
+const void* bbusd_job_obj(struct bbusd_job* job, size_t* size)
+{
+	size_t metasize;
+
+	metasize = job->meta == NULL ? 0 : strlen(job->meta) + 1;
+	*size = job->datasize - metasize;
+
+	return job->data + metasize;
+}
+
+void bbusd_shard_push(unsigned shard, struct bbusd_job* job)
+{
+	(void)__atomic_fetch_add(&shards[shard].counters[BBUSD_CNT_JOBS],
+						1, __ATOMIC_RELAXED);
+	queue_push(&shards[shard].queue, job);
+	(void)bbus_pollset_wakeup(shards[shard].pset);
+}
+
+struct bbusd_job* bbusd_shard_pop(void)
+{
+	struct bbusd_job* job;
+
+	job = queue_pop(&shards[self].queue);
+	if (job != NULL)
+		bbusd_count(BBUSD_CNT_JOBS, -1);
+
+	return job;
+}
+
+void bbusd_count(enum bbusd_counter cnt, long delta)
+{
+	(void)__atomic_fetch_add(&shards[self].counters[cnt],
+						delta, __ATOMIC_RELAXED);
+}
+
+unsigned long bbusd_counter_get(enum bbusd_counter cnt)
+{
+	unsigned long sum = 0;
+	unsigned i;
+
+	for (i = 0; i < numshards; ++i) {
+		sum += __atomic_load_n(&shards[i].counters[cnt],
+						__ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_SHARD__
+#define __BBUSD_SHARD__
+
+#include <busybus.h>
+#include "stats.h"
+
+/*
+ * In threaded mode every reactor thread is a shard owning a subset of
+ * client connections. Everything related to a client - its pollset, the
+ * message buffer as well as caller and pending call maps - is only ever
+ * touched by the owning shard. Work concerning a client owned by another
+ * shard is handed off as a job through that shard's lock-free queue.
+ */
+
+#define BBUSD_MAXSHARDS		64
+
+struct bbusd_method;
+struct bbusd_provider;
+
+/*
+ * Tokens encode the shard owning the client or the pending call in their
+ * upper bits.
+ */
+#define BBUSD_SHARD_SHIFT	26
+#define BBUSD_TOKEN_MASK	((1U << BBUSD_SHARD_SHIFT) - 1)
+
+enum bbusd_job_type
+{
+	BBUSD_JOB_NEWCLI = 1,	/* Adopt a newly accepted client. */
+	BBUSD_JOB_SRVCALL,	/* Pass a call on to a local service. */
+	BBUSD_JOB_CLIREPLY,	/* Pass a reply on to a local caller. */
+	BBUSD_JOB_MON,		/* Send a notification to monitors. */
+	BBUSD_JOB_SIGNAL,	/* Deliver a signal to local subscribers. */
+	BBUSD_JOB_PLUGINCALL,	/* Run by the plugin worker pool. */
+};
+
+struct bbusd_job
+{
+	struct bbusd_job* next;
+	enum bbusd_job_type type;
+	bbus_client* cli;	/* BBUSD_JOB_NEWCLI */
+	unsigned target;	/* Token of the receiving client. */
+	unsigned caller;	/* BBUSD_JOB_SRVCALL: token of the caller. */
+	unsigned callid;
+	uint8_t errcode;
+	/*
+	 * SRVCALL, CLIREPLY and PLUGINCALL: method called, NULL if the call
+	 * isn't accounted. The job owns the pending call's reference to it.
+	 */
+	struct bbusd_method* method;
+	uint64_t start;
+	uint64_t deadline;	/* SRVCALL: 0 if the call has no deadline. */
+	/* SRVCALL: provider picked for the call. */
+	struct bbusd_provider* provider;
+	int monsent;		/* BBUSD_JOB_MON: 1 if sent, 0 if received. */
+	int objflags;		/* BBUS_PROT_OBJFLAGS of the object. */
+	/* SRVCALL and CLIREPLY: see struct bbusd_pending_call. */
+	uint32_t cachehash;
+	unsigned cacheticket;
+	const char* meta;	/* Points into data, can be NULL. */
+	int fd;			/* Passed object descriptor or -1. */
+	size_t datasize;
+	char data[0];		/* Meta followed by the raw object. */
+};
+
+/* Statistics kept by every shard, see bbusd_count(). */
+enum bbusd_counter
+{
+	BBUSD_CNT_CALLERS = 0,
+	BBUSD_CNT_SERVICES,
+	BBUSD_CNT_MONITORS,
+	BBUSD_CNT_CONTROLLERS,
+	BBUSD_CNT_PENDING,	/* Calls waiting for the service's reply. */
+	BBUSD_CNT_JOBS,		/* Jobs queued, but not yet handled. */
+	BBUSD_CNT_CACHEHITS,	/* Calls answered from the reply cache. */
+	BBUSD_NUMCOUNTERS
+};
+
+void bbusd_shards_init(unsigned num);
+void bbusd_shards_free(void);
+unsigned bbusd_numshards(void);
+void bbusd_shard_setself(unsigned shard);
+unsigned bbusd_shard_self(void);
+bbus_pollset* bbusd_shard_pollset(unsigned shard);
+
+unsigned bbusd_make_token(void);
+unsigned bbusd_token_shard(unsigned token);
+
+/*
+ * Allocates a job with room for the meta string and 'objsize' bytes of
+ * data copied from 'obj'.
+ */
+struct bbusd_job* bbusd_job_new(enum bbusd_job_type type, const char* meta,
+					const void* obj, size_t objsize);
+void bbusd_job_free(struct bbusd_job* job);
+const void* bbusd_job_obj(struct bbusd_job* job, size_t* size);
+
+/* Can be called from any thread. */
+void bbusd_shard_push(unsigned shard, struct bbusd_job* job);
+/* Updates a counter of the calling shard. */
+void bbusd_count(enum bbusd_counter cnt, long delta);
+/* Sum of a counter over all shards, can be called from any thread. */
+unsigned long bbusd_counter_get(enum bbusd_counter cnt);
+/* Only called by the shard owning the queue. */
+struct bbusd_job* bbusd_shard_pop(void);
+
+#endif /* __BBUSD_SHARD__ */
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "signals.h"
+#include "common.h"
+#include "shard.h"
+#include "log.h"
+#include <string.h>
+
+/*
+ * Subscriptions are indexed by prefix, so finding the subscribers of a
+ * signal takes one hash probe per component of its path rather than a
+ * scan of all the clients: for 'bbus.foo.bar' these are 'bbus.foo.bar',
+ * 'bbus.foo' and 'bbus'.
+ */
+struct sig_subscriber
+{
+	bbus_client* cli;
+	/* Last delivery this subscriber got, used to skip duplicates. */
+	unsigned long stamp;
+	unsigned numprefixes;
+	char* prefixes[BBUSD_SIG_MAXPREFIXES];
+};
+
+struct sig_prefix
+{
+	unsigned numsubs;
+	unsigned maxsubs;
+	struct sig_subscriber** subs;
+};
+
+/* Keys are prefixes, values are pointers to struct sig_prefix. */
+static BBUS_THREAD_LOCAL bbus_hashmap* prefix_map;
+/* Keys are client tokens, values are pointers to struct sig_subscriber. */
+static BBUS_THREAD_LOCAL bbus_hashmap* subscriber_map;
+static BBUS_THREAD_LOCAL unsigned long curstamp;
+/* Lets the emitting shard skip shards with no subscribers at all. */
+static unsigned long numsubscribers[BBUSD_MAXSHARDS];
+static bbusd_sig_sendfunc sendfunc;
+
+void bbusd_init_signals(bbusd_sig_sendfunc send)
+{
+	sendfunc = send;
+	curstamp = 0;
+
+	prefix_map = bbus_hmap_create(BBUS_HMAP_KEYSTR);
+	subscriber_map = bbus_hmap_create(BBUS_HMAP_KEYUINT);
+	if ((prefix_map == NULL) || (subscriber_map == NULL)) {
+		bbusd_die("Error creating the signal subscription maps: %s\n",
+					bbus_strerror(bbus_lasterror()));
+	}
+}
+
+static int free_prefix(const void* key BBUS_UNUSED,
+		size_t keysize BBUS_UNUSED, void* val, void* arg BBUS_UNUSED)
+{
+	struct sig_prefix* pfx = val;
+
+	bbus_free(pfx->subs);
+	bbus_free(pfx);
+
+	return 0;
+}
+
+static int free_subscriber(const void* key BBUS_UNUSED,
+		size_t keysize BBUS_UNUSED, void* val, void* arg BBUS_UNUSED)
+{
+	struct sig_subscriber* sub = val;
+	unsigned i;
+
+	for (i = 0; i < sub->numprefixes; ++i)
+		bbus_str_free(sub->prefixes[i]);
+	bbus_free(sub);
+
+	return 0;
+}
+
+void bbusd_free_signals(void)
+{
+	(void)bbus_hmap_foreach(prefix_map, free_prefix, NULL);
+	(void)bbus_hmap_foreach(subscriber_map, free_subscriber, NULL);
+	bbus_hmap_free(prefix_map);
+	bbus_hmap_free(subscriber_map);
+	prefix_map = subscriber_map = NULL;
+	__atomic_store_n(&numsubscribers[bbusd_shard_self()], 0,
+						__ATOMIC_RELAXED);
+}
+
+static struct sig_subscriber* get_subscriber(bbus_client* cli)
+{
+	struct sig_subscriber* sub;
+	int ret;
+
+	sub = bbus_hmap_finduint(subscriber_map, bbus_client_gettoken(cli));
+	if (sub != NULL)
+		return sub;
+
+	sub = bbus_malloc0(sizeof(struct sig_subscriber));
+	if (sub == NULL)
+		return NULL;
+
+	sub->cli = cli;
+	ret = bbus_hmap_setuint(subscriber_map,
+				bbus_client_gettoken(cli), sub);
+	if (ret < 0) {
+		bbus_free(sub);
+		return NULL;
+	}
+	__atomic_add_fetch(&numsubscribers[bbusd_shard_self()], 1,
+						__ATOMIC_RELAXED);
+
+	return sub;
+}
+
+static void put_subscriber(struct sig_subscriber* sub)
+{
+	if (sub->numprefixes > 0)
+		return;
+
+	(void)bbus_hmap_rmuint(subscriber_map, bbus_client_gettoken(sub->cli));
+	bbus_free(sub);
+	__atomic_sub_fetch(&numsubscribers[bbusd_shard_self()], 1,
+						__ATOMIC_RELAXED);
+}
+
+static int add_to_prefix(const char* prefix, struct sig_subscriber* sub)
+{
+	struct sig_subscriber** newsubs;
+	struct sig_prefix* pfx;
+	unsigned newmax;
+	int ret;
+
+	pfx = bbus_hmap_findstr(prefix_map, prefix);
+	if (pfx == NULL) {
+		pfx = bbus_malloc0(sizeof(struct sig_prefix));
+		if (pfx == NULL)
+			return -1;
+
+		ret = bbus_hmap_setstr(prefix_map, prefix, pfx);
+		if (ret < 0) {
+			bbus_free(pfx);
+			return -1;
+		}
+	}
+
+	if (pfx->numsubs == pfx->maxsubs) {
+		newmax = pfx->maxsubs == 0 ? 4 : pfx->maxsubs * 2;
+		newsubs = bbus_realloc(pfx->subs,
+				newmax * sizeof(struct sig_subscriber*));
+		if (newsubs == NULL) {
+			if (pfx->numsubs == 0) {
+				(void)bbus_hmap_rmstr(prefix_map, prefix);
+				bbus_free(pfx);
+			}
+			return -1;
+		}
+		pfx->subs = newsubs;
+		pfx->maxsubs = newmax;
+	}
+
+	pfx->subs[pfx->numsubs++] = sub;
+
+	return 0;
+}
+
+/* Removes the subscriber's i-th prefix. */
+static void drop_prefix(struct sig_subscriber* sub, unsigned i)
+{
+	struct sig_prefix* pfx;
+	unsigned j;
+
+	pfx = bbus_hmap_findstr(prefix_map, sub->prefixes[i]);
+	if (pfx != NULL) {
+		for (j = 0; j < pfx->numsubs; ++j) {
+			if (pfx->subs[j] == sub) {
+				pfx->subs[j] = pfx->subs[--pfx->numsubs];
+				break;
+			}
+		}
+
+		if (pfx->numsubs == 0) {
+			(void)bbus_hmap_rmstr(prefix_map, sub->prefixes[i]);
+			bbus_free(pfx->subs);
+			bbus_free(pfx);
+		}
+	}
+
+	bbus_str_free(sub->prefixes[i]);
+	sub->prefixes[i] = sub->prefixes[--sub->numprefixes];
+}
+
+int bbusd_sig_subscribe(bbus_client* cli, const char* prefix)
+{
+	struct sig_subscriber* sub;
+	char* copy;
+	unsigned i;
+
+	sub = get_subscriber(cli);
+	if (sub == NULL)
+		return -1;
+
+	for (i = 0; i < sub->numprefixes; ++i) {
+		if (strcmp(sub->prefixes[i], prefix) == 0)
+			return 0;
+	}
+
+	if (sub->numprefixes == BBUSD_SIG_MAXPREFIXES) {
+		bbusd_logmsg(BBUSD_LOG_ERR,
+			"Client subscribed to too many prefixes.\n");
+		return -1;
+	}
+
+	copy = bbus_str_cpy(prefix);
+	if (copy == NULL)
+		goto err;
+
+	if (add_to_prefix(prefix, sub) < 0) {
+		bbus_str_free(copy);
+		goto err;
+	}
+	sub->prefixes[sub->numprefixes++] = copy;
+
+	return 0;
+
+err:
+	put_subscriber(sub);
+	return -1;
+}
+
+int bbusd_sig_unsubscribe(bbus_client* cli, const char* prefix)
+{
+	struct sig_subscriber* sub;
+	unsigned i;
+
+	sub = bbus_hmap_finduint(subscriber_map, bbus_client_gettoken(cli));
+	if (sub == NULL)
+		return 0;
+
+	for (i = 0; i < sub->numprefixes; ++i) {
+		if (strcmp(sub->prefixes[i], prefix) == 0) {
+			drop_prefix(sub, i);
+			break;
+		}
+	}
+	put_subscriber(sub);
+
+	return 0;
+}
+
+void bbusd_sig_rmclient(bbus_client* cli)
+{
+	struct sig_subscriber* sub;
+
+	sub = bbus_hmap_finduint(subscriber_map, bbus_client_gettoken(cli));
+	if (sub == NULL)
+		return;
+
+	while (sub->numprefixes > 0)
+		drop_prefix(sub, sub->numprefixes - 1);
+	put_subscriber(sub);
+}
+
+void bbusd_sig_deliver(const char* path, const void* obj,
+			size_t objsize, int objflags)
+{
+	struct sig_subscriber* sub;
+	struct sig_prefix* pfx;
+	struct bbus_msg_hdr hdr;
+	size_t len;
+	unsigned i;
+	int ret;
+
+	if (!bbusd_sig_shard_subscribed(bbusd_shard_self()))
+		return;
+
+	/* The same message goes to every subscriber. */
+	len = strlen(path);
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_SRVSIG, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, len + 1 + objsize);
+	hdr.flags |= objflags;
+
+	++curstamp;
+	for (;;) {
+		pfx = bbus_hmap_findstrn(prefix_map, path, len);
+		for (i = 0; (pfx != NULL) && (i < pfx->numsubs); ++i) {
+			sub = pfx->subs[i];
+			if (sub->stamp == curstamp)
+				continue;
+
+			sub->stamp = curstamp;
+			if (bbus_client_acceptsobj(sub->cli, objflags) < 0) {
+				bbusd_logmsg(BBUSD_LOG_DEBUG,
+					"Signal dropped for subscriber "
+					"'%s': %s\n",
+					bbus_client_getname(sub->cli),
+					bbus_strerror(bbus_lasterror()));
+				continue;
+			}
+
+			ret = sendfunc(sub->cli, &hdr, (char*)path,
+							obj, objsize);
+			if (ret < 0) {
+				bbusd_logmsg(BBUSD_LOG_DEBUG,
+					"Signal dropped for subscriber "
+					"'%s': %s\n",
+					bbus_client_getname(sub->cli),
+					bbus_strerror(bbus_lasterror()));
+			}
+		}
+
+		/* Strip the last path component. */
+		while ((len > 0) && (path[len - 1] != '.'))
+			--len;
+		if (len == 0)
+			break;
+		--len;
+	}
+}
+
+int bbusd_sig_shard_subscribed(unsigned shard)
+{
+	return __atomic_load_n(&numsubscribers[shard], __ATOMIC_RELAXED) > 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_SIGNALS__
+#define __BBUSD_SIGNALS__
+
+#include <busybus.h>
+
+/* Maximum number of prefixes a single client can subscribe to. */
+#define BBUSD_SIG_MAXPREFIXES	32
+
+/* Sends an already encoded signal to a single subscriber. */
+typedef int (*bbusd_sig_sendfunc)(bbus_client*, struct bbus_msg_hdr*,
+					char*, const void*, size_t);
+
+/*
+ * Subscriptions are per shard - every shard only ever delivers signals
+ * to the clients it owns.
+ */
+void bbusd_init_signals(bbusd_sig_sendfunc send);
+void bbusd_free_signals(void);
+
+/*
+ * Subscribes the client to every signal whose path is 'prefix' or
+ * starts with 'prefix' followed by a dot.
+ */
+int bbusd_sig_subscribe(bbus_client* cli, const char* prefix);
+int bbusd_sig_unsubscribe(bbus_client* cli, const char* prefix);
+/* Drops every subscription of a disconnecting client. */
+void bbusd_sig_rmclient(bbus_client* cli);
+/*
+ * Sends the signal to all the matching subscribers of this shard,
+ * each of them receiving it at most once. Subscribers whose queues are
+ * full miss the signal.
+ */
+void bbusd_sig_deliver(const char* path, const void* obj,
+			size_t objsize, int objflags);
+/* Can be called from any thread. */
+int bbusd_sig_shard_subscribed(unsigned shard);
+
+#endif /* __BBUSD_SIGNALS__ */
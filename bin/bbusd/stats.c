@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+#define SUBBUCKETS	(1U << BBUSD_STATS_SUBBITS)
+
+uint64_t bbusd_stats_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned bucket_index(uint64_t val)
+{
+	unsigned msb;
+	unsigned ind;
+
+	if (val < SUBBUCKETS)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+	ind = (msb - BBUSD_STATS_SUBBITS + 1) * SUBBUCKETS
+		+ ((val >> (msb - BBUSD_STATS_SUBBITS)) & (SUBBUCKETS - 1));
+
+	return BBUS_MIN(ind, (unsigned)BBUSD_STATS_NUMBUCKETS - 1);
+}
+
+/* Highest value falling into the bucket. */
+static uint64_t bucket_value(unsigned ind)
+{
+	unsigned shift;
+
+	if (ind < SUBBUCKETS)
+		return ind;
+
+	shift = ind / SUBBUCKETS - 1;
+	return (((uint64_t)(SUBBUCKETS + ind % SUBBUCKETS + 1)) << shift) - 1;
+}
+
+void bbusd_stats_record(struct bbusd_method_stats* stats,
+					uint64_t start, int failed)
+{
+	uint64_t lat;
+	uint64_t max;
+
+	lat = bbusd_stats_now() - start;
+
+	__atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+	if (failed)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->totalns, lat, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->buckets[bucket_index(lat)],
+						1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&stats->maxns, __ATOMIC_RELAXED);
+	while ((lat > max) && !__atomic_compare_exchange_n(&stats->maxns,
+				&max, lat, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+		;
+}
+
+static bbus_uint32 to_usec(uint64_t ns)
+{
+	return BBUS_MIN(ns / 1000, UINT32_MAX);
+}
+
+void bbusd_stats_summary(const struct bbusd_method_stats* stats,
+					bbus_uint32* summary)
+{
+	static const unsigned pcts[] = { 50, 90, 99 };
+	unsigned long buckets[BBUSD_STATS_NUMBUCKETS];
+	unsigned long calls = 0;
+	unsigned long seen;
+	uint64_t max;
+	unsigned i;
+	unsigned p;
+
+	memset(summary, 0, BBUSD_STATS_NUMSUMMARY * sizeof(bbus_uint32));
+
+	/* Count the calls from the snapshot to stay consistent with it. */
+	for (i = 0; i < BBUSD_STATS_NUMBUCKETS; ++i) {
+		buckets[i] = __atomic_load_n(&stats->buckets[i],
+						__ATOMIC_RELAXED);
+		calls += buckets[i];
+	}
+
+	summary[0] = calls;
+	summary[1] = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+	if (calls == 0)
+		return;
+
+	/* Buckets only give the upper bounds - never report more than max. */
+	max = __atomic_load_n(&stats->maxns, __ATOMIC_RELAXED);
+	summary[2] = to_usec(__atomic_load_n(&stats->totalns,
+					__ATOMIC_RELAXED) / calls);
+	for (i = 0, p = 0, seen = 0; (i < BBUSD_STATS_NUMBUCKETS)
+				&& (p < BBUS_ARRAY_SIZE(pcts)); ++i) {
+		seen += buckets[i];
+		while ((p < BBUS_ARRAY_SIZE(pcts))
+				&& (seen * 100 >= calls * pcts[p]))
+			summary[3 + p++] = to_usec(BBUS_MIN(bucket_value(i),
+								max));
+	}
+	summary[6] = to_usec(max);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_STATS__
+#define __BBUSD_STATS__
+
+#include <busybus.h>
+
+/*
+ * Per-method call statistics. Latencies are kept in a log-linear
+ * histogram: every power of two is split into 2^BBUSD_STATS_SUBBITS
+ * buckets, so the relative error stays below 1/2^BBUSD_STATS_SUBBITS
+ * whatever the magnitude. Counters are updated atomically by whichever
+ * shard sends the reply, nothing is ever allocated.
+ */
+#define BBUSD_STATS_SUBBITS	3
+#define BBUSD_STATS_NUMBUCKETS	256
+
+struct bbusd_method_stats
+{
+	unsigned long calls;
+	unsigned long errors;
+	uint64_t totalns;
+	uint64_t maxns;
+	unsigned long buckets[BBUSD_STATS_NUMBUCKETS];
+};
+
+/* Monotonic time in nanoseconds. */
+uint64_t bbusd_stats_now(void);
+/* Records a call started at 'start', as returned by bbusd_stats_now(). */
+void bbusd_stats_record(struct bbusd_method_stats* stats,
+					uint64_t start, int failed);
+/*
+ * Fills 'summary' with calls, errors, mean, p50, p90, p99 and max latency
+ * in microseconds in this order.
+ */
+#define BBUSD_STATS_NUMSUMMARY	7
+void bbusd_stats_summary(const struct bbusd_method_stats* stats,
+					bbus_uint32* summary);
+
+#endif /* __BBUSD_STATS__ */
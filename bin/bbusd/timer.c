@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "timer.h"
+#include "stats.h"
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+struct wheel
+{
+	struct bbus_list slots[BBUSD_TIMER_SLOTS];
+	/* Last tick processed by bbusd_timers_run(). */
+	uint64_t curtick;
+	unsigned numtimers;
+};
+
+static BBUS_THREAD_LOCAL struct wheel wheel;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint64_t tick_of(uint64_t ms)
+{
+	return ms / BBUSD_TIMER_TICKMS;
+}
+
+static struct bbus_list* slot_of(uint64_t tick)
+{
+	return &wheel.slots[tick % BBUSD_TIMER_SLOTS];
+}
+
+void bbusd_timer_init(struct bbusd_timer* timer,
+			bbusd_timer_func func, void* arg)
+{
+	memset(timer, 0, sizeof(struct bbusd_timer));
+	timer->func = func;
+	timer->arg = arg;
+}
+
+void bbusd_timer_arm(struct bbusd_timer* timer, unsigned ms)
+{
+	uint64_t now;
+
+	bbusd_timer_cancel(timer);
+
+	now = now_ms();
+	if (wheel.numtimers == 0)
+		wheel.curtick = tick_of(now);
+
+	timer->expires = now + ms;
+	bbus_list_push(slot_of(tick_of(timer->expires)), timer);
+	timer->armed = 1;
+	++wheel.numtimers;
+}
+
+void bbusd_timer_cancel(struct bbusd_timer* timer)
+{
+	if (!timer->armed)
+		return;
+
+	bbus_list_rm(slot_of(tick_of(timer->expires)), timer);
+	timer->armed = 0;
+	--wheel.numtimers;
+}
+
+int bbusd_timer_pending(const struct bbusd_timer* timer)
+{
+	return timer->armed;
+}
+
+int bbusd_timers_timeout(void)
+{
+	struct bbusd_timer* timer;
+	uint64_t nearest = UINT64_MAX;
+	uint64_t tick;
+	uint64_t now;
+	unsigned i;
+
+	if (wheel.numtimers == 0)
+		return -1;
+
+	/*
+	 * Slots are sorted by time within a single revolution of the wheel,
+	 * so the first slot holding a timer due in this revolution contains
+	 * the nearest deadline. Otherwise every timer is further away than
+	 * a whole revolution and all of them had to be looked at anyway.
+	 */
+	for (i = 0; i < BBUSD_TIMER_SLOTS; ++i) {
+		tick = wheel.curtick + i;
+		for (timer = (struct bbusd_timer*)slot_of(tick)->head;
+				timer != NULL; timer = timer->next) {
+			if (timer->expires < nearest)
+				nearest = timer->expires;
+		}
+
+		if (tick_of(nearest) <= tick)
+			break;
+	}
+
+	now = now_ms();
+	if (nearest <= now)
+		return 0;
+
+	return BBUS_MIN(nearest - now, (uint64_t)INT_MAX);
+}
+
+static struct bbusd_timer* first_expired(struct bbus_list* slot, uint64_t now)
+{
+	struct bbusd_timer* timer;
+
+	for (timer = (struct bbusd_timer*)slot->head;
+			timer != NULL; timer = timer->next) {
+		if (timer->expires <= now)
+			return timer;
+	}
+
+	return NULL;
+}
+
+void bbusd_timers_run(void)
+{
+	struct bbusd_timer* timer;
+	struct bbus_list* slot;
+	uint64_t nowtick;
+	uint64_t tick;
+	uint64_t now;
+	unsigned i;
+
+	now = now_ms();
+	nowtick = tick_of(now);
+
+	/* One revolution visits every slot, even after a long sleep. */
+	for (tick = wheel.curtick, i = 0; (tick <= nowtick)
+			&& (i < BBUSD_TIMER_SLOTS); ++tick, ++i) {
+		slot = slot_of(tick);
+		/*
+		 * Handlers are free to arm and cancel any timer, so look for
+		 * the next expired one only after the previous has been run.
+		 */
+		while ((timer = first_expired(slot, now)) != NULL) {
+			bbusd_timer_cancel(timer);
+			timer->func(timer->arg);
+		}
+	}
+
+	wheel.curtick = nowtick;
+}
+
+unsigned bbusd_deadline_left(uint64_t deadline)
+{
+	uint64_t now;
+
+	now = bbusd_stats_now();
+	if (now >= deadline)
+		return 0;
+
+	return BBUS_MIN((deadline - now + 999999) / 1000000,
+						(uint64_t)UINT_MAX);
+}
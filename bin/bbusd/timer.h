@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_TIMER__
+#define __BBUSD_TIMER__
+
+#include <busybus.h>
+#include <stdint.h>
+
+/*
+ * Per-shard hashed timer wheel. Timers belong to the reactor thread which
+ * armed them and must only be armed, cancelled and run on that thread.
+ * The poll loop sleeps until the nearest deadline instead of waking up
+ * periodically.
+ */
+
+#define BBUSD_TIMER_TICKMS	4
+#define BBUSD_TIMER_SLOTS	256
+
+typedef void (*bbusd_timer_func)(void*);
+
+struct bbusd_timer
+{
+	struct bbusd_timer* next;
+	struct bbusd_timer* prev;
+	uint64_t expires;
+	bbusd_timer_func func;
+	void* arg;
+	int armed;
+};
+
+void bbusd_timer_init(struct bbusd_timer* timer,
+			bbusd_timer_func func, void* arg);
+/* Re-arms the timer if it's already pending. */
+void bbusd_timer_arm(struct bbusd_timer* timer, unsigned ms);
+void bbusd_timer_cancel(struct bbusd_timer* timer);
+int bbusd_timer_pending(const struct bbusd_timer* timer);
+/* Milliseconds until the nearest deadline or -1 if no timer is armed. */
+int bbusd_timers_timeout(void);
+/* Calls the handlers of all expired timers. */
+void bbusd_timers_run(void);
+/*
+ * Milliseconds left until a deadline given in bbusd_stats_now() time,
+ * rounded up. Returns 0 if it has already passed.
+ */
+unsigned bbusd_deadline_left(uint64_t deadline);
+
+#endif /* __BBUSD_TIMER__ */
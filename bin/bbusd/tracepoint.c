@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "tracepoint.h"
+#include "shard.h"
+#include "stats.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Only the newest records are dumped if they'd not fit in one reply. */
+#define TP_MAXDUMP	(BBUS_MAXLARGEPLOADSIZE / 48)
+
+struct ring
+{
+	struct bbusd_tp_record* recs;
+	/* Only ever incremented by the owning shard. */
+	unsigned long head;
+};
+
+int bbusd_tp_enabled;
+static struct ring rings[BBUSD_MAXSHARDS];
+static unsigned numrings;
+static unsigned long ringsize;
+
+static const char* const evnames[BBUSD_TP_NUMEVENTS] = {
+	"accept",
+	"recv",
+	"route",
+	"forward",
+	"reply",
+	"monitor",
+};
+
+void bbusd_tp_init(unsigned numshards, unsigned entries)
+{
+	unsigned i;
+
+	ringsize = 1;
+	while (ringsize < entries)
+		ringsize <<= 1;
+
+	for (i = 0; i < numshards; ++i) {
+		rings[i].recs = bbus_malloc0(ringsize
+					* sizeof(struct bbusd_tp_record));
+		if (rings[i].recs == NULL)
+			bbusd_die("Error allocating the tracepoint buffers\n");
+	}
+	numrings = numshards;
+}
+
+void bbusd_tp_free(void)
+{
+	unsigned i;
+
+	for (i = 0; i < numrings; ++i) {
+		bbus_free(rings[i].recs);
+		rings[i].recs = NULL;
+	}
+	numrings = 0;
+}
+
+int bbusd_tp_getenabled(void)
+{
+	return __atomic_load_n(&bbusd_tp_enabled, __ATOMIC_RELAXED);
+}
+
+void bbusd_tp_setenabled(int enabled)
+{
+	__atomic_store_n(&bbusd_tp_enabled, !!enabled, __ATOMIC_RELAXED);
+}
+
+void bbusd_tp_record(enum bbusd_tp_event event, uint32_t arg0,
+					uint32_t arg1, uint32_t arg2)
+{
+	struct bbusd_tp_record* rec;
+	struct ring* ring;
+	unsigned long head;
+	unsigned shard;
+
+	shard = bbusd_shard_self();
+	if (shard >= numrings)
+		return;
+
+	ring = &rings[shard];
+	head = ring->head;
+	rec = &ring->recs[head & (ringsize - 1)];
+	rec->time = bbusd_stats_now();
+	rec->event = event;
+	rec->shard = shard;
+	rec->args[0] = arg0;
+	rec->args[1] = arg1;
+	rec->args[2] = arg2;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies out the records of a ring that may be written to concurrently.
+ * Whatever got overwritten during the copy is dropped.
+ */
+static size_t snapshot_ring(struct ring* ring, struct bbusd_tp_record* buf)
+{
+	unsigned long first;
+	unsigned long head;
+	unsigned long i;
+	size_t num = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	first = head > ringsize ? head - ringsize : 0;
+	for (i = first; i < head; ++i)
+		buf[num++] = ring->recs[i & (ringsize - 1)];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	/* The slot of the record being written now is not to be trusted. */
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+	if (head > first + ringsize) {
+		i = head - first - ringsize;
+		if (i > num)
+			i = num;
+		memmove(buf, buf + i, (num - i)
+				* sizeof(struct bbusd_tp_record));
+		num -= i;
+	}
+
+	return num;
+}
+
+static int cmp_records(const void* p1, const void* p2)
+{
+	const struct bbusd_tp_record* r1 = p1;
+	const struct bbusd_tp_record* r2 = p2;
+
+	if (r1->time != r2->time)
+		return r1->time < r2->time ? -1 : 1;
+	return (int)r1->shard - (int)r2->shard;
+}
+
+bbus_object* bbusd_tp_dump(void)
+{
+	struct bbusd_tp_record* recs;
+	struct bbusd_tp_record* rec;
+	bbus_object* ret = NULL;
+	size_t num = 0;
+	size_t first;
+	size_t i;
+
+	recs = bbus_malloc(numrings * ringsize
+				* sizeof(struct bbusd_tp_record) + 1);
+	if (recs == NULL)
+		return NULL;
+
+	for (i = 0; i < numrings; ++i)
+		num += snapshot_ring(&rings[i], recs + num);
+
+	qsort(recs, num, sizeof(struct bbusd_tp_record), cmp_records);
+	first = num > TP_MAXDUMP ? num - TP_MAXDUMP : 0;
+
+	ret = bbus_obj_alloc();
+	if ((ret == NULL) || (bbus_obj_insarray(ret, num - first) < 0))
+		goto err;
+
+	for (i = first; i < num; ++i) {
+		rec = &recs[i];
+		if ((bbus_obj_insuint(ret, rec->time / 1000000000ULL) < 0)
+			|| (bbus_obj_insuint(ret, rec->time % 1000000000ULL) < 0)
+			|| (bbus_obj_insuint(ret, rec->shard) < 0)
+			|| (bbus_obj_insstr(ret, evnames[rec->event]) < 0)
+			|| (bbus_obj_insuint(ret, rec->args[0]) < 0)
+			|| (bbus_obj_insuint(ret, rec->args[1]) < 0)
+			|| (bbus_obj_insuint(ret, rec->args[2]) < 0))
+			goto err;
+	}
+
+	bbus_free(recs);
+	return ret;
+
+err:
+	bbus_obj_free(ret);
+	bbus_free(recs);
+	return NULL;
+}
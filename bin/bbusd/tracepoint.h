@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUSD_TRACEPOINT__
+#define __BBUSD_TRACEPOINT__
+
+#include <busybus.h>
+
+/*
+ * Tracepoints on the message path. Each one stores a fixed size record in
+ * a ring buffer owned by the shard that hit it - there's no locking and
+ * nothing is allocated, the oldest records are simply overwritten.
+ * Recording is off by default and costs a single relaxed load until
+ * enabled. Building with BBUSD_NO_TRACEPOINTS removes them altogether,
+ * with BBUSD_USDT every tracepoint is also a USDT probe in the 'bbusd'
+ * provider for bpftrace and friends.
+ */
+
+#define BBUSD_TP_DEFENTRIES	4096
+
+enum bbusd_tp_event
+{
+	BBUSD_TP_ACCEPT = 0,	/* client type, token, busy-polling */
+	BBUSD_TP_RECV,		/* message type, token, payload size */
+	BBUSD_TP_ROUTE,		/* caller token, call id, service token */
+	BBUSD_TP_FORWARD,	/* service token, call token, object size */
+	BBUSD_TP_REPLY,		/* caller token, call id, error code */
+	BBUSD_TP_MONITOR,	/* message type, sent, monitors notified */
+	BBUSD_TP_NUMEVENTS,
+};
+
+struct bbusd_tp_record
+{
+	uint64_t time;
+	uint16_t event;
+	uint16_t shard;
+	uint32_t args[3];
+};
+
+/* Whether recording is enabled, only read through BBUSD_TP(). */
+extern int bbusd_tp_enabled;
+
+/*
+ * Allocates a ring of 'entries' records, rounded up to a power of two,
+ * for each shard. Must be called before the reactor threads start.
+ */
+void bbusd_tp_init(unsigned numshards, unsigned entries);
+void bbusd_tp_free(void);
+int bbusd_tp_getenabled(void);
+void bbusd_tp_setenabled(int enabled);
+void bbusd_tp_record(enum bbusd_tp_event event, uint32_t arg0,
+					uint32_t arg1, uint32_t arg2);
+/*
+ * Returns the records of all shards sorted by time as an array of
+ * (seconds, nanoseconds, shard, event name, three arguments).
+ */
+bbus_object* bbusd_tp_dump(void);
+
+#ifdef BBUSD_USDT
+#include <sys/sdt.h>
+#define BBUSD_TP_PROBE(EV, A0, A1, A2) DTRACE_PROBE3(bbusd, EV, A0, A1, A2)
+#else /* BBUSD_USDT */
+#define BBUSD_TP_PROBE(EV, A0, A1, A2) do {} while (0)
+#endif /* BBUSD_USDT */
+
+#ifdef BBUSD_NO_TRACEPOINTS
+#define BBUSD_TP(EV, A0, A1, A2) do {} while (0)
+#else /* BBUSD_NO_TRACEPOINTS */
+#define BBUSD_TP(EV, A0, A1, A2)					\
+	do {								\
+		BBUSD_TP_PROBE(EV, A0, A1, A2);				\
+		if (BBUS_UNLIKELY(__atomic_load_n(&bbusd_tp_enabled,	\
+						__ATOMIC_RELAXED)))	\
+			bbusd_tp_record(BBUSD_TP_##EV, (uint32_t)(A0),	\
+					(uint32_t)(A1), (uint32_t)(A2));\
+	} while (0)
+#endif /* BBUSD_NO_TRACEPOINTS */
+
+#endif /* __BBUSD_TRACEPOINT__ */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Example bbusd plugin keeping named counters in bbusd itself:
+ *
+ *   bbus.counter.incr	s -> u	bumps the counter, creating it if needed
+ *   bbus.counter.get	s -> u	current value, 0 for unknown counters
+ *
+ * Both are tiny and never block, so they run inline.
+ */
+
+#include <busybus-plugin.h>
+#include <pthread.h>
+#include <string.h>
+
+#define MAXCOUNTERS	64
+
+struct counter
+{
+	char name[BBUS_CLIENT_MAXNAMESIZE];
+	unsigned value;
+};
+
+static struct counter counters[MAXCOUNTERS];
+static unsigned numcounters;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct counter* find_counter(const char* name, int create)
+{
+	unsigned i;
+
+	for (i = 0; i < numcounters; ++i) {
+		if (strcmp(counters[i].name, name) == 0)
+			return &counters[i];
+	}
+
+	if (!create || (numcounters == MAXCOUNTERS)
+			|| (strlen(name) >= BBUS_CLIENT_MAXNAMESIZE))
+		return NULL;
+
+	strcpy(counters[numcounters].name, name);
+	return &counters[numcounters++];
+}
+
+static bbus_object* update(bbus_object* arg, int incr)
+{
+	struct counter* cnt;
+	unsigned value = 0;
+	char* name;
+
+	if (bbus_obj_parse(arg, "s", &name) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&lock);
+	cnt = find_counter(name, incr);
+	if (cnt != NULL) {
+		if (incr)
+			++cnt->value;
+		value = cnt->value;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (incr && (cnt == NULL))
+		return NULL;
+
+	return bbus_obj_build("u", value);
+}
+
+static bbus_object* counter_incr(bbus_object* arg)
+{
+	return update(arg, 1);
+}
+
+static bbus_object* counter_get(bbus_object* arg)
+{
+	return update(arg, 0);
+}
+
+static int counter_init(bbusd_plugin_regfunc regfunc)
+{
+	if (regfunc("incr", counter_incr, BBUSD_PLUGIN_INLINE) < 0)
+		return -1;
+	if (regfunc("get", counter_get, BBUSD_PLUGIN_INLINE) < 0)
+		return -1;
+
+	return 0;
+}
+
+BBUSD_PLUGIN_DEFINE("counter", counter_init, NULL);
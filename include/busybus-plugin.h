@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file busybus-plugin.h
+ * @brief Interface of the plugins bbusd loads with --plugin.
+ *
+ * Plugins are shared objects providing local methods - called by bbusd
+ * itself without passing the call on to a separate service process. Every
+ * plugin exports a single struct bbusd_plugin named BBUSD_PLUGIN_SYMBOL,
+ * most easily defined with BBUSD_PLUGIN_DEFINE(). Methods are registered
+ * from the init function and live under the plugin's own subtree:
+ * "bbus.<name>.<method>".
+ *
+ * Method functions may be called from several threads at once and must
+ * be reentrant.
+ */
+
+#ifndef __BUSYBUS_PLUGIN__
+#define __BUSYBUS_PLUGIN__
+
+#include <busybus.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Version of the plugin interface this header describes.
+ */
+#define BBUSD_PLUGIN_VERSION	1
+
+/**
+ * @brief Name of the symbol bbusd looks up in every plugin.
+ */
+#define BBUSD_PLUGIN_SYMBOL	"bbusd_plugin"
+
+/**
+ * @brief Run the method on the thread routing the call.
+ *
+ * By default plugin methods run on bbusd's worker pool, so that a slow
+ * method can't stall routing. Tiny methods which never block can skip the
+ * hand-off to the pool and its latency.
+ */
+#define BBUSD_PLUGIN_INLINE	(1 << 0)
+
+/**
+ * @brief Registers a method under the plugin's subtree.
+ * @param name Last component of the method's path.
+ * @param func Function called for every call of the method.
+ * @param flags Zero or BBUSD_PLUGIN_INLINE.
+ * @return 0 on success, -1 if the method can't be registered.
+ */
+typedef int (*bbusd_plugin_regfunc)(const char* name,
+					bbus_method_func func, int flags);
+
+/**
+ * @brief Describes a plugin.
+ */
+struct bbusd_plugin
+{
+	unsigned version;	/**< Must be BBUSD_PLUGIN_VERSION. */
+	const char* name;	/**< Subtree of the methods: bbus.<name>. */
+	/** Registers the methods, returns 0 on success and -1 on error. */
+	int (*init)(bbusd_plugin_regfunc regfunc);
+	/** Called when bbusd exits, can be NULL. */
+	void (*exit)(void);
+};
+
+/**
+ * @brief Defines the plugin description exported to bbusd.
+ * @param NAME Name of the plugin's subtree.
+ * @param INIT Init function.
+ * @param EXIT Exit function or NULL.
+ */
+#define BBUSD_PLUGIN_DEFINE(NAME, INIT, EXIT)				\
+	BBUS_PUBLIC const struct bbusd_plugin bbusd_plugin = {		\
+		.version = BBUSD_PLUGIN_VERSION,			\
+		.name = NAME,						\
+		.init = INIT,						\
+		.exit = EXIT,						\
+	}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* __BUSYBUS_PLUGIN__ */
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file busybus-stub.h
+ * @brief Typed stubs generated from a service description.
+ *
+ * Calls marshalled with bbus_obj_build() and bbus_obj_parse() have their
+ * descriptions interpreted on every call. This header is a template
+ * which, included after a service description, expands to plain C
+ * structures for the arguments and return values of every method of the
+ * service, straight-line functions converting them to and from busybus
+ * objects, typed client stubs and, if BBUS_STUB_SERVER is defined,
+ * method skeletons ready to be registered.
+ *
+ * A description defines the following macros before including the
+ * header:
+ *
+ * @code
+ * #define BBUS_STUB_PREFIX	echod
+ * #define BBUS_STUB_SERVICE	"echod"
+ * #define BBUS_STUB_METHODS(METHOD)					\
+ * 	METHOD(echo, echo_args, echo_ret)
+ * #define echo_args(FIELD)	FIELD(STR, msg)
+ * #define echo_ret(FIELD)	FIELD(STR, msg)
+ * #include <busybus-stub.h>
+ * @endcode
+ *
+ * BBUS_STUB_PREFIX prefixes every generated symbol, BBUS_STUB_SERVICE is
+ * the name the service connects with. BBUS_STUB_METHODS lists the methods
+ * with the names of macros listing their argument and return fields.
+ * Field types are INT, UINT, BYTE and STR - strings point into the
+ * object they have been decoded from. For every METHOD(name, ...) the
+ * following is defined, where N stands for PREFIX_name:
+ *
+ * <ul>
+ * <li>struct N_args and struct N_ret,</li>
+ * <li>int N_encargs(bbus_object*, const struct N_args*) and
+ * int N_decargs(bbus_object*, struct N_args*), same for N_ret,</li>
+ * <li>bbus_object* N_call(bbus_client_connection*, const struct N_args*,
+ * struct N_ret*) which returns the reply object the decoded return value
+ * points into and which must be freed by the caller.</li>
+ * </ul>
+ *
+ * With BBUS_STUB_SERVER the service implements
+ * int N_impl(const struct N_args*, struct N_ret*), returning 0 on success
+ * or -1 on error, and registers all methods at once using
+ * int PREFIX_register(bbus_service_connection*).
+ *
+ * The header can be included any number of times, every description
+ * macro listed above is undefined at the end of it.
+ */
+
+#include <busybus.h>
+
+#ifndef __BUSYBUS_STUB__
+#define __BUSYBUS_STUB__
+
+#define __BBUS_STUB_CAT(A, B)		A##B
+#define __BBUS_STUB_XCAT(A, B)		__BBUS_STUB_CAT(A, B)
+#define __BBUS_STUB_NAME(METHOD, SUFFIX)				\
+	__BBUS_STUB_XCAT(BBUS_STUB_PREFIX,				\
+		__BBUS_STUB_CAT(_##METHOD, SUFFIX))
+#define __BBUS_STUB_STR(X)		#X
+
+#define __BBUS_STUB_CTYPE_INT		bbus_int32
+#define __BBUS_STUB_CTYPE_UINT		bbus_uint32
+#define __BBUS_STUB_CTYPE_BYTE		bbus_byte
+#define __BBUS_STUB_CTYPE_STR		const char*
+
+#define __BBUS_STUB_DSCR_INT		"i"
+#define __BBUS_STUB_DSCR_UINT		"u"
+#define __BBUS_STUB_DSCR_BYTE		"b"
+#define __BBUS_STUB_DSCR_STR		"s"
+
+#define __BBUS_STUB_SIZE_INT(VAL)	sizeof(bbus_int32)
+#define __BBUS_STUB_SIZE_UINT(VAL)	sizeof(bbus_uint32)
+#define __BBUS_STUB_SIZE_BYTE(VAL)	sizeof(bbus_byte)
+#define __BBUS_STUB_SIZE_STR(VAL)	(strlen(VAL) + 1)
+
+#define __BBUS_STUB_INS_INT(OBJ, VAL)	bbus_obj_insint(OBJ, VAL)
+#define __BBUS_STUB_INS_UINT(OBJ, VAL)	bbus_obj_insuint(OBJ, VAL)
+#define __BBUS_STUB_INS_BYTE(OBJ, VAL)	bbus_obj_insbyte(OBJ, VAL)
+#define __BBUS_STUB_INS_STR(OBJ, VAL)	bbus_obj_insstr(OBJ, VAL)
+
+#define __BBUS_STUB_EXTR_INT(OBJ, PTR)	bbus_obj_extrint(OBJ, PTR)
+#define __BBUS_STUB_EXTR_UINT(OBJ, PTR)	bbus_obj_extruint(OBJ, PTR)
+#define __BBUS_STUB_EXTR_BYTE(OBJ, PTR)	bbus_obj_extrbyte(OBJ, PTR)
+#define __BBUS_STUB_EXTR_STR(OBJ, PTR)	bbus_obj_extrstr(OBJ, (char**)(PTR))
+
+#define __BBUS_STUB_FIELD_DECL(TYPE, NAME)				\
+	__BBUS_STUB_CTYPE_##TYPE NAME;
+#define __BBUS_STUB_FIELD_DSCR(TYPE, NAME)				\
+	__BBUS_STUB_DSCR_##TYPE
+#define __BBUS_STUB_FIELD_SIZE(TYPE, NAME)				\
+	+ __BBUS_STUB_SIZE_##TYPE(val->NAME)
+#define __BBUS_STUB_FIELD_ENC(TYPE, NAME)				\
+	if (__BBUS_STUB_INS_##TYPE(obj, val->NAME) < 0)			\
+		return -1;
+#define __BBUS_STUB_FIELD_DEC(TYPE, NAME)				\
+	if (__BBUS_STUB_EXTR_##TYPE(obj, &val->NAME) < 0) {		\
+		bbus_obj_rewind(obj);					\
+		return -1;						\
+	}
+
+/* Structure and conversion functions for a list of fields. */
+#define __BBUS_STUB_CODEC(METHOD, KIND, FIELDS)				\
+	struct __BBUS_STUB_NAME(METHOD, _##KIND)			\
+	{								\
+		FIELDS(__BBUS_STUB_FIELD_DECL)				\
+	};								\
+									\
+	static inline int __BBUS_STUB_NAME(METHOD, _enc##KIND)(		\
+			bbus_object* obj,				\
+			const struct __BBUS_STUB_NAME(METHOD, _##KIND)* val) \
+	{								\
+		(void)val;						\
+		if (bbus_obj_reserve(obj, 0				\
+				FIELDS(__BBUS_STUB_FIELD_SIZE)) < 0)	\
+			return -1;					\
+		FIELDS(__BBUS_STUB_FIELD_ENC)				\
+		return 0;						\
+	}								\
+									\
+	static inline int __BBUS_STUB_NAME(METHOD, _dec##KIND)(		\
+			bbus_object* obj,				\
+			struct __BBUS_STUB_NAME(METHOD, _##KIND)* val)	\
+	{								\
+		(void)val;						\
+		FIELDS(__BBUS_STUB_FIELD_DEC)				\
+		bbus_obj_rewind(obj);					\
+		return 0;						\
+	}
+
+#define __BBUS_STUB_CLIENT(METHOD, ARGS, RET)				\
+	__BBUS_STUB_CODEC(METHOD, args, ARGS)				\
+	__BBUS_STUB_CODEC(METHOD, ret, RET)				\
+									\
+	static inline bbus_object* __BBUS_STUB_NAME(METHOD, _call)(	\
+			bbus_client_connection* conn,			\
+			const struct __BBUS_STUB_NAME(METHOD, _args)* args, \
+			struct __BBUS_STUB_NAME(METHOD, _ret)* ret)	\
+	{								\
+		bbus_object* argobj;					\
+		bbus_object* retobj;					\
+									\
+		argobj = bbus_obj_alloc();				\
+		if (argobj == NULL)					\
+			return NULL;					\
+									\
+		if (__BBUS_STUB_NAME(METHOD, _encargs)(argobj, args) < 0) { \
+			bbus_obj_free(argobj);				\
+			return NULL;					\
+		}							\
+									\
+		retobj = bbus_callmethod(conn, "bbus." BBUS_STUB_SERVICE \
+				"." __BBUS_STUB_STR(METHOD), argobj);	\
+		bbus_obj_free(argobj);					\
+		if (retobj == NULL)					\
+			return NULL;					\
+									\
+		if (__BBUS_STUB_NAME(METHOD, _decret)(retobj, ret) < 0) { \
+			bbus_obj_free(retobj);				\
+			return NULL;					\
+		}							\
+									\
+		return retobj;						\
+	}
+
+#define __BBUS_STUB_SKELETON(METHOD, ARGS, RET)				\
+	int __BBUS_STUB_NAME(METHOD, _impl)(				\
+			const struct __BBUS_STUB_NAME(METHOD, _args)* args, \
+			struct __BBUS_STUB_NAME(METHOD, _ret)* ret);	\
+									\
+	static bbus_object* __BBUS_STUB_NAME(METHOD, _skel)(		\
+			bbus_object* arg)				\
+	{								\
+		struct __BBUS_STUB_NAME(METHOD, _args) args;		\
+		struct __BBUS_STUB_NAME(METHOD, _ret) ret;		\
+		bbus_object* retobj;					\
+									\
+		if ((__BBUS_STUB_NAME(METHOD, _decargs)(arg, &args) < 0) \
+				|| (__BBUS_STUB_NAME(METHOD, _impl)(	\
+						&args, &ret) < 0))	\
+			return NULL;					\
+									\
+		retobj = bbus_obj_alloc();				\
+		if (retobj == NULL)					\
+			return NULL;					\
+									\
+		if (__BBUS_STUB_NAME(METHOD, _encret)(retobj, &ret) < 0) { \
+			bbus_obj_free(retobj);				\
+			return NULL;					\
+		}							\
+									\
+		return retobj;						\
+	}
+
+#define __BBUS_STUB_METHOD_ENTRY(METHOD, ARGS, RET)			\
+	{								\
+		.name = __BBUS_STUB_STR(METHOD),			\
+		.argdscr = "" ARGS(__BBUS_STUB_FIELD_DSCR),		\
+		.retdscr = "" RET(__BBUS_STUB_FIELD_DSCR),		\
+		.func = __BBUS_STUB_NAME(METHOD, _skel),		\
+	},
+
+#endif /* __BUSYBUS_STUB__ */
+
+#if !defined(BBUS_STUB_PREFIX) || !defined(BBUS_STUB_SERVICE)		\
+					|| !defined(BBUS_STUB_METHODS)
+#error "BBUS_STUB_PREFIX, BBUS_STUB_SERVICE and BBUS_STUB_METHODS needed"
+#endif
+
+#include <string.h>
+
+BBUS_STUB_METHODS(__BBUS_STUB_CLIENT)
+
+#ifdef BBUS_STUB_SERVER
+
+BBUS_STUB_METHODS(__BBUS_STUB_SKELETON)
+
+static struct bbus_method __BBUS_STUB_XCAT(BBUS_STUB_PREFIX, _methods)[] = {
+	BBUS_STUB_METHODS(__BBUS_STUB_METHOD_ENTRY)
+};
+
+static inline int __BBUS_STUB_XCAT(BBUS_STUB_PREFIX, _register)(
+					bbus_service_connection* conn)
+{
+	return bbus_srvc_regmethods(conn,
+		__BBUS_STUB_XCAT(BBUS_STUB_PREFIX, _methods),
+		BBUS_ARRAY_SIZE(__BBUS_STUB_XCAT(BBUS_STUB_PREFIX, _methods)));
+}
+
+#undef BBUS_STUB_SERVER
+#endif /* BBUS_STUB_SERVER */
+
+#undef BBUS_STUB_METHODS
+#undef BBUS_STUB_SERVICE
+#undef BBUS_STUB_PREFIX
@@ -166,6 +166,98 @@ void bbus_free(void* ptr) BBUS_PUBLIC;
  */
 void* bbus_memdup(const void* src, size_t size) BBUS_PUBLIC;
 
+/**
+ * @brief Custom allocator used by bbus_malloc() and friends.
+ *
+ * Every function gets the 'priv' pointer as the last argument. The
+ * functions are never called with a zero size.
+ */
+struct bbus_allocator
+{
+	void* (*malloc)(size_t, void*);		/**< Allocates memory. */
+	void* (*realloc)(void*, size_t, void*);	/**< Resizes memory. */
+	void (*free)(void*, void*);		/**< Frees memory. */
+	void* priv;				/**< Allocator's data. */
+};
+
+/**
+ * @brief Makes the library allocate all memory with a custom allocator.
+ * @param alloc The allocator, NULL restores the standard one.
+ *
+ * Memory is always freed by the allocator it's been allocated with, so
+ * the allocator must be installed before calling any other busybus
+ * function and not changed while any busybus memory is still in use.
+ * The structure is not copied and must remain valid until replaced. The
+ * functions can be called from any thread - a per-thread arena has to
+ * pick the arena itself.
+ */
+void bbus_set_allocator(const struct bbus_allocator* alloc) BBUS_PUBLIC;
+
+/**
+ * @brief Allocation totals collected while accounting is enabled.
+ */
+struct bbus_alloc_stats
+{
+	unsigned long allocs;	/**< Allocations and reallocations. */
+	unsigned long frees;	/**< Calls to bbus_free(). */
+	unsigned long bytes;	/**< Bytes requested. */
+};
+
+/**
+ * @brief Allocations made from a single call site.
+ */
+struct bbus_alloc_site
+{
+	const void* addr;	/**< Return address of the allocation. */
+	unsigned long allocs;	/**< Allocations made. */
+	unsigned long bytes;	/**< Bytes requested. */
+};
+
+/**
+ * @brief Enables or disables allocation accounting.
+ * @param enabled 1 to enable, 0 to disable.
+ *
+ * While enabled, every allocation is counted in the totals and for the
+ * function that called bbus_malloc(), bbus_malloc0(), bbus_realloc() or
+ * bbus_memdup(). Counters are updated atomically and never reset. While
+ * disabled, each allocation costs a single extra load.
+ */
+void bbus_alloc_setaccounting(int enabled) BBUS_PUBLIC;
+
+/**
+ * @brief Tells whether allocation accounting is enabled.
+ * @return 1 if enabled, 0 otherwise.
+ */
+int bbus_alloc_getaccounting(void) BBUS_PUBLIC;
+
+/**
+ * @brief Retrieves the allocation totals.
+ * @param stats Place to store the totals.
+ */
+void bbus_alloc_getstats(struct bbus_alloc_stats* stats) BBUS_PUBLIC;
+
+/**
+ * @brief Retrieves the call sites that requested the most bytes.
+ * @param sites Buffer for the call sites.
+ * @param max Number of elements in 'sites'.
+ * @return Number of call sites stored.
+ *
+ * Call sites are sorted by the number of bytes requested, biggest first.
+ */
+size_t bbus_alloc_getsites(struct bbus_alloc_site* sites,
+					size_t max) BBUS_PUBLIC;
+
+/**
+ * @brief Describes a call site as a binary name and an offset.
+ * @param addr Address of the call site.
+ * @param buf Buffer for the description.
+ * @param size Size of the buffer.
+ *
+ * The offset can be turned into a function and line with addr2line.
+ */
+void bbus_alloc_sitename(const void* addr, char* buf,
+					size_t size) BBUS_PUBLIC;
+
 /**
  * @brief Atomically accesses the value of a variable and returns it.
  * @param VAR The variable to access.
@@ -249,9 +341,47 @@ void bbus_str_free(char* str) BBUS_PUBLIC;
  * @param pattern A valid POSIX regular expression pattern.
  * @param str String to be matched.
  * @return BBUS_TRUE on match, BBUS_FALSE on no-match and -1 on error.
+ *
+ * Every thread caches the compiled forms of the last BBUS_REGEX_CACHESIZE
+ * distinct patterns it used, so matching repeatedly against a few fixed
+ * patterns doesn't recompile them.
  */
 int bbus_regex_match(const char* pattern, const char* str) BBUS_PUBLIC;
 
+/**
+ * @brief Number of compiled patterns cached per thread by bbus_regex_match().
+ */
+#define BBUS_REGEX_CACHESIZE 16
+
+/**
+ * @brief Opaque compiled regular expression.
+ */
+typedef struct __bbus_regex bbus_regex;
+
+/**
+ * @brief Compiles a regular expression pattern.
+ * @param pattern A valid POSIX extended regular expression pattern.
+ * @return Compiled pattern or NULL on error - BBUS_EREGEXPTRN if the
+ * pattern is invalid.
+ *
+ * Returned pattern must be freed using bbus_regex_free().
+ */
+bbus_regex* bbus_regex_compile(const char* pattern) BBUS_PUBLIC;
+
+/**
+ * @brief Matches a string against a compiled pattern.
+ * @param regex Compiled pattern.
+ * @param str String to be matched.
+ * @return BBUS_TRUE on match, BBUS_FALSE on no-match and -1 on error.
+ */
+int bbus_regex_exec(bbus_regex* regex, const char* str) BBUS_PUBLIC;
+
+/**
+ * @brief Frees a compiled pattern.
+ * @param regex Pattern to free.
+ */
+void bbus_regex_free(bbus_regex* regex) BBUS_PUBLIC;
+
 /**
  * @brief Computes crc32 checksum of given data.
  * @param buf Buffer containing the data.
@@ -260,6 +390,34 @@ int bbus_regex_match(const char* pattern, const char* str) BBUS_PUBLIC;
  */
 uint32_t bbus_crc32(const void* buf, size_t bufsize) BBUS_PUBLIC;
 
+/**
+ * @brief Returns the initial state for computing a crc32 incrementally.
+ * @return Initial crc32 state.
+ *
+ * The checksum of data passed in pieces to bbus_crc32_update() is the
+ * same as the one computed by bbus_crc32() over all of the data at once.
+ * Accelerated with carry-less multiplication or crc instructions on cpus
+ * supporting them.
+ */
+uint32_t bbus_crc32_init(void) BBUS_PUBLIC;
+
+/**
+ * @brief Updates the crc32 state with more data.
+ * @param crc Current state.
+ * @param buf Buffer containing the data.
+ * @param bufsize Size of the data.
+ * @return New crc32 state.
+ */
+uint32_t bbus_crc32_update(uint32_t crc, const void* buf,
+					size_t bufsize) BBUS_PUBLIC;
+
+/**
+ * @brief Converts the crc32 state into the final checksum.
+ * @param crc Current state.
+ * @return Crc32 checksum.
+ */
+uint32_t bbus_crc32_final(uint32_t crc) BBUS_PUBLIC;
+
 /**
  * @brief For given uid returns the name of the user.
  * @param uid The user ID.
@@ -371,6 +529,17 @@ enum bbus_hmap_type
  */
 bbus_hashmap* bbus_hmap_create(enum bbus_hmap_type type) BBUS_PUBLIC;
 
+/**
+ * @brief Creates an empty hashmap sized for a number of entries.
+ * @param type Type of the keys.
+ * @param numentries Number of entries the map will hold without growing.
+ * @return Pointer to the new hashmap or NULL if no memory.
+ *
+ * Small values create maps smaller than bbus_hmap_create() does.
+ */
+bbus_hashmap* bbus_hmap_create_sized(enum bbus_hmap_type type,
+				size_t numentries) BBUS_PUBLIC;
+
 /**
  * @brief Inserts an entry or sets a new value for an existing one.
  * @param hmap The hashmap.
@@ -391,6 +560,18 @@ int bbus_hmap_setstr(bbus_hashmap* hmap,
  */
 void* bbus_hmap_findstr(bbus_hashmap* hmap, const char* key) BBUS_PUBLIC;
 
+/**
+ * @brief Looks up the value for the first 'len' characters of a string.
+ * @param hmap The hashmap.
+ * @param key The key, doesn't need to be null-terminated.
+ * @param len Length of the key.
+ * @return Pointer to the looked up entry or NULL if not present.
+ *
+ * Allows to look up substrings without copying them.
+ */
+void* bbus_hmap_findstrn(bbus_hashmap* hmap, const char* key,
+					size_t len) BBUS_PUBLIC;
+
 /**
  * @brief Removes an entry for a given string.
  * @param hmap The hashmap.
@@ -432,6 +613,39 @@ void* bbus_hmap_finduint(bbus_hashmap* hmap, unsigned key) BBUS_PUBLIC;
  */
 void* bbus_hmap_rmuint(bbus_hashmap* hmap, unsigned key) BBUS_PUBLIC;
 
+/**
+ * @brief Creates a copy of a hashmap.
+ * @param hmap Hashmap to copy.
+ * @return Pointer to the new hashmap or NULL if no memory.
+ *
+ * Keys are copied, values are stored as the same pointers as in 'hmap'.
+ * The copy has the same capacity as the original.
+ */
+bbus_hashmap* bbus_hmap_dup(bbus_hashmap* hmap) BBUS_PUBLIC;
+
+/**
+ * @brief Function called for every key-value pair by bbus_hmap_foreach().
+ *
+ * String keys are not null-terminated, unsigned integer keys point to
+ * an unsigned int. A non-zero return value stops the iteration.
+ */
+typedef int (*bbus_hmap_iterfunc)(const void* key, size_t keysize,
+						void* val, void* arg);
+
+/**
+ * @brief Calls a function for every key-value pair in the hashmap.
+ * @param hmap The hashmap.
+ * @param func Function to call.
+ * @param arg Passed to 'func' untouched.
+ * @return 0 if every pair has been visited or the first non-zero value
+ *         returned by 'func'.
+ *
+ * The order is unspecified. The hashmap must not be modified until this
+ * function returns.
+ */
+int bbus_hmap_foreach(bbus_hashmap* hmap, bbus_hmap_iterfunc func,
+						void* arg) BBUS_PUBLIC;
+
 /**
  * @brief Deletes all key-value pairs from the hashmap.
  * @param hmap Hashmap to reset.
@@ -451,6 +665,17 @@ void bbus_hmap_reset(bbus_hashmap* hmap) BBUS_PUBLIC;
  */
 void bbus_hmap_free(bbus_hashmap* hmap) BBUS_PUBLIC;
 
+/**
+ * @brief Hashes a buffer the same way the hashmap hashes its keys.
+ * @param buf Data to hash.
+ * @param bufsize Size of the data.
+ * @return 32-bit hash of the data.
+ *
+ * Much faster than bbus_crc32(), but only meant for hash tables - the
+ * result may change between versions of the library.
+ */
+uint32_t bbus_hmap_hash(const void* buf, size_t bufsize) BBUS_PUBLIC;
+
 /**
  * @brief Converts the hashmap's contents into human-readable form.
  * @param hmap Hashmap object to dump.
@@ -590,15 +815,29 @@ void bbus_free_nonopts(struct bbus_nonopts* nonopts) BBUS_PUBLIC;
  */
 
 /**
- * @brief Path to the busybus unix socket.
+ * @brief Address of the busybus socket.
  *
  * Affects the default socket path. If this variable is set libbbus will use
  * its value instead of the default path specified in busybus.h. In most
  * busybus programs however this can be overridden by socket path passed as a
  * command-line argument e.g. '--sockpath' in bbusd.
+ *
+ * Apart from a unix socket path, which may also be given as 'unix:PATH',
+ * the bus can be reached over TCP with 'tcp:HOST:PORT' and over vsock with
+ * 'vsock:CID:PORT'. An empty host or a CID of 'any' binds to all local
+ * addresses. Network transports can't pass descriptors or credentials and
+ * always use network byte order objects.
  */
 #define BBUS_ENV_SOCKPATH	"BBUS_SOCKPATH"
 
+/**
+ * @brief Disables the io_uring pollset backend if set.
+ *
+ * Pollsets use io_uring on kernels supporting all the needed features and
+ * epoll otherwise. Setting this variable, to any value, forces epoll.
+ */
+#define BBUS_ENV_NOURING	"BBUS_NOURING"
+
 /**
  * @}
  *
@@ -633,7 +872,14 @@ void bbus_free_nonopts(struct bbus_nonopts* nonopts) BBUS_PUBLIC;
 #define BBUS_EHMAPINVTYPE	10017 /**< Invalid key type for this map. */
 #define BBUS_EREGEXPTRN		10018 /**< Invalid regex pattern. */
 #define BBUS_ECLIUNAUTH		10019 /**< Client unauthorized. */
-#define __BBUS_MAX_ERR		10020 /**< Highest error code */
+#define BBUS_EAGAIN		10020 /**< No complete message available yet. */
+#define BBUS_ETIMEDOUT		10021 /**< Call deadline exceeded. */
+#define BBUS_ESTALEROUTE	10022 /**< Method route no longer valid. */
+#define BBUS_ENOHOSTORDER	10023 /**< Peer can't use host byte order. */
+#define BBUS_ENOCOMPRESSION	10024 /**< Peer can't take compressed data. */
+#define BBUS_EINVALADDR		10025 /**< Invalid or unresolvable address. */
+#define BBUS_ENOFDPASS		10026 /**< Transport can't pass descriptors. */
+#define __BBUS_MAX_ERR		10027 /**< Highest error code */
 
 /**
  * @}
@@ -718,6 +964,40 @@ bbus_object* bbus_obj_alloc(void) BBUS_PUBLIC;
  */
 void bbus_obj_free(bbus_object* obj) BBUS_PUBLIC;
 
+/**
+ * @brief Opaque type representing a pool of reusable objects.
+ *
+ * Objects allocated from a pool return their memory to it once freed, so
+ * that subsequent allocations avoid the heap. Buffers are kept in size
+ * classes covering every regular payload size. A pool is not thread-safe -
+ * it should be owned by a single thread.
+ */
+typedef struct __bbus_obj_pool bbus_obj_pool;
+
+/**
+ * @brief Creates an empty object pool.
+ * @return Pointer to the new pool or NULL if no memory.
+ */
+bbus_obj_pool* bbus_obj_pool_create(void) BBUS_PUBLIC;
+
+/**
+ * @brief Frees an object pool and all the memory cached within it.
+ * @param pool The pool - can be NULL.
+ *
+ * All objects allocated from the pool must be freed before calling this
+ * function.
+ */
+void bbus_obj_pool_free(bbus_obj_pool* pool) BBUS_PUBLIC;
+
+/**
+ * @brief Allocate an empty busybus object from a pool.
+ * @param pool The pool.
+ * @return Pointer to a new object or NULL if no memory.
+ *
+ * The object is freed with bbus_obj_free() as usual.
+ */
+bbus_object* bbus_obj_alloc_from(bbus_obj_pool* pool) BBUS_PUBLIC;
+
 /**
  * @brief Resets the state of an object.
  * @param obj The object.
@@ -727,6 +1007,18 @@ void bbus_obj_free(bbus_object* obj) BBUS_PUBLIC;
  */
 void bbus_obj_reset(bbus_object* obj) BBUS_PUBLIC;
 
+/**
+ * @brief Makes room for data about to be inserted into an object.
+ * @param obj The object.
+ * @param size Number of bytes that will be inserted.
+ * @return 0 on success, -1 if no memory.
+ *
+ * Allocates the buffer once instead of growing it step by step as the
+ * data is inserted. Objects built from descriptions are always sized
+ * this way.
+ */
+int bbus_obj_reserve(bbus_object* obj, size_t size) BBUS_PUBLIC;
+
 /**
  * @brief Returns a pointer to the buffer containing the marshalled data.
  * @param obj The object.
@@ -847,6 +1139,71 @@ int bbus_obj_insbytes(bbus_object* obj, const void* buf,
  */
 int bbus_obj_extrbytes(bbus_object* obj, void* buf, size_t size) BBUS_PUBLIC;
 
+/**
+ * @brief Extracts a byte-array from an object without copying it.
+ * @param obj The object.
+ * @param buf Will point to the array's data inside the object's buffer.
+ * @param size Will contain the number of bytes in the array.
+ * @return 0 on success, -1 on error.
+ *
+ * The pointer stays valid until the object is modified or freed.
+ */
+int bbus_obj_extrbytes_ref(bbus_object* obj, const void** buf,
+		size_t* size) BBUS_PUBLIC;
+
+/**
+ * @brief Inserts an array of signed integers into an object.
+ * @param obj The object.
+ * @param vals Integers to insert.
+ * @param num Number of integers.
+ * @return 0 on success, -1 on error.
+ *
+ * Produces the same data as inserting the array size and each element
+ * separately (description "Ai"), but reserves the space and converts the
+ * byte order of all elements in one go.
+ */
+int bbus_obj_insint32v(bbus_object* obj, const bbus_int32* vals,
+		size_t num) BBUS_PUBLIC;
+
+/**
+ * @brief Extracts an array of signed integers from an object.
+ * @param obj The object.
+ * @param buf Place to store extracted integers.
+ * @param num Capacity of buf on input, number of extracted integers on
+ *            output.
+ * @return 0 on success, -1 on error.
+ *
+ * If the array doesn't fit in buf, BBUS_ENOSPACE is set and the object is
+ * left untouched.
+ */
+int bbus_obj_extrint32v(bbus_object* obj, bbus_int32* buf,
+		size_t* num) BBUS_PUBLIC;
+
+/**
+ * @brief Inserts an array of unsigned integers into an object.
+ * @param obj The object.
+ * @param vals Integers to insert.
+ * @param num Number of integers.
+ * @return 0 on success, -1 on error.
+ *
+ * Works like bbus_obj_insint32v().
+ */
+int bbus_obj_insuint32v(bbus_object* obj, const bbus_uint32* vals,
+		size_t num) BBUS_PUBLIC;
+
+/**
+ * @brief Extracts an array of unsigned integers from an object.
+ * @param obj The object.
+ * @param buf Place to store extracted integers.
+ * @param num Capacity of buf on input, number of extracted integers on
+ *            output.
+ * @return 0 on success, -1 on error.
+ *
+ * Works like bbus_obj_extrint32v().
+ */
+int bbus_obj_extruint32v(bbus_object* obj, bbus_uint32* buf,
+		size_t* num) BBUS_PUBLIC;
+
 /**
  * @brief Resets the extraction state of an object.
  * @param obj The object.
@@ -857,6 +1214,53 @@ int bbus_obj_extrbytes(bbus_object* obj, void* buf, size_t size) BBUS_PUBLIC;
  */
 void bbus_obj_rewind(bbus_object* obj) BBUS_PUBLIC;
 
+/**
+ * @brief Integers are stored in network byte order - the default.
+ */
+#define BBUS_OBJ_NETORDER	0
+
+/**
+ * @brief Integers are stored in host byte order.
+ *
+ * All endpoints of a bus run on the same machine, so nothing needs to be
+ * swapped. Such objects can only be sent over connections which agreed
+ * to it at session open - which every connection made by this library
+ * does if the server supports it. Sending them anywhere else fails with
+ * BBUS_ENOHOSTORDER.
+ */
+#define BBUS_OBJ_HOSTORDER	1
+
+/**
+ * @brief Sets the byte order integers are stored in by an object.
+ * @param obj The object.
+ * @param order BBUS_OBJ_NETORDER or BBUS_OBJ_HOSTORDER.
+ *
+ * Doesn't convert the data already stored in the object. Objects received
+ * from the bus have the order of the sender.
+ */
+void bbus_obj_setorder(bbus_object* obj, int order) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the byte order used by an object.
+ * @param obj The object.
+ * @return BBUS_OBJ_NETORDER or BBUS_OBJ_HOSTORDER.
+ */
+int bbus_obj_getorder(const bbus_object* obj) BBUS_PUBLIC;
+
+/**
+ * @brief Sets the byte order of objects created from now on.
+ * @param order BBUS_OBJ_NETORDER or BBUS_OBJ_HOSTORDER.
+ *
+ * Applies to the whole process, BBUS_OBJ_NETORDER is the default.
+ */
+void bbus_obj_setdefaultorder(int order) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the byte order of newly created objects.
+ * @return BBUS_OBJ_NETORDER or BBUS_OBJ_HOSTORDER.
+ */
+int bbus_obj_getdefaultorder(void) BBUS_PUBLIC;
+
 /**
  * @brief Creates an object from data stored in given buffer.
  * @param buf The buffer.
@@ -865,6 +1269,83 @@ void bbus_obj_rewind(bbus_object* obj) BBUS_PUBLIC;
  */
 bbus_object* bbus_obj_frombuf(const void* buf, size_t bufsize) BBUS_PUBLIC;
 
+/**
+ * @brief Creates an object from data stored in given buffer using a pool.
+ * @param pool The pool.
+ * @param buf The buffer.
+ * @param bufsize Size of the buffer.
+ * @return New object or NULL if no memory.
+ */
+bbus_object* bbus_obj_frombuf_from(bbus_obj_pool* pool,
+		const void* buf, size_t bufsize) BBUS_PUBLIC;
+
+/**
+ * @brief Creates an object viewing the data stored in given buffer.
+ * @param buf The buffer.
+ * @param bufsize Size of the buffer.
+ * @return New object or NULL if no memory.
+ *
+ * Unlike bbus_obj_frombuf() nothing is copied - the object only points to
+ * the buffer, which must stay valid and unmodified for as long as the
+ * object is used. The buffer is never written to: inserting data into
+ * the object copies its contents first. Use bbus_obj_detach() to keep
+ * the object around after the buffer goes away.
+ */
+bbus_object* bbus_obj_view(const void* buf, size_t bufsize) BBUS_PUBLIC;
+
+/**
+ * @brief Creates an object viewing given buffer using a pool.
+ * @param pool The pool.
+ * @param buf The buffer.
+ * @param bufsize Size of the buffer.
+ * @return New object or NULL if no memory.
+ */
+bbus_object* bbus_obj_view_from(bbus_obj_pool* pool,
+		const void* buf, size_t bufsize) BBUS_PUBLIC;
+
+/**
+ * @brief Makes an object independent of the buffer it views.
+ * @param obj The object.
+ * @return 0 on success, -1 if no memory.
+ *
+ * Copies the viewed data into memory owned by the object. Does nothing
+ * for objects that already own their data.
+ */
+int bbus_obj_detach(bbus_object* obj) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether a descriptor can be mapped by bbus_obj_fromfd().
+ * @param fd Descriptor of the file, usually received with a message.
+ * @param size Where the size of the file is stored.
+ * @return 0 if the file can be mapped, -1 otherwise.
+ *
+ * Only regular files sealed with at least F_SEAL_SHRINK and F_SEAL_WRITE,
+ * like the memfds created by bbus_obj_tofd(), are accepted. Anything else
+ * could change under the mapping. Fails with BBUS_EOBJINVFMT.
+ */
+int bbus_obj_checkfd(int fd, size_t* size) BBUS_PUBLIC;
+
+/**
+ * @brief Creates an object mapping the contents of a shared memory file.
+ * @param fd Descriptor of the file, usually received with a message.
+ * @return New object or NULL on error.
+ *
+ * The data is mapped privately instead of being copied. The descriptor can
+ * be closed right after this function returns. Files not accepted by
+ * bbus_obj_checkfd() are refused.
+ */
+bbus_object* bbus_obj_fromfd(int fd) BBUS_PUBLIC;
+
+/**
+ * @brief Stores the marshalled data of an object in a sealed memfd.
+ * @param obj The object.
+ * @return New file descriptor or -1 on error.
+ *
+ * The returned descriptor can be attached to a message in place of the
+ * object's data. It must be closed by the caller.
+ */
+int bbus_obj_tofd(bbus_object* obj) BBUS_PUBLIC;
+
 /**
  * @brief Builds an object according to given description and arguments.
  * @param descr Valid object description.
@@ -880,6 +1361,28 @@ bbus_object* bbus_obj_build(const char* descr, ...) BBUS_PUBLIC;
  */
 bbus_object* bbus_obj_vbuild(const char* descr, va_list va) BBUS_PUBLIC;
 
+/**
+ * @brief Builds an object according to given description using a pool.
+ * @param pool The pool.
+ * @param descr Valid object description.
+ * @return New object or NULL on error.
+ *
+ * Both the object and its buffer are taken from the pool and go back to
+ * it once the object is freed.
+ */
+bbus_object* bbus_obj_build_from(bbus_obj_pool* pool,
+		const char* descr, ...) BBUS_PUBLIC;
+
+/**
+ * @brief Builds an object according to given description using a pool.
+ * @param pool The pool.
+ * @param descr Valid object description.
+ * @param va List of variadic arguments corresponding with 'descr'.
+ * @return New object or NULL on error.
+ */
+bbus_object* bbus_obj_vbuild_from(bbus_obj_pool* pool,
+		const char* descr, va_list va) BBUS_PUBLIC;
+
 /**
  * @brief Extracts all data from an object according to given description.
  * @param obj The object.
@@ -910,31 +1413,179 @@ int bbus_obj_repr(bbus_object* obj, const char* descr, char* buf,
 		size_t bufsize) BBUS_PUBLIC;
 
 /**
- * @}
- *
- * @defgroup __protocol__ Protocol definitions
- * @{
+ * @brief Opaque type representing a compiled object description.
  *
- * Contains data structure definitions and constants used in the busybus
- * message exchange protocol.
+ * Compiled descriptions are validated once and don't need to be parsed
+ * again by every call, which makes them a better fit for descriptions
+ * used repeatedly.
  */
+typedef struct __bbus_obj_prog bbus_obj_prog;
 
-/* TODO Signals and simple messages will be added in the future. */
+/**
+ * @brief Compiles an object description.
+ * @param descr The description.
+ * @return Compiled description or NULL on error.
+ *
+ * Sets the error to BBUS_EINVALARG if 'descr' is not valid. The result
+ * can be shared by multiple threads and must be freed using
+ * bbus_obj_prog_free().
+ */
+bbus_obj_prog* bbus_obj_compile(const char* descr) BBUS_PUBLIC;
 
-#define BBUS_MAGIC	"\xBB\xC5"	/**< Busybus magic number. */
-#define BBUS_MAGIC_SIZE	2		/**< Size of the magic number. */
+/**
+ * @brief Frees a compiled object description.
+ * @param prog The compiled description - can be NULL.
+ */
+void bbus_obj_prog_free(bbus_obj_prog* prog) BBUS_PUBLIC;
 
-/* TODO should go in /var/run/bbus/ in the future. */
-#define BBUS_PROT_DEFSOCKPATH "/tmp/bbus.sock" /**< Default socket path. */
+/**
+ * @brief Builds an object according to a compiled description.
+ * @param prog The compiled description.
+ * @return New object or NULL on error.
+ */
+bbus_object* bbus_obj_build_prog(const bbus_obj_prog* prog, ...) BBUS_PUBLIC;
 
 /**
- * @defgroup __protmsgtypes__ Protocol message types
- * @{
- *
- * Message types carried in the 'msgtype' field of the header.
+ * @brief Builds an object according to a compiled description.
+ * @param prog The compiled description.
+ * @param va List of variadic arguments corresponding with 'prog'.
+ * @return New object or NULL on error.
  */
-#define BBUS_MSGTYPE_SO		0x01 /**< Session open. */
-#define BBUS_MSGTYPE_SOOK	0x02 /**< Session open confirmed. */
+bbus_object* bbus_obj_vbuild_prog(const bbus_obj_prog* prog,
+		va_list va) BBUS_PUBLIC;
+
+/**
+ * @brief Extracts all data from an object according to a compiled
+ * description.
+ * @param obj The object.
+ * @param prog The compiled description.
+ * @return 0 on success, -1 on error.
+ */
+int bbus_obj_parse_prog(bbus_object* obj,
+		const bbus_obj_prog* prog, ...) BBUS_PUBLIC;
+
+/**
+ * @brief Extracts all data from an object according to a compiled
+ * description.
+ * @param obj The object.
+ * @param prog The compiled description.
+ * @param va List of data pointers corresponding with 'prog'.
+ * @return 0 on success, -1 on error.
+ */
+int bbus_obj_vparse_prog(bbus_object* obj, const bbus_obj_prog* prog,
+		va_list va) BBUS_PUBLIC;
+
+/**
+ * @brief Converts an object into a human-readable form according to
+ * a compiled description.
+ * @param obj The object.
+ * @param prog The compiled description.
+ * @param buf The buffer to store the converted object in.
+ * @param bufsize Size of 'buf'.
+ * @return Length of the representation or -1 on error.
+ */
+int bbus_obj_repr_prog(bbus_object* obj, const bbus_obj_prog* prog,
+		char* buf, size_t bufsize) BBUS_PUBLIC;
+
+/**
+ * @brief Opaque type representing an object index.
+ *
+ * An index records where every value of an object starts, so that values
+ * can be read in any order without parsing everything before them. Values
+ * are numbered in the order in which bbus_obj_parse() would extract them,
+ * array sizes included and struct delimiters excluded - in an object
+ * described as "sA(us)" the first array element's string is item 3.
+ *
+ * The index stays valid as long as the object's data doesn't change.
+ */
+typedef struct __bbus_obj_index bbus_obj_index;
+
+/**
+ * @brief Builds an index of an object in a single pass.
+ * @param obj The object.
+ * @param descr Description of the object's data.
+ * @return New index or NULL if the data doesn't match the description.
+ *
+ * The extraction state of the object is not changed. The index must be
+ * freed using bbus_obj_index_free().
+ */
+bbus_obj_index* bbus_obj_mkindex(bbus_object* obj,
+		const char* descr) BBUS_PUBLIC;
+
+/**
+ * @brief Builds an index of an object according to a compiled description.
+ * @param obj The object.
+ * @param prog The compiled description.
+ * @return New index or NULL if the data doesn't match the description.
+ */
+bbus_obj_index* bbus_obj_mkindex_prog(bbus_object* obj,
+		const bbus_obj_prog* prog) BBUS_PUBLIC;
+
+/**
+ * @brief Frees an object index.
+ * @param idx The index - can be NULL.
+ */
+void bbus_obj_index_free(bbus_obj_index* idx) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the number of values in an index.
+ * @param idx The index.
+ * @return Number of indexed values.
+ */
+size_t bbus_obj_index_size(const bbus_obj_index* idx) BBUS_PUBLIC;
+
+/**
+ * @brief Moves the extraction position of an object to an indexed value.
+ * @param obj The object.
+ * @param idx Index built for this object.
+ * @param item Number of the value.
+ * @return 0 on success, -1 on error.
+ *
+ * Subsequent extractions continue sequentially from this value.
+ */
+int bbus_obj_seek(bbus_object* obj, const bbus_obj_index* idx,
+		size_t item) BBUS_PUBLIC;
+
+/**
+ * @brief Returns an indexed string without scanning the object's data.
+ * @param obj The object.
+ * @param idx Index built for this object.
+ * @param item Number of the value - must be a string.
+ * @param str Will point to the string inside the object's buffer.
+ * @param len Will contain the length of the string - can be NULL.
+ * @return 0 on success, -1 on error.
+ *
+ * The extraction position of the object is not changed.
+ */
+int bbus_obj_index_getstr(bbus_object* obj, const bbus_obj_index* idx,
+		size_t item, char** str, size_t* len) BBUS_PUBLIC;
+
+/**
+ * @}
+ *
+ * @defgroup __protocol__ Protocol definitions
+ * @{
+ *
+ * Contains data structure definitions and constants used in the busybus
+ * message exchange protocol.
+ */
+
+/* TODO Signals and simple messages will be added in the future. */
+
+#define BBUS_MAGIC	"\xBB\xC5"	/**< Busybus magic number. */
+#define BBUS_MAGIC_SIZE	2		/**< Size of the magic number. */
+
+/* TODO should go in /var/run/bbus/ in the future. */
+#define BBUS_PROT_DEFSOCKPATH "/tmp/bbus.sock" /**< Default socket path. */
+
+/**
+ * @defgroup __protmsgtypes__ Protocol message types
+ * @{
+ *
+ * Message types carried in the 'msgtype' field of the header.
+ */
+#define BBUS_MSGTYPE_SO		0x01 /**< Session open. */
+#define BBUS_MSGTYPE_SOOK	0x02 /**< Session open confirmed. */
 #define BBUS_MSGTYPE_SORJCT	0x03 /**< Session open rejected. */
 #define BBUS_MSGTYPE_SRVREG	0x04 /**< Register service. */
 #define BBUS_MSGTYPE_SRVUNREG	0x05 /**< Unregister service. */
@@ -948,6 +1599,9 @@ int bbus_obj_repr(bbus_object* obj, const char* descr, char* buf,
 #define BBUS_MSGTYPE_CLOSE	0x0D /**< Client closes session. */
 #define BBUS_MSGTYPE_CTRL	0x0E /**< Control message. */
 #define BBUS_MSGTYPE_MON	0x0F /**< Monitoring message. */
+#define BBUS_MSGTYPE_MONFLTR	0x10 /**< Monitor sets its filter. */
+#define BBUS_MSGTYPE_SIGSUB	0x11 /**< Client subscribes to signals. */
+#define BBUS_MSGTYPE_SIGUNSUB	0x12 /**< Client unsubscribes. */
 /**
  * @}
  *
@@ -976,6 +1630,8 @@ int bbus_obj_repr(bbus_object* obj, const char* descr, char* buf,
 #define BBUS_PROT_ENOMETHOD	0x01 /**< No such method. */
 #define BBUS_PROT_EMETHODERR	0x02 /**< Error calling the method. */
 #define BBUS_PROT_EMREGERR	0x03 /**< Error registering the method. */
+#define BBUS_PROT_ETIMEDOUT	0x04 /**< Call deadline exceeded. */
+#define BBUS_PROT_ESTALEROUTE	0x05 /**< Route id is no longer valid. */
 /**
  * @}
  *
@@ -986,10 +1642,66 @@ int bbus_obj_repr(bbus_object* obj, const char* descr, char* buf,
  */
 #define BBUS_PROT_HASMETA	(1 << 0) /**< Message contains metadata. */
 #define BBUS_PROT_HASOBJECT	(1 << 1) /**< Message contains an object. */
+#define BBUS_PROT_LARGE		(1 << 2) /**< Extended payload size is used. */
+#define BBUS_PROT_HASFD		(1 << 3) /**< Object passed as a memfd. */
+#define BBUS_PROT_HASTIMEOUT	(1 << 4) /**< Call has a deadline. */
+#define BBUS_PROT_HASROUTE	(1 << 5) /**< Call uses a route id. */
+/**
+ * @brief In session open messages and their acknowledgements: host byte
+ * order objects can be used. In other messages: the object is encoded in
+ * host byte order.
+ */
+#define BBUS_PROT_HOSTORDER	(1 << 7)
+/**
+ * @brief In session open acknowledgements: compressed objects can be used.
+ * In other messages: the object is compressed.
+ *
+ * Never set in session open messages, which carry their options in the
+ * token instead.
+ */
+#define BBUS_PROT_COMPRESSED	(1 << 6)
+/**
+ * @brief Flags describing how the object is encoded.
+ *
+ * These must be kept when passing the object on to someone else.
+ */
+#define BBUS_PROT_OBJFLAGS	(BBUS_PROT_HOSTORDER | BBUS_PROT_COMPRESSED)
 /**
  * @}
  */
 
+/**
+ * @brief Session open token bit: the client takes compressed objects.
+ *
+ * Session open messages carry the client's BBUS_SO_* options in the token,
+ * the server answers with BBUS_PROT_COMPRESSED set in the acknowledgement
+ * if it agrees.
+ */
+#define BBUS_SO_COMPRESSION	(1 << 0)
+
+/**
+ * @brief Session open token bit: the client busy-polls.
+ */
+#define BBUS_SO_BUSYPOLL	(1 << 1)
+
+/**
+ * @brief Session open token bit: the service provider is a bridge from
+ * another bus daemon.
+ *
+ * Calls passed to bridges carry the full path of the method instead of
+ * its last component, so that the daemon on the other side can route them.
+ */
+#define BBUS_SO_BRIDGE		(1 << 2)
+
+/**
+ * @brief Session open token bits: the client's host byte order.
+ *
+ * Clients on network transports are only granted host byte order objects
+ * if their byte order is the same as the server's.
+ */
+#define BBUS_SO_LITTLEENDIAN	(1 << 3)
+#define BBUS_SO_BIGENDIAN	(1 << 4) /**< See BBUS_SO_LITTLEENDIAN. */
+
 /**
  * @brief Represents the header of every busybus message.
  */
@@ -1002,10 +1714,16 @@ struct bbus_msg_hdr
 	uint32_t token;		/**< Used only for method calling. */
 	uint16_t psize;		/**< Size of the payload. */
 	uint8_t flags;		/**< Various protocol flags. */
+	uint32_t xpsize;	/**< Payload size for large messages. */
+	uint32_t timeout;	/**< Milliseconds left until the deadline. */
+	uint32_t route;		/**< Route id of the method called. */
 };
 
 /**
  * @brief Number of fields in the header.
+ *
+ * The extended payload size, the timeout and the route id are not counted
+ * as they're only present in some messages.
  */
 #define BBUS_MSGHDR_NUMFIELDS	7
 
@@ -1020,11 +1738,62 @@ struct bbus_msg_hdr
 #define BBUS_MSGHDR_REALSIZE						\
 	(4*sizeof(uint8_t) + 2*sizeof(uint16_t) + sizeof(uint32_t))
 
+/**
+ * @brief Size of a single optional header field.
+ *
+ * The extended payload size is sent right after the regular header in
+ * messages with the BBUS_PROT_LARGE flag set, followed by the timeout if
+ * BBUS_PROT_HASTIMEOUT is set and the route id if BBUS_PROT_HASROUTE is
+ * set.
+ */
+#define BBUS_MSGHDR_EXTSIZE	sizeof(uint32_t)
+
+/**
+ * @brief Biggest size of the header on the wire.
+ */
+#define BBUS_MSGHDR_MAXWIRESIZE						\
+	(BBUS_MSGHDR_REALSIZE + 3*BBUS_MSGHDR_EXTSIZE)
+
+/**
+ * @brief Serializes the header into its on-the-wire format.
+ * @param hdr The header.
+ * @param buf Buffer at least BBUS_MSGHDR_MAXWIRESIZE bytes long.
+ * @return Number of bytes written to 'buf'.
+ *
+ * The wire format is a single contiguous block of BBUS_MSGHDR_REALSIZE
+ * bytes with the fields in the order of struct bbus_msg_hdr and no padding.
+ * Up to three BBUS_MSGHDR_EXTSIZE bytes long fields follow it, in order:
+ * the extended payload size if BBUS_PROT_LARGE is set, the timeout if
+ * BBUS_PROT_HASTIMEOUT is set and the route id if BBUS_PROT_HASROUTE is
+ * set. Fields whose flag is not set are skipped without leaving a gap.
+ */
+size_t bbus_hdr_pack(const struct bbus_msg_hdr* hdr, void* buf) BBUS_PUBLIC;
+
+/**
+ * @brief Deserializes the header from its on-the-wire format.
+ * @param hdr Header to fill.
+ * @param buf Buffer containing the wire data - BBUS_MSGHDR_REALSIZE bytes
+ *            plus BBUS_MSGHDR_EXTSIZE bytes for each of BBUS_PROT_LARGE,
+ *            BBUS_PROT_HASTIMEOUT and BBUS_PROT_HASROUTE set in the flags.
+ *
+ * The optional fields are read in the order bbus_hdr_pack() writes them.
+ * The ones whose flag is not set are left zeroed in 'hdr'.
+ */
+void bbus_hdr_unpack(struct bbus_msg_hdr* hdr, const void* buf) BBUS_PUBLIC;
+
 /**
  * @brief Biggest allowed payload size.
  */
 #define BBUS_MAXPLOADSIZE	4096
 
+/**
+ * @brief Biggest allowed payload size of large messages.
+ *
+ * Payloads bigger than BBUS_MAXPLOADSIZE are sent as large messages with
+ * a 32-bit extended payload size.
+ */
+#define BBUS_MAXLARGEPLOADSIZE	(16 * 1024 * 1024)
+
 /**
  * @brief Biggest allowed message size.
  */
@@ -1044,10 +1813,25 @@ struct bbus_msg
  * @param msg The message.
  * @return Extracted busybus object or NULL if object not present.
  *
- * The returned object has to be freed using bbus_obj_free.
+ * The returned object has to be freed using bbus_obj_free. Its byte order
+ * is the one indicated in the header, compressed objects are decompressed.
  */
 bbus_object* bbus_prot_extractobj(const struct bbus_msg* msg) BBUS_PUBLIC;
 
+/**
+ * @brief Locates the marshalled object data inside the message buffer.
+ * @param msg The message.
+ * @param size Place to store the size of the object data.
+ * @return Pointer to the object data or NULL if object not present.
+ *
+ * Unlike bbus_prot_extractobj doesn't copy anything - the returned pointer
+ * points to the area inside 'msg'. Useful for passing the object on
+ * without looking into it. The data is returned as is even if it's
+ * compressed.
+ */
+const void* bbus_prot_extractrawobj(const struct bbus_msg* msg,
+		size_t* size) BBUS_PUBLIC;
+
 /**
  * @brief Extracts the meta string from the message buffer.
  * @param msg The message.
@@ -1063,7 +1847,8 @@ const char* bbus_prot_extractmeta(const struct bbus_msg* msg) BBUS_PUBLIC;
  * @brief Sets new busybus unix socket path.
  * @param path New path.
  *
- * This function is thread-safe.
+ * Any address described for BBUS_ENV_SOCKPATH can be used. This function
+ * is thread-safe.
  */
 void bbus_prot_setsockpath(const char* path) BBUS_PUBLIC;
 
@@ -1093,6 +1878,22 @@ const char* bbus_prot_getsockpath(void) BBUS_PUBLIC;
  */
 void bbus_hdr_build(struct bbus_msg_hdr* hdr, int typ, int err) BBUS_PUBLIC;
 
+/**
+ * @brief Returns the byte order of the object carried by a message.
+ * @param hdr The header.
+ * @return BBUS_OBJ_HOSTORDER if BBUS_PROT_HOSTORDER is set,
+ * BBUS_OBJ_NETORDER otherwise.
+ */
+int bbus_hdr_getobjorder(const struct bbus_msg_hdr* hdr) BBUS_PUBLIC;
+
+/**
+ * @brief Sets BBUS_PROT_HOSTORDER according to the order of an object.
+ * @param hdr The header.
+ * @param obj The object carried by the message.
+ */
+void bbus_hdr_setobjorder(struct bbus_msg_hdr* hdr,
+		const bbus_object* obj) BBUS_PUBLIC;
+
 /**
  * @brief Returns the token value from the header in host byte order.
  * @param hdr The header.
@@ -1119,10 +1920,45 @@ size_t bbus_hdr_getpsize(const struct bbus_msg_hdr* hdr) BBUS_PUBLIC;
  * @param hdr The header.
  * @param size New size.
  *
- * If 'size' exceeds UINT16_MAX, the size will be set exactly to UINT16_MAX.
+ * If 'size' exceeds BBUS_MAXPLOADSIZE, the BBUS_PROT_LARGE flag is set and
+ * the size is stored in the extended payload size field, otherwise the flag
+ * is cleared. Sizes bigger than BBUS_MAXLARGEPLOADSIZE are invalid and will
+ * be rejected when sending the message.
  */
 void bbus_hdr_setpsize(struct bbus_msg_hdr* hdr, size_t size) BBUS_PUBLIC;
 
+/**
+ * @brief Returns the call's timeout in milliseconds.
+ * @param hdr The header.
+ * @return Time left until the deadline or 0 if the call has none.
+ */
+unsigned bbus_hdr_gettimeout(const struct bbus_msg_hdr* hdr) BBUS_PUBLIC;
+
+/**
+ * @brief Sets the call's timeout.
+ * @param hdr The header.
+ * @param ms Time left until the deadline in milliseconds, 0 for none.
+ *
+ * Sets or clears the BBUS_PROT_HASTIMEOUT flag.
+ */
+void bbus_hdr_settimeout(struct bbus_msg_hdr* hdr, unsigned ms) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the route id of the method called.
+ * @param hdr The header.
+ * @return Route id or 0 if the call is made by name.
+ */
+unsigned bbus_hdr_getroute(const struct bbus_msg_hdr* hdr) BBUS_PUBLIC;
+
+/**
+ * @brief Sets the route id of the method called.
+ * @param hdr The header.
+ * @param route Route id returned by the server, 0 to call by name.
+ *
+ * Sets or clears the BBUS_PROT_HASROUTE flag.
+ */
+void bbus_hdr_setroute(struct bbus_msg_hdr* hdr, unsigned route) BBUS_PUBLIC;
+
 /**
  * @brief Returns true if FLAG is set in the header's flags field.
  * @param HDR The header.
@@ -1140,6 +1976,16 @@ void bbus_hdr_setpsize(struct bbus_msg_hdr* hdr, size_t size) BBUS_PUBLIC;
 		(HDR)->flags |= (FLAG);					\
 	} while (0)
 
+/**
+ * @brief Sets FLAG to false in the header's flags field.
+ * @param HDR The header.
+ * @param FLAG The flag to be unset.
+ */
+#define BBUS_HDR_UNSETFLAG(HDR, FLAG)					\
+	do {								\
+		(HDR)->flags &= ~(FLAG);				\
+	} while (0)
+
 /**
  * @}
  *
@@ -1151,13 +1997,16 @@ void bbus_hdr_setpsize(struct bbus_msg_hdr* hdr, size_t size) BBUS_PUBLIC;
  * Functions used by method calling clients.
  */
 
-/* TODO Asynchronous calls. */
-
 /**
  * @brief Opaque type representing a client connection.
  */
 typedef struct __bbus_client_connection bbus_client_connection;
 
+/**
+ * @brief Opaque type representing a resolved method.
+ */
+typedef struct __bbus_method_handle bbus_method_handle;
+
 /**
  * @brief Establishes a client connection with the busybus server.
  * @param name Name by which the client wants to identify itself.
@@ -1166,64 +2015,529 @@ typedef struct __bbus_client_connection bbus_client_connection;
 bbus_client_connection* bbus_connect(const char* name) BBUS_PUBLIC;
 
 /**
- * @brief Calls a method synchronously.
- * @param conn The client connection.
- * @param method Full service and method name.
- * @param arg Marshalled arguments.
- * @return Returned marshalled data or NULL if error.
+ * @brief Connection flag: spin on the socket instead of sleeping.
+ *
+ * Both the client library and bbusd poll for the reply for a short while
+ * before going to sleep, trading CPU time for lower latency. Meant for the
+ * few latency-critical callers only - other connections are unaffected.
+ */
+#define BBUS_CONN_BUSYPOLL		(1 << 0)
+
+/**
+ * @brief Default time in microseconds a busy-polling connection spins.
+ */
+#define BBUS_BUSYPOLL_DEFUSEC		50
+
+/**
+ * @brief Establishes a client connection with given BBUS_CONN_* flags.
+ * @param name Name by which the client wants to identify itself.
+ * @param flags Connection flags.
+ * @return New connection object or NULL in case of an error.
+ */
+bbus_client_connection* bbus_connect_flags(const char* name,
+		int flags) BBUS_PUBLIC;
+
+/**
+ * @brief Calls a method synchronously.
+ * @param conn The client connection.
+ * @param method Full service and method name.
+ * @param arg Marshalled arguments.
+ * @return Returned marshalled data or NULL if error.
+ */
+bbus_object* bbus_callmethod(bbus_client_connection* conn,
+		const char* method, bbus_object* arg) BBUS_PUBLIC;
+
+/**
+ * @brief Calls a method synchronously with a deadline.
+ * @param conn The client connection.
+ * @param method Full service and method name.
+ * @param arg Marshalled arguments.
+ * @param tv Maximum time to wait for the reply.
+ * @return Returned marshalled data or NULL if error.
+ *
+ * The deadline travels with the call: bbusd fails it with BBUS_ETIMEDOUT
+ * once it passes, even if the service never replies, and drops the late
+ * reply. If no answer arrives in time at all, the function gives up with
+ * the same error and the reply is discarded when it arrives.
+ */
+bbus_object* bbus_callmethod_timeout(bbus_client_connection* conn,
+		const char* method, bbus_object* arg,
+		const struct bbus_timeval* tv) BBUS_PUBLIC;
+
+/**
+ * @brief Resolves a method to a handle it can be called through.
+ * @param conn The client connection.
+ * @param method Full service and method name.
+ * @return New handle or NULL if error, BBUS_ENOMETHOD if no such method.
+ *
+ * Calls made through the handle carry a numeric route id assigned by the
+ * server instead of the method name, so neither side handles the name
+ * on every call. The handle stays valid for as long as the method is
+ * registered and can be used on any connection.
+ */
+bbus_method_handle* bbus_resolve(bbus_client_connection* conn,
+				const char* method) BBUS_PUBLIC;
+
+/**
+ * @brief Calls a method through its handle synchronously.
+ * @param conn The client connection.
+ * @param handle The method handle.
+ * @param arg Marshalled arguments.
+ * @return Returned marshalled data or NULL if error.
+ *
+ * If the method has been removed and registered again since it was
+ * resolved, the handle is refreshed and the call is repeated once.
+ */
+bbus_object* bbus_callhandle(bbus_client_connection* conn,
+		bbus_method_handle* handle, bbus_object* arg) BBUS_PUBLIC;
+
+/**
+ * @brief Calls a method through its handle without waiting for the reply.
+ * @param conn The client connection.
+ * @param handle The method handle.
+ * @param arg Marshalled arguments.
+ * @param callid Where the id of the call is stored.
+ * @return 0 if the call has been sent, -1 on error.
+ *
+ * Unlike bbus_callhandle(), the call is not repeated if the route is no
+ * longer valid - its reply fails with BBUS_ESTALEROUTE. Use
+ * bbus_handle_refresh() before calling again.
+ */
+int bbus_callhandle_async(bbus_client_connection* conn,
+		bbus_method_handle* handle, bbus_object* arg,
+		unsigned* callid) BBUS_PUBLIC;
+
+/**
+ * @brief Resolves the handle's method again.
+ * @param conn The client connection.
+ * @param handle The method handle.
+ * @return 0 on success, -1 on error.
+ */
+int bbus_handle_refresh(bbus_client_connection* conn,
+		bbus_method_handle* handle) BBUS_PUBLIC;
+
+/**
+ * @brief Frees a method handle.
+ * @param handle The handle, can be NULL.
+ */
+void bbus_handle_free(bbus_method_handle* handle) BBUS_PUBLIC;
+
+/**
+ * @brief Calls a method asynchronously.
+ * @param conn The client connection.
+ * @param method Full service and method name.
+ * @param arg Marshalled arguments.
+ * @param callid Place to store the id of the call.
+ * @return 0 if the call has been sent, -1 on error.
+ *
+ * Returns right after the call has been sent. Any number of calls can
+ * be in flight on a single connection. Their replies are collected
+ * with bbus_call_poll() or bbus_call_wait(), possibly in a different
+ * order than the calls were made in.
+ */
+int bbus_call_async(bbus_client_connection* conn, const char* method,
+		bbus_object* arg, unsigned* callid) BBUS_PUBLIC;
+
+/**
+ * @brief Single call submitted with bbus_call_batch().
+ */
+struct bbus_batch_call
+{
+	const char* method;	/**< Full service and method name. */
+	bbus_object* arg;	/**< Marshalled arguments. */
+	unsigned callid;	/**< Call id, set by bbus_call_batch(). */
+};
+
+/**
+ * @brief Calls several methods asynchronously at once.
+ * @param conn The client connection.
+ * @param calls Array of calls to make.
+ * @param numcalls Number of elements in 'calls'.
+ * @return 0 if all the calls have been sent, -1 on error.
+ *
+ * All the calls are packed back to back into a single buffer and sent
+ * with a single system call. Every call gets its own id, stored in the
+ * 'callid' field. The replies are collected just like those to calls made
+ * with bbus_call_async().
+ */
+int bbus_call_batch(bbus_client_connection* conn,
+		struct bbus_batch_call* calls, size_t numcalls) BBUS_PUBLIC;
+
+/**
+ * @brief Waits for any asynchronous call to complete.
+ * @param conn The client connection.
+ * @param tv Maximum time to wait, NULL to wait indefinitely.
+ * @param callid Place to store the id of the completed call.
+ * @param ret Place to store the returned marshalled data.
+ * @return 1 if a call completed, 0 on timeout, -1 on error.
+ *
+ * If 1 is returned, but 'ret' has been set to NULL, the call itself
+ * failed - the reason can be retrieved with bbus_lasterror(). The returned
+ * object must be freed by the caller.
+ */
+int bbus_call_poll(bbus_client_connection* conn, struct bbus_timeval* tv,
+		unsigned* callid, bbus_object** ret) BBUS_PUBLIC;
+
+/**
+ * @brief Waits for a given asynchronous call to complete.
+ * @param conn The client connection.
+ * @param callid Id of the call returned by bbus_call_async().
+ * @return Returned marshalled data or NULL if error.
+ *
+ * Replies to other calls received in the meantime are kept in the
+ * connection object until collected.
+ */
+bbus_object* bbus_call_wait(bbus_client_connection* conn,
+		unsigned callid) BBUS_PUBLIC;
+
+/**
+ * @brief Emits a signal.
+ * @param conn The client connection.
+ * @param signame Full signal path.
+ * @param obj Marshalled arguments.
+ * @return 0 on success, -1 on failure.
+ *
+ * The signal is sent once to bbusd, which passes it on to every client
+ * subscribed to a matching prefix. Nobody acknowledges signals - a
+ * subscriber too slow to keep up with them misses some.
+ */
+int bbus_emitsignal(bbus_client_connection* conn,
+		const char* signame, bbus_object* obj) BBUS_PUBLIC;
+
+/**
+ * @brief Subscribes to signals.
+ * @param conn The client connection.
+ * @param prefix Signal path prefix, ie. 'bbus.foo'.
+ * @return 0 if the subscription has been sent, -1 on error.
+ *
+ * The prefix matches whole path components: 'bbus.foo' matches signals
+ * 'bbus.foo' and 'bbus.foo.bar', but not 'bbus.foobar'. A signal
+ * matching several prefixes is only received once.
+ */
+int bbus_subscribe(bbus_client_connection* conn,
+		const char* prefix) BBUS_PUBLIC;
+
+/**
+ * @brief Cancels a subscription made with bbus_subscribe().
+ * @param conn The client connection.
+ * @param prefix Prefix passed to bbus_subscribe().
+ * @return 0 if the request has been sent, -1 on error.
+ */
+int bbus_unsubscribe(bbus_client_connection* conn,
+		const char* prefix) BBUS_PUBLIC;
+
+/**
+ * @brief Waits for a signal.
+ * @param conn The client connection.
+ * @param tv Maximum time to wait, NULL to wait indefinitely.
+ * @param signame Place to store the path of the signal.
+ * @param obj Place to store the marshalled arguments.
+ * @return 1 if a signal has been received, 0 on timeout, -1 on error.
+ *
+ * Signals and call replies share the connection. Signals received while
+ * waiting for a reply are kept until collected with this function, and
+ * replies received here are kept for bbus_call_poll() and
+ * bbus_call_wait(). The path must be freed with bbus_str_free() and the
+ * object with bbus_obj_free().
+ */
+int bbus_sig_poll(bbus_client_connection* conn, struct bbus_timeval* tv,
+		char** signame, bbus_object** obj) BBUS_PUBLIC;
+
+/**
+ * @brief Enables passing big call arguments through shared memory.
+ * @param conn The client connection.
+ * @param threshold Minimum object size to be passed this way, 0 disables.
+ *
+ * Arguments of calls made with bbus_call_async() and bbus_callmethod()
+ * at least 'threshold' bytes long are stored in a memfd, which is then
+ * passed to the service over the socket instead of the data. Disabled
+ * by default and ignored on connections over network transports.
+ */
+void bbus_setshmthreshold(bbus_client_connection* conn,
+		size_t threshold) BBUS_PUBLIC;
+
+/**
+ * @brief Enables compression of big call arguments.
+ * @param conn The client connection.
+ * @param threshold Minimum object size to be compressed, 0 disables.
+ *
+ * Arguments of calls made with bbus_call_async() and bbus_callmethod()
+ * at least 'threshold' bytes long are compressed if the server agreed to
+ * it at session open and if it makes them any smaller. Objects passed
+ * through shared memory are never compressed. The receiving end
+ * decompresses them transparently, bbusd only passes them on - calling
+ * its own methods with compressed arguments fails. Disabled by default.
+ */
+void bbus_setcomprthreshold(bbus_client_connection* conn,
+		size_t threshold) BBUS_PUBLIC;
+
+/**
+ * @brief Changes how long a busy-polling connection spins.
+ * @param conn The client connection.
+ * @param usecs Spin time in microseconds before sleeping, 0 disables.
+ *
+ * Only affects the client side of connections opened with
+ * BBUS_CONN_BUSYPOLL, which start with BBUS_BUSYPOLL_DEFUSEC.
+ */
+void bbus_setbusypoll(bbus_client_connection* conn,
+		unsigned usecs) BBUS_PUBLIC;
+
+/**
+ * @brief Closes the client connection.
+ * @param conn The client connection to close.
+ * @return 0 if the connection has been properly closed, -1 on error.
+ */
+int bbus_closeconn(bbus_client_connection* conn) BBUS_PUBLIC;
+
+/**
+ * @defgroup __monctl__ Control and monitoring
+ * @{
+ *
+ * Functions used to send control messages and receive monitoring info.
+ */
+
+/**
+ * @brief Establishes a monitoring connection with busybus daemon.
+ * @return New connection object or NULL on error.
+ *
+ * Monitors receive every message that has been successfully received
+ * or sent by the busybus server daemon marshalled in a busybus object.
+ *
+ * Monitors use regular client connection objects and can be closed
+ * using bbus_closeconn().
+ */
+bbus_client_connection* bbus_mon_connect(void) BBUS_PUBLIC;
+
+/**
+ * @brief Receive a monitoring message from the busybus daemon.
+ * @param conn The monitor client connection.
+ * @param msg Buffer used to store the received message.
+ * @param bufsize Size of the buffer.
+ * @param tv Maximum interval that this function should wait for data,
+ *           NULL to wait indefinitely.
+ * @param obj Received object is stored at this address.
+ * @param meta The meta string is stored at this address if present.
+ * @return -1 on error, 0 on timeout, 1 when a message has been received.
+ *
+ * Both the meta string and the object point into 'msg' - they're only
+ * valid until the buffer is reused. Call bbus_obj_detach() on the object
+ * to keep it longer. The object must be freed by the caller.
+ *
+ * bbusd never waits for slow monitors - notifications that don't fit in
+ * the monitor's queue are dropped. The next message received will then
+ * have "dropped" as meta and carry the number of lost notifications in
+ * an object described as "u".
+ */
+int bbus_mon_recvmsg(bbus_client_connection* conn,
+		struct bbus_msg* msg, size_t bufsize, struct bbus_timeval* tv,
+		const char** meta, bbus_object** obj) BBUS_PUBLIC;
+
+/**
+ * @brief Selects the messages a monitor is interested in.
+ *
+ * All the criteria must be met for a message to be passed on to the
+ * monitor. The prefix and the pattern are matched against the meta
+ * string, which for method calls is the method path - messages without
+ * meta are treated as having an empty one.
+ */
+struct bbus_mon_filter
+{
+	unsigned msgtypes;	/**< Mask of (1 << msgtype), 0 for all. */
+	const char* prefix;	/**< Meta prefix or NULL. */
+	const char* regex;	/**< Pattern the meta must match or NULL. */
+	unsigned sample;	/**< Only pass every n-th matching message. */
+};
+
+/**
+ * @brief Sets the filter for the messages sent to this monitor.
+ * @param conn The monitor client connection.
+ * @param filter New filter, NULL removes the current one.
+ * @return 0 if the filter has been sent, -1 on error.
+ *
+ * Filters are evaluated by bbusd before building the notifications, so
+ * narrow filters keep monitoring cheap. An invalid pattern makes bbusd
+ * keep the previous filter. Messages handled before the filter reaches
+ * bbusd are still delivered unfiltered.
+ */
+int bbus_mon_setfilter(bbus_client_connection* conn,
+		const struct bbus_mon_filter* filter) BBUS_PUBLIC;
+
+/**
+ * @brief Establishes a control connection with busybus daemon.
+ * @return New connection object or NULL on error.
+ *
+ * Control connections are closed using bbus_closeconn().
+ */
+bbus_client_connection* bbus_ctl_connect(void) BBUS_PUBLIC;
+
+/**
+ * @brief Sends a control request to bbusd and waits for the reply.
+ * @param conn The control connection.
+ * @param cmd Name of the command.
+ * @param arg Argument object or NULL if the command takes none.
+ * @return Reply object or NULL on error.
+ *
+ * Commands understood by bbusd:
+ *
+ * "stats" - returns A(su): name-value pairs with client counts, the
+ * number of pending calls, queued jobs and monitor notifications, the
+ * size of the routing table and the allocation totals, see
+ * bbus_alloc_getstats().
+ *
+ * "methods" - takes "s", a method path prefix, returns A(suuuuuuu): path,
+ * calls, errors and the mean, p50, p90, p99 and max latency in
+ * microseconds of every method matching the prefix.
+ *
+ * "get" - returns A(su): current values of all tunables.
+ *
+ * "set" - takes "su": name and new value of a tunable, returns the same
+ * as "get". Tunables are "loglevel" (syslog levels 0-7), "monsample"
+ * (only every n-th notification goes to the monitors), "cliqueue" (bytes
+ * queued per client), "polltimeout" (upper bound in milliseconds on
+ * how long an idle reactor sleeps, 0 - the default - means it only wakes
+ * up when there's work to do), "tracepoints" (1 enables recording the
+ * tracepoints on the message path, 0 disables it) and "allocstats" (1
+ * enables allocation accounting, 0 disables it).
+ *
+ * "tracepoints" - returns A(uusuuuu): the recorded tracepoint hits of
+ * all reactor threads ordered by time, each with the monotonic time in
+ * seconds and nanoseconds, thread index, event name and three event
+ * specific values.
+ *
+ * "allocs" - returns A(suu): the call sites that requested the most
+ * memory while allocation accounting was enabled, with the number of
+ * allocations and bytes requested, see bbus_alloc_getsites().
+ *
+ * Unknown commands and invalid arguments are reported as
+ * BBUS_EMETHODERR.
+ */
+bbus_object* bbus_ctl_request(bbus_client_connection* conn, const char* cmd,
+					bbus_object* arg) BBUS_PUBLIC;
+
+/**
+ * @defgroup __trace__ Trace files
+ * @{
+ *
+ * Binary captures of the bus traffic written by bbusd --capture.
+ *
+ * A trace file starts with struct bbus_trace_filehdr followed by records,
+ * each consisting of struct bbus_trace_rechdr and 'size' bytes of the
+ * message exactly as seen on the wire - the packed header and the payload.
+ * Records are padded to BBUS_TRACE_ALIGN bytes. The file and record
+ * headers are stored in the byte order of the machine which wrote them.
+ *
+ * Records written by different reactor threads are flushed in large
+ * chunks, so timestamps are only ordered within a single thread.
+ */
+
+/**
+ * @brief Magic string at the start of every trace file.
+ */
+#define BBUS_TRACE_MAGIC	"BBUSTRC1"
+
+/**
+ * @brief Value of the byteorder field in the writer's byte order.
+ */
+#define BBUS_TRACE_BYTEORDER	0x01020304U
+
+/**
+ * @brief Alignment of the trace records.
+ */
+#define BBUS_TRACE_ALIGN	8
+
+/**
+ * @brief Trace file header.
+ */
+struct bbus_trace_filehdr
+{
+	char magic[8];		/**< BBUS_TRACE_MAGIC without the null byte. */
+	uint32_t byteorder;	/**< Always BBUS_TRACE_BYTEORDER. */
+	uint32_t reserved;	/**< Must be zero. */
+};
+
+/**
+ * @brief Message was received by bbusd.
+ */
+#define BBUS_TRACE_RECVD	0
+
+/**
+ * @brief Message was sent by bbusd.
+ */
+#define BBUS_TRACE_SENT		1
+
+/**
+ * @brief Header of a single trace record.
+ */
+struct bbus_trace_rechdr
+{
+	uint64_t tstamp;	/**< CLOCK_MONOTONIC time in nanoseconds. */
+	uint32_t size;		/**< Size of the captured message. */
+	uint8_t direction;	/**< BBUS_TRACE_RECVD or BBUS_TRACE_SENT. */
+	uint8_t shard;		/**< Reactor thread which handled it. */
+	uint16_t reserved;	/**< Must be zero. */
+};
+
+/**
+ * @brief Single message decoded from a trace file.
+ *
+ * All pointers point into the mapped file and stay valid until
+ * the trace is closed.
  */
-bbus_object* bbus_callmethod(bbus_client_connection* conn,
-		const char* method, bbus_object* arg) BBUS_PUBLIC;
+struct bbus_trace_event
+{
+	uint64_t tstamp;		/**< CLOCK_MONOTONIC time in ns. */
+	int direction;			/**< BBUS_TRACE_RECVD or SENT. */
+	unsigned shard;			/**< Reactor thread. */
+	struct bbus_msg_hdr hdr;	/**< Unpacked message header. */
+	const char* meta;		/**< Meta string or NULL. */
+	const void* obj;		/**< Raw object data or NULL. */
+	size_t objsize;			/**< Size of the object data. */
+};
 
 /**
- * @brief Emits a signal.
- * @param conn The client connection.
- * @param signame Full signal path.
- * @param obj Marshalled arguments.
- * @return 0 on success, -1 on failure.
+ * @brief Opaque type representing an opened trace file.
  */
-int bbus_emitsignal(bbus_client_connection* conn,
-		const char* signame, bbus_object* obj) BBUS_PUBLIC;
+typedef struct __bbus_trace bbus_trace;
 
 /**
- * @brief Closes the client connection.
- * @param conn The client connection to close.
- * @return 0 if the connection has been properly closed, -1 on error.
+ * @brief Maps a trace file into memory.
+ * @param path Path to the trace file.
+ * @return New trace object or NULL on error.
+ *
+ * The file header is verified, BBUS_EINVALARG is reported for files
+ * which are not busybus traces or come from a machine with a different
+ * byte order.
  */
-int bbus_closeconn(bbus_client_connection* conn) BBUS_PUBLIC;
+bbus_trace* bbus_trace_open(const char* path) BBUS_PUBLIC;
 
 /**
- * @defgroup __monctl__ Control and monitoring
- * @{
+ * @brief Decodes the next record from the trace.
+ * @param trace The trace file.
+ * @param event Event structure to fill.
+ * @return 1 if an event has been decoded, 0 at the end of the trace,
+ *         -1 if the record is malformed.
  *
- * Functions used to send control messages and receive monitoring info.
+ * Nothing is copied - the event points straight into the mapping.
+ * A record truncated by an interrupted capture ends the trace.
  */
+int bbus_trace_next(bbus_trace* trace,
+		struct bbus_trace_event* event) BBUS_PUBLIC;
 
 /**
- * @brief Establishes a monitoring connection with busybus daemon.
- * @return New connection object or NULL on error.
- *
- * Monitors receive every message that has been successfully received
- * or sent by the busybus server daemon marshalled in a busybus object.
- *
- * Monitors use regular client connection objects and can be closed
- * using bbus_closeconn().
+ * @brief Goes back to the first record of the trace.
+ * @param trace The trace file.
  */
-bbus_client_connection* bbus_mon_connect(void) BBUS_PUBLIC;
+void bbus_trace_rewind(bbus_trace* trace) BBUS_PUBLIC;
 
 /**
- * @brief Receive a monitoring message from the busybus daemon.
- * @param conn The monitor client connection.
- * @param msg Buffer used to store the received message.
- * @param bufsize Size of the buffer.
- * @param tv Maximum interval that this function should wait for data.
- * @param obj Received object is stored at this address.
- * @param meta The meta string is stored at this address if present.
- * @return -1 on error, 0 on timeout, 1 when a message has been received.
+ * @brief Unmaps the trace file and frees the trace object.
+ * @param trace The trace file.
+ */
+void bbus_trace_close(bbus_trace* trace) BBUS_PUBLIC;
+
+/**
+ * @}
  */
-int bbus_mon_recvmsg(bbus_client_connection* conn,
-		struct bbus_msg* msg, size_t bufsize, struct bbus_timeval* tv,
-		const char** meta, bbus_object** obj) BBUS_PUBLIC;
 
 /**
  * @}
@@ -1243,9 +2557,20 @@ typedef struct __bbus_service_connection bbus_service_connection;
 
 /**
  * @brief Represents a function that is actually being called on method call.
+ *
+ * The argument object views the received message and is freed once the
+ * function returns - it must not be stored for later.
  */
 typedef bbus_object* (*bbus_method_func)(bbus_object*);
 
+/**
+ * @brief Method flag: calls are run one at a time in the order received.
+ *
+ * Only matters if the service uses workers - see bbus_srvc_setworkers().
+ * Calls to other methods still run concurrently.
+ */
+#define BBUS_METHOD_ORDERED	(1 << 0)
+
 /**
  * @brief Represents a single busybus method.
  *
@@ -1258,8 +2583,23 @@ struct bbus_method
 	char* argdscr;		/**< Description of required arguments. */
 	char* retdscr;		/**< Description of the return value. */
 	bbus_method_func func;	/**< Pointer to the method function. */
+	int flags;		/**< BBUS_METHOD_* flags. */
+	/**
+	 * Milliseconds bbusd may answer calls with the same argument from
+	 * the reply it got last, 0 if replies are never cached. See
+	 * bbus_srvc_invalidate().
+	 */
+	unsigned cachettl;
 };
 
+/**
+ * @brief Signal making bbusd drop the replies it cached.
+ *
+ * Carries a single string - path of the method or of a whole subservice
+ * without the 'bbus.' prefix. Only honored if emitted by a service.
+ */
+#define BBUS_SRVC_INVALIDATESIG	"bbus.bbusd.invalidate"
+
 /**
  * @brief Establishes a service publisher connection with the busybus server.
  * @param name Whole path of the service location ie. 'foo.bar.baz'.
@@ -1276,15 +2616,101 @@ bbus_service_connection* bbus_srvc_connect(const char* name) BBUS_PUBLIC;
 int bbus_srvc_regmethod(bbus_service_connection* conn,
 		struct bbus_method* method) BBUS_PUBLIC;
 
+/**
+ * @brief Registers a number of methods in a single round trip.
+ * @param conn The publisher connection.
+ * @param methods Array of methods to register.
+ * @param nummethods Number of elements in methods.
+ * @return 0 if all methods have been registered, -1 on error.
+ *
+ * The server inserts all the methods at once - if registering any of them
+ * fails, none is registered. Method names must not contain commas and
+ * no field may contain newlines.
+ */
+int bbus_srvc_regmethods(bbus_service_connection* conn,
+		struct bbus_method* methods, size_t nummethods) BBUS_PUBLIC;
+
 /**
  * @brief Unregisters a method from the busybus server.
  * @param conn The publisher connection.
- * @param method Method data to unregister.
+ * @param method Name of the method to unregister, without the service name.
  * @return 0 on successful unregistration, -1 on error.
+ *
+ * The server doesn't acknowledge the request - calls routed to the method
+ * before the server removed it may still arrive and are answered with
+ * an error. The method is removed from the server once its last provider
+ * is gone. Must not be called while another thread is inside
+ * bbus_srvc_listencalls() for the same connection.
  */
 int bbus_srvc_unregmethod(bbus_service_connection* conn,
 		const char* method) BBUS_PUBLIC;
 
+/**
+ * @brief Emits a signal from a service.
+ * @param conn The publisher connection.
+ * @param signame Full signal path.
+ * @param obj Marshalled arguments.
+ * @return 0 on success, -1 on failure.
+ *
+ * Same as bbus_emitsignal(). Can be called from methods run by workers.
+ */
+int bbus_srvc_emitsignal(bbus_service_connection* conn,
+		const char* signame, bbus_object* obj) BBUS_PUBLIC;
+
+/**
+ * @brief Makes bbusd forget the cached replies of a method.
+ * @param conn The publisher connection.
+ * @param method Name of the method without the service name or NULL for
+ *               every method of the service.
+ * @return 0 on success, -1 on failure.
+ *
+ * Emits BBUS_SRVC_INVALIDATESIG. Calls received by bbusd after the
+ * signal are passed on to the service again, but a call already on its
+ * way may still be answered from the cache.
+ */
+int bbus_srvc_invalidate(bbus_service_connection* conn,
+		const char* method) BBUS_PUBLIC;
+
+/**
+ * @brief Enables passing big return values through shared memory.
+ * @param conn The publisher connection.
+ * @param threshold Minimum object size to be passed this way, 0 disables.
+ *
+ * Same as bbus_setshmthreshold(), but for objects returned by methods.
+ */
+void bbus_srvc_setshmthreshold(bbus_service_connection* conn,
+		size_t threshold) BBUS_PUBLIC;
+
+/**
+ * @brief Enables compression of big return values.
+ * @param conn The publisher connection.
+ * @param threshold Minimum object size to be compressed, 0 disables.
+ *
+ * Same as bbus_setcomprthreshold(), but for objects returned by methods.
+ */
+void bbus_srvc_setcomprthreshold(bbus_service_connection* conn,
+		size_t threshold) BBUS_PUBLIC;
+
+/**
+ * @brief Runs the method callbacks in a pool of worker threads.
+ * @param conn The publisher connection.
+ * @param numworkers Number of worker threads.
+ * @return 0 if the workers have been started, -1 on error.
+ *
+ * By default bbus_srvc_listencalls() runs every method on the calling
+ * thread, so a single slow method holds up all the other calls. With
+ * workers the thread calling bbus_srvc_listencalls() only receives the
+ * calls and hands them over to the pool, which runs them concurrently and
+ * sends the replies, tagged with the call tokens, in whatever order they
+ * complete. Calls to methods registered with BBUS_METHOD_ORDERED are
+ * still run one at a time in the order received.
+ *
+ * Method callbacks must be thread-safe. Can only be called once, before
+ * listening for calls, and requires 'numworkers' greater than 0.
+ */
+int bbus_srvc_setworkers(bbus_service_connection* conn,
+		unsigned numworkers) BBUS_PUBLIC;
+
 /**
  * @brief Closes the service publisher connection.
  * @param conn The publisher connection to close.
@@ -1295,11 +2721,14 @@ int bbus_srvc_closeconn(bbus_service_connection* conn) BBUS_PUBLIC;
 /**
  * @brief Listens for method calls on an open connection.
  * @param conn The service publisher connection.
- * @param tv Time after which the function will exit with a timeout status.
+ * @param tv Time after which the function will exit with a timeout status,
+ *           NULL to wait until a call arrives.
  * @return An integer indicating the result.
  *
  * Returns 0 if timed out with no method call, -1 in case of an
- * error and 1 if method has been called.
+ * error and 1 if method has been called. Errors returned by the method
+ * are reported to the caller and are not errors here. With workers
+ * enabled, 1 means the call has been handed over to the pool.
  */
 int bbus_srvc_listencalls(bbus_service_connection* conn,
 		struct bbus_timeval* tv) BBUS_PUBLIC;
@@ -1332,6 +2761,8 @@ typedef struct __bbus_client bbus_client;
 #define BBUS_CLIENT_SERVICE	2 /**< Service provider. */
 #define BBUS_CLIENT_MON		3 /**< Busybus monitor. */
 #define BBUS_CLIENT_CTL		4 /**< Busybus control program. */
+#define BBUS_CLIENT_PEER	5 /**< Link to another bus server. */
+#define BBUS_CLIENT_OPENING	6 /**< Session not opened yet. */
 
 /**
  * @brief Stores the unix credentials of the client process.
@@ -1375,16 +2806,128 @@ int bbus_client_gettype(bbus_client* cli) BBUS_PUBLIC;
  */
 const char* bbus_client_getname(bbus_client* cli) BBUS_PUBLIC;
 
+/**
+ * @brief Returns the socket descriptor of the client connection.
+ * @param cli The client.
+ * @return The descriptor, unique among the connected clients.
+ */
+int bbus_client_getsock(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the private data pointer associated with this client.
+ * @param cli The client.
+ * @return Pointer set with bbus_client_setpriv() or NULL.
+ */
+void* bbus_client_getpriv(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Associates a private data pointer with this client.
+ * @param cli The client.
+ * @param priv Pointer to store.
+ *
+ * Allows the server implementation to go from a client object returned
+ * by the pollset directly to its own bookkeeping data.
+ */
+void bbus_client_setpriv(bbus_client* cli, void* priv) BBUS_PUBLIC;
+
+/**
+ * @brief Checks without blocking whether there's data waiting on the socket.
+ * @param cli The client.
+ * @return 1 if there's data or the peer hung up, 0 if not, -1 on error.
+ *
+ * Used to drain a client after an edge-triggered event.
+ */
+int bbus_client_haspending(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether the client connected with BBUS_CONN_BUSYPOLL.
+ * @param cli The client.
+ * @return 1 if the client wants to be served busy-polling, 0 otherwise.
+ */
+int bbus_client_busypoll(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether the client agreed to host byte order objects.
+ * @param cli The client.
+ * @return 1 if objects in host byte order can be sent to the client.
+ *
+ * Clients which didn't agree must only be sent objects in network byte
+ * order.
+ */
+int bbus_client_hostorder(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether the client agreed to compressed objects.
+ * @param cli The client.
+ * @return 1 if compressed objects can be sent to the client.
+ */
+int bbus_client_compression(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether descriptors can be passed to the client.
+ * @param cli The client.
+ * @return 1 for clients on local transports, 0 on network transports.
+ */
+int bbus_client_passfds(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether the service provider is another daemon's bridge.
+ * @param cli The client.
+ * @return 1 if the client opened the session with BBUS_SO_BRIDGE set.
+ *
+ * Calls passed to bridges must carry full method paths.
+ */
+int bbus_client_isbridge(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Checks whether an object can be passed on to a client as is.
+ * @param cli The client.
+ * @param objflags BBUS_PROT_OBJFLAGS of the message carrying the object.
+ * @return 0 if it can, -1 if the client didn't agree to the object's
+ *         encoding - BBUS_ENOHOSTORDER or BBUS_ENOCOMPRESSION is set.
+ */
+int bbus_client_acceptsobj(bbus_client* cli, int objflags) BBUS_PUBLIC;
+
+/**
+ * @brief Switches the client connection to the non-blocking mode.
+ * @param cli The client.
+ * @return 0 on success, -1 on error.
+ *
+ * In non-blocking mode partially received messages are kept in a per-client
+ * read buffer until they're complete and data that can't be sent right
+ * away is queued and sent once the socket becomes writable. The client
+ * must be flushed with bbus_client_flush() when reported by the pollset.
+ */
+int bbus_client_setnonblock(bbus_client* cli) BBUS_PUBLIC;
+
 /**
  * @brief Receive a full message from client.
  * @param cli The client.
  * @param buf Buffer for the message to be stored in.
  * @param bufsize Size of 'buf'.
  * @return 0 on success, -1 on error.
+ *
+ * For non-blocking clients -1 is returned and the error is set to
+ * BBUS_EAGAIN if there's no complete message to return yet.
  */
 int bbus_client_rcvmsg(bbus_client* cli, struct bbus_msg* buf,
 		size_t bufsize) BBUS_PUBLIC;
 
+/**
+ * @brief Receive a full message from client into a growable buffer.
+ * @param cli The client.
+ * @param buf Address of the message buffer, may point to NULL.
+ * @param bufsize Address of the size of '*buf'.
+ * @return 0 on success, -1 on error.
+ *
+ * Works like bbus_client_rcvmsg(), but reallocates '*buf' and updates
+ * '*bufsize' with bbus_realloc() if the message doesn't fit. Messages with
+ * payloads up to BBUS_MAXLARGEPLOADSIZE can be received this way. The buffer
+ * must be freed by the caller using bbus_free().
+ */
+int bbus_client_rcvmsg_dyn(bbus_client* cli, struct bbus_msg** buf,
+				size_t* bufsize) BBUS_PUBLIC;
+
 /**
  * @brief Send a full message to the client.
  * @param cli The client.
@@ -1396,6 +2939,95 @@ int bbus_client_rcvmsg(bbus_client* cli, struct bbus_msg* buf,
 int bbus_client_sendmsg(bbus_client* cli, struct bbus_msg_hdr* hdr,
 		const char* meta, bbus_object* obj) BBUS_PUBLIC;
 
+/**
+ * @brief Send a full message with already marshalled object data.
+ * @param cli The client.
+ * @param hdr Header of the message to send.
+ * @param meta Meta data of the message (can be NULL).
+ * @param obj Marshalled object data (can be NULL).
+ * @param objsize Size of the object data.
+ * @return 0 if a full message has been properly sent, -1 on error.
+ *
+ * Allows to forward an object received in another message straight
+ * from the receive buffer.
+ */
+int bbus_client_sendbuf(bbus_client* cli, struct bbus_msg_hdr* hdr,
+		const char* meta, const void* obj, size_t objsize) BBUS_PUBLIC;
+
+/**
+ * @brief Send a message with the object data passed as a descriptor.
+ * @param cli The client.
+ * @param hdr Header of the message to send.
+ * @param meta Meta data of the message (can be NULL).
+ * @param fd Descriptor to pass, usually a memfd holding the object.
+ * @return 0 if the message has been sent or queued, -1 on error.
+ *
+ * Sets BBUS_PROT_HASFD in the header. The payload size must only cover
+ * 'meta'. The descriptor is closed once it has been passed to the client,
+ * or when an error occurs. Fails with BBUS_ENOFDPASS for clients connected
+ * over network transports.
+ */
+int bbus_client_sendfd(bbus_client* cli, struct bbus_msg_hdr* hdr,
+		const char* meta, int fd) BBUS_PUBLIC;
+
+/**
+ * @brief Takes the descriptor received with the last message.
+ * @param cli The client.
+ * @return The descriptor or -1 if the last message carried none.
+ *
+ * Only messages with BBUS_PROT_HASFD set carry a descriptor. It must be
+ * closed by the caller. If not taken, it's closed when the next message
+ * is received.
+ */
+int bbus_client_takefd(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Sends as much of the queued outgoing data as possible.
+ * @param cli The client.
+ * @return 0 on success (even if some data remains queued), -1 on error.
+ *
+ * Only non-blocking clients queue data, for others it's a no-op.
+ */
+int bbus_client_flush(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Corks or uncorks a non-blocking client.
+ * @param cli The client.
+ * @param on 1 to cork the client, 0 to uncork it.
+ * @return 0 on success, -1 on error.
+ *
+ * Messages sent to a corked client that belongs to a pollset are only
+ * queued, so that all messages produced for it in one iteration of the
+ * event loop go out with a single sendmsg(). The owner of the pollset
+ * flushes them using bbus_pollset_nextdirty(). Uncorking flushes the
+ * client right away. Fails with BBUS_EINVALARG for blocking clients.
+ */
+int bbus_client_setcork(bbus_client* cli, int on) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the number of bytes queued for sending to this client.
+ * @param cli The client.
+ * @return Number of queued bytes.
+ */
+size_t bbus_client_wrqueued(bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Default limit of data queued for a non-blocking client.
+ */
+#define BBUS_CLIENT_DEFWRQUEUE						\
+	(BBUS_MAXLARGEPLOADSIZE + 64 * BBUS_MAXMSGSIZE)
+
+/**
+ * @brief Changes the limit of data queued for a non-blocking client.
+ * @param cli The client.
+ * @param size New limit in bytes.
+ *
+ * Messages which would make the queue exceed the limit are rejected with
+ * BBUS_ENOSPACE. Data already queued is kept even if it exceeds the new
+ * limit.
+ */
+void bbus_client_setmaxwrqueue(bbus_client* cli, size_t size) BBUS_PUBLIC;
+
 /**
  * @brief Closes the client connection.
  * @param cli The client.
@@ -1421,9 +3053,20 @@ typedef struct __bbus_server bbus_server;
 /**
  * @brief Creates a server instance.
  * @return Pointer to the newly created server instance or NULL on error.
+ *
+ * The server is bound to the address returned by bbus_prot_getsockpath().
  */
 bbus_server* bbus_srv_create(void) BBUS_PUBLIC;
 
+/**
+ * @brief Creates a server instance bound to a given address.
+ * @param addr Any address described for BBUS_ENV_SOCKPATH.
+ * @return Pointer to the newly created server instance or NULL on error.
+ *
+ * Lets a single process serve clients over several transports.
+ */
+bbus_server* bbus_srv_create_addr(const char* addr) BBUS_PUBLIC;
+
 /**
  * @brief Sets the server into listening mode.
  * @param srv The server.
@@ -1481,10 +3124,59 @@ struct bbus_accept_callbacks
  *
  * The 'authfunc' pointer can be NULL - in that case no authentication will
  * be performed and every client will be accepted.
+ *
+ * Clients connected over network transports have no credentials - 'authfunc'
+ * receives a pid of 0 and uid and gid of -1.
  */
 bbus_client* bbus_srv_accept(bbus_server* srv,
 		const struct bbus_accept_callbacks* funcs) BBUS_PUBLIC;
 
+/**
+ * @brief Accepts a client connection without waiting for its session open.
+ * @param srv The server.
+ * @param funcs Callback functions.
+ * @return New non-blocking client of type BBUS_CLIENT_OPENING or NULL on
+ * error - BBUS_EAGAIN if there are no more connections pending.
+ *
+ * Credentials are checked with 'auth' right away; the session itself is
+ * opened with bbus_srv_handshake() once the client has sent its request,
+ * so the caller can keep serving others in the meantime. The server socket
+ * is switched to non-blocking mode - afterwards bbus_srv_accept() fails
+ * with EAGAIN instead of waiting if no connection is pending.
+ */
+bbus_client* bbus_srv_acceptnb(bbus_server* srv,
+		const struct bbus_accept_callbacks* funcs) BBUS_PUBLIC;
+
+/**
+ * @brief Continues opening the session of a client from bbus_srv_acceptnb().
+ * @param cli The client.
+ * @param funcs Callback functions, 'auth' isn't used.
+ * @return 1 once the session is open, 0 if the session open request hasn't
+ * fully arrived yet and -1 on error.
+ *
+ * Call it whenever the pollset reports the client. When it returns 1 the
+ * client has its real type and name, and the answer has been sent or
+ * queued in its write buffer.
+ */
+int bbus_srv_handshake(bbus_client* cli,
+		const struct bbus_accept_callbacks* funcs) BBUS_PUBLIC;
+
+/**
+ * @brief Opens a session with another bus server on behalf of this one.
+ * @param addr Address of the other server.
+ * @param name Name this side of the link is known by.
+ * @return New client of type BBUS_CLIENT_PEER or NULL on error.
+ *
+ * The other server sees a service provider with BBUS_SO_BRIDGE set. The
+ * returned client is used just like the accepted ones: it receives the
+ * calls made to the methods it registers and sends back the replies.
+ * Connecting and opening the session give up after BBUS_PEER_TIMEOUTMS.
+ */
+bbus_client* bbus_srv_connectpeer(const char* addr,
+				const char* name) BBUS_PUBLIC;
+
+#define BBUS_PEER_TIMEOUTMS	2000 /**< Session open timeout for peers. */
+
 /**
  * @brief Stops listening on a server socket and closes it.
  * @param srv The server.
@@ -1511,6 +3203,15 @@ void bbus_srv_free(bbus_server* srv) BBUS_PUBLIC;
  * @brief Opaque pollset object.
  *
  * Stores server and client objects in a form suitable for polling.
+ * Objects stay registered across calls to bbus_poll() until removed.
+ *
+ * On Linux the pollset is backed by epoll in edge-triggered mode, which
+ * means that a client reported as ready must be read until there's no
+ * more data pending (see bbus_client_haspending()) or it won't be reported
+ * again. Where the kernel supports it, multishot io_uring polls with the
+ * same edge-triggered semantics replace epoll, and the data queued for
+ * corked clients is sent in a single batch (see bbus_pollset_nextdirty()).
+ * Other systems, or builds with BBUS_POLL_SELECT defined, use select().
  */
 typedef struct __bbus_pollset bbus_pollset;
 
@@ -1523,30 +3224,52 @@ bbus_pollset* bbus_pollset_make(void) BBUS_PUBLIC;
 /**
  * @brief Clears an existing pollset object.
  * @param pset The pollset.
+ *
+ * Removes all registered server and client objects.
  */
 void bbus_pollset_clear(bbus_pollset* pset) BBUS_PUBLIC;
 
+#define BBUS_POLLSET_MAXSRVS	4 /**< Servers watched by a single pollset. */
+
 /**
  * @brief Adds a server object to the pollset.
  * @param pset The pollset.
  * @param src The server.
+ * @return 0 on success, -1 on error.
+ *
+ * Up to BBUS_POLLSET_MAXSRVS server objects can be watched by a pollset,
+ * e.g. servers listening on different transports.
  */
-void bbus_pollset_addsrv(bbus_pollset* pset, bbus_server* src) BBUS_PUBLIC;
+int bbus_pollset_addsrv(bbus_pollset* pset, bbus_server* src) BBUS_PUBLIC;
 
 /**
  * @brief Adds a client to the pollset.
  * @param pset The pollset.
  * @param cli The client.
+ * @return 0 on success, -1 on error.
+ */
+int bbus_pollset_addcli(bbus_pollset* pset, bbus_client* cli) BBUS_PUBLIC;
+
+/**
+ * @brief Removes a client from the pollset.
+ * @param pset The pollset.
+ * @param cli The client.
+ *
+ * Must be called before the client is closed. The client won't be returned
+ * by bbus_pollset_nextcli() even if it's been reported by the last poll.
  */
-void bbus_pollset_addcli(bbus_pollset* pset, bbus_client* cli) BBUS_PUBLIC;
+void bbus_pollset_rmcli(bbus_pollset* pset, bbus_client* cli) BBUS_PUBLIC;
 
 /**
  * @brief Performs an I/O poll on all the objects set within 'pset'.
  * @param pset The pollset.
- * @param tv Time value that is a struct bbus_timeval.
+ * @param tv Time value that is a struct bbus_timeval, NULL to wait until
+ *           there's I/O or the pollset is woken up.
  * @return Number of descriptors ready for I/O, 0 on timeout or -1 on error.
  *
- * Checks only whether there are descriptors ready for reading.
+ * Checks whether there are descriptors ready for reading and, for clients
+ * with queued outgoing data, for writing. The epoll backend doesn't
+ * update 'tv'.
  */
 int bbus_poll(bbus_pollset* pset, struct bbus_timeval* tv) BBUS_PUBLIC;
 
@@ -1566,6 +3289,51 @@ int bbus_pollset_srvisset(bbus_pollset* pset, bbus_server* srv) BBUS_PUBLIC;
  */
 int bbus_pollset_cliisset(bbus_pollset* pset, bbus_client* cli) BBUS_PUBLIC;
 
+/**
+ * @brief Interrupts bbus_poll() waiting on this pollset.
+ * @param pset The pollset.
+ * @return 0 on success, -1 on error.
+ *
+ * Unlike other pollset functions, this one can be called from any thread.
+ * Once woken, bbus_pollset_woken() returns true until the next call to
+ * bbus_poll().
+ */
+int bbus_pollset_wakeup(bbus_pollset* pset) BBUS_PUBLIC;
+
+/**
+ * @brief Checks if the last bbus_poll() has been interrupted by a wakeup.
+ * @param pset The pollset.
+ * @return 1 if bbus_pollset_wakeup() has been called, 0 otherwise.
+ */
+int bbus_pollset_woken(bbus_pollset* pset) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the next client reported as ready by the last poll.
+ * @param pset The pollset.
+ * @return Next ready client or NULL if there are no more.
+ *
+ * Lets the caller visit only the ready clients instead of checking every
+ * registered one with bbus_pollset_cliisset().
+ */
+bbus_client* bbus_pollset_nextcli(bbus_pollset* pset) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the next corked client with data waiting to be flushed.
+ * @param pset The pollset.
+ * @return Next such client or NULL if there are no more.
+ *
+ * Every client is returned once after it queued its first message since
+ * the last time it was returned. It should be passed to bbus_client_flush().
+ */
+bbus_client* bbus_pollset_nextdirty(bbus_pollset* pset) BBUS_PUBLIC;
+
+/**
+ * @brief Returns the name of the mechanism used by the pollset.
+ * @param pset The pollset.
+ * @return "io_uring", "epoll" or "select".
+ */
+const char* bbus_pollset_backend(bbus_pollset* pset) BBUS_PUBLIC;
+
 /**
  * @brief Disposes of a pollset object.
  * @param pset The pollset to free.
@@ -14,13 +14,102 @@
 
 #include <busybus.h>
 #include "protocol.h"
+#include "object.h"
 #include "socket.h"
 #include "error.h"
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 
 struct __bbus_client_connection
 {
 	int sock;
+	unsigned lastcallid;
+	/* Replies received, but not yet collected by the user. */
+	struct bbus_list replies;
+	bbus_hashmap* replymap;
+	/* Signals received, but not yet collected by the user. */
+	struct bbus_list signals;
+	/* Receive buffer, grown on demand. */
+	struct bbus_msg* rcvbuf;
+	size_t rcvbufsize;
+	/* Arguments this big are passed in shared memory, 0 if never. */
+	size_t shmthreshold;
+	/* Microseconds spent spinning before sleeping on the socket. */
+	unsigned busypoll;
+	/* The server agreed to host byte order objects. */
+	int hostorder;
+	/* The server agreed to compressed objects. */
+	int compression;
+	/* Arguments this big are compressed, 0 if never. */
+	size_t comprthreshold;
+};
+
+/*
+ * Completed asynchronous call. Stored in the connection both in the order
+ * of arrival and in a map indexed by call id.
+ */
+struct call_reply
+{
+	struct call_reply* next;
+	struct call_reply* prev;
+	unsigned callid;
+	int errnum;
+	bbus_object* obj;
+};
+
+struct __bbus_method_handle
+{
+	char* method;
+	unsigned route;
+};
+
+struct signal_msg
+{
+	struct signal_msg* next;
+	struct signal_msg* prev;
+	char* signame;
+	bbus_object* obj;
+};
+
+/* Method registered by a service, the values of the methods map. */
+struct srvc_method
+{
+	bbus_method_func func;
+	int flags;
+	/* BBUS_METHOD_ORDERED: protected by the pool lock. */
+	int busy;
+	struct bbus_list backlog;
+	/* Unregistered methods are kept until the connection is closed. */
+	struct srvc_method* nextretired;
+};
+
+/* Call received by the reader and waiting for a worker. */
+struct srvc_call
+{
+	struct srvc_call* next;
+	struct srvc_call* prev;
+	struct srvc_method* mthd;	/* NULL if there's no such method. */
+	unsigned token;
+	int fd;
+	int objflags;			/* Flags describing the argument. */
+	size_t size;
+	char data[0];			/* Raw argument object. */
+};
+
+struct srvc_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bbus_list queue;
+	int stop;
+	/* Serializes the replies. */
+	pthread_mutex_t sendlock;
+	unsigned numthreads;
+	pthread_t threads[0];
 };
 
 struct __bbus_service_connection
@@ -28,26 +117,53 @@ struct __bbus_service_connection
 	int sock;
 	char* srvname;
 	bbus_hashmap* methods;
+	struct bbus_msg* rcvbuf;
+	size_t rcvbufsize;
+	size_t shmthreshold;
+	bbus_obj_pool* pool; /* Reused for call arguments. */
+	struct srvc_pool* workers; /* NULL if calls are handled inline. */
+	/* Calls queued for the workers may still use these. */
+	struct srvc_method* retired;
+	/* The server agreed to host byte order objects. */
+	int hostorder;
+	int compression;
+	size_t comprthreshold;
 };
 
-static int do_session_open(const char* path, int clitype, const char* name)
+/*
+ * 'soflags' are BBUS_SO_* options passed in the session open token.
+ * Every session asks for host byte order objects, 'hostorder' is set to 1
+ * if the server agrees. Compressed objects are only asked for if
+ * 'compression' is not NULL, likewise it's set to 1 if the server agrees.
+ */
+static int do_session_open(const char* path, int clitype,
+			const char* name, int soflags, int* hostorder,
+			int* compression)
 {
 	int r;
 	struct bbus_msg_hdr hdr;
+	struct __bbus_sockaddr addr;
 	int sock;
 
-	sock = __bbus_sock_un_mksocket();
+	r = __bbus_sock_parseaddr(path, &addr);
+	if (r < 0)
+		goto errout;
+
+	sock = __bbus_sock_mksocket(&addr);
 	if (sock < 0)
 		goto errout;
 
-	r = __bbus_sock_un_connect(sock, path);
+	r = __bbus_sock_connect(sock, &addr);
 	if (r < 0)
-		goto errout;
+		goto errout_close;
 
 	memset(&hdr, 0, BBUS_MSGHDR_SIZE);
 	__bbus_prot_hdrsetmagic(&hdr);
 	hdr.msgtype = BBUS_MSGTYPE_SO;
 	hdr.sotype = clitype;
+	hdr.flags = BBUS_PROT_HOSTORDER;
+	bbus_hdr_settoken(&hdr, soflags | __BBUS_SO_HOSTENDIAN
+			| (compression != NULL ? BBUS_SO_COMPRESSION : 0));
 	if (name) {
 		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
 		bbus_hdr_setpsize(&hdr, strlen(name)+1);
@@ -62,6 +178,10 @@ static int do_session_open(const char* path, int clitype, const char* name)
 		goto errout_close;
 
 	if (hdr.msgtype == BBUS_MSGTYPE_SOOK) {
+		*hostorder = !!BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_HOSTORDER);
+		if (compression != NULL)
+			*compression = !!BBUS_HDR_ISFLAGSET(&hdr,
+						BBUS_PROT_COMPRESSED);
 		return sock;
 	} else
 	if (hdr.msgtype == BBUS_MSGTYPE_SORJCT) {
@@ -97,308 +217,1532 @@ static int send_session_close(int sock)
 }
 
 bbus_client_connection* bbus_connect(const char* name)
+{
+	return bbus_connect_flags(name, 0);
+}
+
+bbus_client_connection* bbus_connect_flags(const char* name, int flags)
 {
 	int sock;
+	int hostorder;
+	int compression;
 	bbus_client_connection* conn;
 
-	sock = do_session_open(bbus_prot_getsockpath(),
-				BBUS_SOTYPE_MTHCL, name);
+	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_MTHCL,
+			name, flags & BBUS_CONN_BUSYPOLL ? BBUS_SO_BUSYPOLL : 0,
+			&hostorder, &compression);
 	if (sock < 0)
 		return NULL;
 
-	conn = bbus_malloc(sizeof(struct __bbus_client_connection));
+	conn = bbus_malloc0(sizeof(struct __bbus_client_connection));
 	if (conn == NULL)
 		return NULL;
 	conn->sock = sock;
+	conn->hostorder = hostorder;
+	conn->compression = compression;
+	if (flags & BBUS_CONN_BUSYPOLL)
+		conn->busypoll = BBUS_BUSYPOLL_DEFUSEC;
 	return conn;
 }
 
-bbus_object* bbus_callmethod(bbus_client_connection* conn,
-		const char* method, bbus_object* arg)
+static int use_shm(size_t threshold, bbus_object* obj)
 {
-	int r;
-	struct bbus_msg_hdr hdr;
-	size_t metasize;
-	size_t objsize;
-	char buf[BBUS_MAXMSGSIZE];
+	return (obj != NULL) && (threshold > 0)
+			&& (bbus_obj_rawsize(obj) >= threshold);
+}
 
-	metasize = strlen(method) + 1;
-	objsize = bbus_obj_rawsize(arg);
-	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
-	__bbus_prot_hdrsetmagic(&hdr);
-	hdr.msgtype = BBUS_MSGTYPE_CLICALL;
-	bbus_hdr_setpsize(&hdr, metasize + objsize);
-	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
-	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+/*
+ * Sends the message with the object stored in a memfd. The payload size
+ * in 'hdr' must only cover 'meta'.
+ */
+static int send_shm(int sock, struct bbus_msg_hdr* hdr,
+				const char* meta, bbus_object* obj)
+{
+	int fd;
+	int r;
 
-	r = __bbus_prot_sendvmsg(conn->sock, &hdr, method,
-			bbus_obj_rawdata(arg), objsize);
-	if (r < 0)
-		return NULL;
+	fd = bbus_obj_tofd(obj);
+	if (fd < 0)
+		return -1;
 
-	memset(&hdr, 0, BBUS_MSGHDR_SIZE);
-	memset(buf, 0, BBUS_MAXMSGSIZE);
-	r = __bbus_prot_recvvmsg(conn->sock, &hdr, buf,
-			BBUS_MAXMSGSIZE - BBUS_MSGHDR_SIZE);
-	if (r < 0)
-		return NULL;
+	r = __bbus_prot_sendvmsgfd(sock, hdr, meta, fd);
+	close(fd);
 
-	if (hdr.msgtype == BBUS_MSGTYPE_CLIREPLY) {
-		if (hdr.errcode != 0) {
-			__bbus_seterr(__bbus_prot_errtoerrnum(hdr.errcode));
-			return NULL;
-		}
-		return bbus_obj_frombuf(buf, BBUS_MAXMSGSIZE);
-	} else {
-		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
-		return NULL;
-	}
+	return r;
 }
 
-/* TODO Refactor common code for bbus_connect and this. */
-bbus_client_connection* bbus_mon_connect(void)
+/*
+ * Compresses objects at least 'threshold' bytes long if the server agreed
+ * to it. Returns the data to send instead of the object's and sets the
+ * flag in 'hdr' or returns NULL if the object is to be sent as is.
+ */
+static void* compress_obj(struct bbus_msg_hdr* hdr, bbus_object* obj,
+			int compression, size_t threshold, size_t* size)
 {
-	int sock;
-	bbus_client_connection* conn;
+	void* buf;
 
-	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_MON, NULL);
-	if (sock < 0)
+	if (!compression || (obj == NULL) || (threshold == 0)
+				|| (bbus_obj_rawsize(obj) < threshold))
 		return NULL;
 
-	conn = bbus_malloc(sizeof(struct __bbus_client_connection));
-	if (conn == NULL)
-		return NULL;
-	conn->sock = sock;
-	return conn;
+	buf = __bbus_obj_compress(obj, size);
+	if (buf != NULL)
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_COMPRESSED);
+
+	return buf;
 }
 
-int bbus_mon_recvmsg(bbus_client_connection* conn,
-		struct bbus_msg* msg, size_t bufsize,
-		struct bbus_timeval* tv, const char** meta, bbus_object** obj)
+static int objflags_order(int objflags)
 {
-	int r;
+	return objflags & BBUS_PROT_HOSTORDER
+			? BBUS_OBJ_HOSTORDER : BBUS_OBJ_NETORDER;
+}
 
-	r = __bbus_sock_rdready(conn->sock, tv);
-	if (r <= 0) {
-		return r;
-	} else {
-		memset(msg, 0, bufsize);
-		r = __bbus_prot_recvmsg(conn->sock, msg, bufsize);
-		if (r < 0)
-			return -1;
-		if (msg->hdr.msgtype != BBUS_MSGTYPE_MON) {
-			__bbus_seterr(BBUS_EMSGINVTYPRCVD);
-			return -1;
-		}
+/*
+ * 'objflags' are the BBUS_PROT_OBJFLAGS of the message. Borrows 'raw'
+ * unless the object has to be decompressed.
+ */
+static bbus_object* obj_frompayload(bbus_obj_pool* pool, int objflags,
+					const void* raw, size_t size)
+{
+	bbus_object* obj;
 
-		if (meta) {
-			if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASMETA)) {
-				*meta = bbus_prot_extractmeta(msg);
-				if (*meta == NULL)
-					return -1;
-			}
-		}
+	if (objflags & BBUS_PROT_COMPRESSED)
+		obj = __bbus_obj_decompress(pool, raw, size);
+	else if (pool != NULL)
+		obj = bbus_obj_view_from(pool, raw, size);
+	else
+		obj = bbus_obj_view(raw, size);
+	if (obj != NULL)
+		bbus_obj_setorder(obj, objflags_order(objflags));
 
-		if (!BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASOBJECT)) {
-			__bbus_seterr(BBUS_EMSGINVTYPRCVD);
-			return -1;
-		}
-		if (obj == NULL) {
-			__bbus_seterr(BBUS_EINVALARG);
-			return -1;
-		}
+	return obj;
+}
 
-		*obj = bbus_prot_extractobj(msg);
-		if (*obj == NULL)
-			return -1;
-	}
+static bbus_object* obj_fromfd(int fd, int order)
+{
+	bbus_object* obj;
 
-	return 1;
+	obj = bbus_obj_fromfd(fd);
+	close(fd);
+	if (obj != NULL)
+		bbus_obj_setorder(obj, order);
+
+	return obj;
 }
 
-int bbus_closeconn(bbus_client_connection* conn)
+/* Objects in host byte order can't go anywhere the server didn't agree. */
+static int set_objorder(struct bbus_msg_hdr* hdr,
+				const bbus_object* obj, int hostorder)
 {
-	int r;
+	if (obj == NULL)
+		return 0;
 
-	r = send_session_close(conn->sock);
-	if (r < 0)
-		r = -1;
-	bbus_free(conn);
+	if (!hostorder && (bbus_obj_getorder(obj) == BBUS_OBJ_HOSTORDER)) {
+		__bbus_seterr(BBUS_ENOHOSTORDER);
+		return -1;
+	}
 
-	return r;
+	bbus_hdr_setobjorder(hdr, obj);
+	return 0;
 }
 
-bbus_service_connection* bbus_srvc_connect(const char* name)
+static unsigned next_callid(bbus_client_connection* conn)
 {
-	int sock;
-	bbus_service_connection* conn;
+	/* Call id 0 is never used. */
+	if (++conn->lastcallid == 0)
+		++conn->lastcallid;
 
-	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_SRVPRV, NULL);
-	if (sock < 0)
-		return NULL;
+	return conn->lastcallid;
+}
 
-	conn = bbus_malloc(sizeof(struct __bbus_service_connection));
-	if (conn == NULL)
-		return NULL;
-	conn->sock = sock;
-	conn->srvname = bbus_str_cpy(name);
-	conn->methods = bbus_hmap_create(BBUS_HMAP_KEYSTR);
-	if (conn->methods == NULL) {
-		__bbus_sock_close(conn->sock);
-		bbus_str_free(conn->srvname);
-		bbus_free(conn);
-		return NULL;
-	}
-	return conn;
+/* Calls by route id ('method' is NULL) carry no meta. */
+static void mkcallhdr(struct bbus_msg_hdr* hdr, unsigned callid,
+				const char* method, bbus_object* arg)
+{
+	memset(hdr, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(hdr);
+	hdr->msgtype = BBUS_MSGTYPE_CLICALL;
+	bbus_hdr_settoken(hdr, callid);
+	bbus_hdr_setpsize(hdr, (method == NULL ? 0 : strlen(method) + 1)
+						+ bbus_obj_rawsize(arg));
+	if (method != NULL)
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASOBJECT);
 }
 
-int bbus_srvc_regmethod(bbus_service_connection* conn,
-		struct bbus_method* method)
+static int call_async(bbus_client_connection* conn, const char* method,
+		unsigned route, bbus_object* arg, unsigned timeout,
+		unsigned* callid)
 {
-	struct bbus_msg_hdr hdr;
-	size_t metasize;
-	char* meta;
 	int r;
+	struct bbus_msg_hdr hdr;
+	unsigned id;
+	void* zbuf;
+	size_t zsize;
 
-	metasize = strlen(conn->srvname) + 1; /* +1 for dot */
-	metasize += strlen(method->name) + 1; /* +1 for comma */
-	metasize += strlen(method->argdscr) + 1; /* +1 for comma */
-	metasize += strlen(method->retdscr) + 1; /* +1 for NULL */
-	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
-	__bbus_prot_hdrsetmagic(&hdr);
-	hdr.msgtype = BBUS_MSGTYPE_SRVREG;
-	bbus_hdr_setpsize(&hdr, metasize);
-	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
-	meta = bbus_str_build("%s.%s,%s,%s",
-					conn->srvname,
-					method->name,
-					method->argdscr,
-					method->retdscr);
-	if (meta == NULL) {
+	id = next_callid(conn);
+	mkcallhdr(&hdr, id, method, arg);
+	if (set_objorder(&hdr, arg, conn->hostorder) < 0)
 		return -1;
+	bbus_hdr_settimeout(&hdr, timeout);
+	bbus_hdr_setroute(&hdr, route);
+	if (use_shm(conn->shmthreshold, arg)) {
+		bbus_hdr_setpsize(&hdr, method == NULL
+					? 0 : strlen(method) + 1);
+		r = send_shm(conn->sock, &hdr, method, arg);
 	} else
-	if (strlen(meta) != (metasize-1)) {
-		bbus_str_free(meta);
-		__bbus_seterr(BBUS_ELOGICERR);
-		return -1;
+	if ((zbuf = compress_obj(&hdr, arg, conn->compression,
+				conn->comprthreshold, &zsize)) != NULL) {
+		bbus_hdr_setpsize(&hdr, (method == NULL
+					? 0 : strlen(method) + 1) + zsize);
+		r = __bbus_prot_sendvmsg(conn->sock, &hdr, method,
+							zbuf, zsize);
+		bbus_free(zbuf);
+	} else {
+		r = __bbus_prot_sendvmsg(conn->sock, &hdr, method,
+			bbus_obj_rawdata(arg), bbus_obj_rawsize(arg));
 	}
-
-	r = __bbus_prot_sendvmsg(conn->sock, &hdr, meta, NULL, 0);
 	if (r < 0)
 		return -1;
 
-	memset(&hdr, 0, BBUS_MSGHDR_SIZE);
-	r = __bbus_prot_recvvmsg(conn->sock, &hdr, NULL, 0);
-	if (r < 0)
-		return -1;
+	*callid = id;
+	return 0;
+}
 
-	if (hdr.msgtype != BBUS_MSGTYPE_SRVACK) {
-		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
-		return -1;
+int bbus_call_async(bbus_client_connection* conn, const char* method,
+		bbus_object* arg, unsigned* callid)
+{
+	return call_async(conn, method, 0, arg, 0, callid);
+}
+
+int bbus_call_batch(bbus_client_connection* conn,
+		struct bbus_batch_call* calls, size_t numcalls)
+{
+	struct iovec iov[__BBUS_PROT_MAXNUMIOV];
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	struct bbus_msg_hdr hdr;
+	size_t bufsize;
+	size_t psize;
+	size_t msgsize;
+	size_t i;
+	char* buf;
+	char* ptr;
+	int numiov;
+	int r;
+
+	if (numcalls == 0)
+		return 0;
+
+	bufsize = 0;
+	for (i = 0; i < numcalls; ++i) {
+		psize = strlen(calls[i].method) + 1
+					+ bbus_obj_rawsize(calls[i].arg);
+		bufsize += psize + (psize > BBUS_MAXPLOADSIZE
+					? BBUS_MSGHDR_MAXWIRESIZE
+					: BBUS_MSGHDR_REALSIZE);
 	}
-	if (hdr.errcode != 0) {
-		__bbus_seterr(__bbus_prot_errtoerrnum(hdr.errcode));
+
+	buf = bbus_malloc(bufsize);
+	if (buf == NULL)
 		return -1;
+
+	/* Pack all the calls back to back and send them at once. */
+	for (i = 0, ptr = buf; i < numcalls; ++i) {
+		calls[i].callid = next_callid(conn);
+		mkcallhdr(&hdr, calls[i].callid,
+				calls[i].method, calls[i].arg);
+		r = __bbus_prot_msgtoiov(&hdr, wire, calls[i].method,
+				bbus_obj_rawdata(calls[i].arg),
+				bbus_obj_rawsize(calls[i].arg),
+				iov, &numiov, &msgsize);
+		if (r < 0)
+			goto out;
+
+		ptr += __bbus_prot_iovtobuf(iov, numiov, ptr);
 	}
 
-	r = bbus_hmap_setstr(conn->methods, method->name,
-			(void*)method->func);
-	if (r < 0)
+	r = __bbus_prot_sendbuf(conn->sock, buf, ptr - buf);
+
+out:
+	bbus_free(buf);
+	return r < 0 ? -1 : 0;
+}
+
+static int queue_signal(bbus_client_connection* conn,
+				const struct bbus_msg* msg)
+{
+	struct signal_msg* sig;
+	const char* signame;
+
+	signame = bbus_prot_extractmeta(msg);
+	if (signame == NULL)
 		return -1;
 
+	sig = bbus_malloc0(sizeof(struct signal_msg));
+	if (sig == NULL)
+		return -1;
+
+	sig->signame = bbus_str_cpy(signame);
+	if (sig->signame == NULL)
+		goto err;
+
+	sig->obj = bbus_prot_extractobj(msg);
+	if (sig->obj == NULL)
+		goto err;
+
+	bbus_list_push(&conn->signals, sig);
 	return 0;
+
+err:
+	bbus_str_free(sig->signame);
+	bbus_free(sig);
+	return -1;
 }
 
-int bbus_srvc_listencalls(bbus_service_connection* conn,
-		struct bbus_timeval* tv)
+static void free_signal(struct signal_msg* sig)
+{
+	bbus_str_free(sig->signame);
+	bbus_obj_free(sig->obj);
+	bbus_free(sig);
+}
+
+/*
+ * Receives a single reply from the daemon. The returned reply is not
+ * stored in the connection. Signals received in the meantime are queued
+ * in the connection - NULL is returned with BBUS_EAGAIN if the message
+ * was a signal.
+ */
+static struct call_reply* recv_reply(bbus_client_connection* conn)
 {
 	int r;
-	struct bbus_msg_hdr hdr;
-	char buf[BBUS_MAXMSGSIZE];
-	const char* meta;
-	bbus_object* objarg;
-	bbus_object* objret;
-	void* callback;
-	unsigned token;
+	int fd = -1;
 	struct bbus_msg* msg;
+	struct call_reply* reply;
 
-	msg = (struct bbus_msg*)buf;
-	r = __bbus_sock_rdready(conn->sock, tv);
-	if (r < 0) {
-		return -1;
-	} else
-	if (r == 0) {
-		/* Timeout */
-		return 0;
-	} else {
-		/* Message incoming */
-		memset(buf, 0, BBUS_MAXMSGSIZE);
-		r = __bbus_prot_recvmsg(conn->sock, msg, BBUS_MAXMSGSIZE);
-		if (r < 0)
-			return -1;
-		if (msg->hdr.msgtype != BBUS_MSGTYPE_SRVCALL) {
-			__bbus_seterr(BBUS_EMSGINVTYPRCVD);
-			return -1;
-		}
+	r = __bbus_prot_recvmsgdyn(conn->sock,
+				&conn->rcvbuf, &conn->rcvbufsize, &fd);
+	if (r < 0)
+		return NULL;
 
-		token = bbus_hdr_gettoken(&msg->hdr);
-		meta = bbus_prot_extractmeta(msg);
-		if (meta == NULL) {
-			__bbus_seterr(BBUS_EMSGINVFMT);
-			return -1;
-		}
+	msg = conn->rcvbuf;
+	if (msg->hdr.msgtype == BBUS_MSGTYPE_SRVSIG) {
+		if (fd >= 0)
+			close(fd);
+		if (queue_signal(conn, msg) < 0)
+			return NULL;
+		__bbus_seterr(BBUS_EAGAIN);
+		return NULL;
+	}
 
-		objarg = bbus_prot_extractobj(msg);
-		if (objarg == NULL) {
-			__bbus_seterr(BBUS_EMSGINVFMT);
-			return -1;
-		}
+	if (msg->hdr.msgtype != BBUS_MSGTYPE_CLIREPLY) {
+		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+		goto err;
+	}
 
-		memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
-		__bbus_prot_hdrsetmagic(&hdr);
-		hdr.msgtype = BBUS_MSGTYPE_SRVREPLY;
-		bbus_hdr_settoken(&hdr, token);
-		objret = NULL;
-		callback = bbus_hmap_findstr(conn->methods, meta);
-		if (callback == NULL) {
-			hdr.errcode = BBUS_PROT_ENOMETHOD;
-			__bbus_seterr(BBUS_ENOMETHOD);
-			goto send_reply;
-		}
+	reply = bbus_malloc0(sizeof(struct call_reply));
+	if (reply == NULL)
+		goto err;
 
-		objret = ((bbus_method_func)callback)(objarg);
-		if (objret == NULL) {
-			hdr.errcode = BBUS_PROT_EMETHODERR;
-			__bbus_seterr(BBUS_EMETHODERR);
-			goto send_reply;
+	reply->callid = bbus_hdr_gettoken(&msg->hdr);
+	if (msg->hdr.errcode != 0) {
+		reply->errnum = __bbus_prot_errtoerrnum(msg->hdr.errcode);
+	} else {
+		if (fd >= 0) {
+			reply->obj = obj_fromfd(fd,
+					bbus_hdr_getobjorder(&msg->hdr));
+			fd = -1;
+		} else {
+			reply->obj = bbus_prot_extractobj(msg);
 		}
+		if (reply->obj == NULL)
+			reply->errnum = bbus_lasterror();
+	}
 
-		bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(objret));
-		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	if (fd >= 0)
+		close(fd);
+	return reply;
 
-send_reply:
-		r = __bbus_prot_sendvmsg(conn->sock, &hdr, NULL,
-			objret == NULL ? NULL : bbus_obj_rawdata(objret),
-			objret == NULL ? 0 : bbus_obj_rawsize(objret));
-		if (r < 0)
-			return -1;
+err:
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
 
-		bbus_obj_free(objret);
-		bbus_obj_free(objarg);
+/*
+ * Marks calls whose callers have given up waiting in the reply map. Their
+ * replies are dropped as soon as they arrive.
+ */
+static char abandoned;
+
+static int map_reply(bbus_client_connection* conn, unsigned callid,
+							void* val)
+{
+	if (conn->replymap == NULL) {
+		conn->replymap = bbus_hmap_create(BBUS_HMAP_KEYUINT);
+		if (conn->replymap == NULL)
+			return -1;
 	}
 
-	return hdr.errcode == 0 ? 0 : -1;
+	return bbus_hmap_setuint(conn->replymap, callid, val);
 }
 
-int bbus_srvc_closeconn(bbus_service_connection* conn)
+static int store_reply(bbus_client_connection* conn, struct call_reply* reply)
 {
 	int r;
 
-	r = send_session_close(conn->sock);
+	r = map_reply(conn, reply->callid, reply);
 	if (r < 0)
 		return -1;
-	bbus_str_free(conn->srvname);
-	bbus_hmap_free(conn->methods);
+	bbus_list_push(&conn->replies, reply);
+
+	return 0;
+}
+
+static void free_reply(struct call_reply* reply)
+{
+	bbus_obj_free(reply->obj);
+	bbus_free(reply);
+}
+
+/*
+ * Same as recv_reply(), but skips the replies nobody waits for anymore.
+ * Returns NULL with BBUS_EAGAIN if only such a reply has been received.
+ */
+static struct call_reply* recv_wanted_reply(bbus_client_connection* conn)
+{
+	struct call_reply* reply;
+
+	reply = recv_reply(conn);
+	if (reply == NULL)
+		return NULL;
+
+	if ((conn->replymap != NULL) && (bbus_hmap_finduint(conn->replymap,
+					reply->callid) == &abandoned)) {
+		(void)bbus_hmap_rmuint(conn->replymap, reply->callid);
+		free_reply(reply);
+		__bbus_seterr(BBUS_EAGAIN);
+		return NULL;
+	}
+
+	return reply;
+}
+
+static void unstore_reply(bbus_client_connection* conn,
+				struct call_reply* reply)
+{
+	bbus_list_rm(&conn->replies, reply);
+	(void)bbus_hmap_rmuint(conn->replymap, reply->callid);
+}
+
+/*
+ * Frees the reply and returns the object it contained, sets the error
+ * if the call failed.
+ */
+static bbus_object* reply_to_obj(struct call_reply* reply)
+{
+	bbus_object* obj;
+
+	obj = reply->obj;
+	if (obj == NULL)
+		__bbus_seterr(reply->errnum);
+	bbus_free(reply);
+
+	return obj;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Polls the socket without blocking for at most conn->busypoll
+ * microseconds, but not longer than 'tv', which is updated.
+ */
+static int spin_rdready(bbus_client_connection* conn, struct bbus_timeval* tv)
+{
+	uint64_t start;
+	uint64_t budget;
+	uint64_t left;
+	uint64_t spent;
+	int r;
+
+	budget = conn->busypoll;
+	if (tv != NULL) {
+		left = (uint64_t)tv->sec * 1000000ULL + tv->usec;
+		if (left < budget)
+			budget = left;
+	}
+
+	start = now_usec();
+	do {
+		r = __bbus_sock_haspending(conn->sock);
+		if (r == 0)
+			(void)sched_yield();
+		spent = now_usec() - start;
+	} while ((r == 0) && (spent < budget));
+
+	if (tv != NULL) {
+		left -= spent < left ? spent : left;
+		tv->sec = left / 1000000;
+		tv->usec = left % 1000000;
+	}
+
+	return r;
+}
+
+/*
+ * Waits until there's something to read or 'tv' passes. If 'tv' is NULL,
+ * the caller will block in recv() anyway, so 1 is returned right away.
+ */
+static int wait_rdready(bbus_client_connection* conn, struct bbus_timeval* tv)
+{
+	int r;
+
+	if (conn->busypoll > 0) {
+		r = spin_rdready(conn, tv);
+		if (r != 0)
+			return r;
+	}
+
+	if (tv == NULL)
+		return 1;
+
+	return __bbus_sock_rdready(conn->sock, tv);
+}
+
+int bbus_call_poll(bbus_client_connection* conn, struct bbus_timeval* tv,
+		unsigned* callid, bbus_object** ret)
+{
+	struct call_reply* reply;
+	int r;
+
+	reply = (struct call_reply*)conn->replies.head;
+	if (reply != NULL) {
+		unstore_reply(conn, reply);
+	} else {
+		do {
+			r = wait_rdready(conn, tv);
+			if (r <= 0)
+				return r;
+
+			reply = recv_wanted_reply(conn);
+		} while ((reply == NULL) && (bbus_lasterror() == BBUS_EAGAIN));
+		if (reply == NULL)
+			return -1;
+	}
+
+	*callid = reply->callid;
+	*ret = reply_to_obj(reply);
+	return 1;
+}
+
+/*
+ * Waits for the reply to given call, indefinitely if 'tv' is NULL. On
+ * timeout the call is abandoned.
+ */
+static bbus_object* call_wait(bbus_client_connection* conn, unsigned callid,
+						struct bbus_timeval* tv)
+{
+	struct call_reply* reply;
+	int r;
+
+	if (conn->replymap != NULL) {
+		reply = bbus_hmap_finduint(conn->replymap, callid);
+		if (reply != NULL) {
+			unstore_reply(conn, reply);
+			return reply_to_obj(reply);
+		}
+	}
+
+	for (;;) {
+		r = wait_rdready(conn, tv);
+		if (r < 0)
+			return NULL;
+		if (r == 0) {
+			(void)map_reply(conn, callid, &abandoned);
+			__bbus_seterr(BBUS_ETIMEDOUT);
+			return NULL;
+		}
+
+		reply = recv_wanted_reply(conn);
+		if (reply == NULL) {
+			if (bbus_lasterror() == BBUS_EAGAIN)
+				continue;
+			return NULL;
+		}
+
+		if (reply->callid == callid)
+			return reply_to_obj(reply);
+
+		/* Reply to a different call - keep it for later. */
+		r = store_reply(conn, reply);
+		if (r < 0) {
+			free_reply(reply);
+			return NULL;
+		}
+	}
+}
+
+bbus_object* bbus_call_wait(bbus_client_connection* conn, unsigned callid)
+{
+	return call_wait(conn, callid, NULL);
+}
+
+bbus_object* bbus_callmethod(bbus_client_connection* conn,
+		const char* method, bbus_object* arg)
+{
+	unsigned callid;
+	int r;
+
+	r = bbus_call_async(conn, method, arg, &callid);
+	if (r < 0)
+		return NULL;
+
+	return bbus_call_wait(conn, callid);
+}
+
+bbus_object* bbus_callmethod_timeout(bbus_client_connection* conn,
+		const char* method, bbus_object* arg,
+		const struct bbus_timeval* tv)
+{
+	struct bbus_timeval left;
+	unsigned callid;
+	unsigned ms;
+	int r;
+
+	ms = tv->sec * 1000 + tv->usec / 1000;
+	/* A zero timeout would mean no deadline at all. */
+	if (ms == 0)
+		ms = 1;
+	r = call_async(conn, method, 0, arg, ms, &callid);
+	if (r < 0)
+		return NULL;
+
+	left = *tv;
+	return call_wait(conn, callid, &left);
+}
+
+int bbus_handle_refresh(bbus_client_connection* conn,
+				bbus_method_handle* handle)
+{
+	bbus_object* arg;
+	bbus_object* ret;
+	bbus_uint32 route;
+	int r;
+
+	arg = bbus_obj_build("s", handle->method);
+	if (arg == NULL)
+		return -1;
+
+	ret = bbus_callmethod(conn, "bbus.bbusd.resolve", arg);
+	bbus_obj_free(arg);
+	if (ret == NULL)
+		return -1;
+
+	r = bbus_obj_parse(ret, "u", &route);
+	bbus_obj_free(ret);
+	if (r < 0)
+		return -1;
+
+	if (route == 0) {
+		__bbus_seterr(BBUS_ENOMETHOD);
+		return -1;
+	}
+
+	handle->route = route;
+	return 0;
+}
+
+bbus_method_handle* bbus_resolve(bbus_client_connection* conn,
+						const char* method)
+{
+	bbus_method_handle* handle;
+
+	handle = bbus_malloc0(sizeof(struct __bbus_method_handle));
+	if (handle == NULL)
+		return NULL;
+
+	handle->method = bbus_str_cpy(method);
+	if (handle->method == NULL)
+		goto err;
+
+	if (bbus_handle_refresh(conn, handle) < 0)
+		goto err;
+
+	return handle;
+
+err:
+	bbus_handle_free(handle);
+	return NULL;
+}
+
+void bbus_handle_free(bbus_method_handle* handle)
+{
+	if (handle != NULL) {
+		bbus_str_free(handle->method);
+		bbus_free(handle);
+	}
+}
+
+int bbus_callhandle_async(bbus_client_connection* conn,
+		bbus_method_handle* handle, bbus_object* arg, unsigned* callid)
+{
+	return call_async(conn, NULL, handle->route, arg, 0, callid);
+}
+
+bbus_object* bbus_callhandle(bbus_client_connection* conn,
+		bbus_method_handle* handle, bbus_object* arg)
+{
+	bbus_object* ret;
+	unsigned callid;
+
+	if (bbus_callhandle_async(conn, handle, arg, &callid) < 0)
+		return NULL;
+
+	ret = bbus_call_wait(conn, callid);
+	if ((ret == NULL) && (bbus_lasterror() == BBUS_ESTALEROUTE)) {
+		/* The method is gone or has been registered again. */
+		if ((bbus_handle_refresh(conn, handle) < 0)
+				|| (bbus_callhandle_async(conn, handle,
+							arg, &callid) < 0))
+			return NULL;
+
+		ret = bbus_call_wait(conn, callid);
+	}
+
+	return ret;
+}
+
+static int send_signal(int sock, int hostorder,
+			const char* signame, bbus_object* obj)
+{
+	struct bbus_msg_hdr hdr;
+
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLISIG, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, strlen(signame) + 1 + bbus_obj_rawsize(obj));
+	if (set_objorder(&hdr, obj, hostorder) < 0)
+		return -1;
+
+	return __bbus_prot_sendvmsg(sock, &hdr, signame,
+			bbus_obj_rawdata(obj), bbus_obj_rawsize(obj));
+}
+
+int bbus_emitsignal(bbus_client_connection* conn,
+		const char* signame, bbus_object* obj)
+{
+	return send_signal(conn->sock, conn->hostorder, signame, obj);
+}
+
+static int send_subscription(bbus_client_connection* conn, int msgtype,
+						const char* prefix)
+{
+	struct bbus_msg_hdr hdr;
+
+	bbus_hdr_build(&hdr, msgtype, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	bbus_hdr_setpsize(&hdr, strlen(prefix) + 1);
+
+	return __bbus_prot_sendvmsg(conn->sock, &hdr, prefix, NULL, 0);
+}
+
+int bbus_subscribe(bbus_client_connection* conn, const char* prefix)
+{
+	return send_subscription(conn, BBUS_MSGTYPE_SIGSUB, prefix);
+}
+
+int bbus_unsubscribe(bbus_client_connection* conn, const char* prefix)
+{
+	return send_subscription(conn, BBUS_MSGTYPE_SIGUNSUB, prefix);
+}
+
+int bbus_sig_poll(bbus_client_connection* conn, struct bbus_timeval* tv,
+		char** signame, bbus_object** obj)
+{
+	struct call_reply* reply;
+	struct signal_msg* sig;
+	int r;
+
+	while (conn->signals.head == NULL) {
+		r = wait_rdready(conn, tv);
+		if (r <= 0)
+			return r;
+
+		reply = recv_wanted_reply(conn);
+		if (reply == NULL) {
+			if (bbus_lasterror() == BBUS_EAGAIN)
+				continue;
+			return -1;
+		}
+
+		/* Keep the reply for bbus_call_poll() or bbus_call_wait(). */
+		r = store_reply(conn, reply);
+		if (r < 0) {
+			free_reply(reply);
+			return -1;
+		}
+	}
+
+	sig = (struct signal_msg*)conn->signals.head;
+	bbus_list_rm(&conn->signals, sig);
+	*signame = sig->signame;
+	*obj = sig->obj;
+	bbus_free(sig);
+
+	return 1;
+}
+
+/* TODO Refactor common code for bbus_connect and this. */
+bbus_client_connection* bbus_mon_connect(void)
+{
+	int sock;
+	int hostorder;
+	bbus_client_connection* conn;
+
+	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_MON,
+						NULL, 0, &hostorder, NULL);
+	if (sock < 0)
+		return NULL;
+
+	conn = bbus_malloc0(sizeof(struct __bbus_client_connection));
+	if (conn == NULL)
+		return NULL;
+	conn->sock = sock;
+	conn->hostorder = hostorder;
+	return conn;
+}
+
+int bbus_mon_recvmsg(bbus_client_connection* conn,
+		struct bbus_msg* msg, size_t bufsize,
+		struct bbus_timeval* tv, const char** meta, bbus_object** obj)
+{
+	const void* raw;
+	size_t rawsize;
+	int r;
+
+	r = __bbus_sock_rdready(conn->sock, tv);
+	if (r <= 0) {
+		return r;
+	} else {
+		r = __bbus_prot_recvmsg(conn->sock, msg, bufsize);
+		if (r < 0)
+			return -1;
+		if (msg->hdr.msgtype != BBUS_MSGTYPE_MON) {
+			__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+			return -1;
+		}
+
+		if (meta) {
+			if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASMETA)) {
+				*meta = bbus_prot_extractmeta(msg);
+				if (*meta == NULL)
+					return -1;
+			}
+		}
+
+		if (!BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_HASOBJECT)) {
+			__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+			return -1;
+		}
+		if (obj == NULL) {
+			__bbus_seterr(BBUS_EINVALARG);
+			return -1;
+		}
+
+		raw = bbus_prot_extractrawobj(msg, &rawsize);
+		if (raw == NULL)
+			return -1;
+		*obj = bbus_obj_view(raw, rawsize);
+		if (*obj == NULL)
+			return -1;
+		bbus_obj_setorder(*obj, bbus_hdr_getobjorder(&msg->hdr));
+	}
+
+	return 1;
+}
+
+int bbus_mon_setfilter(bbus_client_connection* conn,
+		const struct bbus_mon_filter* filter)
+{
+	static const struct bbus_mon_filter nofilter = { 0, NULL, NULL, 0 };
+	struct bbus_msg_hdr hdr;
+	bbus_object* obj;
+	int r;
+
+	if (filter == NULL)
+		filter = &nofilter;
+
+	obj = bbus_obj_build("ussu", filter->msgtypes,
+				filter->prefix == NULL ? "" : filter->prefix,
+				filter->regex == NULL ? "" : filter->regex,
+				filter->sample);
+	if (obj == NULL)
+		return -1;
+
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_MONFLTR, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(obj));
+	r = set_objorder(&hdr, obj, conn->hostorder);
+	if (r == 0)
+		r = __bbus_prot_sendvmsg(conn->sock, &hdr, NULL,
+			bbus_obj_rawdata(obj), bbus_obj_rawsize(obj));
+	bbus_obj_free(obj);
+
+	return r;
+}
+
+bbus_client_connection* bbus_ctl_connect(void)
+{
+	int sock;
+	int hostorder;
+	bbus_client_connection* conn;
+
+	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_CTL,
+						NULL, 0, &hostorder, NULL);
+	if (sock < 0)
+		return NULL;
+
+	conn = bbus_malloc0(sizeof(struct __bbus_client_connection));
+	if (conn == NULL)
+		return NULL;
+	conn->sock = sock;
+	conn->hostorder = hostorder;
+	return conn;
+}
+
+bbus_object* bbus_ctl_request(bbus_client_connection* conn, const char* cmd,
+					bbus_object* arg)
+{
+	struct bbus_msg_hdr hdr;
+	struct bbus_msg* msg;
+	size_t objsize;
+	int r;
+
+	objsize = arg == NULL ? 0 : bbus_obj_rawsize(arg);
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_CTRL, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	if (arg != NULL)
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, strlen(cmd) + 1 + objsize);
+	if (set_objorder(&hdr, arg, conn->hostorder) < 0)
+		return NULL;
+
+	r = __bbus_prot_sendvmsg(conn->sock, &hdr, cmd,
+			arg == NULL ? NULL : bbus_obj_rawdata(arg), objsize);
+	if (r < 0)
+		return NULL;
+
+	r = __bbus_prot_recvmsgdyn(conn->sock,
+				&conn->rcvbuf, &conn->rcvbufsize, NULL);
+	if (r < 0)
+		return NULL;
+
+	msg = conn->rcvbuf;
+	if (msg->hdr.msgtype != BBUS_MSGTYPE_CTRL) {
+		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+		return NULL;
+	}
+
+	if (msg->hdr.errcode != BBUS_PROT_EGOOD) {
+		__bbus_seterr(__bbus_prot_errtoerrnum(msg->hdr.errcode));
+		return NULL;
+	}
+
+	return bbus_prot_extractobj(msg);
+}
+
+void bbus_setshmthreshold(bbus_client_connection* conn, size_t threshold)
+{
+	/* Descriptors can't be passed to another host. */
+	conn->shmthreshold = __bbus_sock_islocal(conn->sock) ? threshold : 0;
+}
+
+void bbus_setcomprthreshold(bbus_client_connection* conn, size_t threshold)
+{
+	conn->comprthreshold = threshold;
+}
+
+void bbus_setbusypoll(bbus_client_connection* conn, unsigned usecs)
+{
+	conn->busypoll = usecs;
+}
+
+int bbus_closeconn(bbus_client_connection* conn)
+{
+	struct call_reply* reply;
+	struct signal_msg* sig;
+	int r;
+
+	r = send_session_close(conn->sock);
+	if (r < 0)
+		r = -1;
+
+	while ((reply = (struct call_reply*)conn->replies.head) != NULL) {
+		bbus_list_rm(&conn->replies, reply);
+		free_reply(reply);
+	}
+	while ((sig = (struct signal_msg*)conn->signals.head) != NULL) {
+		bbus_list_rm(&conn->signals, sig);
+		free_signal(sig);
+	}
+	bbus_hmap_free(conn->replymap);
+	bbus_free(conn->rcvbuf);
+	bbus_free(conn);
+
+	return r;
+}
+
+bbus_service_connection* bbus_srvc_connect(const char* name)
+{
+	int sock;
+	int hostorder;
+	int compression;
+	bbus_service_connection* conn;
+
+	sock = do_session_open(bbus_prot_getsockpath(), BBUS_SOTYPE_SRVPRV,
+					NULL, 0, &hostorder, &compression);
+	if (sock < 0)
+		return NULL;
+
+	conn = bbus_malloc0(sizeof(struct __bbus_service_connection));
+	if (conn == NULL)
+		return NULL;
+	conn->sock = sock;
+	conn->hostorder = hostorder;
+	conn->compression = compression;
+	conn->srvname = bbus_str_cpy(name);
+	conn->methods = bbus_hmap_create(BBUS_HMAP_KEYSTR);
+	conn->pool = bbus_obj_pool_create();
+	if ((conn->methods == NULL) || (conn->pool == NULL)) {
+		bbus_hmap_free(conn->methods);
+		__bbus_sock_close(conn->sock);
+		bbus_str_free(conn->srvname);
+		bbus_free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+int bbus_srvc_regmethod(bbus_service_connection* conn,
+		struct bbus_method* method)
+{
+	return bbus_srvc_regmethods(conn, method, 1);
+}
+
+int bbus_srvc_regmethods(bbus_service_connection* conn,
+		struct bbus_method* methods, size_t nummethods)
+{
+	struct srvc_method* mthd;
+	struct bbus_msg_hdr hdr;
+	size_t metasize;
+	size_t i;
+	char* meta;
+	char* ptr;
+	int r;
+
+	if (nummethods == 0)
+		return 0;
+
+	/* All the registrations go in one message, separated by newlines. */
+	metasize = 0;
+	for (i = 0; i < nummethods; ++i) {
+		if ((index(methods[i].name, '\n') != NULL)
+				|| (index(methods[i].name, ',') != NULL)
+				|| (index(methods[i].argdscr, '\n') != NULL)
+				|| (index(methods[i].retdscr, '\n') != NULL)) {
+			__bbus_seterr(BBUS_EINVALARG);
+			return -1;
+		}
+
+		metasize += strlen(conn->srvname) + 1; /* +1 for dot */
+		metasize += strlen(methods[i].name) + 1; /* +1 for comma */
+		metasize += strlen(methods[i].argdscr) + 1; /* +1 for comma */
+		/* +1 for the newline or NULL */
+		metasize += strlen(methods[i].retdscr) + 1;
+		/* Optional ",ttl" field. */
+		if (methods[i].cachettl > 0)
+			metasize += snprintf(NULL, 0, ",%u",
+						methods[i].cachettl);
+	}
+
+	meta = bbus_malloc(metasize);
+	if (meta == NULL)
+		return -1;
+
+	for (i = 0, ptr = meta; i < nummethods; ++i) {
+		ptr += sprintf(ptr, "%s%s.%s,%s,%s", i > 0 ? "\n" : "",
+					conn->srvname,
+					methods[i].name,
+					methods[i].argdscr,
+					methods[i].retdscr);
+		if (methods[i].cachettl > 0)
+			ptr += sprintf(ptr, ",%u", methods[i].cachettl);
+	}
+
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(&hdr);
+	hdr.msgtype = BBUS_MSGTYPE_SRVREG;
+	bbus_hdr_setpsize(&hdr, metasize);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+
+	r = __bbus_prot_sendvmsg(conn->sock, &hdr, meta, NULL, 0);
+	bbus_free(meta);
+	if (r < 0)
+		return -1;
+
+	memset(&hdr, 0, BBUS_MSGHDR_SIZE);
+	r = __bbus_prot_recvvmsg(conn->sock, &hdr, NULL, 0);
+	if (r < 0)
+		return -1;
+
+	if (hdr.msgtype != BBUS_MSGTYPE_SRVACK) {
+		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+		return -1;
+	}
+	if (hdr.errcode != 0) {
+		__bbus_seterr(__bbus_prot_errtoerrnum(hdr.errcode));
+		return -1;
+	}
+
+	for (i = 0; i < nummethods; ++i) {
+		mthd = bbus_malloc0(sizeof(struct srvc_method));
+		if (mthd == NULL)
+			return -1;
+
+		mthd->func = methods[i].func;
+		mthd->flags = methods[i].flags;
+		r = bbus_hmap_setstr(conn->methods, methods[i].name, mthd);
+		if (r < 0) {
+			bbus_free(mthd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int bbus_srvc_unregmethod(bbus_service_connection* conn,
+		const char* method)
+{
+	struct srvc_method* mthd;
+	struct bbus_msg_hdr hdr;
+	char* meta;
+	int r;
+
+	mthd = bbus_hmap_rmstr(conn->methods, method);
+	if (mthd == NULL) {
+		__bbus_seterr(BBUS_ENOMETHOD);
+		return -1;
+	}
+	mthd->nextretired = conn->retired;
+	conn->retired = mthd;
+
+	meta = bbus_str_build("%s.%s", conn->srvname, method);
+	if (meta == NULL)
+		return -1;
+
+	/*
+	 * There's no acknowledgement - calls already routed to the method
+	 * may still arrive and are answered with an error.
+	 */
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(&hdr);
+	hdr.msgtype = BBUS_MSGTYPE_SRVUNREG;
+	bbus_hdr_setpsize(&hdr, strlen(meta) + 1);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+
+	if (conn->workers != NULL)
+		pthread_mutex_lock(&conn->workers->sendlock);
+	r = __bbus_prot_sendvmsg(conn->sock, &hdr, meta, NULL, 0);
+	if (conn->workers != NULL)
+		pthread_mutex_unlock(&conn->workers->sendlock);
+	bbus_str_free(meta);
+
+	return r < 0 ? -1 : 0;
+}
+
+/*
+ * Runs the method and sends the reply. Method errors are reported to the
+ * caller, only a failure to send the reply is an error here.
+ */
+static int run_call(bbus_service_connection* conn,
+		const struct srvc_method* mthd, unsigned token,
+		bbus_object* objarg)
+{
+	struct bbus_msg_hdr hdr;
+	bbus_object* objret = NULL;
+	void* zbuf;
+	size_t zsize;
+	int r;
+
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(&hdr);
+	hdr.msgtype = BBUS_MSGTYPE_SRVREPLY;
+	bbus_hdr_settoken(&hdr, token);
+	if (mthd == NULL) {
+		hdr.errcode = BBUS_PROT_ENOMETHOD;
+	} else
+	if (objarg == NULL) {
+		hdr.errcode = BBUS_PROT_EMETHODERR;
+	} else {
+		objret = mthd->func(objarg);
+		if ((objret != NULL) && (set_objorder(&hdr, objret,
+						conn->hostorder) < 0)) {
+			bbus_obj_free(objret);
+			objret = NULL;
+		}
+		if (objret == NULL) {
+			hdr.errcode = BBUS_PROT_EMETHODERR;
+		} else {
+			bbus_hdr_setpsize(&hdr, bbus_obj_rawsize(objret));
+			BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		}
+	}
+
+	/* Replies sent by different workers must not interleave. */
+	if (conn->workers != NULL)
+		pthread_mutex_lock(&conn->workers->sendlock);
+	if (use_shm(conn->shmthreshold, objret)) {
+		bbus_hdr_setpsize(&hdr, 0);
+		r = send_shm(conn->sock, &hdr, NULL, objret);
+	} else
+	if ((zbuf = compress_obj(&hdr, objret, conn->compression,
+				conn->comprthreshold, &zsize)) != NULL) {
+		bbus_hdr_setpsize(&hdr, zsize);
+		r = __bbus_prot_sendvmsg(conn->sock, &hdr, NULL, zbuf, zsize);
+		bbus_free(zbuf);
+	} else {
+		r = __bbus_prot_sendvmsg(conn->sock, &hdr, NULL,
+			objret == NULL ? NULL : bbus_obj_rawdata(objret),
+			objret == NULL ? 0 : bbus_obj_rawsize(objret));
+	}
+	if (conn->workers != NULL)
+		pthread_mutex_unlock(&conn->workers->sendlock);
+
+	bbus_obj_free(objret);
+
+	return r;
+}
+
+static struct srvc_call* queue_pop(struct bbus_list* queue)
+{
+	struct srvc_call* call;
+
+	call = (struct srvc_call*)queue->head;
+	if (call != NULL)
+		bbus_list_rm(queue, call);
+
+	return call;
+}
+
+/*
+ * Calls of ordered methods are let into the worker queue one at a time,
+ * the rest wait in the method's backlog. Must be called with the pool
+ * lock held.
+ */
+static void pool_enqueue(struct srvc_pool* pool, struct srvc_call* call)
+{
+	struct srvc_method* mthd = call->mthd;
+
+	if ((mthd != NULL) && (mthd->flags & BBUS_METHOD_ORDERED)) {
+		if (mthd->busy) {
+			bbus_list_push(&mthd->backlog, call);
+			return;
+		}
+		mthd->busy = 1;
+	}
+
+	bbus_list_push(&pool->queue, call);
+	pthread_cond_signal(&pool->cond);
+}
+
+static void* worker_main(void* arg)
+{
+	bbus_service_connection* conn = arg;
+	struct srvc_pool* pool = conn->workers;
+	struct srvc_method* mthd;
+	struct srvc_call* call;
+	struct srvc_call* next;
+	bbus_object* objarg;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (((call = queue_pop(&pool->queue)) == NULL)
+							&& !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (call == NULL)
+			break;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (call->fd >= 0) {
+			objarg = obj_fromfd(call->fd,
+					objflags_order(call->objflags));
+		} else {
+			objarg = obj_frompayload(NULL, call->objflags,
+						call->data, call->size);
+		}
+		/* Still answer if there's no argument - nobody must hang. */
+		(void)run_call(conn, call->mthd, call->token, objarg);
+		bbus_obj_free(objarg);
+
+		pthread_mutex_lock(&pool->lock);
+		mthd = call->mthd;
+		if ((mthd != NULL) && (mthd->flags & BBUS_METHOD_ORDERED)) {
+			mthd->busy = 0;
+			next = queue_pop(&mthd->backlog);
+			if (next != NULL)
+				pool_enqueue(pool, next);
+		}
+		bbus_free(call);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Waits for the workers to handle all queued calls and frees the pool. */
+static void stop_workers(bbus_service_connection* conn)
+{
+	struct srvc_pool* pool = conn->workers;
+	unsigned i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->numthreads; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->sendlock);
+	pthread_mutex_destroy(&pool->lock);
+	bbus_free(pool);
+	conn->workers = NULL;
+}
+
+int bbus_srvc_setworkers(bbus_service_connection* conn, unsigned numworkers)
+{
+	struct srvc_pool* pool;
+	unsigned i;
+	int r;
+
+	if ((conn->workers != NULL) || (numworkers == 0)) {
+		__bbus_seterr(BBUS_EINVALARG);
+		return -1;
+	}
+
+	pool = bbus_malloc0(sizeof(struct srvc_pool)
+				+ numworkers * sizeof(pthread_t));
+	if (pool == NULL)
+		return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->sendlock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	conn->workers = pool;
+	for (i = 0; i < numworkers; ++i) {
+		r = pthread_create(&pool->threads[i], NULL, worker_main, conn);
+		if (r != 0) {
+			__bbus_seterr(r);
+			stop_workers(conn);
+			return -1;
+		}
+		pool->numthreads++;
+	}
+
+	return 0;
+}
+
+/*
+ * The message buffer is reused for the next call - copy the argument
+ * and hand the call over to the workers.
+ */
+static int dispatch_call(bbus_service_connection* conn,
+		struct srvc_method* mthd, unsigned token,
+		const void* rawarg, size_t rawsize, int fd, int objflags)
+{
+	struct srvc_call* call;
+
+	call = bbus_malloc(sizeof(struct srvc_call) + rawsize);
+	if (call == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	call->mthd = mthd;
+	call->token = token;
+	call->fd = fd;
+	call->objflags = objflags;
+	call->size = rawsize;
+	if (rawsize > 0)
+		memcpy(call->data, rawarg, rawsize);
+
+	pthread_mutex_lock(&conn->workers->lock);
+	pool_enqueue(conn->workers, call);
+	pthread_mutex_unlock(&conn->workers->lock);
+
+	return 0;
+}
+
+int bbus_srvc_listencalls(bbus_service_connection* conn,
+		struct bbus_timeval* tv)
+{
+	int r;
+	const char* meta;
+	bbus_object* objarg;
+	struct srvc_method* mthd;
+	unsigned token;
+	struct bbus_msg* msg;
+	const void* rawarg = NULL;
+	size_t rawsize = 0;
+	int fd = -1;
+
+	r = __bbus_sock_rdready(conn->sock, tv);
+	if (r <= 0)
+		return r;
+
+	r = __bbus_prot_recvmsgdyn(conn->sock,
+			&conn->rcvbuf, &conn->rcvbufsize, &fd);
+	if (r < 0)
+		return -1;
+
+	msg = conn->rcvbuf;
+	if (msg->hdr.msgtype != BBUS_MSGTYPE_SRVCALL) {
+		if (fd >= 0)
+			close(fd);
+		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+		return -1;
+	}
+
+	token = bbus_hdr_gettoken(&msg->hdr);
+	meta = bbus_prot_extractmeta(msg);
+	if (meta == NULL) {
+		if (fd >= 0)
+			close(fd);
+		__bbus_seterr(BBUS_EMSGINVFMT);
+		return -1;
+	}
+
+	mthd = bbus_hmap_findstr(conn->methods, meta);
+	if (fd < 0) {
+		rawarg = bbus_prot_extractrawobj(msg, &rawsize);
+		if (rawarg == NULL) {
+			__bbus_seterr(BBUS_EMSGINVFMT);
+			return -1;
+		}
+	}
+
+	if (conn->workers != NULL) {
+		r = dispatch_call(conn, mthd, token, rawarg, rawsize, fd,
+					msg->hdr.flags & BBUS_PROT_OBJFLAGS);
+		return r < 0 ? -1 : 1;
+	}
+
+	/* Big arguments are mapped right from the caller's memfd. */
+	if (fd >= 0) {
+		objarg = obj_fromfd(fd, bbus_hdr_getobjorder(&msg->hdr));
+	} else {
+		objarg = obj_frompayload(conn->pool,
+				msg->hdr.flags & BBUS_PROT_OBJFLAGS,
+				rawarg, rawsize);
+	}
+	if (objarg == NULL) {
+		__bbus_seterr(BBUS_EMSGINVFMT);
+		return -1;
+	}
+
+	r = run_call(conn, mthd, token, objarg);
+	bbus_obj_free(objarg);
+
+	return r < 0 ? -1 : 1;
+}
+
+int bbus_srvc_emitsignal(bbus_service_connection* conn,
+		const char* signame, bbus_object* obj)
+{
+	int r;
+
+	/* Methods run by workers may emit signals too. */
+	if (conn->workers != NULL)
+		pthread_mutex_lock(&conn->workers->sendlock);
+	r = send_signal(conn->sock, conn->hostorder, signame, obj);
+	if (conn->workers != NULL)
+		pthread_mutex_unlock(&conn->workers->sendlock);
+
+	return r;
+}
+
+int bbus_srvc_invalidate(bbus_service_connection* conn, const char* method)
+{
+	bbus_object* obj;
+	char* path;
+	int r;
+
+	path = method == NULL ? bbus_str_cpy(conn->srvname)
+			: bbus_str_build("%s.%s", conn->srvname, method);
+	if (path == NULL)
+		return -1;
+
+	obj = bbus_obj_build("s", path);
+	bbus_str_free(path);
+	if (obj == NULL)
+		return -1;
+
+	r = bbus_srvc_emitsignal(conn, BBUS_SRVC_INVALIDATESIG, obj);
+	bbus_obj_free(obj);
+
+	return r;
+}
+
+void bbus_srvc_setshmthreshold(bbus_service_connection* conn,
+						size_t threshold)
+{
+	conn->shmthreshold = __bbus_sock_islocal(conn->sock) ? threshold : 0;
+}
+
+void bbus_srvc_setcomprthreshold(bbus_service_connection* conn,
+						size_t threshold)
+{
+	conn->comprthreshold = threshold;
+}
+
+static int free_method(const void* key BBUS_UNUSED,
+		size_t keysize BBUS_UNUSED, void* val, void* arg BBUS_UNUSED)
+{
+	bbus_free(val);
+	return 0;
+}
+
+int bbus_srvc_closeconn(bbus_service_connection* conn)
+{
+	struct srvc_method* mthd;
+	int r;
+
+	/* Let the workers send the replies to the calls already received. */
+	stop_workers(conn);
+	r = send_session_close(conn->sock);
+	if (r < 0)
+		return -1;
+	bbus_str_free(conn->srvname);
+	(void)bbus_hmap_foreach(conn->methods, free_method, NULL);
+	bbus_hmap_free(conn->methods);
+	while ((mthd = conn->retired) != NULL) {
+		conn->retired = mthd->nextretired;
+		bbus_free(mthd);
+	}
+	bbus_free(conn->rcvbuf);
+	bbus_obj_pool_free(conn->pool);
 	bbus_free(conn);
 	return 0;
 }
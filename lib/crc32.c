@@ -13,7 +13,19 @@
  */
 
 #include <busybus.h>
+#include "crc32.h"
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_HW_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define CRC32_HW_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 static const uint32_t crc32_tab[] = {
 	0x00000000U, 0x04C11DB7U, 0x09823B6EU, 0x0D4326D9U, 0x130476DCU,
@@ -82,11 +94,244 @@ static uint32_t update_crc32(uint32_t crc,
 	return crc;
 }
 
-uint32_t bbus_crc32(const void* buf, size_t bufsize)
+uint32_t __bbus_crc32_update_bytewise(uint32_t crc,
+				const void* buf, size_t bufsize)
+{
+	return update_crc32(crc, buf, bufsize);
+}
+
+/*
+ * Slice-by-8: crc32_slices[n][b] is the crc of the byte b followed by n
+ * zero bytes, which allows to process eight bytes with eight independent
+ * lookups.
+ */
+static uint32_t crc32_slices[8][256];
+
+static void make_slices(void)
+{
+	unsigned i;
+	unsigned j;
+	uint32_t crc;
+
+	for (i = 0; i < 256; ++i) {
+		crc = crc32_tab[i];
+		crc32_slices[0][i] = crc;
+		for (j = 1; j < 8; ++j) {
+			crc = crc32_tab[crc >> 24] ^ (crc << 8);
+			crc32_slices[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t update_crc32_slice8(uint32_t crc,
+		const unsigned char* buf, size_t bufsize)
+{
+	while (bufsize >= 8) {
+		crc ^= ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16)
+			| ((uint32_t)buf[2] << 8) | buf[3];
+		crc = crc32_slices[7][crc >> 24]
+			^ crc32_slices[6][(crc >> 16) & 0xff]
+			^ crc32_slices[5][(crc >> 8) & 0xff]
+			^ crc32_slices[4][crc & 0xff]
+			^ crc32_slices[3][buf[4]]
+			^ crc32_slices[2][buf[5]]
+			^ crc32_slices[1][buf[6]]
+			^ crc32_slices[0][buf[7]];
+		buf += 8;
+		bufsize -= 8;
+	}
+
+	return update_crc32(crc, buf, bufsize);
+}
+
+uint32_t __bbus_crc32_update_slice8(uint32_t crc,
+				const void* buf, size_t bufsize)
 {
-	return update_crc32(0xffffffff,
-		(const unsigned char*)buf, bufsize) ^ 0xffffffff;
+	return update_crc32_slice8(crc, buf, bufsize);
 }
 
+#ifdef CRC32_HW_X86
+
+/*
+ * Carry-less multiplication folding as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction". Data
+ * is loaded byte-reversed, since this crc is not bit-reflected. Folding
+ * a 128-bit chunk forward by N bits multiplies its upper and lower half
+ * by x^(N+64) mod P and x^N mod P respectively.
+ */
+#define CRC32_K_576 0x8833794cULL
+#define CRC32_K_512 0xe6228b11ULL
+#define CRC32_K_192 0xc5b9cd4cULL
+#define CRC32_K_128 0xe8a45605ULL
 
+#define CRC32_HW_TARGET __attribute__((target("pclmul,ssse3")))
 
+static inline CRC32_HW_TARGET __m128i crc32_fold(__m128i x, __m128i k,
+							__m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+					_mm_clmulepi64_si128(x, k, 0x00)), next);
+}
+
+static inline CRC32_HW_TARGET __m128i crc32_load(const unsigned char* buf,
+							__m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)buf), bswap);
+}
+
+static CRC32_HW_TARGET uint32_t update_crc32_hw(uint32_t crc,
+		const unsigned char* buf, size_t bufsize)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+						7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i k512 = _mm_set_epi64x(CRC32_K_576, CRC32_K_512);
+	const __m128i k128 = _mm_set_epi64x(CRC32_K_192, CRC32_K_128);
+	__m128i x0, x1, x2, x3;
+	unsigned char rem[16];
+
+	if (bufsize < 64)
+		return update_crc32_slice8(crc, buf, bufsize);
+
+	/* The current crc is xored into the first four bytes. */
+	x0 = _mm_xor_si128(crc32_load(buf, bswap),
+				_mm_set_epi32(crc, 0, 0, 0));
+	x1 = crc32_load(buf + 16, bswap);
+	x2 = crc32_load(buf + 32, bswap);
+	x3 = crc32_load(buf + 48, bswap);
+	buf += 64;
+	bufsize -= 64;
+
+	while (bufsize >= 64) {
+		x0 = crc32_fold(x0, k512, crc32_load(buf, bswap));
+		x1 = crc32_fold(x1, k512, crc32_load(buf + 16, bswap));
+		x2 = crc32_fold(x2, k512, crc32_load(buf + 32, bswap));
+		x3 = crc32_fold(x3, k512, crc32_load(buf + 48, bswap));
+		buf += 64;
+		bufsize -= 64;
+	}
+
+	x1 = crc32_fold(x0, k128, x1);
+	x2 = crc32_fold(x1, k128, x2);
+	x3 = crc32_fold(x2, k128, x3);
+
+	while (bufsize >= 16) {
+		x3 = crc32_fold(x3, k128, crc32_load(buf, bswap));
+		buf += 16;
+		bufsize -= 16;
+	}
+
+	/*
+	 * What's left is congruent to the data processed so far - its crc
+	 * is the crc of the whole thing.
+	 */
+	_mm_storeu_si128((__m128i*)rem, _mm_shuffle_epi8(x3, bswap));
+	crc = update_crc32_slice8(0, rem, sizeof(rem));
+
+	return update_crc32_slice8(crc, buf, bufsize);
+}
+
+static int have_hw(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul")
+		&& __builtin_cpu_supports("ssse3");
+}
+
+#elif defined(CRC32_HW_ARMV8)
+
+/*
+ * ARMv8 crc32 instructions compute the bit-reflected variant of this crc.
+ * Reflecting the state as well as every input byte gives the same result
+ * as the table.
+ */
+static inline uint32_t crc32_rbit32(uint32_t val)
+{
+	__asm__("rbit %w0, %w1" : "=r"(val) : "r"(val));
+	return val;
+}
+
+static inline uint64_t crc32_rbit64(uint64_t val)
+{
+	__asm__("rbit %0, %1" : "=r"(val) : "r"(val));
+	return val;
+}
+
+static __attribute__((target("+crc"))) uint32_t update_crc32_hw(uint32_t crc,
+		const unsigned char* buf, size_t bufsize)
+{
+	uint64_t val;
+
+	crc = crc32_rbit32(crc);
+	while (bufsize >= 8) {
+		memcpy(&val, buf, sizeof(val));
+		/* Reverse the bits within every byte. */
+		val = __builtin_bswap64(crc32_rbit64(val));
+		crc = __crc32d(crc, val);
+		buf += 8;
+		bufsize -= 8;
+	}
+
+	while (bufsize > 0) {
+		crc = __crc32b(crc, crc32_rbit32(*buf) >> 24);
+		++buf;
+		--bufsize;
+	}
+
+	return crc32_rbit32(crc);
+}
+
+static int have_hw(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+
+#endif
+
+static __bbus_crc32_func crc32_hwfunc;
+static __bbus_crc32_func crc32_func = __bbus_crc32_update_bytewise;
+
+#if defined(CRC32_HW_X86) || defined(CRC32_HW_ARMV8)
+static uint32_t crc32_update_hw(uint32_t crc, const void* buf, size_t bufsize)
+{
+	return update_crc32_hw(crc, buf, bufsize);
+}
+#endif
+
+static void BBUS_ATSTART crc32_init(void)
+{
+	make_slices();
+	crc32_func = __bbus_crc32_update_slice8;
+
+#if defined(CRC32_HW_X86) || defined(CRC32_HW_ARMV8)
+	if (have_hw()) {
+		crc32_hwfunc = crc32_update_hw;
+		crc32_func = crc32_hwfunc;
+	}
+#endif
+}
+
+__bbus_crc32_func __bbus_crc32_hwfunc(void)
+{
+	return crc32_hwfunc;
+}
+
+uint32_t bbus_crc32_init(void)
+{
+	return 0xffffffff;
+}
+
+uint32_t bbus_crc32_update(uint32_t crc, const void* buf, size_t bufsize)
+{
+	return crc32_func(crc, buf, bufsize);
+}
+
+uint32_t bbus_crc32_final(uint32_t crc)
+{
+	return crc ^ 0xffffffff;
+}
+
+uint32_t bbus_crc32(const void* buf, size_t bufsize)
+{
+	return bbus_crc32_final(bbus_crc32_update(bbus_crc32_init(),
+							buf, bufsize));
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_CRC32__
+#define __BBUS_CRC32__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The implementations behind bbus_crc32_update(), exposed for testing
+ * and benchmarking. They all take and return the raw crc state.
+ */
+typedef uint32_t (*__bbus_crc32_func)(uint32_t, const void*, size_t);
+
+uint32_t __bbus_crc32_update_bytewise(uint32_t crc,
+				const void* buf, size_t bufsize);
+uint32_t __bbus_crc32_update_slice8(uint32_t crc,
+				const void* buf, size_t bufsize);
+/* Returns NULL if the cpu has no crc acceleration we can use. */
+__bbus_crc32_func __bbus_crc32_hwfunc(void);
+
+#endif /* __BBUS_CRC32__ */
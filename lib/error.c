@@ -46,7 +46,14 @@ static const char* const error_descr[] = {
 	"error registering the method",
 	"invalid key type used on a hashmap",
 	"invalid regular expression pattern",
-	"client unauthorized"
+	"client unauthorized",
+	"no complete message available yet",
+	"call deadline exceeded",
+	"method route no longer valid",
+	"peer can't use host byte order",
+	"peer can't take compressed data",
+	"invalid or unresolvable bus address",
+	"transport can't pass descriptors"
 };
 
 int bbus_lasterror(void)
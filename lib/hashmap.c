@@ -12,6 +12,7 @@
  * GNU General Public License for more details.
  */
 
+
 #include <busybus.h>
 #include "error.h"
 #include <stdlib.h>
@@ -19,52 +20,376 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define DEF_MAP_SIZE 32
+/*
+ * Open addressing with Robin Hood linear probing. Slots are stored in a
+ * single flat array, short keys are stored inline.
+ *
+ * When the table fills up, a new one twice the size is allocated, but
+ * the entries are moved there a few at a time on every subsequent
+ * modification, so that no single insertion ever has to rehash the
+ * whole map. Until that is done lookups check both tables.
+ *
+ * Lookups never modify the map, so any number of threads can look up
+ * an unchanging map concurrently.
+ */
+
+#define DEF_MAP_SIZE	32 /* Must be a power of two. */
+#define MIN_MAP_SIZE	4 /* Same. */
+#define KEY_INLINE	16
+#define MIGRATE_STEP	8
+
+/*
+ * Hashing. CRC32 is a checksum, not a hash function: it's slow and
+ * spreads similar keys poorly. String keys are hashed with a variant of
+ * wyhash, which consumes eight bytes at a time. Integer keys only need
+ * their bits mixed.
+ */
+
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+#define HASH_P3 0x589965cc75374cc3ULL
+
+/* Multiplies two 64-bit numbers and folds the 128-bit result. */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r;
+
+	r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else /* __SIZEOF_INT128__ */
+	uint64_t ha = a >> 32, hb = b >> 32;
+	uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+	uint64_t rh, rm0, rm1, rl, t, lo, c;
+
+	rh = ha * hb;
+	rm0 = ha * lb;
+	rm1 = hb * la;
+	rl = la * lb;
+	t = rl + (rm0 << 32);
+	c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+
+	return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif /* __SIZEOF_INT128__ */
+}
+
+static inline uint64_t hash_read64(const unsigned char* p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hash_read32(const unsigned char* p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash_bytes(const void* key, size_t len)
+{
+	const unsigned char* p = key;
+	uint64_t seed = HASH_P0;
+	uint64_t seed1;
+	uint64_t seed2;
+	uint64_t a;
+	uint64_t b;
+	size_t i;
+
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (hash_read32(p) << 32)
+				| hash_read32(p + ((len >> 3) << 2));
+			b = (hash_read32(p + len - 4) << 32)
+				| hash_read32(p + len - 4 - ((len >> 3) << 2));
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16)
+				| ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		i = len;
+		if (i > 48) {
+			seed1 = seed;
+			seed2 = seed;
+			do {
+				seed = hash_mix(hash_read64(p) ^ HASH_P1,
+						hash_read64(p + 8) ^ seed);
+				seed1 = hash_mix(hash_read64(p + 16) ^ HASH_P2,
+						hash_read64(p + 24) ^ seed1);
+				seed2 = hash_mix(hash_read64(p + 32) ^ HASH_P3,
+						hash_read64(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= seed1 ^ seed2;
+		}
+
+		while (i > 16) {
+			seed = hash_mix(hash_read64(p) ^ HASH_P1,
+					hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+
+		a = hash_read64(p + i - 16);
+		b = hash_read64(p + i - 8);
+	}
+
+	a = hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed));
+	return (uint32_t)(a ^ (a >> 32));
+}
+
+/* Murmur3 finalizer. */
+static inline uint32_t hash_uint(unsigned key)
+{
+	uint32_t h = key;
 
-struct map_entry
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+struct map_slot
 {
-	struct map_entry* next;
-	struct map_entry* prev;
-	void* key;
+	uint32_t hash;
+	/* Distance from the desired slot plus one, 0 means empty. */
+	uint32_t dist;
 	size_t ksize;
+	union
+	{
+		char buf[KEY_INLINE];
+		void* ptr;
+	} key;
 	void* val;
 };
 
-struct entry_list
+struct map_table
 {
-	struct map_entry* head;
-	struct map_entry* tail;
+	struct map_slot* slots;
+	size_t size;
+	size_t numstored;
 };
 
 struct __bbus_hashmap
 {
-	size_t size;
-	size_t numstored;
-	struct entry_list* buckets;
+	struct map_table cur;
+	/* Table being migrated to cur, slots are NULL if none. */
+	struct map_table old;
+	size_t migpos;
 	enum bbus_hmap_type type;
 };
 
-static bbus_hashmap* create_hashmap(enum bbus_hmap_type type, size_t size)
+static const void* slot_key(const struct map_slot* slot)
+{
+	return slot->ksize <= KEY_INLINE ? slot->key.buf : slot->key.ptr;
+}
+
+static int slot_setkey(struct map_slot* slot, const void* key, size_t ksize)
+{
+	slot->ksize = ksize;
+	if (ksize <= KEY_INLINE) {
+		memcpy(slot->key.buf, key, ksize);
+	} else {
+		slot->key.ptr = bbus_memdup(key, ksize);
+		if (slot->key.ptr == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void slot_freekey(struct map_slot* slot)
+{
+	if (slot->ksize > KEY_INLINE)
+		bbus_free(slot->key.ptr);
+}
+
+static int table_init(struct map_table* tbl, size_t size)
+{
+	tbl->slots = bbus_malloc0(size * sizeof(struct map_slot));
+	if (tbl->slots == NULL)
+		return -1;
+
+	tbl->size = size;
+	tbl->numstored = 0;
+
+	return 0;
+}
+
+static void table_free(struct map_table* tbl)
+{
+	size_t i;
+
+	if (tbl->slots == NULL)
+		return;
+
+	for (i = 0; i < tbl->size; ++i) {
+		if (tbl->slots[i].dist != 0)
+			slot_freekey(&tbl->slots[i]);
+	}
+	bbus_free(tbl->slots);
+	tbl->slots = NULL;
+	tbl->size = 0;
+	tbl->numstored = 0;
+}
+
+static struct map_slot* table_find(const struct map_table* tbl, uint32_t hash,
+					const void* key, size_t ksize)
+{
+	struct map_slot* slot;
+	size_t mask;
+	size_t ind;
+	uint32_t dist;
+
+	if (tbl->slots == NULL)
+		return NULL;
+
+	mask = tbl->size - 1;
+	for (ind = hash & mask, dist = 1;; ind = (ind + 1) & mask, ++dist) {
+		slot = &tbl->slots[ind];
+		/* An entry this close to home means ours is not here. */
+		if (slot->dist < dist)
+			return NULL;
+
+		if ((slot->hash == hash) && (slot->ksize == ksize)
+				&& (memcmp(slot_key(slot), key, ksize) == 0))
+			return slot;
+	}
+}
+
+/*
+ * Insert an entry which is not yet in the table. The table must have at
+ * least one free slot.
+ */
+static void table_insert(struct map_table* tbl, const struct map_slot* entry)
+{
+	struct map_slot ins;
+	struct map_slot tmp;
+	size_t mask;
+	size_t ind;
+
+	ins = *entry;
+	ins.dist = 1;
+	mask = tbl->size - 1;
+	for (ind = ins.hash & mask;; ind = (ind + 1) & mask, ++ins.dist) {
+		if (tbl->slots[ind].dist == 0) {
+			tbl->slots[ind] = ins;
+			tbl->numstored++;
+			return;
+		}
+
+		/* Take from the rich, give to the poor. */
+		if (tbl->slots[ind].dist < ins.dist) {
+			tmp = tbl->slots[ind];
+			tbl->slots[ind] = ins;
+			ins = tmp;
+		}
+	}
+}
+
+/*
+ * Remove the entry in given slot without freeing its key. Following
+ * entries are shifted back, so no tombstones are needed.
+ */
+static void table_remove(struct map_table* tbl, struct map_slot* slot)
+{
+	size_t mask;
+	size_t ind;
+	size_t next;
+
+	mask = tbl->size - 1;
+	for (ind = slot - tbl->slots;; ind = next) {
+		next = (ind + 1) & mask;
+		if (tbl->slots[next].dist <= 1) {
+			tbl->slots[ind].dist = 0;
+			break;
+		}
+
+		tbl->slots[ind] = tbl->slots[next];
+		tbl->slots[ind].dist--;
+	}
+
+	tbl->numstored--;
+}
+
+static void migrate(bbus_hashmap* hmap, size_t count)
+{
+	struct map_slot* slot;
+
+	if (hmap->old.slots == NULL)
+		return;
+
+	while ((count > 0) && (hmap->migpos < hmap->old.size)) {
+		slot = &hmap->old.slots[hmap->migpos];
+		if (slot->dist == 0) {
+			hmap->migpos++;
+			continue;
+		}
+
+		/*
+		 * Removing shifts the following entry into this slot, so
+		 * don't advance.
+		 */
+		table_insert(&hmap->cur, slot);
+		table_remove(&hmap->old, slot);
+		--count;
+	}
+
+	if (hmap->old.numstored == 0) {
+		bbus_free(hmap->old.slots);
+		hmap->old.slots = NULL;
+		hmap->old.size = 0;
+	}
+}
+
+static int grow(bbus_hashmap* hmap)
+{
+	struct map_table newtbl;
+
+	/* Finish the previous migration first. */
+	migrate(hmap, SIZE_MAX);
+
+	if (table_init(&newtbl, hmap->cur.size * 2) < 0)
+		return -1;
+
+	hmap->old = hmap->cur;
+	hmap->cur = newtbl;
+	hmap->migpos = 0;
+
+	return 0;
+}
+
+static int need_grow(const struct map_table* tbl)
+{
+	/* Keep the load factor below 7/8. */
+	return (tbl->numstored + 1) * 8 > tbl->size * 7;
+}
+
+static bbus_hashmap* hmap_new(enum bbus_hmap_type type, size_t size)
 {
 	bbus_hashmap* hmap;
-	unsigned i;
 
-	hmap = bbus_malloc(sizeof(struct __bbus_hashmap));
+	hmap = bbus_malloc0(sizeof(struct __bbus_hashmap));
 	if (hmap == NULL)
 		return NULL;
 
-	hmap->buckets = bbus_malloc(size * sizeof(struct entry_list));
-	if (hmap->buckets == NULL) {
+	if (table_init(&hmap->cur, size) < 0) {
 		bbus_free(hmap);
 		return NULL;
 	}
-
-	for (i = 0; i < size; ++i) {
-		hmap->buckets[i].head = NULL;
-		hmap->buckets[i].tail = NULL;
-	}
-	hmap->size = size;
-	hmap->numstored = 0;
 	hmap->type = type;
 
 	return hmap;
@@ -72,151 +397,93 @@ static bbus_hashmap* create_hashmap(enum bbus_hmap_type type, size_t size)
 
 bbus_hashmap* bbus_hmap_create(enum bbus_hmap_type type)
 {
-	return create_hashmap(type, DEF_MAP_SIZE);
+	return hmap_new(type, DEF_MAP_SIZE);
 }
 
-/* Prototype for enlarge_map(). */
-static int hmap_set(bbus_hashmap* hmap, const void* key,
-					size_t ksize, void* val);
+bbus_hashmap* bbus_hmap_create_sized(enum bbus_hmap_type type,
+							size_t numentries)
+{
+	size_t size = MIN_MAP_SIZE;
+
+	/* Smallest table holding all the entries without growing. */
+	while (numentries * 8 > size * 7)
+		size *= 2;
 
-static int enlarge_map(bbus_hashmap* hmap)
+	return hmap_new(type, size);
+}
+
+static struct map_slot* locate_entry(bbus_hashmap* hmap, uint32_t hash,
+			const void* key, size_t ksize, struct map_table** tbl)
 {
-	bbus_hashmap* newmap;
-	struct map_entry* el;
-	unsigned i;
-	int r;
+	struct map_slot* slot;
 
-	newmap = create_hashmap(hmap->type, hmap->size * 2);
-	if (newmap == NULL)
-		return -1;
-	for (i = 0; i < hmap->size; ++i) {
-		for (el = hmap->buckets[i].head; el != NULL; el = el->next) {
-			r = hmap_set(newmap, el->key, el->ksize, el->val);
-			if (r < 0) {
-				bbus_hmap_free(newmap);
-				return -1;
-			}
-		}
+	*tbl = &hmap->cur;
+	slot = table_find(&hmap->cur, hash, key, ksize);
+	if (slot == NULL) {
+		*tbl = &hmap->old;
+		slot = table_find(&hmap->old, hash, key, ksize);
 	}
 
-	bbus_hmap_reset(hmap);
-	bbus_free(hmap->buckets);
-	hmap->size = newmap->size;
-	hmap->numstored = newmap->numstored;
-	hmap->buckets = newmap->buckets;
-	bbus_free(newmap); /* Free only the pointer to avoid a memory leak. */
-
-	return 0;
+	return slot;
 }
 
-static int hmap_set(bbus_hashmap* hmap, const void* key,
+static int hmap_set(bbus_hashmap* hmap, uint32_t hash, const void* key,
 					size_t ksize, void* val)
 {
-	uint32_t crc;
-	unsigned ind;
-	int r;
-	struct map_entry* tmpel;
-	struct map_entry* newel;
-
-	if (hmap->numstored == hmap->size) {
-		r = enlarge_map(hmap);
-		if (r < 0)
-			return -1;
+	struct map_slot* slot;
+	struct map_slot entry;
+	struct map_table* tbl;
+
+	slot = locate_entry(hmap, hash, key, ksize, &tbl);
+	if (slot != NULL) {
+		slot->val = val;
+		return 0;
 	}
 
-	crc = bbus_crc32(key, ksize);
-	ind = crc % hmap->size;
-	if (hmap->buckets[ind].head == NULL) {
-		newel = bbus_malloc(sizeof(struct map_entry));
-		if (newel == NULL)
-			return -1;
-		newel->key = bbus_memdup(key, ksize);
-		if (newel->key == NULL) {
-			bbus_free(newel);
-			return -1;
-		}
-		newel->ksize = ksize;
-		newel->val = val;
-		bbus_list_push(&hmap->buckets[ind], newel);
-	} else {
-		for (tmpel = hmap->buckets[ind].head;
-				tmpel != NULL; tmpel = tmpel->next) {
-			if (memcmp(tmpel->key, key,
-					BBUS_MIN(tmpel->ksize, ksize)) == 0) {
-				tmpel->val = val;
-				return 0;
-			}
-		}
-		newel = bbus_malloc(sizeof(struct map_entry));
-		if (newel == NULL)
-			return -1;
-		newel->key = bbus_memdup(key, ksize);
-		if (newel->key == NULL) {
-			bbus_free(newel);
+	if (need_grow(&hmap->cur)) {
+		if (grow(hmap) < 0)
 			return -1;
-		}
-		newel->ksize = ksize;
-		newel->val = val;
-		bbus_list_push(&hmap->buckets[ind], newel);
 	}
 
-	hmap->numstored++;
-	return 0;
-}
-
-static struct map_entry* locate_entry(bbus_hashmap* hmap,
-		const void* key, size_t ksize, struct entry_list** list)
-{
-	uint32_t crc;
-	unsigned ind;
-	struct map_entry* entr;
+	memset(&entry, 0, sizeof(struct map_slot));
+	entry.hash = hash;
+	entry.val = val;
+	if (slot_setkey(&entry, key, ksize) < 0)
+		return -1;
 
-	crc = bbus_crc32(key, ksize);
-	ind = crc % hmap->size;
-	if (hmap->buckets[ind].head == NULL)
-		goto noelem;
+	table_insert(&hmap->cur, &entry);
+	migrate(hmap, MIGRATE_STEP);
 
-	for (entr = hmap->buckets[ind].head;
-			entr != NULL; entr = entr->next) {
-		if (memcmp(entr->key, key,
-				BBUS_MIN(entr->ksize, ksize)) == 0) {
-			if (list != NULL) {
-				/* bbus_hmap_rm() needs to know the bucket */
-				*list = &hmap->buckets[ind];
-			}
-			return entr;
-		}
-	}
-
-noelem:
-	return NULL;
+	return 0;
 }
 
-static void* hmap_find(bbus_hashmap* hmap, const void* key,
+static void* hmap_find(bbus_hashmap* hmap, uint32_t hash, const void* key,
 		size_t ksize)
 {
-	struct map_entry* entr;
+	struct map_slot* slot;
+	struct map_table* tbl;
 
-	entr = locate_entry(hmap, key, ksize, NULL);
-	if (entr == NULL)
+	slot = locate_entry(hmap, hash, key, ksize, &tbl);
+	if (slot == NULL)
 		return NULL;
-	return entr->val;
+	return slot->val;
 }
 
-static void* hmap_rm(bbus_hashmap* hmap, const void* key, size_t ksize)
+static void* hmap_rm(bbus_hashmap* hmap, uint32_t hash, const void* key,
+		size_t ksize)
 {
-	struct map_entry* entr;
-	struct entry_list* bucket;
+	struct map_slot* slot;
+	struct map_table* tbl;
 	void* ret;
 
-	entr = locate_entry(hmap, key, ksize, &bucket);
-	if (entr == NULL)
+	slot = locate_entry(hmap, hash, key, ksize, &tbl);
+	if (slot == NULL)
 		return NULL;
-	ret = entr->val;
-	bbus_list_rm(bucket, entr);
-	bbus_free(entr->key);
-	bbus_free(entr);
-	hmap->numstored--;
+
+	ret = slot->val;
+	slot_freekey(slot);
+	table_remove(tbl, slot);
+	migrate(hmap, MIGRATE_STEP);
 
 	return ret;
 }
@@ -231,64 +498,138 @@ static void* hmap_rm(bbus_hashmap* hmap, const void* key, size_t ksize)
 
 int bbus_hmap_setstr(bbus_hashmap* hmap, const char* key, void* val)
 {
+	size_t len;
+
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYSTR, -1);
-	return hmap_set(hmap, key, strlen(key), val);
+	len = strlen(key);
+
+	return hmap_set(hmap, hash_bytes(key, len), key, len, val);
 }
 
 void* bbus_hmap_findstr(bbus_hashmap* hmap, const char* key)
 {
+	size_t len;
+
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYSTR, NULL);
-	return hmap_find(hmap, key, strlen(key));
+	len = strlen(key);
+
+	return hmap_find(hmap, hash_bytes(key, len), key, len);
+}
+
+void* bbus_hmap_findstrn(bbus_hashmap* hmap, const char* key, size_t len)
+{
+	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYSTR, NULL);
+	return hmap_find(hmap, hash_bytes(key, len), key, len);
 }
 
 void* bbus_hmap_rmstr(bbus_hashmap* hmap, const char* key)
 {
+	size_t len;
+
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYSTR, NULL);
-	return hmap_rm(hmap, key, strlen(key));
+	len = strlen(key);
+
+	return hmap_rm(hmap, hash_bytes(key, len), key, len);
+}
+
+uint32_t bbus_hmap_hash(const void* buf, size_t bufsize)
+{
+	return hash_bytes(buf, bufsize);
 }
 
 int bbus_hmap_setuint(bbus_hashmap* hmap, unsigned key, void* val)
 {
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYUINT, -1);
-	return hmap_set(hmap, &key, sizeof(unsigned), val);
+	return hmap_set(hmap, hash_uint(key), &key, sizeof(unsigned), val);
 }
 
 void* bbus_hmap_finduint(bbus_hashmap* hmap, unsigned key)
 {
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYUINT, NULL);
-	return hmap_find(hmap, &key, sizeof(unsigned));
+	return hmap_find(hmap, hash_uint(key), &key, sizeof(unsigned));
 }
 
 void* bbus_hmap_rmuint(bbus_hashmap* hmap, unsigned key)
 {
 	CHECK_HMAP_TYPE(hmap, BBUS_HMAP_KEYUINT, NULL);
-	return hmap_rm(hmap, &key, sizeof(unsigned));
+	return hmap_rm(hmap, hash_uint(key), &key, sizeof(unsigned));
+}
+
+bbus_hashmap* bbus_hmap_dup(bbus_hashmap* hmap)
+{
+	bbus_hashmap* newmap;
+	struct map_table* tbl;
+	struct map_slot* slot;
+	size_t i;
+	int r;
+
+	/* Same capacity - copies are usually modified and copied again. */
+	newmap = hmap_new(hmap->type, hmap->cur.size);
+	if (newmap == NULL)
+		return NULL;
+
+	for (tbl = &hmap->cur; tbl != NULL;
+			tbl = tbl == &hmap->cur ? &hmap->old : NULL) {
+		for (i = 0; i < tbl->size; ++i) {
+			slot = &tbl->slots[i];
+			if (slot->dist == 0)
+				continue;
+
+			r = hmap_set(newmap, slot->hash, slot_key(slot),
+					slot->ksize, slot->val);
+			if (r < 0) {
+				bbus_hmap_free(newmap);
+				return NULL;
+			}
+		}
+	}
+
+	return newmap;
+}
+
+int bbus_hmap_foreach(bbus_hashmap* hmap, bbus_hmap_iterfunc func,
+								void* arg)
+{
+	struct map_table* tbl;
+	struct map_slot* slot;
+	size_t i;
+	int r;
+
+	for (tbl = &hmap->cur; tbl != NULL;
+			tbl = tbl == &hmap->cur ? &hmap->old : NULL) {
+		for (i = 0; i < tbl->size; ++i) {
+			slot = &tbl->slots[i];
+			if (slot->dist == 0)
+				continue;
+
+			r = func(slot_key(slot), slot->ksize, slot->val, arg);
+			if (r != 0)
+				return r;
+		}
+	}
+
+	return 0;
 }
 
 void bbus_hmap_reset(bbus_hashmap* hmap)
 {
-	unsigned i;
-	struct map_entry* el;
-	struct map_entry* tmpel;
-
-	for (i = 0; i < hmap->size; ++i) {
-		el = hmap->buckets[i].head;
-		while (el != NULL) {
-			tmpel = el;
-			el = el->next;
-			bbus_free(tmpel->key);
-			bbus_free(tmpel);
+	size_t i;
+
+	table_free(&hmap->old);
+	for (i = 0; i < hmap->cur.size; ++i) {
+		if (hmap->cur.slots[i].dist != 0) {
+			slot_freekey(&hmap->cur.slots[i]);
+			hmap->cur.slots[i].dist = 0;
 		}
-		hmap->buckets[i].head = NULL;
-		hmap->buckets[i].tail = NULL;
 	}
+	hmap->cur.numstored = 0;
 }
 
 void bbus_hmap_free(bbus_hashmap* hmap)
 {
 	if (hmap) {
-		bbus_hmap_reset(hmap);
-		bbus_free(hmap->buckets);
+		table_free(&hmap->old);
+		table_free(&hmap->cur);
 		bbus_free(hmap);
 	}
 }
@@ -311,48 +652,52 @@ static int BBUS_PRINTF_FUNC(3, 4) dump_append(char** buf,
 	return 0;
 }
 
-static const char* keyrepr(const void* src, size_t srcsize BBUS_UNUSED,
-				char* dst BBUS_UNUSED,
-				size_t dstsize BBUS_UNUSED)
+static int dump_table(bbus_hashmap* hmap, struct map_table* tbl,
+					char** buf, size_t* bufsize)
 {
-	return (const char*)src; /* TODO Do a proper conversion. */
+	struct map_slot* slot;
+	unsigned key;
+	size_t i;
+	int r;
+
+	for (i = 0; i < tbl->size; ++i) {
+		slot = &tbl->slots[i];
+		if (slot->dist == 0)
+			continue;
+
+		if (hmap->type == BBUS_HMAP_KEYUINT) {
+			memcpy(&key, slot_key(slot), sizeof(unsigned));
+			r = dump_append(buf, bufsize,
+				"Slot nr %u: [%u]->[0x%p]\n",
+				(unsigned)i, key, slot->val);
+		} else {
+			r = dump_append(buf, bufsize,
+				"Slot nr %u: [\"%.*s\"]->[0x%p]\n",
+				(unsigned)i, (int)slot->ksize,
+				(const char*)slot_key(slot), slot->val);
+		}
+		if (r < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
 int bbus_hmap_dump(bbus_hashmap* hmap, char* buf, size_t bufsize)
 {
-	unsigned i;
 	int r;
-	struct map_entry* el;
-	char reprbuf[1024];
 
 	memset(buf, 0, bufsize);
 	r = dump_append(&buf, &bufsize,
 			"Hashmap size: %u, objects stored: %u\n",
-			(unsigned)hmap->size, (unsigned)hmap->numstored);
+			(unsigned)(hmap->cur.size + hmap->old.size),
+			(unsigned)(hmap->cur.numstored + hmap->old.numstored));
 	if (r < 0)
 		return -1;
 
-	for (i = 0; i < hmap->size; ++i) {
-		r = dump_append(&buf, &bufsize, "Bucket nr %u:\n%s", i,
-				hmap->buckets[i].head == NULL ? "" : "| ");
-		if (r < 0)
-			return -1;
-		el = hmap->buckets[i].head;
-		while (el != NULL) {
-			r = dump_append(&buf, &bufsize,
-				" [\"%s\"]->[0x%p] |%s",
-				keyrepr(el->key, el->ksize, reprbuf,
-						sizeof(reprbuf)),
-				el->val,
-				el->next == NULL ? "\n" : "");
-			if (r < 0)
-				return -1;
-			el = el->next;
-		}
-	}
+	r = dump_table(hmap, &hmap->cur, &buf, &bufsize);
+	if (r < 0)
+		return -1;
 
-	return 0;
+	return dump_table(hmap, &hmap->old, &buf, &bufsize);
 }
-
-
-
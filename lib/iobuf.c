@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "iobuf.h"
+#include <string.h>
+
+#define IOBUF_BASE 256
+
+void __bbus_iobuf_init(struct __bbus_iobuf* iob)
+{
+	memset(iob, 0, sizeof(struct __bbus_iobuf));
+}
+
+void __bbus_iobuf_free(struct __bbus_iobuf* iob)
+{
+	bbus_free(iob->data);
+	__bbus_iobuf_init(iob);
+}
+
+size_t __bbus_iobuf_used(const struct __bbus_iobuf* iob)
+{
+	return iob->end - iob->start;
+}
+
+char* __bbus_iobuf_head(const struct __bbus_iobuf* iob)
+{
+	return iob->data + iob->start;
+}
+
+char* __bbus_iobuf_tail(const struct __bbus_iobuf* iob)
+{
+	return iob->data + iob->end;
+}
+
+size_t __bbus_iobuf_avail(const struct __bbus_iobuf* iob)
+{
+	return iob->size - iob->end;
+}
+
+int __bbus_iobuf_reserve(struct __bbus_iobuf* iob, size_t size)
+{
+	size_t used;
+	size_t newsize;
+	char* newdata;
+
+	if (__bbus_iobuf_avail(iob) >= size)
+		return 0;
+
+	used = __bbus_iobuf_used(iob);
+	if ((iob->size - used) >= size) {
+		/* Enough space if we move the data to the front. */
+		memmove(iob->data, __bbus_iobuf_head(iob), used);
+		iob->start = 0;
+		iob->end = used;
+		return 0;
+	}
+
+	newsize = iob->size ? iob->size : IOBUF_BASE;
+	while ((newsize - used) < size)
+		newsize *= 2;
+
+	newdata = bbus_malloc(newsize);
+	if (newdata == NULL)
+		return -1;
+
+	if (used > 0)
+		memcpy(newdata, __bbus_iobuf_head(iob), used);
+	bbus_free(iob->data);
+	iob->data = newdata;
+	iob->size = newsize;
+	iob->start = 0;
+	iob->end = used;
+
+	return 0;
+}
+
+void __bbus_iobuf_produce(struct __bbus_iobuf* iob, size_t size)
+{
+	iob->end += size;
+}
+
+int __bbus_iobuf_append(struct __bbus_iobuf* iob,
+				const void* data, size_t size)
+{
+	int ret;
+
+	ret = __bbus_iobuf_reserve(iob, size);
+	if (ret < 0)
+		return -1;
+
+	memcpy(__bbus_iobuf_tail(iob), data, size);
+	__bbus_iobuf_produce(iob, size);
+
+	return 0;
+}
+
+void __bbus_iobuf_consume(struct __bbus_iobuf* iob, size_t size)
+{
+	iob->start += size;
+	if (iob->start >= iob->end)
+		iob->start = iob->end = 0;
+}
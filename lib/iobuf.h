@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_IOBUF__
+#define __BBUS_IOBUF__
+
+#include <busybus.h>
+#include <stdlib.h>
+
+/*
+ * Simple byte buffer used for queueing partially received or partially
+ * sent data on non-blocking connections. Valid data lives between 'start'
+ * and 'end'.
+ */
+struct __bbus_iobuf
+{
+	char* data;
+	size_t size;
+	size_t start;
+	size_t end;
+};
+
+void __bbus_iobuf_init(struct __bbus_iobuf* iob);
+void __bbus_iobuf_free(struct __bbus_iobuf* iob);
+size_t __bbus_iobuf_used(const struct __bbus_iobuf* iob);
+char* __bbus_iobuf_head(const struct __bbus_iobuf* iob);
+char* __bbus_iobuf_tail(const struct __bbus_iobuf* iob);
+size_t __bbus_iobuf_avail(const struct __bbus_iobuf* iob);
+int __bbus_iobuf_reserve(struct __bbus_iobuf* iob, size_t size);
+void __bbus_iobuf_produce(struct __bbus_iobuf* iob, size_t size);
+int __bbus_iobuf_append(struct __bbus_iobuf* iob,
+				const void* data, size_t size);
+void __bbus_iobuf_consume(struct __bbus_iobuf* iob, size_t size);
+
+#endif /* __BBUS_IOBUF__ */
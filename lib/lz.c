@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Every sequence starts with a token: the upper nibble is the number of
+ * literals, the lower one the match length minus LZ_MINMATCH. A nibble
+ * equal to 15 is followed by extra length bytes, each one but the last
+ * equal to 255. The literals come next, then the match offset as two
+ * little-endian bytes and the extra match length bytes. The last sequence
+ * has literals only.
+ */
+#define LZ_MINMATCH	4
+#define LZ_MAXOFFSET	65535
+#define LZ_HASHBITS	12
+#define LZ_NIBBLEMAX	15
+/* The search step grows by one every this many bytes without a match. */
+#define LZ_SKIPSHIFT	6
+
+static uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static uint8_t* put_length(uint8_t* op, const uint8_t* oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op == oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op == oend)
+		return NULL;
+	*op++ = len;
+
+	return op;
+}
+
+/* A match length of 0 marks the last sequence. */
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* oend,
+				const uint8_t* lit, size_t litlen,
+				size_t offset, size_t mlen)
+{
+	uint8_t* token;
+
+	if (op == oend)
+		return NULL;
+
+	token = op++;
+	*token = (litlen < LZ_NIBBLEMAX ? litlen : LZ_NIBBLEMAX) << 4;
+	if (litlen >= LZ_NIBBLEMAX) {
+		op = put_length(op, oend, litlen - LZ_NIBBLEMAX);
+		if (op == NULL)
+			return NULL;
+	}
+
+	if ((size_t)(oend - op) < litlen)
+		return NULL;
+	memcpy(op, lit, litlen);
+	op += litlen;
+
+	if (mlen == 0)
+		return op;
+
+	if ((oend - op) < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	mlen -= LZ_MINMATCH;
+	*token |= mlen < LZ_NIBBLEMAX ? mlen : LZ_NIBBLEMAX;
+	if (mlen >= LZ_NIBBLEMAX)
+		op = put_length(op, oend, mlen - LZ_NIBBLEMAX);
+
+	return op;
+}
+
+size_t __bbus_lz_compress(const void* src, size_t size,
+				void* dst, size_t dstsize)
+{
+	uint32_t table[1 << LZ_HASHBITS];
+	const uint8_t* base = src;
+	const uint8_t* iend = base + size;
+	const uint8_t* anchor = base;
+	const uint8_t* ip = base;
+	const uint8_t* ref;
+	uint8_t* op = dst;
+	const uint8_t* oend = op + dstsize;
+	uint32_t seq;
+	unsigned h;
+	size_t mlen;
+
+	/* Stale entries are harmless - every candidate is verified. */
+	memset(table, 0, sizeof(table));
+
+	while ((size_t)(iend - ip) >= LZ_MINMATCH) {
+		seq = read32(ip);
+		h = hash32(seq);
+		ref = base + table[h];
+		table[h] = ip - base;
+		if ((ref >= ip) || ((ip - ref) > LZ_MAXOFFSET)
+						|| (read32(ref) != seq)) {
+			ip += 1 + ((ip - anchor) >> LZ_SKIPSHIFT);
+			continue;
+		}
+
+		for (mlen = LZ_MINMATCH; (ip + mlen < iend)
+				&& (ref[mlen] == ip[mlen]); ++mlen);
+
+		op = put_sequence(op, oend, anchor, ip - anchor,
+							ip - ref, mlen);
+		if (op == NULL)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (op == NULL)
+		return 0;
+
+	return op - (uint8_t*)dst;
+}
+
+static const uint8_t* get_length(const uint8_t* ip, const uint8_t* iend,
+							size_t* len)
+{
+	uint8_t b;
+
+	do {
+		if (ip == iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+
+	return ip;
+}
+
+int __bbus_lz_decompress(const void* src, size_t size,
+				void* dst, size_t dstsize)
+{
+	const uint8_t* ip = src;
+	const uint8_t* iend = ip + size;
+	uint8_t* op = dst;
+	uint8_t* oend = op + dstsize;
+	const uint8_t* ref;
+	size_t offset;
+	size_t len;
+	uint8_t token;
+
+	for (;;) {
+		if (ip == iend)
+			return -1;
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == LZ_NIBBLEMAX) {
+			ip = get_length(ip, iend, &len);
+			if (ip == NULL)
+				return -1;
+		}
+		if (((size_t)(iend - ip) < len) || ((size_t)(oend - op) < len))
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		if ((iend - ip) < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if ((offset == 0) || (offset > (size_t)(op - (uint8_t*)dst)))
+			return -1;
+
+		len = token & LZ_NIBBLEMAX;
+		if (len == LZ_NIBBLEMAX) {
+			ip = get_length(ip, iend, &len);
+			if (ip == NULL)
+				return -1;
+		}
+		len += LZ_MINMATCH;
+		if ((size_t)(oend - op) < len)
+			return -1;
+
+		/* Matches may overlap the data being produced. */
+		ref = op - offset;
+		while (len--)
+			*op++ = *ref++;
+	}
+
+	return op == oend ? 0 : -1;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_LZ__
+#define __BBUS_LZ__
+
+#include <stddef.h>
+
+/*
+ * Small LZ77 block codec in the spirit of LZ4 used for payload compression:
+ * byte-aligned sequences of literals followed by back references within
+ * the last 64 KB, no entropy coding.
+ */
+
+/*
+ * Returns the compressed size or 0 if the result doesn't fit in 'dstsize'
+ * bytes, in which case the data is not worth compressing.
+ */
+size_t __bbus_lz_compress(const void* src, size_t size,
+				void* dst, size_t dstsize);
+/*
+ * Returns 0 if 'src' decompresses to exactly 'dstsize' bytes, -1 if it's
+ * malformed. Never writes past the end of 'dst'.
+ */
+int __bbus_lz_decompress(const void* src, size_t size,
+				void* dst, size_t dstsize);
+
+#endif /* __BBUS_LZ__ */
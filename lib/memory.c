@@ -15,24 +15,109 @@
 #include <busybus.h>
 #include "memory.h"
 #include "error.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <dlfcn.h>
 
-void* bbus_malloc(size_t size)
+static void* std_malloc(size_t size, void* priv BBUS_UNUSED)
+{
+	return malloc(size);
+}
+
+static void* std_realloc(void* ptr, size_t size, void* priv BBUS_UNUSED)
+{
+	return realloc(ptr, size);
+}
+
+static void std_free(void* ptr, void* priv BBUS_UNUSED)
+{
+	free(ptr);
+}
+
+static const struct bbus_allocator std_allocator = {
+	.malloc = std_malloc,
+	.realloc = std_realloc,
+	.free = std_free,
+	.priv = NULL,
+};
+
+static const struct bbus_allocator* allocator = &std_allocator;
+
+/*
+ * Accounting is off until enabled, then every allocation is counted
+ * globally and for its call site. Sites live in an open-addressed table
+ * claimed with a compare-and-swap, never removed - once it's full, new
+ * sites are only counted in the totals.
+ */
+#define MAXSITES	1024
+
+struct site
 {
+	const void* addr;
+	unsigned long allocs;
+	unsigned long bytes;
+};
+
+static int accounting;
+static struct bbus_alloc_stats totals;
+static struct site sites[MAXSITES];
+
+static void account(const void* addr, size_t size)
+{
+	struct site* site;
+	const void* found;
+	unsigned i;
+	unsigned n;
+
+	(void)__atomic_add_fetch(&totals.allocs, 1, __ATOMIC_RELAXED);
+	(void)__atomic_add_fetch(&totals.bytes, size, __ATOMIC_RELAXED);
+
+	i = (unsigned)(((uintptr_t)addr >> 2) * 2654435761u) % MAXSITES;
+	for (n = 0; n < MAXSITES; ++n, i = (i + 1) % MAXSITES) {
+		site = &sites[i];
+		found = __atomic_load_n(&site->addr, __ATOMIC_ACQUIRE);
+		if (found == NULL) {
+			if (!__atomic_compare_exchange_n(&site->addr, &found,
+					addr, 0, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE) && (found != addr))
+				continue;
+		} else if (found != addr) {
+			continue;
+		}
+
+		(void)__atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+		(void)__atomic_add_fetch(&site->bytes, size, __ATOMIC_RELAXED);
+		return;
+	}
+}
+
+static void* do_malloc(size_t size, const void* site)
+{
+	const struct bbus_allocator* alloc;
 	void* p;
 
 	if (size == 0)
 		size = 1;
-	p = malloc(size);
+	if (BBUS_UNLIKELY(__atomic_load_n(&accounting, __ATOMIC_RELAXED)))
+		account(site, size);
+
+	alloc = __atomic_load_n(&allocator, __ATOMIC_ACQUIRE);
+	p = alloc->malloc(size, alloc->priv);
 	if (p == NULL)
 		__bbus_seterr(BBUS_ENOMEM);
 	return p;
 }
 
+void* bbus_malloc(size_t size)
+{
+	return do_malloc(size, __builtin_return_address(0));
+}
+
 void* bbus_malloc0(size_t size)
 {
 	void* p;
 
-	p = bbus_malloc(size);
+	p = do_malloc(size, __builtin_return_address(0));
 	if (p)
 		memset(p, 0, size);
 
@@ -41,11 +126,16 @@ void* bbus_malloc0(size_t size)
 
 void* bbus_realloc(void* ptr, size_t size)
 {
+	const struct bbus_allocator* alloc;
 	void* p;
 
 	if (size == 0)
 		size = 1;
-	p = realloc(ptr, size);
+	if (BBUS_UNLIKELY(__atomic_load_n(&accounting, __ATOMIC_RELAXED)))
+		account(__builtin_return_address(0), size);
+
+	alloc = __atomic_load_n(&allocator, __ATOMIC_ACQUIRE);
+	p = alloc->realloc(ptr, size, alloc->priv);
 	if (p == NULL)
 		__bbus_seterr(BBUS_ENOMEM);
 	return p;
@@ -53,18 +143,106 @@ void* bbus_realloc(void* ptr, size_t size)
 
 void bbus_free(void* ptr)
 {
-	if (ptr != NULL)
-		free(ptr);
+	const struct bbus_allocator* alloc;
+
+	if (ptr != NULL) {
+		if (BBUS_UNLIKELY(__atomic_load_n(&accounting,
+						__ATOMIC_RELAXED)))
+			(void)__atomic_add_fetch(&totals.frees, 1,
+						__ATOMIC_RELAXED);
+
+		alloc = __atomic_load_n(&allocator, __ATOMIC_ACQUIRE);
+		alloc->free(ptr, alloc->priv);
+	}
 }
 
 void* bbus_memdup(const void* src, size_t size)
 {
 	void* newp;
 
-	newp = bbus_malloc(size);
+	newp = do_malloc(size, __builtin_return_address(0));
 	if (newp)
 		memcpy(newp, src, size);
 
 	return newp;
 }
 
+void bbus_set_allocator(const struct bbus_allocator* alloc)
+{
+	__atomic_store_n(&allocator, alloc != NULL ? alloc : &std_allocator,
+							__ATOMIC_RELEASE);
+}
+
+void bbus_alloc_setaccounting(int enabled)
+{
+	__atomic_store_n(&accounting, !!enabled, __ATOMIC_RELAXED);
+}
+
+int bbus_alloc_getaccounting(void)
+{
+	return __atomic_load_n(&accounting, __ATOMIC_RELAXED);
+}
+
+void bbus_alloc_getstats(struct bbus_alloc_stats* stats)
+{
+	stats->allocs = __atomic_load_n(&totals.allocs, __ATOMIC_RELAXED);
+	stats->frees = __atomic_load_n(&totals.frees, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&totals.bytes, __ATOMIC_RELAXED);
+}
+
+static int cmp_sites(const void* p1, const void* p2)
+{
+	const struct bbus_alloc_site* s1 = p1;
+	const struct bbus_alloc_site* s2 = p2;
+
+	if (s1->bytes != s2->bytes)
+		return s1->bytes > s2->bytes ? -1 : 1;
+	return 0;
+}
+
+size_t bbus_alloc_getsites(struct bbus_alloc_site* buf, size_t max)
+{
+	struct bbus_alloc_site* all;
+	size_t num = 0;
+	unsigned i;
+
+	all = bbus_malloc(MAXSITES * sizeof(struct bbus_alloc_site));
+	if (all == NULL)
+		return 0;
+
+	for (i = 0; i < MAXSITES; ++i) {
+		all[num].addr = __atomic_load_n(&sites[i].addr,
+						__ATOMIC_ACQUIRE);
+		if (all[num].addr == NULL)
+			continue;
+
+		all[num].allocs = __atomic_load_n(&sites[i].allocs,
+						__ATOMIC_RELAXED);
+		all[num].bytes = __atomic_load_n(&sites[i].bytes,
+						__ATOMIC_RELAXED);
+		++num;
+	}
+
+	qsort(all, num, sizeof(struct bbus_alloc_site), cmp_sites);
+	if (num > max)
+		num = max;
+	memcpy(buf, all, num * sizeof(struct bbus_alloc_site));
+	bbus_free(all);
+
+	return num;
+}
+
+void bbus_alloc_sitename(const void* addr, char* buf, size_t size)
+{
+	const char* obj;
+	Dl_info info;
+
+	if ((dladdr(addr, &info) != 0) && (info.dli_fname != NULL)) {
+		obj = strrchr(info.dli_fname, '/');
+		obj = obj != NULL ? obj + 1 : info.dli_fname;
+		snprintf(buf, size, "%s+0x%lx", obj, (unsigned long)
+				((uintptr_t)addr - (uintptr_t)info.dli_fbase));
+	} else {
+		snprintf(buf, size, "%p", addr);
+	}
+}
@@ -13,12 +13,18 @@
  */
 
 #include <busybus.h>
+#include "object.h"
 #include "error.h"
+#include "lz.h"
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 struct __bbus_object
 {
@@ -28,22 +34,207 @@ struct __bbus_object
 	/* These fields are used for data extraction. */
 	int extracting;	/* 0 if not currently extracting, 1 otherwise. */
 	char* at;	/* Current position during extraction. */
-
+	int bufowner;	/* Who is responsible for buf - see below. */
+	bbus_obj_pool* pool; /* Pool to return the object to or NULL. */
+	struct __bbus_object* next; /* Next free object in the pool. */
+	int order;	/* BBUS_OBJ_NETORDER or BBUS_OBJ_HOSTORDER. */
 };
 
+/* buf is allocated by the object itself. */
+#define BUFFER_OWNED	0
+/* buf is a private shared memory mapping. */
+#define BUFFER_MAPPED	1
+/* buf belongs to someone else and must outlive the object. */
+#define BUFFER_BORROWED	2
+
 #define BUFFER_BASE	64
 #define BUFFER_AT(OBJ)	((OBJ)->buf + (OBJ)->bufused)
 
+/* Byte order of new objects. */
+static int default_order = BBUS_OBJ_NETORDER;
+
+/* Integers are only swapped in objects using the network byte order. */
+static uint32_t to_order(const bbus_object* obj, uint32_t val)
+{
+	return obj->order == BBUS_OBJ_HOSTORDER ? val : htonl(val);
+}
+
+static uint32_t from_order(const bbus_object* obj, uint32_t val)
+{
+	return obj->order == BBUS_OBJ_HOSTORDER ? val : ntohl(val);
+}
+
+/*
+ * Pools keep freed objects and their buffers for reuse. Buffers come in
+ * power-of-two size classes starting at BUFFER_BASE up to the maximum
+ * size of a regular payload, bigger ones are always allocated and freed
+ * directly.
+ */
+#define POOL_NUMCLASSES		7
+#define POOL_MAXBUFSIZE		(BUFFER_BASE << (POOL_NUMCLASSES - 1))
+#define POOL_MAXCACHED		64
+
+#if POOL_MAXBUFSIZE < BBUS_MAXPLOADSIZE
+#error "Object pool size classes must cover BBUS_MAXPLOADSIZE"
+#endif
+
+struct pool_buf
+{
+	struct pool_buf* next;
+};
+
+struct __bbus_obj_pool
+{
+	struct __bbus_object* objs;
+	unsigned numobjs;
+	struct pool_buf* bufs[POOL_NUMCLASSES];
+	unsigned numbufs[POOL_NUMCLASSES];
+};
+
+static int pool_class(size_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < POOL_NUMCLASSES; ++cls) {
+		if (size <= ((size_t)BUFFER_BASE << cls))
+			return cls;
+	}
+
+	return -1;
+}
+
+/*
+ * Allocates a buffer of at least 'size' bytes for the object and stores
+ * the actual size in 'realsize'.
+ */
+static char* buf_alloc(bbus_obj_pool* pool, size_t size, size_t* realsize)
+{
+	struct pool_buf* buf;
+	int cls;
+
+	cls = pool == NULL ? -1 : pool_class(size);
+	if (cls < 0) {
+		*realsize = size;
+		return bbus_malloc(size);
+	}
+
+	*realsize = (size_t)BUFFER_BASE << cls;
+	buf = pool->bufs[cls];
+	if (buf == NULL)
+		return bbus_malloc(*realsize);
+
+	pool->bufs[cls] = buf->next;
+	pool->numbufs[cls]--;
+
+	return (char*)buf;
+}
+
+static void buf_free(bbus_obj_pool* pool, char* buf, size_t size)
+{
+	int cls;
+
+	if (buf == NULL)
+		return;
+
+	cls = pool == NULL ? -1 : pool_class(size);
+	if ((cls < 0) || (pool->numbufs[cls] >= POOL_MAXCACHED)) {
+		bbus_free(buf);
+		return;
+	}
+
+	((struct pool_buf*)buf)->next = pool->bufs[cls];
+	pool->bufs[cls] = (struct pool_buf*)buf;
+	pool->numbufs[cls]++;
+}
+
+bbus_obj_pool* bbus_obj_pool_create(void)
+{
+	return bbus_malloc0(sizeof(struct __bbus_obj_pool));
+}
+
+void bbus_obj_pool_free(bbus_obj_pool* pool)
+{
+	struct __bbus_object* obj;
+	struct pool_buf* buf;
+	int cls;
+
+	if (pool == NULL)
+		return;
+
+	while ((obj = pool->objs) != NULL) {
+		pool->objs = obj->next;
+		bbus_free(obj);
+	}
+
+	for (cls = 0; cls < POOL_NUMCLASSES; ++cls) {
+		while ((buf = pool->bufs[cls]) != NULL) {
+			pool->bufs[cls] = buf->next;
+			bbus_free(buf);
+		}
+	}
+
+	bbus_free(pool);
+}
+
 bbus_object* bbus_obj_alloc(void)
 {
-	return bbus_malloc0(sizeof(struct __bbus_object));
+	bbus_object* obj;
+
+	obj = bbus_malloc0(sizeof(struct __bbus_object));
+	if (obj != NULL)
+		obj->order = bbus_obj_getdefaultorder();
+
+	return obj;
+}
+
+bbus_object* bbus_obj_alloc_from(bbus_obj_pool* pool)
+{
+	bbus_object* obj;
+
+	obj = pool->objs;
+	if (obj == NULL) {
+		obj = bbus_malloc(sizeof(struct __bbus_object));
+		if (obj == NULL)
+			return NULL;
+	} else {
+		pool->objs = obj->next;
+		pool->numobjs--;
+	}
+
+	memset(obj, 0, sizeof(struct __bbus_object));
+	obj->pool = pool;
+	obj->order = bbus_obj_getdefaultorder();
+
+	return obj;
+}
+
+static void release_buffer(bbus_object* obj)
+{
+	switch (obj->bufowner) {
+	case BUFFER_OWNED:
+		buf_free(obj->pool, obj->buf, obj->bufsize);
+		break;
+	case BUFFER_MAPPED:
+		munmap(obj->buf, obj->bufsize);
+		break;
+	}
 }
 
 void bbus_obj_free(bbus_object* obj)
 {
+	bbus_obj_pool* pool;
+
 	if (obj) {
-		bbus_free(obj->buf);
-		bbus_free(obj);
+		pool = obj->pool;
+		release_buffer(obj);
+
+		if ((pool == NULL) || (pool->numobjs >= POOL_MAXCACHED)) {
+			bbus_free(obj);
+		} else {
+			obj->next = pool->objs;
+			pool->objs = obj;
+			pool->numobjs++;
+		}
 	}
 }
 
@@ -108,16 +299,48 @@ static int has_needed_space(bbus_object* obj, size_t needed)
 	return (obj->bufsize - obj->bufused) >= needed ? 1 : 0;
 }
 
+/*
+ * Copies the contents of the buffer to a new one owned by the object and
+ * at least 'size' bytes big.
+ */
+static int move_buffer(bbus_object* obj, size_t size)
+{
+	char* newbuf;
+	size_t newsize;
+
+	newbuf = buf_alloc(obj->pool, size < BUFFER_BASE ? BUFFER_BASE : size,
+								&newsize);
+	if (newbuf == NULL)
+		return -1;
+	memcpy(newbuf, obj->buf, obj->bufused);
+	if (obj->extracting)
+		obj->at = newbuf + (obj->at - obj->buf);
+	release_buffer(obj);
+	obj->buf = newbuf;
+	obj->bufsize = newsize;
+	obj->bufowner = BUFFER_OWNED;
+
+	return 0;
+}
+
 static int enlarge_buffer(bbus_object* obj)
 {
+	char* newbuf;
+
 	if (obj->buf == NULL) {
-		obj->buf = bbus_malloc0(BUFFER_BASE);
+		obj->buf = buf_alloc(obj->pool, BUFFER_BASE, &obj->bufsize);
 		if (obj->buf == NULL)
 			return -1;
-		obj->bufsize = BUFFER_BASE;
+		memset(obj->buf, 0, obj->bufsize);
+		obj->bufowner = BUFFER_OWNED;
+	} else
+	if ((obj->bufowner != BUFFER_OWNED) || (obj->pool != NULL)) {
+		/*
+		 * Mapped objects are copied to the heap once modified, pooled
+		 * buffers are exchanged for ones from the next size class.
+		 */
+		return move_buffer(obj, obj->bufsize*2);
 	} else {
-		char* newbuf;
-
 		newbuf = bbus_realloc(obj->buf, obj->bufsize*2);
 		if (newbuf == NULL)
 			return -1;
@@ -132,6 +355,13 @@ static int make_enough_space(bbus_object* obj, size_t needed)
 {
 	int r;
 
+	/* Borrowed memory is never written to, even if there's room. */
+	if (obj->bufowner == BUFFER_BORROWED) {
+		r = move_buffer(obj, obj->bufused + needed);
+		if (r < 0)
+			return -1;
+	}
+
 	while (!has_needed_space(obj, needed)) {
 		r = enlarge_buffer(obj);
 		if (r < 0)
@@ -141,6 +371,23 @@ static int make_enough_space(bbus_object* obj, size_t needed)
 	return 0;
 }
 
+int bbus_obj_reserve(bbus_object* obj, size_t size)
+{
+	int r;
+
+	if ((obj->bufowner != BUFFER_BORROWED) && has_needed_space(obj, size))
+		return 0;
+
+	/* A single allocation instead of successive doubling. */
+	r = move_buffer(obj, obj->bufused + size);
+	if (r < 0) {
+		__bbus_seterr(BBUS_ENOMEM);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int insert_data(bbus_object* obj, const void* data, size_t size)
 {
 	int r;
@@ -187,7 +434,7 @@ static int extract_data(bbus_object* obj, void* buf, size_t size)
 
 int bbus_obj_insarray(bbus_object* obj, bbus_size arrsize)
 {
-	arrsize = htonl(arrsize);
+	arrsize = to_order(obj, arrsize);
 
 	return insert_data(obj, &arrsize, sizeof(bbus_size));
 }
@@ -199,14 +446,14 @@ int bbus_obj_extrarray(bbus_object* obj, bbus_size* arrsize)
 	r = extract_data(obj, arrsize, sizeof(bbus_size));
 	if (r < 0)
 		return -1;
-	*arrsize = ntohl(*arrsize);
+	*arrsize = from_order(obj, *arrsize);
 
 	return 0;
 }
 
 int bbus_obj_insint(bbus_object* obj, bbus_int32 val)
 {
-	val = htonl(val);
+	val = to_order(obj, val);
 
 	return insert_data(obj, &val, sizeof(bbus_int32));
 }
@@ -218,14 +465,14 @@ int bbus_obj_extrint(bbus_object* obj, bbus_int32* val)
 	r = extract_data(obj, val, sizeof(bbus_int32));
 	if (r < 0)
 		return -1;
-	*val = ntohl(*val);
+	*val = from_order(obj, *val);
 
 	return 0;
 }
 
 int bbus_obj_insuint(bbus_object* obj, bbus_uint32 val)
 {
-	val = htonl(val);
+	val = to_order(obj, val);
 
 	return insert_data(obj, &val, sizeof(bbus_uint32));
 }
@@ -237,7 +484,7 @@ int bbus_obj_extruint(bbus_object* obj, bbus_uint32* val)
 	r = extract_data(obj, val, sizeof(bbus_uint32));
 	if (r < 0)
 		return -1;
-	*val = ntohl(*val);
+	*val = from_order(obj, *val);
 
 	return 0;
 }
@@ -261,14 +508,14 @@ int bbus_obj_extrstr(bbus_object* obj, char** val)
 	 * make *val point to its beginning.
 	 */
 
-	end = memmem(obj->at, (obj->buf + obj->bufused) - obj->at, "\0", 1);
+	end = memchr(obj->at, '\0', (obj->buf + obj->bufused) - obj->at);
 	if (end == NULL) {
 		__bbus_seterr(BBUS_EOBJINVFMT);
 		return -1;
 	}
 
 	*val = obj->at;
-	obj->at += strlen(obj->at) + 1;
+	obj->at = (char*)end + 1;
 
 	return 0;
 }
@@ -319,273 +566,812 @@ int bbus_obj_extrbytes(bbus_object* obj, void* buf, size_t size)
 	return extract_data(obj, buf, size);
 }
 
-void bbus_obj_rewind(bbus_object* obj)
+int bbus_obj_extrbytes_ref(bbus_object* obj, const void** buf, size_t* size)
 {
-	obj->extracting = 0;
-}
+	bbus_size arrsize;
+	int r;
 
-bbus_object* bbus_obj_frombuf(const void* buf, size_t bufsize)
-{
-	bbus_object* obj;
+	r = bbus_obj_extrarray(obj, &arrsize);
+	if (r < 0)
+		return -1;
 
-	obj = bbus_malloc0(sizeof(struct __bbus_object));
-	if (obj == NULL)
-		return NULL;
-	obj->buf = bbus_malloc0(bufsize);
-	if (obj->buf == NULL) {
-		bbus_free(obj);
-		return NULL;
+	if (!can_extract_size(obj, arrsize)) {
+		obj->at -= sizeof(bbus_size);
+		__bbus_seterr(BBUS_EOBJINVFMT);
+		return -1;
 	}
-	memcpy(obj->buf, buf, bufsize);
-	obj->bufsize = bufsize;
-	obj->bufused = bufsize;
 
-	return obj;
+	*buf = obj->at;
+	*size = arrsize;
+	obj->at += arrsize;
+
+	return 0;
 }
 
-struct va_list_box
-{
-	va_list va;
-};
+/* Four words at a time - maps to SSE2 on x86-64 and NEON on arm. */
+typedef uint32_t word_vector __attribute__((vector_size(16)));
 
-static int build_simple_type(char descr, bbus_object* obj,
-				struct va_list_box* va_box)
+/*
+ * Copies 32-bit words between the object's buffer and a user array,
+ * swapping the bytes of each one if needed. Neither side has to be
+ * aligned.
+ */
+static void convert_words(const bbus_object* obj, void* dst,
+				const void* src, size_t num)
 {
-	int ret;
+	const char* s = src;
+	char* d = dst;
+	word_vector v;
+	uint32_t w;
+	size_t i;
+
+	if ((obj->order == BBUS_OBJ_HOSTORDER) || (htonl(1) == 1)) {
+		memcpy(dst, src, num * sizeof(uint32_t));
+		return;
+	}
 
-	switch (descr) {
-	case BBUS_TYPE_INT32:
-		ret = bbus_obj_insint(obj, va_arg(va_box->va, bbus_int32));
-		break;
-	case BBUS_TYPE_UINT32:
-		ret = bbus_obj_insuint(obj, va_arg(va_box->va, bbus_uint32));
-		break;
-	case BBUS_TYPE_BYTE:
-		ret = bbus_obj_insbyte(obj,
-				(bbus_byte)va_arg(va_box->va, int));
-		break;
-	case BBUS_TYPE_STRING:
-		ret = bbus_obj_insstr(obj, va_arg(va_box->va, char*));
-		break;
-	default:
-		__bbus_seterr(BBUS_ELOGICERR);
-		return -1;
+	for (i = 0; i + 4 <= num; i += 4) {
+		memcpy(&v, s + i * sizeof(uint32_t), sizeof(word_vector));
+		v = (v >> 24) | ((v >> 8) & 0xff00)
+			| ((v << 8) & 0xff0000) | (v << 24);
+		memcpy(d + i * sizeof(uint32_t), &v, sizeof(word_vector));
 	}
 
-	return ret;
+	for (; i < num; ++i) {
+		memcpy(&w, s + i * sizeof(uint32_t), sizeof(uint32_t));
+		w = ntohl(w);
+		memcpy(d + i * sizeof(uint32_t), &w, sizeof(uint32_t));
+	}
 }
 
-/* Prototype for build_struct(). */
-static int build_array(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box);
-
-static int build_struct(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box)
+static int insert_words(bbus_object* obj, const void* vals, size_t num)
 {
-	int ret;
+	int r;
 
-	while (**descr != BBUS_TYPE_STRUCT_END) {
-		switch (**descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = build_array(descr, obj, va_box);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			++(*descr);
-			ret = build_struct(descr, obj, va_box);
-			break;
-		default:
-			ret = build_simple_type(**descr, obj, va_box);
-			++(*descr);
-			break;
-		}
-		if (ret < 0)
-			return -1;
+	r = bbus_obj_insarray(obj, (bbus_size)num);
+	if (r < 0)
+		return -1;
+
+	r = make_enough_space(obj, num * sizeof(uint32_t));
+	if (r < 0) {
+		__bbus_seterr(BBUS_ENOMEM);
+		return -1;
 	}
 
-	++(*descr);
+	convert_words(obj, BUFFER_AT(obj), vals, num);
+	obj->bufused += num * sizeof(uint32_t);
+
 	return 0;
 }
 
-static int build_array(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box)
+static int extract_words(bbus_object* obj, void* buf, size_t* num)
 {
 	bbus_size arrsize;
-	int ret;
-	const char* pos;
+	char* start;
+	int r;
 
-	arrsize = va_arg(va_box->va, bbus_size);
-	ret = bbus_obj_insarray(obj, arrsize);
-	++(*descr);
-	while (--arrsize) {
-		switch (**descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = build_array(descr, obj, va_box);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			pos = *descr;
-			++(*descr);
-			ret = build_struct(descr, obj, va_box);
-			*descr = pos;
-			break;
-		default:
-			ret = build_simple_type(**descr, obj, va_box);
-			break;
-		}
-		if (ret < 0)
-			return -1;
+	if (obj->extracting == 0)
+		make_ready_for_extraction(obj);
+
+	start = obj->at;
+	r = bbus_obj_extrarray(obj, &arrsize);
+	if (r < 0)
+		return -1;
+
+	if (!can_extract_size(obj, (size_t)arrsize * sizeof(uint32_t))) {
+		__bbus_seterr(BBUS_EOBJINVFMT);
+		goto err;
+	}
+
+	/* Leave the object untouched so that the caller can retry. */
+	if (arrsize > *num) {
+		__bbus_seterr(BBUS_ENOSPACE);
+		goto err;
 	}
 
+	convert_words(obj, buf, obj->at, arrsize);
+	obj->at += arrsize * sizeof(uint32_t);
+	*num = arrsize;
+
 	return 0;
+
+err:
+	obj->at = start;
+	return -1;
 }
 
-bbus_object* bbus_obj_build(const char* descr, ...)
+int bbus_obj_insint32v(bbus_object* obj, const bbus_int32* vals, size_t num)
 {
-	va_list va;
-	bbus_object* obj;
-
-	va_start(va, descr);
-	obj = bbus_obj_vbuild(descr, va);
-	va_end(va);
+	return insert_words(obj, vals, num);
+}
 
-	return obj;
+int bbus_obj_extrint32v(bbus_object* obj, bbus_int32* buf, size_t* num)
+{
+	return extract_words(obj, buf, num);
 }
 
-bbus_object* bbus_obj_vbuild(const char* descr, va_list va)
+int bbus_obj_insuint32v(bbus_object* obj, const bbus_uint32* vals,
+							size_t num)
 {
-	bbus_object* obj;
-	int ret;
-	struct va_list_box va_box;
+	return insert_words(obj, vals, num);
+}
 
-	if (!bbus_obj_descrvalid(descr)) {
-		__bbus_seterr(BBUS_EINVALARG);
-		return NULL;
-	}
+int bbus_obj_extruint32v(bbus_object* obj, bbus_uint32* buf, size_t* num)
+{
+	return extract_words(obj, buf, num);
+}
 
-	obj = bbus_obj_alloc();
-	if (obj == NULL)
-		return NULL;
+void bbus_obj_setorder(bbus_object* obj, int order)
+{
+	obj->order = order;
+}
 
-	va_copy(va_box.va, va);
+int bbus_obj_getorder(const bbus_object* obj)
+{
+	return obj->order;
+}
 
-	while (*descr) {
-		switch (*descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = build_array(&descr, obj, &va_box);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			++descr;
-			ret = build_struct(&descr, obj, &va_box);
-			break;
-		case BBUS_TYPE_STRUCT_END:
-			/* This should have been handled by build_struct(). */
-			__bbus_seterr(BBUS_ELOGICERR);
-			ret = -1;
-			break;
-		default:
-			ret = build_simple_type(*descr, obj, &va_box);
-			++descr;
-			break;
-		}
-		if (ret < 0)
-			goto out;
-	}
+void bbus_obj_setdefaultorder(int order)
+{
+	__atomic_store_n(&default_order, order, __ATOMIC_RELAXED);
+}
 
-	return obj;
+int bbus_obj_getdefaultorder(void)
+{
+	return __atomic_load_n(&default_order, __ATOMIC_RELAXED);
+}
 
-out:
-	va_end(va_box.va);
-	bbus_obj_free(obj);
-	return NULL;
+void bbus_obj_rewind(bbus_object* obj)
+{
+	obj->extracting = 0;
 }
 
-static int parse_simple_type(char descr, bbus_object* obj,
-					struct va_list_box* va_box)
+bbus_object* bbus_obj_frombuf(const void* buf, size_t bufsize)
 {
-	int ret;
+	bbus_object* obj;
 
-	switch (descr) {
-	case BBUS_TYPE_INT32:
-		ret = bbus_obj_extrint(obj, va_arg(va_box->va, bbus_int32*));
-		break;
-	case BBUS_TYPE_UINT32:
-		ret = bbus_obj_extruint(obj, va_arg(va_box->va, bbus_uint32*));
-		break;
-	case BBUS_TYPE_BYTE:
-		ret = bbus_obj_extrbyte(obj,
-				(bbus_byte*)va_arg(va_box->va, int*));
-		break;
+	obj = bbus_malloc0(sizeof(struct __bbus_object));
+	if (obj == NULL)
+		return NULL;
+	obj->buf = bbus_malloc0(bufsize);
+	if (obj->buf == NULL) {
+		bbus_free(obj);
+		return NULL;
+	}
+	memcpy(obj->buf, buf, bufsize);
+	obj->bufsize = bufsize;
+	obj->bufused = bufsize;
+
+	return obj;
+}
+
+bbus_object* bbus_obj_frombuf_from(bbus_obj_pool* pool,
+				const void* buf, size_t bufsize)
+{
+	bbus_object* obj;
+
+	obj = bbus_obj_alloc_from(pool);
+	if (obj == NULL)
+		return NULL;
+
+	obj->buf = buf_alloc(pool, bufsize, &obj->bufsize);
+	if (obj->buf == NULL) {
+		bbus_obj_free(obj);
+		return NULL;
+	}
+	memcpy(obj->buf, buf, bufsize);
+	obj->bufused = bufsize;
+
+	return obj;
+}
+
+bbus_object* bbus_obj_view(const void* buf, size_t bufsize)
+{
+	bbus_object* obj;
+
+	obj = bbus_malloc0(sizeof(struct __bbus_object));
+	if (obj == NULL)
+		return NULL;
+
+	obj->buf = (char*)buf;
+	obj->bufsize = bufsize;
+	obj->bufused = bufsize;
+	obj->bufowner = BUFFER_BORROWED;
+
+	return obj;
+}
+
+bbus_object* bbus_obj_view_from(bbus_obj_pool* pool,
+				const void* buf, size_t bufsize)
+{
+	bbus_object* obj;
+
+	obj = bbus_obj_alloc_from(pool);
+	if (obj == NULL)
+		return NULL;
+
+	obj->buf = (char*)buf;
+	obj->bufsize = bufsize;
+	obj->bufused = bufsize;
+	obj->bufowner = BUFFER_BORROWED;
+
+	return obj;
+}
+
+void* __bbus_obj_compress(bbus_object* obj, size_t* size)
+{
+	uint32_t rawsize;
+	size_t zsize;
+	char* buf;
+
+	if (obj->bufused <= sizeof(uint32_t))
+		return NULL;
+
+	/* Bail out as soon as the output isn't smaller than the input. */
+	buf = bbus_malloc(obj->bufused);
+	if (buf == NULL)
+		return NULL;
+
+	zsize = __bbus_lz_compress(obj->buf, obj->bufused,
+				buf + sizeof(uint32_t),
+				obj->bufused - sizeof(uint32_t) - 1);
+	if (zsize == 0) {
+		bbus_free(buf);
+		return NULL;
+	}
+
+	rawsize = htonl(obj->bufused);
+	memcpy(buf, &rawsize, sizeof(uint32_t));
+	*size = zsize + sizeof(uint32_t);
+
+	return buf;
+}
+
+bbus_object* __bbus_obj_decompress(bbus_obj_pool* pool,
+				const void* buf, size_t size)
+{
+	bbus_object* obj;
+	uint32_t rawsize;
+
+	if (size < sizeof(uint32_t))
+		goto err_invfmt;
+
+	memcpy(&rawsize, buf, sizeof(uint32_t));
+	rawsize = ntohl(rawsize);
+	if ((rawsize == 0) || (rawsize > BBUS_MAXLARGEPLOADSIZE))
+		goto err_invfmt;
+
+	obj = pool == NULL ? bbus_obj_alloc() : bbus_obj_alloc_from(pool);
+	if (obj == NULL)
+		return NULL;
+
+	obj->buf = buf_alloc(pool, rawsize, &obj->bufsize);
+	if (obj->buf == NULL) {
+		bbus_obj_free(obj);
+		return NULL;
+	}
+
+	if (__bbus_lz_decompress((const char*)buf + sizeof(uint32_t),
+			size - sizeof(uint32_t), obj->buf, rawsize) < 0) {
+		bbus_obj_free(obj);
+		goto err_invfmt;
+	}
+	obj->bufused = rawsize;
+
+	return obj;
+
+err_invfmt:
+	__bbus_seterr(BBUS_EOBJINVFMT);
+	return NULL;
+}
+
+int bbus_obj_detach(bbus_object* obj)
+{
+	if (obj->bufowner != BUFFER_BORROWED)
+		return 0;
+
+	return move_buffer(obj, obj->bufused);
+}
+
+int bbus_obj_checkfd(int fd, size_t* size)
+{
+	struct stat st;
+	int seals;
+	int r;
+
+	r = fstat(fd, &st);
+	if (r < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	/*
+	 * A file the sender could still truncate would make every access
+	 * to the mapping past the new end fault with SIGBUS.
+	 */
+	seals = S_ISREG(st.st_mode) ? fcntl(fd, F_GET_SEALS) : -1;
+	if ((seals < 0) || ((seals & (F_SEAL_SHRINK | F_SEAL_WRITE))
+				!= (F_SEAL_SHRINK | F_SEAL_WRITE))) {
+		__bbus_seterr(BBUS_EOBJINVFMT);
+		return -1;
+	}
+
+	*size = st.st_size;
+	return 0;
+}
+
+bbus_object* bbus_obj_fromfd(int fd)
+{
+	bbus_object* obj;
+	size_t size;
+	void* addr;
+	int r;
+
+	r = bbus_obj_checkfd(fd, &size);
+	if (r < 0)
+		return NULL;
+
+	obj = bbus_malloc0(sizeof(struct __bbus_object));
+	if (obj == NULL)
+		return NULL;
+
+	if (size == 0)
+		return obj;
+
+	/* Private mapping - the sender's data is never modified. */
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		__bbus_seterr(errno);
+		bbus_free(obj);
+		return NULL;
+	}
+
+	obj->buf = addr;
+	obj->bufsize = size;
+	obj->bufused = size;
+	obj->bufowner = BUFFER_MAPPED;
+
+	return obj;
+}
+
+int bbus_obj_tofd(bbus_object* obj)
+{
+	size_t written;
+	ssize_t r;
+	int fd;
+
+	fd = memfd_create("bbus-object", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	for (written = 0; written < obj->bufused; written += r) {
+		r = write(fd, obj->buf + written, obj->bufused - written);
+		if (r < 0) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			goto err;
+		}
+	}
+
+	/* The receiver maps it - make sure it can't change under it. */
+	r = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+					| F_SEAL_WRITE | F_SEAL_SEAL);
+	if (r < 0)
+		goto err;
+
+	return fd;
+
+err:
+	__bbus_seterr(errno);
+	close(fd);
+	return -1;
+}
+
+/*
+ * Object descriptions are compiled into flat programs with one operation
+ * per description character. An array operation is followed by the
+ * operations describing a single element, 'len' tells how many there are.
+ * Struct delimiters are only kept for the sake of repr.
+ */
+struct prog_op
+{
+	char type;
+	unsigned len;
+};
+
+struct __bbus_obj_prog
+{
+	unsigned numops;
+	struct prog_op* ops;
+};
+
+/* Uncompiled descriptions this short are compiled on the stack. */
+#define PROG_STACKOPS	64
+
+static int compile_item(const char** descr, struct prog_op* ops,
+						unsigned* numops)
+{
+	unsigned start;
+	int ret;
+
+	if (**descr == '\0')
+		return -1;
+
+	start = (*numops)++;
+	ops[start].type = **descr;
+	ops[start].len = 0;
+
+	switch (*(*descr)++) {
+	case BBUS_TYPE_INT32:
+	case BBUS_TYPE_UINT32:
+	case BBUS_TYPE_BYTE:
 	case BBUS_TYPE_STRING:
-		ret = bbus_obj_extrstr(obj, va_arg(va_box->va, char**));
+		break;
+	case BBUS_TYPE_ARRAY:
+		ret = compile_item(descr, ops, numops);
+		if (ret < 0)
+			return -1;
+		ops[start].len = *numops - start - 1;
+		break;
+	case BBUS_TYPE_STRUCT_START:
+		if (**descr == BBUS_TYPE_STRUCT_END)
+			return -1;
+		while (**descr != BBUS_TYPE_STRUCT_END) {
+			ret = compile_item(descr, ops, numops);
+			if (ret < 0)
+				return -1;
+		}
+		ops[(*numops)++].type = *(*descr)++;
+		ops[start].len = *numops - start - 1;
 		break;
 	default:
-		__bbus_seterr(BBUS_ELOGICERR);
+		/* Also covers unbalanced parentheses. */
 		return -1;
 	}
 
-	return ret;
+	return 0;
+}
+
+/*
+ * Compiles 'descr' into 'ops', which must have room for at least
+ * strlen(descr) operations. Returns the number of operations or -1 if
+ * the description is not valid.
+ */
+static int compile_descr(const char* descr, struct prog_op* ops)
+{
+	unsigned numops = 0;
+	int ret;
+
+	if (*descr == '\0')
+		goto err;
+
+	while (*descr) {
+		ret = compile_item(&descr, ops, &numops);
+		if (ret < 0)
+			goto err;
+	}
+
+	return numops;
+
+err:
+	__bbus_seterr(BBUS_EINVALARG);
+	return -1;
+}
+
+bbus_obj_prog* bbus_obj_compile(const char* descr)
+{
+	bbus_obj_prog* prog;
+	int ret;
+
+	prog = bbus_malloc(sizeof(struct __bbus_obj_prog)
+				+ strlen(descr) * sizeof(struct prog_op));
+	if (prog == NULL)
+		return NULL;
+
+	prog->ops = (struct prog_op*)(prog + 1);
+	ret = compile_descr(descr, prog->ops);
+	if (ret < 0) {
+		bbus_free(prog);
+		return NULL;
+	}
+	prog->numops = ret;
+
+	return prog;
+}
+
+void bbus_obj_prog_free(bbus_obj_prog* prog)
+{
+	bbus_free(prog);
+}
+
+/*
+ * Compiles a description passed to one of the uncompiled entry points,
+ * using 'stackops' if it's big enough. Must be followed by a call to
+ * put_tmpprog().
+ */
+static int get_tmpprog(const char* descr, struct __bbus_obj_prog* prog,
+					struct prog_op* stackops)
+{
+	size_t len;
+	int ret;
+
+	len = strlen(descr);
+	if (len <= PROG_STACKOPS) {
+		prog->ops = stackops;
+	} else {
+		prog->ops = bbus_malloc(len * sizeof(struct prog_op));
+		if (prog->ops == NULL)
+			return -1;
+	}
+
+	ret = compile_descr(descr, prog->ops);
+	if (ret < 0) {
+		if (prog->ops != stackops)
+			bbus_free(prog->ops);
+		return -1;
+	}
+	prog->numops = ret;
+
+	return 0;
+}
+
+static void put_tmpprog(struct __bbus_obj_prog* prog,
+					struct prog_op* stackops)
+{
+	if (prog->ops != stackops)
+		bbus_free(prog->ops);
+}
+
+struct va_list_box
+{
+	va_list va;
+};
+
+static int build_ops(bbus_object* obj, const struct prog_op* op,
+			const struct prog_op* end, struct va_list_box* va_box)
+{
+	bbus_size arrsize;
+	int ret = 0;
+
+	for (; op < end; ++op) {
+		switch (op->type) {
+		case BBUS_TYPE_INT32:
+			ret = bbus_obj_insint(obj,
+					va_arg(va_box->va, bbus_int32));
+			break;
+		case BBUS_TYPE_UINT32:
+			ret = bbus_obj_insuint(obj,
+					va_arg(va_box->va, bbus_uint32));
+			break;
+		case BBUS_TYPE_BYTE:
+			ret = bbus_obj_insbyte(obj,
+					(bbus_byte)va_arg(va_box->va, int));
+			break;
+		case BBUS_TYPE_STRING:
+			ret = bbus_obj_insstr(obj, va_arg(va_box->va, char*));
+			break;
+		case BBUS_TYPE_ARRAY:
+			arrsize = va_arg(va_box->va, bbus_size);
+			ret = bbus_obj_insarray(obj, arrsize);
+			while ((ret == 0) && arrsize--)
+				ret = build_ops(obj, op + 1,
+						op + 1 + op->len, va_box);
+			op += op->len;
+			break;
+		case BBUS_TYPE_STRUCT_START:
+		case BBUS_TYPE_STRUCT_END:
+			break;
+		default:
+			__bbus_seterr(BBUS_ELOGICERR);
+			return -1;
+		}
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Computes the size of the marshalled data without building anything,
+ * so that the object's buffer can be allocated up front.
+ */
+static size_t size_ops(const struct prog_op* op,
+			const struct prog_op* end, struct va_list_box* va_box)
+{
+	bbus_size arrsize;
+	size_t size = 0;
+
+	for (; op < end; ++op) {
+		switch (op->type) {
+		case BBUS_TYPE_INT32:
+			(void)va_arg(va_box->va, bbus_int32);
+			size += sizeof(bbus_int32);
+			break;
+		case BBUS_TYPE_UINT32:
+			(void)va_arg(va_box->va, bbus_uint32);
+			size += sizeof(bbus_uint32);
+			break;
+		case BBUS_TYPE_BYTE:
+			(void)va_arg(va_box->va, int);
+			size += sizeof(bbus_byte);
+			break;
+		case BBUS_TYPE_STRING:
+			size += strlen(va_arg(va_box->va, char*)) + 1;
+			break;
+		case BBUS_TYPE_ARRAY:
+			arrsize = va_arg(va_box->va, bbus_size);
+			size += sizeof(bbus_size);
+			while (arrsize--)
+				size += size_ops(op + 1,
+						op + 1 + op->len, va_box);
+			op += op->len;
+			break;
+		}
+	}
+
+	return size;
+}
+
+static bbus_object* do_build(bbus_obj_pool* pool,
+			const bbus_obj_prog* prog, va_list va)
+{
+	bbus_object* obj;
+	size_t size;
+	int ret;
+	struct va_list_box va_box;
+
+	obj = pool == NULL ? bbus_obj_alloc() : bbus_obj_alloc_from(pool);
+	if (obj == NULL)
+		return NULL;
+
+	va_copy(va_box.va, va);
+	size = size_ops(prog->ops, prog->ops + prog->numops, &va_box);
+	va_end(va_box.va);
+	ret = bbus_obj_reserve(obj, size);
+	if (ret < 0) {
+		bbus_obj_free(obj);
+		return NULL;
+	}
+
+	va_copy(va_box.va, va);
+	ret = build_ops(obj, prog->ops, prog->ops + prog->numops, &va_box);
+	va_end(va_box.va);
+	if (ret < 0) {
+		bbus_obj_free(obj);
+		return NULL;
+	}
+
+	return obj;
 }
 
-/* Prototype for parse_struct(). */
-static int parse_array(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box);
+bbus_object* bbus_obj_build(const char* descr, ...)
+{
+	va_list va;
+	bbus_object* obj;
+
+	va_start(va, descr);
+	obj = bbus_obj_vbuild(descr, va);
+	va_end(va);
 
-static int parse_struct(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box)
+	return obj;
+}
+
+bbus_object* bbus_obj_vbuild(const char* descr, va_list va)
 {
+	return bbus_obj_vbuild_from(NULL, descr, va);
+}
+
+bbus_object* bbus_obj_build_from(bbus_obj_pool* pool, const char* descr, ...)
+{
+	va_list va;
+	bbus_object* obj;
+
+	va_start(va, descr);
+	obj = bbus_obj_vbuild_from(pool, descr, va);
+	va_end(va);
+
+	return obj;
+}
+
+bbus_object* bbus_obj_vbuild_from(bbus_obj_pool* pool,
+			const char* descr, va_list va)
+{
+	struct prog_op stackops[PROG_STACKOPS];
+	struct __bbus_obj_prog prog;
+	bbus_object* obj;
 	int ret;
 
-	while (**descr != BBUS_TYPE_STRUCT_END) {
-		switch (**descr) {
+	ret = get_tmpprog(descr, &prog, stackops);
+	if (ret < 0)
+		return NULL;
+
+	obj = do_build(pool, &prog, va);
+	put_tmpprog(&prog, stackops);
+
+	return obj;
+}
+
+bbus_object* bbus_obj_build_prog(const bbus_obj_prog* prog, ...)
+{
+	va_list va;
+	bbus_object* obj;
+
+	va_start(va, prog);
+	obj = do_build(NULL, prog, va);
+	va_end(va);
+
+	return obj;
+}
+
+bbus_object* bbus_obj_vbuild_prog(const bbus_obj_prog* prog, va_list va)
+{
+	return do_build(NULL, prog, va);
+}
+
+static int parse_ops(bbus_object* obj, const struct prog_op* op,
+			const struct prog_op* end, struct va_list_box* va_box)
+{
+	bbus_size arrsize;
+	int ret = 0;
+
+	for (; op < end; ++op) {
+		switch (op->type) {
+		case BBUS_TYPE_INT32:
+			ret = bbus_obj_extrint(obj,
+					va_arg(va_box->va, bbus_int32*));
+			break;
+		case BBUS_TYPE_UINT32:
+			ret = bbus_obj_extruint(obj,
+					va_arg(va_box->va, bbus_uint32*));
+			break;
+		case BBUS_TYPE_BYTE:
+			ret = bbus_obj_extrbyte(obj,
+					va_arg(va_box->va, bbus_byte*));
+			break;
+		case BBUS_TYPE_STRING:
+			ret = bbus_obj_extrstr(obj, va_arg(va_box->va, char**));
+			break;
 		case BBUS_TYPE_ARRAY:
-			ret = parse_array(descr, obj, va_box);
+			ret = bbus_obj_extrarray(obj, &arrsize);
+			if (ret < 0)
+				return -1;
+			*(va_arg(va_box->va, bbus_size*)) = arrsize;
+			while ((ret == 0) && arrsize--)
+				ret = parse_ops(obj, op + 1,
+						op + 1 + op->len, va_box);
+			op += op->len;
 			break;
 		case BBUS_TYPE_STRUCT_START:
-			++(*descr);
-			ret = parse_struct(descr, obj, va_box);
+		case BBUS_TYPE_STRUCT_END:
 			break;
 		default:
-			ret = parse_simple_type(**descr, obj, va_box);
-			++(*descr);
-			break;
+			__bbus_seterr(BBUS_ELOGICERR);
+			return -1;
 		}
 		if (ret < 0)
 			return -1;
 	}
 
-	++(*descr);
 	return 0;
 }
 
-static int parse_array(const char** descr, bbus_object* obj,
-					struct va_list_box* va_box)
+static int do_parse(bbus_object* obj, const bbus_obj_prog* prog,
+							va_list va)
 {
-	bbus_size arrsize;
+	struct va_list_box va_box;
 	int ret;
-	const char* pos;
 
-	ret = bbus_obj_extrarray(obj, &arrsize);
-	*(va_arg(va_box->va, bbus_size*)) = arrsize;
-	++(*descr);
-	while (--arrsize) {
-		switch (**descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = parse_array(descr, obj, va_box);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			pos = *descr;
-			++(*descr);
-			ret = parse_struct(descr, obj, va_box);
-			*descr = pos;
-			break;
-		default:
-			ret = parse_simple_type(**descr, obj, va_box);
-			break;
-		}
-		if (ret < 0)
-			return -1;
-	}
+	va_copy(va_box.va, va);
+	ret = parse_ops(obj, prog->ops, prog->ops + prog->numops, &va_box);
+	va_end(va_box.va);
+	obj->extracting = 0;
 
-	return 0;
+	return ret;
 }
 
 int bbus_obj_parse(bbus_object* obj, const char* descr, ...)
@@ -602,260 +1388,401 @@ int bbus_obj_parse(bbus_object* obj, const char* descr, ...)
 
 int bbus_obj_vparse(bbus_object* obj, const char* descr, va_list va)
 {
-	int ret = 0;
-	struct va_list_box va_box;
+	struct prog_op stackops[PROG_STACKOPS];
+	struct __bbus_obj_prog prog;
+	int ret;
 
-	if (!bbus_obj_descrvalid(descr)) {
-		__bbus_seterr(BBUS_EINVALARG);
+	ret = get_tmpprog(descr, &prog, stackops);
+	if (ret < 0)
+		return -1;
+
+	ret = do_parse(obj, &prog, va);
+	put_tmpprog(&prog, stackops);
+
+	return ret;
+}
+
+int bbus_obj_parse_prog(bbus_object* obj, const bbus_obj_prog* prog, ...)
+{
+	va_list va;
+	int r;
+
+	va_start(va, prog);
+	r = do_parse(obj, prog, va);
+	va_end(va);
+
+	return r;
+}
+
+int bbus_obj_vparse_prog(bbus_object* obj, const bbus_obj_prog* prog,
+							va_list va)
+{
+	return do_parse(obj, prog, va);
+}
+
+static int repr_append(char** buf, size_t* bufsize, const char* fmt, ...)
+{
+	va_list va;
+	int ret;
+
+	va_start(va, fmt);
+	ret = vsnprintf(*buf, *bufsize, fmt, va);
+	va_end(va);
+	if ((ret < 0) || ((size_t)ret >= *bufsize)) {
+		__bbus_seterr(BBUS_ENOSPACE);
 		return -1;
 	}
 
-	va_copy(va_box.va, va);
+	*buf += ret;
+	*bufsize -= ret;
 
-	while (*descr) {
-		switch (*descr) {
+	return 0;
+}
+
+/* Drops the separator following the last value, if there is one. */
+static void repr_dropsep(char* bufstart, char** buf, size_t* bufsize)
+{
+	if (((*buf - bufstart) >= 2) && (strncmp((*buf)-2, ", ", 2) == 0)) {
+		*buf -= 2;
+		*bufsize += 2;
+	}
+}
+
+static int repr_ops(bbus_object* obj, const struct prog_op* op,
+			const struct prog_op* end, char* bufstart,
+			char** buf, size_t* bufsize)
+{
+	bbus_size arrsize;
+	bbus_int32 i;
+	bbus_uint32 u;
+	bbus_byte b;
+	char* s;
+	int ret = 0;
+
+	for (; op < end; ++op) {
+		switch (op->type) {
+		case BBUS_TYPE_INT32:
+			ret = bbus_obj_extrint(obj, &i);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "%d, ", i);
+			break;
+		case BBUS_TYPE_UINT32:
+			ret = bbus_obj_extruint(obj, &u);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "%u, ", u);
+			break;
+		case BBUS_TYPE_BYTE:
+			ret = bbus_obj_extrbyte(obj, &b);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "0x%x, ", b);
+			break;
+		case BBUS_TYPE_STRING:
+			ret = bbus_obj_extrstr(obj, &s);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "'%s', ", s);
+			break;
 		case BBUS_TYPE_ARRAY:
-			ret = parse_array(&descr, obj, &va_box);
+			ret = bbus_obj_extrarray(obj, &arrsize);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "A[");
+			while ((ret == 0) && arrsize--)
+				ret = repr_ops(obj, op + 1, op + 1 + op->len,
+						bufstart, buf, bufsize);
+			if (ret == 0)
+				ret = repr_append(buf, bufsize, "]");
+			op += op->len;
 			break;
 		case BBUS_TYPE_STRUCT_START:
-			++descr;
-			ret = parse_struct(&descr, obj, &va_box);
+			ret = repr_append(buf, bufsize, "(");
 			break;
 		case BBUS_TYPE_STRUCT_END:
-			/* This should have been handled by parse_struct(). */
-			__bbus_seterr(BBUS_ELOGICERR);
-			ret = -1;
+			repr_dropsep(bufstart, buf, bufsize);
+			ret = repr_append(buf, bufsize, ")");
 			break;
 		default:
-			ret = parse_simple_type(*descr, obj, &va_box);
-			++descr;
-			break;
+			__bbus_seterr(BBUS_ELOGICERR);
+			return -1;
 		}
 		if (ret < 0)
-			goto out;
+			return -1;
 	}
 
-out:
-	va_end(va_box.va);
-	obj->extracting = 0;
-	return ret;
+	return 0;
 }
 
-static inline void shrinkbuf(char** buf, size_t* bufsize, size_t numbytes)
+static int do_repr(bbus_object* obj, const bbus_obj_prog* prog,
+					char* buf, size_t bufsize)
 {
-	*buf += numbytes;
-	*bufsize -= numbytes;
+	char* bufstart = buf;
+	int ret;
+
+	ret = repr_append(&buf, &bufsize, "bbus_object(");
+	if (ret < 0)
+		return -1;
+
+	ret = repr_ops(obj, prog->ops, prog->ops + prog->numops,
+						bufstart, &buf, &bufsize);
+	obj->extracting = 0;
+	if (ret < 0)
+		return -1;
+
+	repr_dropsep(bufstart, &buf, &bufsize);
+	ret = repr_append(&buf, &bufsize, ")");
+	if (ret < 0)
+		return -1;
+
+	return buf - bufstart;
 }
 
-static int repr_simple_type(char descr, bbus_object* obj,
-				char** buf, size_t* bufsize)
+int bbus_obj_repr(bbus_object* obj, const char* descr,
+		char* buf, size_t bufsize)
 {
+	struct prog_op stackops[PROG_STACKOPS];
+	struct __bbus_obj_prog prog;
 	int ret;
 
-	switch (descr) {
-	case BBUS_TYPE_INT32:
-		{
-			bbus_int32 v;
-			ret = bbus_obj_extrint(obj, &v);
-			if (ret < 0)
-				goto out;
-			ret = snprintf(*buf, *bufsize, "%d, ", v);
-		}
-		break;
-	case BBUS_TYPE_UINT32:
-		{
-			bbus_uint32 v;
-			ret = bbus_obj_extruint(obj, &v);
-			if (ret < 0)
-				goto out;
-			ret = snprintf(*buf, *bufsize, "%u, ", v);
-		}
-		break;
-	case BBUS_TYPE_BYTE:
-		{
-			bbus_byte v;
-			ret = bbus_obj_extrbyte(obj, &v);
-			if (ret < 0)
-				goto out;
-			ret = snprintf(*buf, *bufsize, "0x%x, ", v);
-		}
-		break;
-	case BBUS_TYPE_STRING:
-		{
-			char* v;
-			ret = bbus_obj_extrstr(obj, &v);
-			if (ret < 0)
-				goto out;
-			ret = snprintf(*buf, *bufsize, "'%s', ", v);
-		}
-		break;
-	default:
-		__bbus_seterr(BBUS_ELOGICERR);
-		return -1;
-	}
-
-	if (ret < 0) {
-		__bbus_seterr(BBUS_ENOSPACE);
+	ret = get_tmpprog(descr, &prog, stackops);
+	if (ret < 0)
 		return -1;
-	}
 
-	shrinkbuf(buf, bufsize, ret);
+	ret = do_repr(obj, &prog, buf, bufsize);
+	put_tmpprog(&prog, stackops);
 
-out:
 	return ret;
 }
 
-/* Prototype for repr_struct(). */
-static int repr_array(const char** descr, bbus_object* obj,
-				char** buf, size_t* bufsize);
+int bbus_obj_repr_prog(bbus_object* obj, const bbus_obj_prog* prog,
+					char* buf, size_t bufsize)
+{
+	return do_repr(obj, prog, buf, bufsize);
+}
+
+/*
+ * An index holds the position and size of every value in an object, in the
+ * order in which bbus_obj_parse() would extract them. Struct delimiters
+ * don't take any space and have no entries.
+ */
+struct index_item
+{
+	size_t offset;
+	size_t size;
+	char type;
+};
 
-static int repr_struct(const char** descr, bbus_object* obj,
-				char** buf, size_t* bufsize)
+struct __bbus_obj_index
 {
-	int ret;
+	size_t numitems;
+	size_t maxitems;
+	struct index_item* items;
+};
 
-	ret = snprintf(*buf, *bufsize, "(");
-	if (ret < 0) {
-		__bbus_seterr(errno);
-		return -1;
-	}
-	shrinkbuf(buf, bufsize, ret);
+#define INDEX_BASE	16
 
-	while (**descr != BBUS_TYPE_STRUCT_END) {
-		switch (**descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = repr_array(descr, obj, buf, bufsize);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			++(*descr);
-			ret = repr_struct(descr, obj, buf, bufsize);
-			break;
-		default:
-			ret = repr_simple_type(**descr, obj, buf, bufsize);
-			++(*descr);
-			break;
-		}
-		if (ret < 0)
+static int index_add(bbus_obj_index* idx, char type, size_t offset,
+							size_t size)
+{
+	struct index_item* items;
+	size_t newmax;
+
+	if (idx->numitems == idx->maxitems) {
+		newmax = idx->maxitems ? idx->maxitems * 2 : INDEX_BASE;
+		items = bbus_realloc(idx->items,
+				newmax * sizeof(struct index_item));
+		if (items == NULL)
 			return -1;
+		idx->items = items;
+		idx->maxitems = newmax;
 	}
 
-	if (strncmp((*buf)-2, ", ", 1) == 0) {
-		*buf -= 2;
-		*bufsize += 2;
-	}
+	idx->items[idx->numitems].type = type;
+	idx->items[idx->numitems].offset = offset;
+	idx->items[idx->numitems].size = size;
+	idx->numitems++;
 
-	ret = snprintf(*buf, *bufsize, ")");
-	if (ret < 0) {
-		__bbus_seterr(errno);
-		return -1;
+	return 0;
+}
+
+static size_t index_valsize(bbus_object* obj, char type)
+{
+	char* end;
+
+	switch (type) {
+	case BBUS_TYPE_INT32:
+		return sizeof(bbus_int32);
+	case BBUS_TYPE_UINT32:
+		return sizeof(bbus_uint32);
+	case BBUS_TYPE_BYTE:
+		return sizeof(bbus_byte);
+	case BBUS_TYPE_ARRAY:
+		return sizeof(bbus_size);
+	case BBUS_TYPE_STRING:
+		end = memchr(obj->at, '\0', (obj->buf + obj->bufused) - obj->at);
+		return end == NULL ? 0 : (size_t)(end - obj->at) + 1;
 	}
-	shrinkbuf(buf, bufsize, ret);
 
-	++(*descr);
 	return 0;
 }
 
-static int repr_array(const char** descr, bbus_object* obj,
-				char** buf, size_t* bufsize)
+static int index_ops(bbus_object* obj, const struct prog_op* op,
+			const struct prog_op* end, bbus_obj_index* idx)
 {
 	bbus_size arrsize;
+	size_t size;
 	int ret;
-	const char* strstart;
-	const char* strend = NULL;;
-
-	ret = snprintf(*buf, *bufsize, "A[");
-	if (ret < 0) {
-		__bbus_seterr(errno);
-		return -1;
-	}
-	shrinkbuf(buf, bufsize, ret);
 
-	ret = bbus_obj_extrarray(obj, &arrsize);
-	++(*descr);
-	while (arrsize--) {
-		switch (**descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = repr_array(descr, obj, buf, bufsize);
-			strend = NULL;
-			break;
+	for (; op < end; ++op) {
+		switch (op->type) {
 		case BBUS_TYPE_STRUCT_START:
-			strstart = *descr;
-			++(*descr);
-			ret = repr_struct(descr, obj, buf, bufsize);
-			strend = *descr;
-			*descr = strstart;
+		case BBUS_TYPE_STRUCT_END:
+			continue;
+		case BBUS_TYPE_INT32:
+		case BBUS_TYPE_UINT32:
+		case BBUS_TYPE_BYTE:
+		case BBUS_TYPE_STRING:
+		case BBUS_TYPE_ARRAY:
 			break;
 		default:
-			ret = repr_simple_type(**descr, obj, buf, bufsize);
-			strend = NULL;
-			break;
+			__bbus_seterr(BBUS_ELOGICERR);
+			return -1;
 		}
-		if (ret < 0)
+
+		size = index_valsize(obj, op->type);
+		if ((size == 0) || !can_extract_size(obj, size)) {
+			__bbus_seterr(BBUS_EOBJINVFMT);
 			return -1;
-	}
+		}
 
-	ret = snprintf(*buf, *bufsize, "]");
-	if (ret < 0) {
-		__bbus_seterr(errno);
-		return -1;
+		ret = index_add(idx, op->type, obj->at - obj->buf, size);
+		if (ret < 0) {
+			__bbus_seterr(BBUS_ENOMEM);
+			return -1;
+		}
+
+		if (op->type == BBUS_TYPE_ARRAY) {
+			(void)bbus_obj_extrarray(obj, &arrsize);
+			while (arrsize--) {
+				ret = index_ops(obj, op + 1,
+						op + 1 + op->len, idx);
+				if (ret < 0)
+					return -1;
+			}
+			op += op->len;
+		} else {
+			obj->at += size;
+		}
 	}
-	shrinkbuf(buf, bufsize, ret);
-	if (strend)
-		*descr = strend;
 
 	return 0;
 }
 
-int bbus_obj_repr(bbus_object* obj, const char* descr,
-		char* buf, size_t bufsize)
+bbus_obj_index* bbus_obj_mkindex_prog(bbus_object* obj,
+					const bbus_obj_prog* prog)
 {
+	bbus_obj_index* idx;
+	int extracting;
+	size_t at;
 	int ret;
-	char* bufstart = buf;
 
-	if (!bbus_obj_descrvalid(descr)) {
-		__bbus_seterr(BBUS_EINVALARG);
-		return -1;
-	}
+	idx = bbus_malloc0(sizeof(struct __bbus_obj_index));
+	if (idx == NULL)
+		return NULL;
 
-	ret = snprintf(buf, bufsize, "bbus_object(");
+	/* Building the index doesn't change the extraction state. */
+	extracting = obj->extracting;
+	at = obj->at - obj->buf;
+	make_ready_for_extraction(obj);
+	ret = index_ops(obj, prog->ops, prog->ops + prog->numops, idx);
+	obj->extracting = extracting;
+	obj->at = obj->buf + at;
 	if (ret < 0) {
-		__bbus_seterr(errno);
-		return -1;
+		bbus_obj_index_free(idx);
+		return NULL;
 	}
-	shrinkbuf(&buf, &bufsize, ret);
 
-	while (*descr) {
-		switch (*descr) {
-		case BBUS_TYPE_ARRAY:
-			ret = repr_array(&descr, obj, &buf, &bufsize);
-			break;
-		case BBUS_TYPE_STRUCT_START:
-			++descr;
-			ret = repr_struct(&descr, obj, &buf, &bufsize);
-			break;
-		case BBUS_TYPE_STRUCT_END:
-			/* This should have been handled by repr_struct(). */
-			__bbus_seterr(BBUS_ELOGICERR);
-			ret = -1;
-			break;
-		default:
-			ret = repr_simple_type(*descr, obj, &buf, &bufsize);
-			++descr;
-			break;
-		}
-		if (ret < 0)
-			goto out;
+	return idx;
+}
+
+bbus_obj_index* bbus_obj_mkindex(bbus_object* obj, const char* descr)
+{
+	struct prog_op stackops[PROG_STACKOPS];
+	struct __bbus_obj_prog prog;
+	bbus_obj_index* idx;
+	int ret;
+
+	ret = get_tmpprog(descr, &prog, stackops);
+	if (ret < 0)
+		return NULL;
+
+	idx = bbus_obj_mkindex_prog(obj, &prog);
+	put_tmpprog(&prog, stackops);
+
+	return idx;
+}
+
+void bbus_obj_index_free(bbus_obj_index* idx)
+{
+	if (idx) {
+		bbus_free(idx->items);
+		bbus_free(idx);
+	}
+}
+
+size_t bbus_obj_index_size(const bbus_obj_index* idx)
+{
+	return idx->numitems;
+}
+
+static const struct index_item* index_get(const bbus_object* obj,
+				const bbus_obj_index* idx, size_t item)
+{
+	const struct index_item* it;
+
+	if (item >= idx->numitems) {
+		__bbus_seterr(BBUS_EINVALARG);
+		return NULL;
 	}
 
-	if (strncmp((buf)-2, ", ", 1) == 0) {
-		buf -= 2;
-		bufsize += 2;
+	/* Guard against an index built for a different object. */
+	it = &idx->items[item];
+	if ((it->offset + it->size) > obj->bufused) {
+		__bbus_seterr(BBUS_EOBJINVFMT);
+		return NULL;
 	}
 
-	snprintf(buf, bufsize, ")");
-	ret = strlen(bufstart);
+	return it;
+}
 
-out:
-	return ret;
+int bbus_obj_seek(bbus_object* obj, const bbus_obj_index* idx, size_t item)
+{
+	const struct index_item* it;
+
+	it = index_get(obj, idx, item);
+	if (it == NULL)
+		return -1;
+
+	obj->extracting = 1;
+	obj->at = obj->buf + it->offset;
+
+	return 0;
 }
 
+int bbus_obj_index_getstr(bbus_object* obj, const bbus_obj_index* idx,
+				size_t item, char** str, size_t* len)
+{
+	const struct index_item* it;
+
+	it = index_get(obj, idx, item);
+	if (it == NULL)
+		return -1;
+
+	if (it->type != BBUS_TYPE_STRING) {
+		__bbus_seterr(BBUS_EOBJINVFMT);
+		return -1;
+	}
+
+	*str = obj->buf + it->offset;
+	if (len != NULL)
+		*len = it->size - 1;
+
+	return 0;
+}
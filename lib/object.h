@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_OBJECT__
+#define __BBUS_OBJECT__
+
+#include <busybus.h>
+
+/*
+ * Compressed objects are sent as the original size in network byte order
+ * followed by the compressed data.
+ */
+
+/*
+ * Returns a buffer to be freed with bbus_free() holding the compressed
+ * object or NULL if compressing doesn't make it any smaller.
+ */
+void* __bbus_obj_compress(bbus_object* obj, size_t* size);
+/* Takes the object from 'pool' unless it's NULL. */
+bbus_object* __bbus_obj_decompress(bbus_obj_pool* pool,
+				const void* buf, size_t size);
+
+#endif /* __BBUS_OBJECT__ */
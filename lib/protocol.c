@@ -16,14 +16,17 @@
 #include "socket.h"
 #include "error.h"
 #include "protocol.h"
+#include "object.h"
 #include "spinlock.h"
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
 
-#define MAX_NUMIOV (BBUS_MSGHDR_NUMFIELDS + 2) /* Header + meta + object. */
+#define MAX_NUMIOV __BBUS_PROT_MAXNUMIOV /* Header + meta + object. */
 
 static struct __bbus_spinlock sockpath_lock;
 static char sockpath[BBUS_PROT_SOCKPATHMAX];
@@ -65,102 +68,373 @@ static int hdr_check_magic(const struct bbus_msg_hdr* hdr)
 						? BBUS_TRUE : BBUS_FALSE;
 }
 
-static void header_to_iovec(const struct bbus_msg_hdr* hdr,
-				struct iovec* iov, int* numiov)
-{
-	iov[*numiov].iov_base = (void*)&hdr->magic;
-	iov[*numiov].iov_len = sizeof(hdr->magic);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->msgtype;
-	iov[*numiov].iov_len = sizeof(hdr->msgtype);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->sotype;
-	iov[*numiov].iov_len = sizeof(hdr->sotype);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->errcode;
-	iov[*numiov].iov_len = sizeof(hdr->errcode);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->token;
-	iov[*numiov].iov_len = sizeof(hdr->token);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->psize;
-	iov[*numiov].iov_len = sizeof(hdr->psize);
-	++*numiov;
-	iov[*numiov].iov_base = (void*)&hdr->flags;
-	iov[*numiov].iov_len = sizeof(hdr->flags);
-	++*numiov;
+size_t bbus_hdr_pack(const struct bbus_msg_hdr* hdr, void* buf)
+{
+	struct __bbus_wire_hdr* wire = buf;
+	size_t size;
+
+	/* Token and payload sizes are already in network byte order. */
+	memcpy(wire->magic, &hdr->magic, BBUS_MAGIC_SIZE);
+	wire->msgtype = hdr->msgtype;
+	wire->sotype = hdr->sotype;
+	wire->errcode = hdr->errcode;
+	wire->token = hdr->token;
+	wire->psize = hdr->psize;
+	wire->flags = hdr->flags;
+
+	size = BBUS_MSGHDR_REALSIZE;
+	if (hdr->flags & BBUS_PROT_LARGE) {
+		memcpy((char*)buf + size, &hdr->xpsize, BBUS_MSGHDR_EXTSIZE);
+		size += BBUS_MSGHDR_EXTSIZE;
+	}
+	if (hdr->flags & BBUS_PROT_HASTIMEOUT) {
+		memcpy((char*)buf + size, &hdr->timeout, BBUS_MSGHDR_EXTSIZE);
+		size += BBUS_MSGHDR_EXTSIZE;
+	}
+	if (hdr->flags & BBUS_PROT_HASROUTE) {
+		memcpy((char*)buf + size, &hdr->route, BBUS_MSGHDR_EXTSIZE);
+		size += BBUS_MSGHDR_EXTSIZE;
+	}
+
+	return size;
 }
 
-int __bbus_prot_recvmsg(int sock, struct bbus_msg* buf, size_t bufsize)
+void bbus_hdr_unpack(struct bbus_msg_hdr* hdr, const void* buf)
 {
-	return __bbus_prot_recvvmsg(sock, &buf->hdr, buf->payload,
-						bufsize-BBUS_MSGHDR_SIZE);
+	const struct __bbus_wire_hdr* wire = buf;
+	const char* ext;
+
+	memset(hdr, 0, sizeof(struct bbus_msg_hdr));
+	memcpy(&hdr->magic, wire->magic, BBUS_MAGIC_SIZE);
+	hdr->msgtype = wire->msgtype;
+	hdr->sotype = wire->sotype;
+	hdr->errcode = wire->errcode;
+	hdr->token = wire->token;
+	hdr->psize = wire->psize;
+	hdr->flags = wire->flags;
+
+	ext = (const char*)buf + BBUS_MSGHDR_REALSIZE;
+	if (hdr->flags & BBUS_PROT_LARGE) {
+		memcpy(&hdr->xpsize, ext, BBUS_MSGHDR_EXTSIZE);
+		ext += BBUS_MSGHDR_EXTSIZE;
+	}
+	if (hdr->flags & BBUS_PROT_HASTIMEOUT) {
+		memcpy(&hdr->timeout, ext, BBUS_MSGHDR_EXTSIZE);
+		ext += BBUS_MSGHDR_EXTSIZE;
+	}
+	if (hdr->flags & BBUS_PROT_HASROUTE)
+		memcpy(&hdr->route, ext, BBUS_MSGHDR_EXTSIZE);
 }
 
-int __bbus_prot_recvvmsg(int sock, struct bbus_msg_hdr* hdr,
-					void* payload, size_t psize)
+size_t __bbus_prot_wirehdrsize(const void* buf)
+{
+	const struct __bbus_wire_hdr* wire = buf;
+	size_t size = BBUS_MSGHDR_REALSIZE;
+
+	if (wire->flags & BBUS_PROT_LARGE)
+		size += BBUS_MSGHDR_EXTSIZE;
+	if (wire->flags & BBUS_PROT_HASTIMEOUT)
+		size += BBUS_MSGHDR_EXTSIZE;
+	if (wire->flags & BBUS_PROT_HASROUTE)
+		size += BBUS_MSGHDR_EXTSIZE;
+
+	return size;
+}
+
+int __bbus_prot_checkhdr(const struct bbus_msg_hdr* hdr, size_t psize)
 {
-	ssize_t rcv1;
-	ssize_t rcv2 = 0;
-	ssize_t rcvsum;
-	struct iovec iov[MAX_NUMIOV];
-	int numiov;
 	size_t exppsize;
+	size_t maxpsize;
 
-	numiov = 0;
-	header_to_iovec(hdr, iov, &numiov);
-	rcv1 = __bbus_sock_recv(sock, iov, numiov);
-	if (rcv1 < 0)
+	if (!hdr_check_magic(hdr)) {
+		__bbus_seterr(BBUS_EMSGMAGIC);
 		return -1;
+	}
+
+	/* Session open options go in the token, nothing in them is compressed. */
+	if ((hdr->msgtype == BBUS_MSGTYPE_SO)
+			&& BBUS_HDR_ISFLAGSET(hdr, BBUS_PROT_COMPRESSED)) {
+		__bbus_seterr(BBUS_EMSGINVFMT);
+		return -1;
+	}
+
+	maxpsize = hdr->flags & BBUS_PROT_LARGE
+			? BBUS_MAXLARGEPLOADSIZE : BBUS_MAXPLOADSIZE;
 	exppsize = bbus_hdr_getpsize(hdr);
-	if ((exppsize > psize) || (exppsize > BBUS_MAXPLOADSIZE)) {
+	if ((exppsize > psize) || (exppsize > maxpsize)) {
 		__bbus_seterr(BBUS_EMSGINVFMT);
 		return -1;
 	}
 
-	numiov = 0;
-	if (payload && (exppsize > 0)) {
-		iov[numiov].iov_base = payload;
-		iov[numiov].iov_len = exppsize;
-		++numiov;
+	return 0;
+}
 
-		rcv2 = __bbus_sock_recv(sock, iov, numiov);
-		if (rcv2 < 0)
-			return -1;
+int __bbus_prot_msgtoiov(const struct bbus_msg_hdr* hdr, void* wire,
+		const char* meta, const char* obj, size_t objsize,
+		struct iovec* iov, int* numiov, size_t* msgsize)
+{
+	size_t metasize;
+	size_t psize;
+
+	metasize = meta == NULL ? 0 : strlen(meta)+1;
+	psize = bbus_hdr_getpsize(hdr);
+	if ((psize != (metasize + objsize))
+			|| (psize > BBUS_MAXLARGEPLOADSIZE)) {
+		__bbus_seterr(BBUS_EINVALARG);
+		return -1;
 	}
 
-	rcvsum = rcv1 + rcv2;
-	if (rcvsum < (ssize_t)BBUS_MSGHDR_REALSIZE) {
-		__bbus_seterr(BBUS_EMSGINVFMT);
+	iov[0].iov_base = wire;
+	iov[0].iov_len = bbus_hdr_pack(hdr, wire);
+	*msgsize = iov[0].iov_len + psize;
+	*numiov = 1;
+	if (meta != NULL) {
+		iov[*numiov].iov_base = (void*)meta;
+		iov[*numiov].iov_len = metasize;
+		++*numiov;
+	}
+	if (obj != NULL) {
+		iov[*numiov].iov_base = (void*)obj;
+		iov[*numiov].iov_len = objsize;
+		++*numiov;
+	}
+
+	return 0;
+}
+
+int __bbus_prot_growmsgbuf(struct bbus_msg** buf, size_t* bufsize,
+								size_t size)
+{
+	struct bbus_msg* newbuf;
+
+	if (*bufsize >= size)
+		return 0;
+
+	newbuf = bbus_realloc(*buf, size);
+	if (newbuf == NULL)
 		return -1;
+
+	*buf = newbuf;
+	*bufsize = size;
+
+	return 0;
+}
+
+/*
+ * Receives exactly 'size' bytes, retrying on short reads. If 'fd' is not
+ * NULL, a descriptor passed along with the first chunk is stored in it.
+ */
+static int recv_all(int sock, void* buf, size_t size, int* fd)
+{
+	int fds[__BBUS_SOCK_MAXFDS];
+	struct iovec iov;
+	int numfds;
+	ssize_t r;
+	int i;
+
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	while (iov.iov_len > 0) {
+		if (fd != NULL) {
+			numfds = __BBUS_SOCK_MAXFDS;
+			r = __bbus_sock_recvfds(sock, &iov, 1, fds, &numfds);
+			if (r > 0) {
+				for (i = 0; i < numfds; ++i) {
+					if (*fd < 0)
+						*fd = fds[i];
+					else
+						close(fds[i]);
+				}
+			}
+		} else {
+			r = __bbus_sock_recv(sock, &iov, 1);
+		}
+
+		if (r < 0) {
+			if (bbus_lasterror() == EINTR)
+				continue;
+			return -1;
+		} else
+		if (r == 0) {
+			__bbus_seterr(iov.iov_len == size
+					? BBUS_ECONNCLOSED : BBUS_ERCVDLESS);
+			return -1;
+		}
+
+		iov.iov_base = (char*)iov.iov_base + r;
+		iov.iov_len -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * The descriptor of a BBUS_PROT_HASFD message is attached to the first
+ * byte of its header. It's stored in *fd, or closed if fd is NULL.
+ */
+static int recv_hdr(int sock, struct bbus_msg_hdr* hdr, int* fd)
+{
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	size_t wiresize;
+	int msgfd = -1;
+	int r;
+
+	r = recv_all(sock, wire, BBUS_MSGHDR_REALSIZE, &msgfd);
+	if (r < 0)
+		goto err;
+
+	wiresize = __bbus_prot_wirehdrsize(wire);
+	if (wiresize > BBUS_MSGHDR_REALSIZE) {
+		r = recv_all(sock, wire + BBUS_MSGHDR_REALSIZE,
+				wiresize - BBUS_MSGHDR_REALSIZE, NULL);
+		if (r < 0)
+			goto err;
+	}
+
+	bbus_hdr_unpack(hdr, wire);
+	if (BBUS_HDR_ISFLAGSET(hdr, BBUS_PROT_HASFD)) {
+		if (msgfd < 0) {
+			__bbus_seterr(BBUS_EMSGINVFMT);
+			return -1;
+		}
 	} else
-	if (rcvsum < (ssize_t)(BBUS_MSGHDR_REALSIZE
-				+ bbus_hdr_getpsize(hdr))) {
-		__bbus_seterr(BBUS_ERCVDLESS);
+	if (msgfd >= 0) {
+		/* Nobody asked for it. */
+		close(msgfd);
+		msgfd = -1;
+	}
+
+	if (fd != NULL)
+		*fd = msgfd;
+	else if (msgfd >= 0)
+		close(msgfd);
+
+	return 0;
+
+err:
+	if (msgfd >= 0)
+		close(msgfd);
+	return -1;
+}
+
+int __bbus_prot_recvmsg(int sock, struct bbus_msg* buf, size_t bufsize)
+{
+	return __bbus_prot_recvvmsg(sock, &buf->hdr, buf->payload,
+						bufsize-BBUS_MSGHDR_SIZE);
+}
+
+int __bbus_prot_recvvmsg(int sock, struct bbus_msg_hdr* hdr,
+					void* payload, size_t psize)
+{
+	return __bbus_prot_recvvmsgfd(sock, hdr, payload, psize, NULL);
+}
+
+static void close_msgfd(int* fd)
+{
+	if ((fd != NULL) && (*fd >= 0)) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+int __bbus_prot_recvvmsgfd(int sock, struct bbus_msg_hdr* hdr,
+				void* payload, size_t psize, int* fd)
+{
+	size_t exppsize;
+	int r;
+
+	r = recv_hdr(sock, hdr, fd);
+	if (r < 0)
 		return -1;
+
+	r = __bbus_prot_checkhdr(hdr, psize);
+	if (r < 0)
+		goto err;
+
+	exppsize = bbus_hdr_getpsize(hdr);
+	if (payload && (exppsize > 0)) {
+		r = recv_all(sock, payload, exppsize, NULL);
+		if (r < 0)
+			goto err;
 	}
 
-	if (!hdr_check_magic(hdr)) {
-		__bbus_seterr(BBUS_EMSGMAGIC);
+	return 0;
+
+err:
+	close_msgfd(fd);
+	return -1;
+}
+
+int __bbus_prot_recvmsgdyn(int sock, struct bbus_msg** buf,
+					size_t* bufsize, int* fd)
+{
+	struct bbus_msg_hdr hdr;
+	size_t psize;
+	int r;
+
+	r = recv_hdr(sock, &hdr, fd);
+	if (r < 0)
 		return -1;
+
+	r = __bbus_prot_checkhdr(&hdr, BBUS_MAXLARGEPLOADSIZE);
+	if (r < 0)
+		goto err;
+
+	psize = bbus_hdr_getpsize(&hdr);
+	r = __bbus_prot_growmsgbuf(buf, bufsize, BBUS_MSGHDR_SIZE + psize);
+	if (r < 0)
+		goto err;
+
+	memcpy(&(*buf)->hdr, &hdr, sizeof(struct bbus_msg_hdr));
+	if (psize > 0) {
+		r = recv_all(sock, (*buf)->payload, psize, NULL);
+		if (r < 0)
+			goto err;
 	}
 
 	return 0;
+
+err:
+	close_msgfd(fd);
+	return -1;
 }
 
-static int do_send(int sock, const struct iovec* iov,
-				int numiov, size_t msgsize)
+/*
+ * If fd is not negative, it's attached to the first chunk sent.
+ */
+static int do_send(int sock, struct iovec* iov, int numiov,
+					size_t msgsize, int fd)
 {
 	ssize_t r;
+	size_t sent;
+
+	for (sent = 0;;) {
+		if ((sent == 0) && (fd >= 0))
+			r = __bbus_sock_sendfd(sock, iov, numiov, fd);
+		else
+			r = __bbus_sock_send(sock, iov, numiov);
+		if (r < 0) {
+			if (bbus_lasterror() == EINTR)
+				continue;
+			return -1;
+		} else
+		if (r == 0) {
+			__bbus_seterr(BBUS_ESENTLESS);
+			return -1;
+		}
 
-	r = __bbus_sock_send(sock, iov, numiov);
-	if (r < 0) {
-		return -1;
-	} else
-	if (r != (ssize_t)msgsize) {
-		/* TODO Retry? */
-		__bbus_seterr(BBUS_ESENTLESS);
-		return -1;
+		sent += r;
+		if (sent == msgsize)
+			break;
+
+		/* Short write - skip whatever has been sent and retry. */
+		while ((size_t)r >= iov->iov_len) {
+			r -= iov->iov_len;
+			++iov;
+			--numiov;
+		}
+		iov->iov_base = (char*)iov->iov_base + r;
+		iov->iov_len -= r;
 	}
 
 	return 0;
@@ -169,22 +443,21 @@ static int do_send(int sock, const struct iovec* iov,
 int __bbus_prot_sendmsg(int sock, const struct bbus_msg* msg)
 {
 	ssize_t r;
-	size_t msgsize;
+	size_t psize;
 	struct iovec iov[MAX_NUMIOV];
-	int numiov;
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
 
-	msgsize = BBUS_MSGHDR_REALSIZE + bbus_hdr_getpsize(&msg->hdr);
-	if (msgsize > BBUS_MAXMSGSIZE) {
+	psize = bbus_hdr_getpsize(&msg->hdr);
+	if (psize > BBUS_MAXLARGEPLOADSIZE) {
 		__bbus_seterr(BBUS_EINVALARG);
 		return -1;
 	}
 
-	numiov = 0;
-	header_to_iovec(&msg->hdr, iov, &numiov);
-	iov[numiov].iov_base = (void*)msg->payload;
-	iov[numiov].iov_len = bbus_hdr_getpsize(&msg->hdr);
-	++numiov;
-	r = do_send(sock, iov, numiov, msgsize);
+	iov[0].iov_base = wire;
+	iov[0].iov_len = bbus_hdr_pack(&msg->hdr, wire);
+	iov[1].iov_base = (void*)msg->payload;
+	iov[1].iov_len = psize;
+	r = do_send(sock, iov, 2, iov[0].iov_len + psize, -1);
 	if (r < 0)
 		return -1;
 
@@ -197,38 +470,82 @@ int __bbus_prot_sendvmsg(int sock, const struct bbus_msg_hdr* hdr,
 	ssize_t r;
 	size_t msgsize;
 	struct iovec iov[MAX_NUMIOV];
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
 	int numiov;
-	size_t metasize;
 
-	metasize = meta == NULL ? 0 : strlen(meta)+1;
-	msgsize = BBUS_MSGHDR_REALSIZE + metasize + objsize;
-	if ((msgsize != (BBUS_MSGHDR_REALSIZE + bbus_hdr_getpsize(hdr)))
-				|| (msgsize > BBUS_MAXMSGSIZE)) {
-		__bbus_seterr(BBUS_EINVALARG);
+	r = __bbus_prot_msgtoiov(hdr, wire, meta, obj, objsize,
+					iov, &numiov, &msgsize);
+	if (r < 0)
 		return -1;
-	}
 
-	numiov = 0;
-	header_to_iovec(hdr, iov, &numiov);
-	if (meta != NULL) {
-		iov[numiov].iov_base = (void*)meta;
-		iov[numiov].iov_len = metasize;
-		++numiov;
-	}
-	if (obj != NULL) {
-		iov[numiov].iov_base = (void*)obj;
-		iov[numiov].iov_len = objsize;
-		++numiov;
-	}
+	r = do_send(sock, iov, numiov, msgsize, -1);
+	if (r < 0)
+		return -1;
 
-	r = do_send(sock, iov, numiov, msgsize);
+	return 0;
+}
+
+int __bbus_prot_sendvmsgfd(int sock, struct bbus_msg_hdr* hdr,
+					const char* meta, int fd)
+{
+	ssize_t r;
+	size_t msgsize;
+	struct iovec iov[MAX_NUMIOV];
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	int numiov;
+
+	BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASFD);
+	r = __bbus_prot_msgtoiov(hdr, wire, meta, NULL, 0,
+					iov, &numiov, &msgsize);
 	if (r < 0)
 		return -1;
 
+	r = do_send(sock, iov, numiov, msgsize, fd);
+	if (r < 0)
+		return -1;
 
 	return 0;
 }
 
+int __bbus_prot_sendbuf(int sock, const void* buf, size_t size)
+{
+	struct iovec iov;
+	ssize_t r;
+
+	iov.iov_base = (void*)buf;
+	iov.iov_len = size;
+	while (iov.iov_len > 0) {
+		r = __bbus_sock_send(sock, &iov, 1);
+		if (r < 0) {
+			if (bbus_lasterror() == EINTR)
+				continue;
+			return -1;
+		} else
+		if (r == 0) {
+			__bbus_seterr(BBUS_ESENTLESS);
+			return -1;
+		}
+
+		iov.iov_base = (char*)iov.iov_base + r;
+		iov.iov_len -= r;
+	}
+
+	return 0;
+}
+
+size_t __bbus_prot_iovtobuf(const struct iovec* iov, int numiov, void* buf)
+{
+	char* ptr;
+	int i;
+
+	for (i = 0, ptr = buf; i < numiov; ++i) {
+		memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+		ptr += iov[i].iov_len;
+	}
+
+	return ptr - (char*)buf;
+}
+
 void __bbus_prot_hdrsetmagic(struct bbus_msg_hdr* hdr)
 {
 	memcpy(&hdr->magic, BBUS_MAGIC, BBUS_MAGIC_SIZE);
@@ -252,6 +569,12 @@ int __bbus_prot_errtoerrnum(uint8_t errcode)
 	case BBUS_PROT_EMREGERR:
 		errnum = BBUS_EMREGERR;
 		break;
+	case BBUS_PROT_ETIMEDOUT:
+		errnum = BBUS_ETIMEDOUT;
+		break;
+	case BBUS_PROT_ESTALEROUTE:
+		errnum = BBUS_ESTALEROUTE;
+		break;
 	default:
 		errnum = BBUS_EINVALARG;
 		break;
@@ -280,7 +603,7 @@ err:
 	return NULL;
 }
 
-bbus_object* bbus_prot_extractobj(const struct bbus_msg* msg)
+const void* bbus_prot_extractrawobj(const struct bbus_msg* msg, size_t* size)
 {
 	const char* meta;
 	const void* payload;
@@ -292,18 +615,54 @@ bbus_object* bbus_prot_extractobj(const struct bbus_msg* msg)
 		payload = msg->payload;
 		if (msg->hdr.flags & BBUS_PROT_HASMETA) {
 			meta = bbus_prot_extractmeta(msg);
-			if (meta != NULL) {
-				offset = strlen(meta)+1;
-				payload += offset;
-				psize -= offset;
-			}
+			if (meta == NULL)
+				return NULL;
+			offset = strlen(meta)+1;
+			payload += offset;
+			psize -= offset;
 		}
 	} else {
 		__bbus_seterr(BBUS_EOBJINVFMT);
 		return NULL;
 	}
 
-	return bbus_obj_frombuf(payload, psize);
+	*size = psize;
+	return payload;
+}
+
+bbus_object* bbus_prot_extractobj(const struct bbus_msg* msg)
+{
+	const void* payload;
+	size_t psize;
+
+	bbus_object* obj;
+
+	payload = bbus_prot_extractrawobj(msg, &psize);
+	if (payload == NULL)
+		return NULL;
+
+	if (BBUS_HDR_ISFLAGSET(&msg->hdr, BBUS_PROT_COMPRESSED))
+		obj = __bbus_obj_decompress(NULL, payload, psize);
+	else
+		obj = bbus_obj_frombuf(payload, psize);
+	if (obj != NULL)
+		bbus_obj_setorder(obj, bbus_hdr_getobjorder(&msg->hdr));
+
+	return obj;
+}
+
+int bbus_hdr_getobjorder(const struct bbus_msg_hdr* hdr)
+{
+	return BBUS_HDR_ISFLAGSET(hdr, BBUS_PROT_HOSTORDER)
+				? BBUS_OBJ_HOSTORDER : BBUS_OBJ_NETORDER;
+}
+
+void bbus_hdr_setobjorder(struct bbus_msg_hdr* hdr, const bbus_object* obj)
+{
+	if (bbus_obj_getorder(obj) == BBUS_OBJ_HOSTORDER)
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HOSTORDER);
+	else
+		BBUS_HDR_UNSETFLAG(hdr, BBUS_PROT_HOSTORDER);
 }
 
 void bbus_hdr_build(struct bbus_msg_hdr* hdr, int typ, int err)
@@ -326,11 +685,61 @@ void bbus_hdr_settoken(struct bbus_msg_hdr* hdr, unsigned tok)
 
 size_t bbus_hdr_getpsize(const struct bbus_msg_hdr* hdr)
 {
+	if (hdr->flags & BBUS_PROT_LARGE)
+		return (size_t)ntohl(hdr->xpsize);
+
 	return (size_t)ntohs(hdr->psize);
 }
 
 void bbus_hdr_setpsize(struct bbus_msg_hdr* hdr, size_t size)
 {
-	hdr->psize = size > UINT16_MAX ? UINT16_MAX : htons((uint16_t)size);
+	if (size > BBUS_MAXPLOADSIZE) {
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_LARGE);
+		hdr->psize = 0;
+		hdr->xpsize = (uint32_t)htonl(size > UINT32_MAX
+						? UINT32_MAX : (uint32_t)size);
+	} else {
+		BBUS_HDR_UNSETFLAG(hdr, BBUS_PROT_LARGE);
+		hdr->psize = htons((uint16_t)size);
+		hdr->xpsize = 0;
+	}
+}
+
+unsigned bbus_hdr_gettimeout(const struct bbus_msg_hdr* hdr)
+{
+	if (hdr->flags & BBUS_PROT_HASTIMEOUT)
+		return (unsigned)ntohl(hdr->timeout);
+
+	return 0;
+}
+
+unsigned bbus_hdr_getroute(const struct bbus_msg_hdr* hdr)
+{
+	if (hdr->flags & BBUS_PROT_HASROUTE)
+		return (unsigned)ntohl(hdr->route);
+
+	return 0;
+}
+
+void bbus_hdr_setroute(struct bbus_msg_hdr* hdr, unsigned route)
+{
+	if (route > 0) {
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASROUTE);
+		hdr->route = (uint32_t)htonl(route);
+	} else {
+		BBUS_HDR_UNSETFLAG(hdr, BBUS_PROT_HASROUTE);
+		hdr->route = 0;
+	}
+}
+
+void bbus_hdr_settimeout(struct bbus_msg_hdr* hdr, unsigned ms)
+{
+	if (ms > 0) {
+		BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASTIMEOUT);
+		hdr->timeout = (uint32_t)htonl(ms);
+	} else {
+		BBUS_HDR_UNSETFLAG(hdr, BBUS_PROT_HASTIMEOUT);
+		hdr->timeout = 0;
+	}
 }
 
@@ -16,13 +16,58 @@
 #define __BBUS_PROTO__
 
 #include <busybus.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define __BBUS_PROT_MAXNUMIOV 3 /* Header + meta + object. */
+
+/* Byte order bit for the session open token. */
+#define __BBUS_SO_HOSTENDIAN (htonl(1) == 1				\
+			? BBUS_SO_BIGENDIAN : BBUS_SO_LITTLEENDIAN)
+#define __BBUS_SO_ENDIANMASK (BBUS_SO_BIGENDIAN | BBUS_SO_LITTLEENDIAN)
+
+/*
+ * Busybus message header as sent over the wire - no padding, token and
+ * payload size in network byte order.
+ */
+struct __bbus_wire_hdr
+{
+	uint8_t magic[BBUS_MAGIC_SIZE];
+	uint8_t msgtype;
+	uint8_t sotype;
+	uint8_t errcode;
+	uint32_t token;
+	uint16_t psize;
+	uint8_t flags;
+} __attribute__((packed));
+
+/* Breaks the build if the wire header size is not what we expect. */
+typedef char __bbus_wire_hdr_size_check[
+	sizeof(struct __bbus_wire_hdr) == BBUS_MSGHDR_REALSIZE ? 1 : -1];
 
 int __bbus_prot_recvmsg(int sock, struct bbus_msg* buf, size_t bufsize);
 int __bbus_prot_recvvmsg(int sock, struct bbus_msg_hdr* hdr,
 		void* payload, size_t psize);
+int __bbus_prot_recvvmsgfd(int sock, struct bbus_msg_hdr* hdr,
+		void* payload, size_t psize, int* fd);
+int __bbus_prot_recvmsgdyn(int sock, struct bbus_msg** buf,
+		size_t* bufsize, int* fd);
+int __bbus_prot_growmsgbuf(struct bbus_msg** buf, size_t* bufsize,
+		size_t size);
 int __bbus_prot_sendmsg(int sock, const struct bbus_msg* buf);
+/* Sends header and meta with 'fd' attached, sets BBUS_PROT_HASFD. */
+int __bbus_prot_sendvmsgfd(int sock, struct bbus_msg_hdr* hdr,
+		const char* meta, int fd);
 int __bbus_prot_sendvmsg(int sock, const struct bbus_msg_hdr* hdr,
 		const char* meta, const char* obj, size_t objsize);
+size_t __bbus_prot_wirehdrsize(const void* buf);
+int __bbus_prot_checkhdr(const struct bbus_msg_hdr* hdr, size_t psize);
+/* 'wire' must be at least BBUS_MSGHDR_MAXWIRESIZE bytes long. */
+int __bbus_prot_msgtoiov(const struct bbus_msg_hdr* hdr, void* wire,
+		const char* meta, const char* obj, size_t objsize,
+		struct iovec* iov, int* numiov, size_t* msgsize);
+int __bbus_prot_sendbuf(int sock, const void* buf, size_t size);
+size_t __bbus_prot_iovtobuf(const struct iovec* iov, int numiov, void* buf);
 void __bbus_prot_hdrsetmagic(struct bbus_msg_hdr* hdr);
 int __bbus_prot_errtoerrnum(uint8_t errcode);
 
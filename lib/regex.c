@@ -15,40 +15,189 @@
 #include <busybus.h>
 #include "error.h"
 #include <regex.h>
+#include <string.h>
+#include <pthread.h>
 
-int bbus_regex_match(const char* pattern, const char* str)
+struct __bbus_regex
 {
-	int ret;
 	regex_t regex;
+};
+
+/*
+ * Every thread keeps its own cache of compiled patterns for
+ * bbus_regex_match(), so entries are never evicted while another thread
+ * is still matching against them.
+ */
+struct cache_entry
+{
+	char* pattern;
+	bbus_regex* regex;
+	unsigned long lastused;
+};
+
+struct regex_cache
+{
+	struct cache_entry entries[BBUS_REGEX_CACHESIZE];
+	unsigned long clock;
+};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
 
-	ret = regcomp(&regex, pattern, REG_EXTENDED | REG_NEWLINE);
+bbus_regex* bbus_regex_compile(const char* pattern)
+{
+	bbus_regex* regex;
+	int ret;
+
+	regex = bbus_malloc(sizeof(struct __bbus_regex));
+	if (regex == NULL)
+		return NULL;
+
+	ret = regcomp(&regex->regex, pattern, REG_EXTENDED | REG_NEWLINE);
 	if (ret != REG_NOERROR) {
 		if (ret == REG_ESPACE) {
 			__bbus_seterr(BBUS_ENOMEM);
 		} else {
 			__bbus_seterr(BBUS_EREGEXPTRN);
 		}
-		return -1;
+		bbus_free(regex);
+		return NULL;
 	}
 
-	ret = regexec(&regex, str, 0, NULL, 0);
+	return regex;
+}
+
+int bbus_regex_exec(bbus_regex* regex, const char* str)
+{
+	int ret;
+
+	ret = regexec(&regex->regex, str, 0, NULL, 0);
 	if (ret != REG_NOERROR) {
-		if (ret == REG_NOMATCH) {
-			ret = BBUS_FALSE;
-		} else {
-			/*
-			 * This seems to be the only error
-			 * regexec can return.
-			 */
+		if (ret == REG_NOMATCH)
+			return BBUS_FALSE;
+
+		/* This seems to be the only error regexec can return. */
+		__bbus_seterr(BBUS_ENOMEM);
+		return -1;
+	}
+
+	return BBUS_TRUE;
+}
+
+void bbus_regex_free(bbus_regex* regex)
+{
+	if (regex) {
+		regfree(&regex->regex);
+		bbus_free(regex);
+	}
+}
+
+static void free_cache(void* arg)
+{
+	struct regex_cache* cache = arg;
+	unsigned i;
+
+	for (i = 0; i < BBUS_REGEX_CACHESIZE; ++i) {
+		bbus_str_free(cache->entries[i].pattern);
+		bbus_regex_free(cache->entries[i].regex);
+	}
+	bbus_free(cache);
+}
+
+static void make_cache_key(void)
+{
+	(void)pthread_key_create(&cache_key, free_cache);
+}
+
+static struct regex_cache* get_cache(void)
+{
+	struct regex_cache* cache;
+
+	(void)pthread_once(&cache_once, make_cache_key);
+	cache = pthread_getspecific(cache_key);
+	if (cache == NULL) {
+		cache = bbus_malloc0(sizeof(struct regex_cache));
+		if (cache == NULL)
+			return NULL;
+
+		if (pthread_setspecific(cache_key, cache) != 0) {
+			bbus_free(cache);
 			__bbus_seterr(BBUS_ENOMEM);
-			ret = -1;
+			return NULL;
 		}
-		goto out;
 	}
 
-	ret = BBUS_TRUE;
+	return cache;
+}
+
+static bbus_regex* cache_lookup(struct regex_cache* cache,
+						const char* pattern)
+{
+	struct cache_entry* entry;
+	struct cache_entry* lru;
+	bbus_regex* regex;
+	char* copy;
+	unsigned i;
+
+	lru = &cache->entries[0];
+	for (i = 0; i < BBUS_REGEX_CACHESIZE; ++i) {
+		entry = &cache->entries[i];
+		if (entry->pattern == NULL) {
+			/* Entries are filled in order - no further hits. */
+			lru = entry;
+			break;
+		}
+
+		if (strcmp(entry->pattern, pattern) == 0) {
+			entry->lastused = ++cache->clock;
+			return entry->regex;
+		}
+
+		if (entry->lastused < lru->lastused)
+			lru = entry;
+	}
+
+	regex = bbus_regex_compile(pattern);
+	if (regex == NULL)
+		return NULL;
+
+	copy = bbus_str_cpy(pattern);
+	if (copy == NULL) {
+		bbus_regex_free(regex);
+		return NULL;
+	}
+
+	bbus_str_free(lru->pattern);
+	bbus_regex_free(lru->regex);
+	lru->pattern = copy;
+	lru->regex = regex;
+	lru->lastused = ++cache->clock;
+
+	return regex;
+}
+
+int bbus_regex_match(const char* pattern, const char* str)
+{
+	struct regex_cache* cache;
+	bbus_regex* regex;
+	int ret;
+
+	cache = get_cache();
+	if (cache != NULL) {
+		regex = cache_lookup(cache, pattern);
+		if (regex == NULL)
+			return -1;
+
+		return bbus_regex_exec(regex, str);
+	}
+
+	/* No memory for the cache - fall back to a one-shot compile. */
+	regex = bbus_regex_compile(pattern);
+	if (regex == NULL)
+		return -1;
+
+	ret = bbus_regex_exec(regex, str);
+	bbus_regex_free(regex);
 
-out:
-	regfree(&regex);
 	return ret;
 }
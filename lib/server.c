@@ -17,209 +17,1945 @@
 #include "socket.h"
 #include "protocol.h"
 #include "cred.h"
+#include "iobuf.h"
 #include <string.h>
 #include <sys/select.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+ * Epoll is used on Linux unless BBUS_POLL_SELECT is defined, select() is
+ * the fallback for other systems and exotic C libraries.
+ */
+#if defined(__linux__) && !defined(BBUS_POLL_SELECT)
+#define POLL_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/*
+ * The epoll pollset switches to io_uring at runtime if the kernel supports
+ * it, unless built with BBUS_POLL_NOURING.
+ */
+#if defined(POLL_EPOLL) && !defined(BBUS_POLL_NOURING)
+#define POLL_URING
+#include "uring.h"
+#include <stdlib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
 
 #define DEF_LISTEN_QUEUE 5
 
-struct __bbus_client
+/* Non-blocking clients read up to this many bytes at once. */
+#define CLI_RDCHUNK BBUS_MAXMSGSIZE
+/*
+ * A descriptor comes along with the first byte of the message it belongs
+ * to, which is somewhere between 'start' and 'end' of rdbuf - a single
+ * read can return data sent before it too.
+ */
+struct client_rdfd
+{
+	int fd;
+	size_t start;
+	size_t end;
+};
+
+struct __bbus_client
+{
+	int sock;
+	int type;
+	uint32_t token;
+	struct bbus_client_cred cred;
+	char* name;
+	void* priv;
+	int nonblock;
+	int busypoll;
+	/* Agreed to host byte order objects at session open. */
+	int hostorder;
+	/* Agreed to compressed objects at session open. */
+	int compression;
+	/* Another daemon's bridge, wants full method paths. */
+	int bridge;
+	/* Connected over a transport passing descriptors. */
+	int local;
+	/* Corked clients only queue data until explicitly flushed. */
+	int cork;
+	/* Set while the client is on its pollset's list of clients to flush. */
+	int dirty;
+	/* Set while the pollset watches the socket for becoming writable. */
+	int wrwatch;
+	/* Index into the io_uring pollset's slot table. */
+	unsigned ringslot;
+	struct __bbus_iobuf rdbuf;
+	struct __bbus_iobuf wrbuf;
+	/* Limit of data queued for a client that doesn't read. */
+	size_t maxwrqueue;
+	bbus_pollset* pset;
+	/* Descriptor received with the last message, -1 if none. */
+	int msgfd;
+	/* Descriptors received, but not yet claimed by a message. */
+	struct client_rdfd rdfds[__BBUS_SOCK_MAXFDS];
+	size_t numrdfds;
+	/* Descriptors to be attached at given offsets of wrbuf. */
+	struct client_wrfd* wrfds;
+	size_t numwrfds;
+};
+
+struct client_wrfd
+{
+	int fd;
+	size_t pos;
+};
+
+struct __bbus_server
+{
+	int sock;
+	struct __bbus_sockaddr addr;
+	/* Switched to non-blocking by bbus_srv_acceptnb(). */
+	int nonblock;
+};
+
+/* Corked clients with queued data, flushed by the pollset's owner. */
+struct dirty_list
+{
+	bbus_client** clients;
+	size_t num;
+	size_t max;
+	/* Set once the current list has been sent in one batch. */
+	int batched;
+};
+
+#ifdef POLL_URING
+
+/* Polled clients, completions are matched to them by index and generation. */
+struct ring_slot
+{
+	bbus_client* cli;
+	uint32_t gen;
+	uint32_t nextfree;
+};
+
+#endif /* POLL_URING */
+
+#ifdef POLL_EPOLL
+
+#define POLL_MAXEVENTS 64
+
+struct __bbus_pollset
+{
+	int epfd;
+	bbus_server* srvs[BBUS_POLLSET_MAXSRVS];
+	unsigned numsrvs;
+	/* Bit mask of the servers with connections pending. */
+	unsigned srvready;
+	int wakefd[2];
+	int woken;
+	struct dirty_list dirty;
+	struct epoll_event events[POLL_MAXEVENTS];
+	int numevents;
+	int curevent;
+#ifdef POLL_URING
+	/* NULL if epoll is used instead. */
+	struct __bbus_uring* ring;
+	/* Flushes are sent on a separate ring, so they can be waited for. */
+	struct __bbus_uring* sendring;
+	struct ring_slot* slots;
+	uint32_t numslots;
+	uint32_t freeslot;
+#endif /* POLL_URING */
+};
+
+#else /* POLL_EPOLL */
+
+struct __bbus_pollset
+{
+	fd_set fdset;
+	fd_set rdset;
+	fd_set wrfdset;
+	fd_set wrset;
+	int highsock;
+	bbus_server* srvs[BBUS_POLLSET_MAXSRVS];
+	unsigned numsrvs;
+	/* Bit mask of the servers with connections pending. */
+	unsigned srvready;
+	int wakefd[2];
+	int woken;
+	struct dirty_list dirty;
+	bbus_client** clients;
+	size_t numclients;
+	size_t maxclients;
+	size_t curclient;
+};
+
+#endif /* POLL_EPOLL */
+
+/*
+ * Tells the pollset whether we're interested in the client becoming
+ * writable. Defined separately for every pollset backend.
+ */
+static void pollset_setwrite(bbus_pollset* pset, bbus_client* cli, int on);
+
+/*
+ * Gives the backend a chance to send the data queued for all dirty clients
+ * at once, before they're flushed one by one.
+ */
+static void pollset_senddirty(bbus_pollset* pset);
+
+static int pollset_srvind(bbus_pollset* pset, bbus_server* srv)
+{
+	unsigned i;
+
+	for (i = 0; i < pset->numsrvs; ++i) {
+		if (pset->srvs[i] == srv)
+			return i;
+	}
+
+	return -1;
+}
+
+static int pollset_srvfull(bbus_pollset* pset)
+{
+	if (pset->numsrvs == BBUS_POLLSET_MAXSRVS) {
+		__bbus_seterr(BBUS_ENOSPACE);
+		return 1;
+	}
+
+	return 0;
+}
+
+int bbus_pollset_srvisset(bbus_pollset* pset, bbus_server* srv)
+{
+	int ind;
+
+	ind = pollset_srvind(pset, srv);
+	return (ind >= 0) && (pset->srvready & (1U << ind));
+}
+
+static int mark_dirty(bbus_client* cli)
+{
+	struct dirty_list* list = &cli->pset->dirty;
+	bbus_client** newcli;
+	size_t newmax;
+
+	if (cli->dirty)
+		return 0;
+
+	if (list->num == list->max) {
+		newmax = list->max ? 2 * list->max : 16;
+		newcli = bbus_realloc(list->clients,
+					newmax * sizeof(bbus_client*));
+		if (newcli == NULL)
+			return -1;
+		list->clients = newcli;
+		list->max = newmax;
+	}
+
+	list->clients[list->num++] = cli;
+	cli->dirty = 1;
+
+	return 0;
+}
+
+static void unmark_dirty(bbus_pollset* pset, bbus_client* cli)
+{
+	size_t i;
+
+	if (!cli->dirty)
+		return;
+
+	for (i = 0; i < pset->dirty.num; ++i) {
+		if (pset->dirty.clients[i] == cli) {
+			pset->dirty.clients[i] =
+				pset->dirty.clients[--pset->dirty.num];
+			break;
+		}
+	}
+	cli->dirty = 0;
+}
+
+static void clear_dirty(bbus_pollset* pset)
+{
+	while (pset->dirty.num > 0)
+		pset->dirty.clients[--pset->dirty.num]->dirty = 0;
+	pset->dirty.batched = 0;
+}
+
+bbus_client* bbus_pollset_nextdirty(bbus_pollset* pset)
+{
+	bbus_client* cli;
+
+	if (pset->dirty.num == 0)
+		return NULL;
+
+	if (!pset->dirty.batched) {
+		pollset_senddirty(pset);
+		pset->dirty.batched = 1;
+	}
+
+	cli = pset->dirty.clients[--pset->dirty.num];
+	cli->dirty = 0;
+	if (pset->dirty.num == 0)
+		pset->dirty.batched = 0;
+
+	return cli;
+}
+
+/*
+ * Every pollset owns a non-blocking pipe, that can be written to from any
+ * thread to interrupt bbus_poll().
+ */
+static int wake_init(bbus_pollset* pset)
+{
+	int ret;
+
+	ret = pipe2(pset->wakefd, O_NONBLOCK | O_CLOEXEC);
+	if (ret < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void wake_drain(bbus_pollset* pset)
+{
+	char buf[64];
+
+	while (read(pset->wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	pset->woken = 1;
+}
+
+static void wake_close(bbus_pollset* pset)
+{
+	close(pset->wakefd[0]);
+	close(pset->wakefd[1]);
+}
+
+int bbus_pollset_wakeup(bbus_pollset* pset)
+{
+	ssize_t ret;
+
+	ret = write(pset->wakefd[1], "w", 1);
+	/* A full pipe means a wakeup is pending anyway. */
+	if ((ret < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int bbus_pollset_woken(bbus_pollset* pset)
+{
+	return pset->woken;
+}
+
+uint32_t bbus_client_gettoken(bbus_client* cli)
+{
+	return cli->token;
+}
+
+void bbus_client_settoken(bbus_client* cli, uint32_t tok)
+{
+	cli->token = tok;
+}
+
+int bbus_client_gettype(bbus_client* cli)
+{
+	return cli->type;
+}
+
+const char* bbus_client_getname(bbus_client* cli)
+{
+	return cli->name;
+}
+
+int bbus_client_getsock(bbus_client* cli)
+{
+	return cli->sock;
+}
+
+void* bbus_client_getpriv(bbus_client* cli)
+{
+	return cli->priv;
+}
+
+void bbus_client_setpriv(bbus_client* cli, void* priv)
+{
+	cli->priv = priv;
+}
+
+int bbus_client_haspending(bbus_client* cli)
+{
+	return __bbus_sock_haspending(cli->sock);
+}
+
+int bbus_client_busypoll(bbus_client* cli)
+{
+	return cli->busypoll;
+}
+
+int bbus_client_hostorder(bbus_client* cli)
+{
+	return cli->hostorder;
+}
+
+int bbus_client_compression(bbus_client* cli)
+{
+	return cli->compression;
+}
+
+int bbus_client_passfds(bbus_client* cli)
+{
+	return cli->local;
+}
+
+int bbus_client_isbridge(bbus_client* cli)
+{
+	return cli->bridge;
+}
+
+int bbus_client_acceptsobj(bbus_client* cli, int objflags)
+{
+	if ((objflags & BBUS_PROT_HOSTORDER) && !cli->hostorder) {
+		__bbus_seterr(BBUS_ENOHOSTORDER);
+		return -1;
+	}
+
+	if ((objflags & BBUS_PROT_COMPRESSED) && !cli->compression) {
+		__bbus_seterr(BBUS_ENOCOMPRESSION);
+		return -1;
+	}
+
+	return 0;
+}
+
+int bbus_client_setcork(bbus_client* cli, int on)
+{
+	if (!cli->nonblock) {
+		__bbus_seterr(BBUS_EINVALARG);
+		return -1;
+	}
+
+	cli->cork = on;
+	if (!on) {
+		if (cli->pset)
+			unmark_dirty(cli->pset, cli);
+		return bbus_client_flush(cli);
+	}
+
+	return 0;
+}
+
+int bbus_client_setnonblock(bbus_client* cli)
+{
+	int ret;
+
+	ret = __bbus_sock_setnonblock(cli->sock);
+	if (ret < 0)
+		return -1;
+	cli->nonblock = 1;
+
+	return 0;
+}
+
+static int sock_wouldblock(void)
+{
+	return (bbus_lasterror() == EAGAIN) || (bbus_lasterror() == EWOULDBLOCK);
+}
+
+static void close_msgfd(bbus_client* cli)
+{
+	if (cli->msgfd >= 0) {
+		close(cli->msgfd);
+		cli->msgfd = -1;
+	}
+}
+
+/*
+ * No message carries more than one descriptor, a client with more of them
+ * queued than a single read can return is sending garbage.
+ */
+static int push_rdfd(bbus_client* cli, int fd, size_t start, size_t end)
+{
+	if (cli->numrdfds == __BBUS_SOCK_MAXFDS) {
+		close(fd);
+		__bbus_seterr(BBUS_EMSGINVFMT);
+		return -1;
+	}
+
+	cli->rdfds[cli->numrdfds].fd = fd;
+	cli->rdfds[cli->numrdfds].start = start;
+	cli->rdfds[cli->numrdfds].end = end;
+	++cli->numrdfds;
+
+	return 0;
+}
+
+/* Takes the descriptor that may belong to the message at rdbuf's head. */
+static int pop_rdfd(bbus_client* cli)
+{
+	int fd;
+
+	if ((cli->numrdfds == 0) || (cli->rdfds[0].start > 0))
+		return -1;
+
+	fd = cli->rdfds[0].fd;
+	memmove(cli->rdfds, cli->rdfds + 1,
+			--cli->numrdfds * sizeof(struct client_rdfd));
+
+	return fd;
+}
+
+/*
+ * Called after 'used' bytes of rdbuf have been consumed. Descriptors that
+ * came with them only weren't claimed by any message and are closed.
+ */
+static void consume_rdfds(bbus_client* cli, size_t used)
+{
+	struct client_rdfd* rdfd;
+	size_t i;
+	size_t j;
+
+	for (i = 0, j = 0; i < cli->numrdfds; ++i) {
+		rdfd = &cli->rdfds[i];
+		if (rdfd->end <= used) {
+			close(rdfd->fd);
+			continue;
+		}
+
+		rdfd->start = rdfd->start > used ? rdfd->start - used : 0;
+		rdfd->end -= used;
+		cli->rdfds[j++] = *rdfd;
+	}
+	cli->numrdfds = j;
+}
+
+static int push_wrfd(bbus_client* cli, int fd, size_t pos)
+{
+	struct client_wrfd* newfds;
+
+	newfds = bbus_realloc(cli->wrfds, (cli->numwrfds+1)
+					* sizeof(struct client_wrfd));
+	if (newfds == NULL)
+		return -1;
+
+	cli->wrfds = newfds;
+	cli->wrfds[cli->numwrfds].fd = fd;
+	cli->wrfds[cli->numwrfds].pos = pos;
+	++cli->numwrfds;
+
+	return 0;
+}
+
+/*
+ * Called after 'sent' bytes of wrbuf have been consumed. If 'fdsent' is
+ * set, the first descriptor went along with them.
+ */
+static void consume_wrfds(bbus_client* cli, size_t sent, int fdsent)
+{
+	size_t i;
+
+	if (fdsent) {
+		close(cli->wrfds[0].fd);
+		memmove(cli->wrfds, cli->wrfds + 1, --cli->numwrfds
+					* sizeof(struct client_wrfd));
+	}
+
+	for (i = 0; i < cli->numwrfds; ++i)
+		cli->wrfds[i].pos -= sent;
+}
+
+/*
+ * Returns 1 if a complete message has been moved from the read buffer
+ * to '*buf', 0 if there's not enough data yet and -1 on error. If 'grow'
+ * is set, *buf is reallocated when the message doesn't fit.
+ */
+static int nb_extract_msg(bbus_client* cli, struct bbus_msg** buf,
+					size_t* bufsize, int grow)
+{
+	struct bbus_msg_hdr hdr;
+	size_t wiresize;
+	size_t used;
+	size_t psize;
+	char* head;
+	int ret;
+
+	used = __bbus_iobuf_used(&cli->rdbuf);
+	if (used < BBUS_MSGHDR_REALSIZE)
+		return 0;
+
+	head = __bbus_iobuf_head(&cli->rdbuf);
+	wiresize = __bbus_prot_wirehdrsize(head);
+	if (used < wiresize)
+		return 0;
+
+	bbus_hdr_unpack(&hdr, head);
+	ret = __bbus_prot_checkhdr(&hdr, grow ? BBUS_MAXLARGEPLOADSIZE
+					: *bufsize-BBUS_MSGHDR_SIZE);
+	if (ret < 0)
+		return -1;
+
+	psize = bbus_hdr_getpsize(&hdr);
+	if (used < (wiresize + psize))
+		return 0;
+
+	if (grow) {
+		ret = __bbus_prot_growmsgbuf(buf, bufsize,
+					BBUS_MSGHDR_SIZE + psize);
+		if (ret < 0)
+			return -1;
+	}
+
+	if (BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_HASFD)) {
+		/* The descriptor came along with the header's first byte. */
+		cli->msgfd = pop_rdfd(cli);
+		if (cli->msgfd < 0) {
+			__bbus_seterr(BBUS_EMSGINVFMT);
+			return -1;
+		}
+	}
+
+	memcpy(&(*buf)->hdr, &hdr, sizeof(struct bbus_msg_hdr));
+	memcpy((*buf)->payload, head + wiresize, psize);
+	__bbus_iobuf_consume(&cli->rdbuf, wiresize + psize);
+	consume_rdfds(cli, wiresize + psize);
+
+	return 1;
+}
+
+static int nb_rcvmsg(bbus_client* cli, struct bbus_msg** buf,
+					size_t* bufsize, int grow)
+{
+	int fds[__BBUS_SOCK_MAXFDS];
+	struct iovec iov;
+	ssize_t rcvd;
+	size_t used;
+	int numfds;
+	int ret;
+	int i;
+
+	for (;;) {
+		ret = nb_extract_msg(cli, buf, bufsize, grow);
+		if (ret < 0)
+			return -1;
+		else if (ret > 0)
+			return 0;
+
+		ret = __bbus_iobuf_reserve(&cli->rdbuf, CLI_RDCHUNK);
+		if (ret < 0)
+			return -1;
+
+		iov.iov_base = __bbus_iobuf_tail(&cli->rdbuf);
+		iov.iov_len = __bbus_iobuf_avail(&cli->rdbuf);
+		numfds = __BBUS_SOCK_MAXFDS;
+		rcvd = __bbus_sock_recvfds(cli->sock, &iov, 1, fds, &numfds);
+		if (rcvd < 0) {
+			if (bbus_lasterror() == EINTR)
+				continue;
+			if (sock_wouldblock())
+				__bbus_seterr(BBUS_EAGAIN);
+			return -1;
+		} else
+		if (rcvd == 0) {
+			__bbus_seterr(BBUS_ECONNCLOSED);
+			return -1;
+		}
+
+		used = __bbus_iobuf_used(&cli->rdbuf);
+		__bbus_iobuf_produce(&cli->rdbuf, rcvd);
+		for (i = 0; i < numfds; ++i) {
+			ret = push_rdfd(cli, fds[i], used, used + rcvd);
+			if (ret < 0) {
+				while (++i < numfds)
+					close(fds[i]);
+				return -1;
+			}
+		}
+	}
+}
+
+int bbus_client_rcvmsg(bbus_client* cli,
+				struct bbus_msg* buf, size_t bufsize)
+{
+	close_msgfd(cli);
+	if (cli->nonblock)
+		return nb_rcvmsg(cli, &buf, &bufsize, 0);
+
+	return __bbus_prot_recvvmsgfd(cli->sock, &buf->hdr, buf->payload,
+				bufsize-BBUS_MSGHDR_SIZE, &cli->msgfd);
+}
+
+int bbus_client_rcvmsg_dyn(bbus_client* cli,
+				struct bbus_msg** buf, size_t* bufsize)
+{
+	close_msgfd(cli);
+	if (cli->nonblock)
+		return nb_rcvmsg(cli, buf, bufsize, 1);
+
+	return __bbus_prot_recvmsgdyn(cli->sock, buf, bufsize, &cli->msgfd);
+}
+
+int bbus_client_takefd(bbus_client* cli)
+{
+	int fd;
+
+	fd = cli->msgfd;
+	cli->msgfd = -1;
+
+	return fd;
+}
+
+/*
+ * If fd is not negative, it's attached to the message and closed once
+ * it has been sent.
+ */
+static int nb_sendmsg(bbus_client* cli, const struct iovec* iov,
+				int numiov, size_t msgsize, int fd)
+{
+	ssize_t sent = 0;
+	size_t queued;
+	size_t skip;
+	int ret;
+	int i;
+
+	queued = __bbus_iobuf_used(&cli->wrbuf);
+	/* Never start sending a message we won't be able to queue. */
+	if ((queued + msgsize) > cli->maxwrqueue) {
+		__bbus_seterr(BBUS_ENOSPACE);
+		goto err;
+	}
+
+	/* Corked clients with a pollset are flushed by its owner. */
+	if ((queued == 0) && !(cli->cork && cli->pset)) {
+		if (fd >= 0)
+			sent = __bbus_sock_sendfd(cli->sock, iov, numiov, fd);
+		else
+			sent = __bbus_sock_send(cli->sock, iov, numiov);
+		if (sent < 0) {
+			if (!sock_wouldblock() && (bbus_lasterror() != EINTR))
+				goto err;
+			sent = 0;
+		} else {
+			if (fd >= 0) {
+				close(fd);
+				fd = -1;
+			}
+
+			if (sent == (ssize_t)msgsize)
+				return 0;
+		}
+	}
+
+	ret = __bbus_iobuf_reserve(&cli->wrbuf, msgsize - sent);
+	if (ret < 0)
+		goto err;
+
+	if (fd >= 0) {
+		ret = push_wrfd(cli, fd, queued);
+		if (ret < 0)
+			goto err;
+	}
+
+	for (i = 0, skip = sent; i < numiov; ++i) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+
+		(void)__bbus_iobuf_append(&cli->wrbuf,
+					(char*)iov[i].iov_base + skip,
+					iov[i].iov_len - skip);
+		skip = 0;
+	}
+
+	if (cli->cork && cli->pset) {
+		if (mark_dirty(cli) < 0) {
+			/* Don't let the data sit there until the next write. */
+			pollset_setwrite(cli->pset, cli, 1);
+		}
+	} else if ((queued == 0) && cli->pset) {
+		pollset_setwrite(cli->pset, cli, 1);
+	}
+
+	return 0;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+int bbus_client_sendmsg(bbus_client* cli, struct bbus_msg_hdr* hdr,
+		const char* meta, bbus_object* obj)
+{
+	return bbus_client_sendbuf(cli, hdr, meta,
+				obj == NULL ? NULL : bbus_obj_rawdata(obj),
+				obj == NULL ? 0 : bbus_obj_rawsize(obj));
+}
+
+int bbus_client_sendbuf(bbus_client* cli, struct bbus_msg_hdr* hdr,
+		const char* meta, const void* obj, size_t objsize)
+{
+	struct iovec iov[__BBUS_PROT_MAXNUMIOV];
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	int numiov;
+	size_t msgsize;
+	int ret;
+
+	if (!cli->nonblock)
+		return __bbus_prot_sendvmsg(cli->sock, hdr, meta, obj, objsize);
+
+	ret = __bbus_prot_msgtoiov(hdr, wire, meta, obj, objsize,
+					iov, &numiov, &msgsize);
+	if (ret < 0)
+		return -1;
+
+	return nb_sendmsg(cli, iov, numiov, msgsize, -1);
+}
+
+int bbus_client_sendfd(bbus_client* cli, struct bbus_msg_hdr* hdr,
+					const char* meta, int fd)
+{
+	struct iovec iov[__BBUS_PROT_MAXNUMIOV];
+	char wire[BBUS_MSGHDR_MAXWIRESIZE];
+	int numiov;
+	size_t msgsize;
+	int ret;
+
+	if (!cli->local) {
+		__bbus_seterr(BBUS_ENOFDPASS);
+		close(fd);
+		return -1;
+	}
+
+	if (!cli->nonblock) {
+		ret = __bbus_prot_sendvmsgfd(cli->sock, hdr, meta, fd);
+		close(fd);
+		return ret;
+	}
+
+	BBUS_HDR_SETFLAG(hdr, BBUS_PROT_HASFD);
+	ret = __bbus_prot_msgtoiov(hdr, wire, meta, NULL, 0,
+					iov, &numiov, &msgsize);
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return nb_sendmsg(cli, iov, numiov, msgsize, fd);
+}
+
+int bbus_client_flush(bbus_client* cli)
+{
+	struct iovec iov;
+	ssize_t sent;
+	size_t next;
+	int fd;
+
+	while (__bbus_iobuf_used(&cli->wrbuf) > 0) {
+		iov.iov_base = __bbus_iobuf_head(&cli->wrbuf);
+		iov.iov_len = __bbus_iobuf_used(&cli->wrbuf);
+
+		/*
+		 * A descriptor must go along with the first byte of its
+		 * message - never send past the start of the next one.
+		 */
+		fd = -1;
+		next = 0;
+		if (cli->numwrfds > 0) {
+			if (cli->wrfds[0].pos == 0) {
+				fd = cli->wrfds[0].fd;
+				if (cli->numwrfds > 1)
+					next = cli->wrfds[1].pos;
+			} else {
+				next = cli->wrfds[0].pos;
+			}
+		}
+		if ((next > 0) && (next < iov.iov_len))
+			iov.iov_len = next;
+
+		if (fd >= 0)
+			sent = __bbus_sock_sendfd(cli->sock, &iov, 1, fd);
+		else
+			sent = __bbus_sock_send(cli->sock, &iov, 1);
+		if (sent < 0) {
+			if (bbus_lasterror() == EINTR)
+				continue;
+			if (sock_wouldblock()) {
+				/* Corked data isn't watched for until now. */
+				if (cli->cork && cli->pset)
+					pollset_setwrite(cli->pset, cli, 1);
+				return 0;
+			}
+			return -1;
+		}
+
+		__bbus_iobuf_consume(&cli->wrbuf, sent);
+		if (cli->numwrfds > 0)
+			consume_wrfds(cli, sent, fd >= 0);
+	}
+
+	if (cli->pset)
+		pollset_setwrite(cli->pset, cli, 0);
+
+	return 0;
+}
+
+size_t bbus_client_wrqueued(bbus_client* cli)
+{
+	return __bbus_iobuf_used(&cli->wrbuf);
+}
+
+void bbus_client_setmaxwrqueue(bbus_client* cli, size_t size)
+{
+	cli->maxwrqueue = size;
+}
+
+int bbus_client_close(bbus_client* cli)
+{
+	return __bbus_sock_close(cli->sock);
+}
+
+void bbus_client_free(bbus_client* cli)
+{
+	size_t i;
+
+	__bbus_iobuf_free(&cli->rdbuf);
+	__bbus_iobuf_free(&cli->wrbuf);
+	close_msgfd(cli);
+	for (i = 0; i < cli->numrdfds; ++i)
+		close(cli->rdfds[i].fd);
+	for (i = 0; i < cli->numwrfds; ++i)
+		close(cli->wrfds[i].fd);
+	bbus_free(cli->wrfds);
+	bbus_str_free(cli->name);
+	bbus_free(cli);
+}
+
+bbus_server* bbus_srv_create(void)
+{
+	return bbus_srv_create_addr(bbus_prot_getsockpath());
+}
+
+bbus_server* bbus_srv_create_addr(const char* addr)
+{
+	struct __bbus_sockaddr sockaddr;
+	bbus_server* srv;
+	int sock;
+	int ret;
+
+	ret = __bbus_sock_parseaddr(addr, &sockaddr);
+	if (ret < 0)
+		return NULL;
+
+	sock = __bbus_sock_mksocket(&sockaddr);
+	if (sock < 0)
+		return NULL;
+
+	ret = __bbus_sock_bind(sock, &sockaddr);
+	if (ret < 0)
+		goto err;
+
+	srv = bbus_malloc(sizeof(struct __bbus_server));
+	if (srv == NULL)
+		goto err;
+
+	srv->sock = sock;
+	srv->nonblock = 0;
+	memcpy(&srv->addr, &sockaddr, sizeof(struct __bbus_sockaddr));
+	return srv;
+
+err:
+	__bbus_sock_close(sock);
+	return NULL;
+}
+
+int bbus_srv_listen(bbus_server* srv)
+{
+	return __bbus_sock_listen(srv->sock, DEF_LISTEN_QUEUE);
+}
+
+int bbus_srv_clientpending(bbus_server* srv)
+{
+	struct bbus_timeval tv;
+
+	memset(&tv, 0, sizeof(struct bbus_timeval));
+	tv.sec = 0;
+	tv.usec = 0;
+
+	return __bbus_sock_rdready(srv->sock, &tv);
+}
+
+static bbus_client* client_new(int sock, int type, const char* name)
+{
+	bbus_client* cli;
+
+	cli = bbus_malloc0(sizeof(struct __bbus_client));
+	if (cli == NULL)
+		return NULL;
+
+	cli->sock = sock;
+	cli->type = type;
+	cli->local = __bbus_sock_islocal(sock);
+	__bbus_iobuf_init(&cli->rdbuf);
+	__bbus_iobuf_init(&cli->wrbuf);
+	cli->maxwrqueue = BBUS_CLIENT_DEFWRQUEUE;
+	cli->msgfd = -1;
+	cli->name = bbus_str_build("%s", strlen(name) == 0
+					? "<unknown>" : name);
+	if (cli->name == NULL) {
+		bbus_free(cli);
+		return NULL;
+	}
+
+	return cli;
+}
+
+static int accept_sock(bbus_server* srv, int flags,
+			const struct bbus_accept_callbacks* funcs,
+			struct bbus_client_cred* cred)
+{
+	int sock;
+	int ret;
+
+	sock = __bbus_sock_accept(srv->sock, &srv->addr, flags);
+	if (sock < 0)
+		return -1;
+
+	if (__bbus_sock_islocal(sock)) {
+		ret = __bbus_cred_get(sock, cred);
+		if (ret < 0)
+			goto errout;
+	} else {
+		/* Nothing is known about processes on other hosts. */
+		cred->pid = 0;
+		cred->uid = (uid_t)-1;
+		cred->gid = (gid_t)-1;
+	}
+
+	if (funcs && funcs->auth) {
+		ret = funcs->auth(cred);
+		if (ret == BBUS_SRV_AUTHERR) {
+			__bbus_seterr(BBUS_ECLIUNAUTH);
+			goto errout;
+		}
+	}
+
+	return sock;
+
+errout:
+	__bbus_sock_close(sock);
+	return -1;
+}
+
+static bbus_client* accepted_client(int sock,
+				const struct bbus_client_cred* cred)
+{
+	bbus_client* cli;
+
+	/* The real type and name come with the session open message. */
+	cli = client_new(sock, BBUS_CLIENT_OPENING, "");
+	if (cli == NULL) {
+		__bbus_sock_close(sock);
+		return NULL;
+	}
+	__bbus_cred_copy(&cli->cred, cred);
+
+	return cli;
+}
+
+/*
+ * Applies the session open message to the client and fills 'reply' with
+ * the header of the answer.
+ */
+static int open_session(bbus_client* cli, const struct bbus_msg* msg,
+				struct bbus_msg_hdr* reply,
+				const struct bbus_accept_callbacks* funcs)
+{
+	const struct bbus_msg_hdr* hdr = &msg->hdr;
+	const char* name = "";
+	char* newname;
+	uint32_t token;
+	int clitype;
+
+	if (hdr->msgtype != BBUS_MSGTYPE_SO) {
+		__bbus_seterr(BBUS_EMSGINVTYPRCVD);
+		return -1;
+	}
+
+	if (BBUS_HDR_ISFLAGSET(hdr, BBUS_PROT_HASMETA)) {
+		name = bbus_prot_extractmeta(msg);
+		if (name == NULL)
+			return -1;
+	}
+
+	if (funcs && funcs->rcvd)
+		funcs->rcvd(msg);
+
+	/* TODO Small function to do the convertion. */
+	switch (hdr->sotype) {
+	case BBUS_SOTYPE_MTHCL: clitype = BBUS_CLIENT_CALLER; break;
+	case BBUS_SOTYPE_SRVPRV: clitype = BBUS_CLIENT_SERVICE; break;
+	case BBUS_SOTYPE_MON: clitype = BBUS_CLIENT_MON; break;
+	case BBUS_SOTYPE_CTL: clitype = BBUS_CLIENT_CTL; break;
+	default:
+		__bbus_seterr(BBUS_EMSGINVFMT);
+		return -1;
+	}
+
+	newname = bbus_str_build("%s", strlen(name) == 0
+					? "<unknown>" : name);
+	if (newname == NULL)
+		return -1;
+	bbus_str_free(cli->name);
+	cli->name = newname;
+
+	token = bbus_hdr_gettoken(hdr);
+	cli->type = clitype;
+	cli->busypoll = !!(token & BBUS_SO_BUSYPOLL);
+	/*
+	 * Everyone using this library understands both byte orders, but
+	 * peers on other hosts may be of different endianness.
+	 */
+	cli->hostorder = BBUS_HDR_ISFLAGSET(hdr, BBUS_PROT_HOSTORDER)
+			&& (cli->local || ((token & __BBUS_SO_ENDIANMASK)
+						== __BBUS_SO_HOSTENDIAN));
+	/* Compressed data is passed on, never looked into. */
+	cli->compression = !!(token & BBUS_SO_COMPRESSION);
+	cli->bridge = (clitype == BBUS_CLIENT_SERVICE)
+					&& (token & BBUS_SO_BRIDGE);
+
+	memset(reply, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(reply);
+	reply->msgtype = BBUS_MSGTYPE_SOOK;
+	reply->sotype = hdr->sotype;
+	if (cli->hostorder)
+		BBUS_HDR_SETFLAG(reply, BBUS_PROT_HOSTORDER);
+	if (cli->compression)
+		BBUS_HDR_SETFLAG(reply, BBUS_PROT_COMPRESSED);
+
+	return 0;
+}
+
+/* Big enough for a session open message with the longest client name. */
+#define SO_BUFSIZE (sizeof(struct bbus_msg) + BBUS_CLIENT_MAXNAMESIZE)
+
+bbus_client* bbus_srv_accept(bbus_server* srv,
+				const struct bbus_accept_callbacks* funcs)
+{
+	unsigned char buf[SO_BUFSIZE];
+	struct bbus_msg* msg = (struct bbus_msg*)buf;
+	struct bbus_msg_hdr reply;
+	struct bbus_client_cred cred;
+	bbus_client* cli;
+	int sock;
+	int ret;
+
+	sock = accept_sock(srv, 0, funcs, &cred);
+	if (sock < 0)
+		return NULL;
+
+	cli = accepted_client(sock, &cred);
+	if (cli == NULL)
+		return NULL;
+
+	memset(buf, 0, sizeof(buf));
+	ret = __bbus_prot_recvvmsg(sock, &msg->hdr, msg->payload,
+					sizeof(buf) - BBUS_MSGHDR_SIZE);
+	if (ret < 0)
+		goto errout;
+
+	ret = open_session(cli, msg, &reply, funcs);
+	if (ret < 0)
+		goto errout;
+
+	ret = __bbus_prot_sendvmsg(sock, &reply, NULL, NULL, 0);
+	if (ret < 0)
+		goto errout;
+
+	if (funcs && funcs->sent)
+		funcs->sent(&reply, NULL, NULL);
+
+	return cli;
+
+errout:
+	bbus_client_close(cli);
+	bbus_client_free(cli);
+	return NULL;
+}
+
+bbus_client* bbus_srv_acceptnb(bbus_server* srv,
+				const struct bbus_accept_callbacks* funcs)
+{
+	struct bbus_client_cred cred;
+	bbus_client* cli;
+	int sock;
+	int ret;
+
+	if (!srv->nonblock) {
+		ret = __bbus_sock_setnonblock(srv->sock);
+		if (ret < 0)
+			return NULL;
+		srv->nonblock = 1;
+	}
+
+	sock = accept_sock(srv, SOCK_NONBLOCK | SOCK_CLOEXEC, funcs, &cred);
+	if (sock < 0) {
+		if (sock_wouldblock())
+			__bbus_seterr(BBUS_EAGAIN);
+		return NULL;
+	}
+
+	cli = accepted_client(sock, &cred);
+	if (cli == NULL)
+		return NULL;
+	cli->nonblock = 1;
+
+	return cli;
+}
+
+int bbus_srv_handshake(bbus_client* cli,
+			const struct bbus_accept_callbacks* funcs)
+{
+	unsigned char buf[SO_BUFSIZE];
+	struct bbus_msg* msg = (struct bbus_msg*)buf;
+	size_t bufsize = sizeof(buf);
+	struct bbus_msg_hdr reply;
+	int ret;
+
+	if (cli->type != BBUS_CLIENT_OPENING)
+		return 1;
+
+	ret = nb_rcvmsg(cli, &msg, &bufsize, 0);
+	if (ret < 0)
+		return bbus_lasterror() == BBUS_EAGAIN ? 0 : -1;
+	/* Descriptors have no business coming along with a session open. */
+	close_msgfd(cli);
+
+	ret = open_session(cli, msg, &reply, funcs);
+	if (ret < 0)
+		return -1;
+
+	/* Queued if the socket is full, the pollset flushes it later. */
+	ret = bbus_client_sendmsg(cli, &reply, NULL, NULL);
+	if (ret < 0)
+		return -1;
+
+	if (funcs && funcs->sent)
+		funcs->sent(&reply, NULL, NULL);
+
+	return 1;
+}
+
+bbus_client* bbus_srv_connectpeer(const char* addr, const char* name)
+{
+	struct __bbus_sockaddr sockaddr;
+	struct bbus_msg_hdr hdr;
+	bbus_client* cli;
+	int sock;
+	int ret;
+
+	ret = __bbus_sock_parseaddr(addr, &sockaddr);
+	if (ret < 0)
+		return NULL;
+
+	sock = __bbus_sock_mksocket(&sockaddr);
+	if (sock < 0)
+		return NULL;
+
+	/* A peer that's gone mustn't block this server for long. */
+	ret = __bbus_sock_settimeout(sock, BBUS_PEER_TIMEOUTMS);
+	if (ret < 0)
+		goto errout;
+
+	ret = __bbus_sock_connect(sock, &sockaddr);
+	if (ret < 0)
+		goto errout;
+
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	__bbus_prot_hdrsetmagic(&hdr);
+	hdr.msgtype = BBUS_MSGTYPE_SO;
+	hdr.sotype = BBUS_SOTYPE_SRVPRV;
+	hdr.flags = BBUS_PROT_HOSTORDER;
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	bbus_hdr_setpsize(&hdr, strlen(name) + 1);
+	bbus_hdr_settoken(&hdr, BBUS_SO_BRIDGE | BBUS_SO_COMPRESSION
+						| __BBUS_SO_HOSTENDIAN);
+	ret = __bbus_prot_sendvmsg(sock, &hdr, name, NULL, 0);
+	if (ret < 0)
+		goto errout;
+
+	memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
+	ret = __bbus_prot_recvvmsg(sock, &hdr, NULL, 0);
+	if (ret < 0)
+		goto errout;
+	if (hdr.msgtype != BBUS_MSGTYPE_SOOK) {
+		__bbus_seterr(hdr.msgtype == BBUS_MSGTYPE_SORJCT
+				? BBUS_ESORJCTD : BBUS_EMSGINVTYPRCVD);
+		goto errout;
+	}
+
+	ret = __bbus_sock_settimeout(sock, 0);
+	if (ret < 0)
+		goto errout;
+
+	cli = client_new(sock, BBUS_CLIENT_PEER, name);
+	if (cli == NULL)
+		goto errout;
+	cli->hostorder = !!BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_HOSTORDER);
+	cli->compression = !!BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_COMPRESSED);
+
+	return cli;
+
+errout:
+	__bbus_sock_close(sock);
+	return NULL;
+}
+
+int bbus_srv_close(bbus_server* srv)
+{
+	return __bbus_sock_close(srv->sock);
+}
+
+void bbus_srv_free(bbus_server* srv)
+{
+	bbus_free(srv);
+}
+
+
+#ifdef POLL_URING
+
+#define URING_ENTRIES		256
+#define URING_SENDENTRIES	64
+/* Completions that don't belong to any client. */
+#define URING_WAKE		(~0ULL)
+#define URING_IGNORE		(~0ULL - 1)
+/* One for every server watched. */
+#define URING_SRV(ind)		(~0ULL - 2 - (ind))
+#define URING_ISSRV(data)	(((data) <= URING_SRV(0))		\
+				&& ((data) > URING_SRV(BBUS_POLLSET_MAXSRVS)))
+#define URING_NOSLOT		UINT32_MAX
+#define URING_BASEEVENTS	(POLLIN | POLLRDHUP)
+
+/* Client completions carry the slot generation and index. */
+static uint64_t slot_data(bbus_pollset* pset, uint32_t slot)
+{
+	return ((uint64_t)pset->slots[slot].gen << 32) | slot;
+}
+
+static int ring_polladd(bbus_pollset* pset, int fd,
+				uint64_t data, unsigned events)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = __bbus_uring_getsqe(pset->ring);
+	if (sqe == NULL)
+		return -1;
+
+	/* Multishot polls are edge-triggered, just like our epoll. */
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+
+	return 0;
+}
+
+static void ring_pollrm(bbus_pollset* pset, uint64_t data)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = __bbus_uring_getsqe(pset->ring);
+	if (sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = data;
+	sqe->user_data = URING_IGNORE;
+}
+
+static int ring_init(bbus_pollset* pset)
+{
+	pset->ring = __bbus_uring_new(URING_ENTRIES);
+	if (pset->ring == NULL)
+		return -1;
+
+	pset->sendring = __bbus_uring_new(URING_SENDENTRIES);
+	if (pset->sendring == NULL) {
+		__bbus_uring_free(pset->ring);
+		pset->ring = NULL;
+		return -1;
+	}
+
+	pset->freeslot = URING_NOSLOT;
+	pset->epfd = -1;
+
+	return ring_polladd(pset, pset->wakefd[0], URING_WAKE, POLLIN);
+}
+
+static uint32_t ring_getslot(bbus_pollset* pset, bbus_client* cli)
+{
+	struct ring_slot* newslots;
+	uint32_t newnum;
+	uint32_t slot;
+	uint32_t i;
+
+	if (pset->freeslot == URING_NOSLOT) {
+		newnum = pset->numslots ? 2 * pset->numslots : 64;
+		newslots = bbus_realloc(pset->slots,
+				newnum * sizeof(struct ring_slot));
+		if (newslots == NULL)
+			return URING_NOSLOT;
+
+		for (i = pset->numslots; i < newnum; ++i) {
+			newslots[i].cli = NULL;
+			newslots[i].gen = 0;
+			newslots[i].nextfree = i + 1 < newnum
+						? i + 1 : URING_NOSLOT;
+		}
+		pset->slots = newslots;
+		pset->freeslot = pset->numslots;
+		pset->numslots = newnum;
+	}
+
+	slot = pset->freeslot;
+	pset->freeslot = pset->slots[slot].nextfree;
+	pset->slots[slot].cli = cli;
+
+	return slot;
+}
+
+static void ring_putslot(bbus_pollset* pset, uint32_t slot)
+{
+	pset->slots[slot].cli = NULL;
+	/* Completions still in flight won't match anymore. */
+	pset->slots[slot].gen = (pset->slots[slot].gen + 1) & 0x7fffffff;
+	pset->slots[slot].nextfree = pset->freeslot;
+	pset->freeslot = slot;
+}
+
+static int ring_addcli(bbus_pollset* pset, bbus_client* cli)
+{
+	uint32_t slot;
+	int ret;
+
+	slot = ring_getslot(pset, cli);
+	if (slot == URING_NOSLOT)
+		return -1;
+
+	cli->wrwatch = __bbus_iobuf_used(&cli->wrbuf) > 0;
+	ret = ring_polladd(pset, cli->sock, slot_data(pset, slot),
+			URING_BASEEVENTS | (cli->wrwatch ? POLLOUT : 0));
+	if (ret < 0) {
+		ring_putslot(pset, slot);
+		return -1;
+	}
+	cli->ringslot = slot;
+	cli->pset = pset;
+
+	return 0;
+}
+
+static void ring_setwrite(bbus_pollset* pset, bbus_client* cli, int on)
+{
+	struct io_uring_sqe* sqe;
+
+	sqe = __bbus_uring_getsqe(pset->ring);
+	if (sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = slot_data(pset, cli->ringslot);
+	sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = URING_BASEEVENTS | (on ? POLLOUT : 0);
+	sqe->user_data = URING_IGNORE;
+	cli->wrwatch = on;
+}
+
+static void ring_rmcli(bbus_pollset* pset, bbus_client* cli)
+{
+	ring_pollrm(pset, slot_data(pset, cli->ringslot));
+	ring_putslot(pset, cli->ringslot);
+}
+
+/* Removes all client registrations, keeps the wakeup pipe. */
+static void ring_clear(bbus_pollset* pset)
 {
-	int sock;
-	int type;
-	uint32_t token;
-	struct bbus_client_cred cred;
-	char* name;
-};
+	uint32_t i;
 
-struct __bbus_server
+	for (i = 0; i < pset->numslots; ++i) {
+		if (pset->slots[i].cli != NULL) {
+			ring_pollrm(pset, slot_data(pset, i));
+			ring_putslot(pset, i);
+		}
+	}
+
+	for (i = 0; i < pset->numsrvs; ++i)
+		ring_pollrm(pset, URING_SRV(i));
+}
+
+static void ring_report(bbus_pollset* pset, bbus_client* cli, uint32_t events)
 {
-	int sock;
-};
+	int i;
 
-struct __bbus_pollset
+	/* A multishot poll may fire more than once before we get to it. */
+	for (i = 0; i < pset->numevents; ++i) {
+		if (pset->events[i].data.ptr == cli) {
+			pset->events[i].events |= events;
+			return;
+		}
+	}
+
+	pset->events[pset->numevents].events = events;
+	pset->events[pset->numevents].data.ptr = cli;
+	pset->numevents++;
+}
+
+/* Returns 1 if the completion is reported to the pollset's user. */
+static int ring_handle_cqe(bbus_pollset* pset, struct io_uring_cqe* cqe)
 {
-	fd_set fdset;
-	int highsock;
-};
+	struct ring_slot* slot;
+	uint32_t ind;
+	int more;
 
-uint32_t bbus_client_gettoken(bbus_client* cli)
+	more = cqe->flags & IORING_CQE_F_MORE;
+	if (cqe->user_data == URING_IGNORE) {
+		return 0;
+	} else
+	if (cqe->user_data == URING_WAKE) {
+		if (!more)
+			(void)ring_polladd(pset, pset->wakefd[0],
+						URING_WAKE, POLLIN);
+		wake_drain(pset);
+		return 1;
+	} else
+	if (URING_ISSRV(cqe->user_data)) {
+		ind = URING_SRV(0) - cqe->user_data;
+		if (ind >= pset->numsrvs)
+			return 0;
+		if (!more)
+			(void)ring_polladd(pset, pset->srvs[ind]->sock,
+						cqe->user_data, POLLIN);
+		pset->srvready |= 1U << ind;
+		return 1;
+	}
+
+	ind = cqe->user_data & 0xffffffff;
+	if (ind >= pset->numslots)
+		return 0;
+	slot = &pset->slots[ind];
+	if ((slot->cli == NULL) || (slot->gen != (cqe->user_data >> 32)))
+		return 0;
+
+	if (cqe->res < 0) {
+		/* Let the user notice the error when reading. */
+		ring_report(pset, slot->cli, EPOLLERR);
+		return 1;
+	}
+
+	/* The kernel may terminate multishot polls, e.g. on CQ overflow. */
+	if (!more)
+		(void)ring_polladd(pset, slot->cli->sock, cqe->user_data,
+				URING_BASEEVENTS
+				| (slot->cli->wrwatch ? POLLOUT : 0));
+	ring_report(pset, slot->cli, cqe->res);
+
+	return 1;
+}
+
+static int ring_poll(bbus_pollset* pset, struct bbus_timeval* tv)
 {
-	return cli->token;
+	struct io_uring_cqe cqe;
+	int reported = 0;
+	int ret;
+
+	do {
+		ret = __bbus_uring_enter(pset->ring, 1, tv);
+		if (ret < 0)
+			return -1;
+
+		while ((pset->numevents < POLL_MAXEVENTS)
+				&& __bbus_uring_getcqe(pset->ring, &cqe))
+			reported += ring_handle_cqe(pset, &cqe);
+		/* Without a timeout only return once there's something. */
+	} while ((reported == 0) && (tv == NULL));
+
+	return reported;
 }
 
-void bbus_client_settoken(bbus_client* cli, uint32_t tok)
+/*
+ * Sends the data queued for every dirty client with a single
+ * io_uring_enter(). Non-blocking sends on local sockets complete right
+ * away, whatever is left is written by the following bbus_client_flush().
+ */
+static void ring_reap_sends(bbus_pollset* pset, unsigned num)
 {
-	cli->token = tok;
+	struct io_uring_cqe cqe;
+	bbus_client* cli;
+	int ret;
+
+	while (num > 0) {
+		if (!__bbus_uring_getcqe(pset->sendring, &cqe)) {
+			ret = __bbus_uring_enter(pset->sendring, num, NULL);
+			if ((ret < 0) && (bbus_lasterror() != BBUS_EPOLLINTR))
+				return;
+			continue;
+		}
+
+		--num;
+		if (cqe.res <= 0)
+			continue;
+
+		cli = pset->dirty.clients[cqe.user_data];
+		__bbus_iobuf_consume(&cli->wrbuf, cqe.res);
+	}
 }
 
-int bbus_client_gettype(bbus_client* cli)
+static void pollset_senddirty(bbus_pollset* pset)
 {
-	return cli->type;
+	struct io_uring_sqe* sqe;
+	bbus_client* cli;
+	unsigned num = 0;
+	size_t i;
+
+	if (pset->sendring == NULL)
+		return;
+
+	for (i = 0; i < pset->dirty.num; ++i) {
+		cli = pset->dirty.clients[i];
+		/* Descriptors need sendmsg() with ancillary data. */
+		if ((cli->numwrfds > 0)
+				|| (__bbus_iobuf_used(&cli->wrbuf) == 0))
+			continue;
+
+		sqe = __bbus_uring_getsqe(pset->sendring);
+		if (sqe == NULL)
+			break;
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = cli->sock;
+		sqe->addr = (uintptr_t)__bbus_iobuf_head(&cli->wrbuf);
+		sqe->len = __bbus_iobuf_used(&cli->wrbuf);
+		sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		sqe->user_data = i;
+
+		if (++num == URING_SENDENTRIES) {
+			ring_reap_sends(pset, num);
+			num = 0;
+		}
+	}
+
+	ring_reap_sends(pset, num);
 }
 
-const char* bbus_client_getname(bbus_client* cli)
+static void ring_free(bbus_pollset* pset)
 {
-	return cli->name;
+	__bbus_uring_free(pset->ring);
+	__bbus_uring_free(pset->sendring);
+	bbus_free(pset->slots);
 }
 
-int bbus_client_rcvmsg(bbus_client* cli,
-				struct bbus_msg* buf, size_t bufsize)
+#else /* POLL_URING */
+
+static void pollset_senddirty(bbus_pollset* pset BBUS_UNUSED)
 {
-	return __bbus_prot_recvmsg(cli->sock, buf, bufsize);
 }
 
-int bbus_client_sendmsg(bbus_client* cli, struct bbus_msg_hdr* hdr,
-		const char* meta, bbus_object* obj)
+#endif /* POLL_URING */
+
+#ifdef POLL_EPOLL
+
+static int epoll_add_wake(bbus_pollset* pset)
 {
-	return __bbus_prot_sendvmsg(cli->sock, hdr, meta,
-				obj == NULL ? NULL : bbus_obj_rawdata(obj),
-				obj == NULL ? 0 : bbus_obj_rawsize(obj));
+	struct epoll_event ev;
+	int ret;
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.ptr = pset->wakefd;
+	ret = epoll_ctl(pset->epfd, EPOLL_CTL_ADD, pset->wakefd[0], &ev);
+	if (ret < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
 }
 
-int bbus_client_close(bbus_client* cli)
+bbus_pollset* bbus_pollset_make(void)
 {
-	return __bbus_sock_close(cli->sock);
+	bbus_pollset* pset;
+
+	pset = bbus_malloc0(sizeof(struct __bbus_pollset));
+	if (pset == NULL)
+		return NULL;
+
+#ifdef POLL_URING
+	if (getenv(BBUS_ENV_NOURING) == NULL) {
+		if (wake_init(pset) < 0) {
+			bbus_free(pset);
+			return NULL;
+		}
+
+		if (ring_init(pset) == 0)
+			return pset;
+
+		/* Not supported by the kernel - fall back to epoll. */
+		if (pset->ring != NULL)
+			ring_free(pset);
+		pset->ring = NULL;
+		pset->sendring = NULL;
+		wake_close(pset);
+	}
+#endif /* POLL_URING */
+
+	pset->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pset->epfd < 0) {
+		__bbus_seterr(errno);
+		bbus_free(pset);
+		return NULL;
+	}
+
+	if ((wake_init(pset) < 0) || (epoll_add_wake(pset) < 0)) {
+		close(pset->epfd);
+		bbus_free(pset);
+		return NULL;
+	}
+
+	return pset;
 }
 
-void bbus_client_free(bbus_client* cli)
+void bbus_pollset_clear(bbus_pollset* pset)
 {
-	bbus_str_free(cli->name);
-	bbus_free(cli);
+#ifdef POLL_URING
+	if (pset->ring) {
+		ring_clear(pset);
+		goto out;
+	}
+#endif /* POLL_URING */
+
+	/*
+	 * Closing the epoll descriptor drops all registrations at once,
+	 * there's no need to remove them one by one.
+	 */
+	close(pset->epfd);
+	pset->epfd = epoll_create1(EPOLL_CLOEXEC);
+	(void)epoll_add_wake(pset);
+#ifdef POLL_URING
+out:
+#endif /* POLL_URING */
+	clear_dirty(pset);
+	pset->numsrvs = 0;
+	pset->srvready = 0;
+	pset->woken = 0;
+	pset->numevents = 0;
+	pset->curevent = 0;
 }
 
-bbus_server* bbus_srv_create(void)
+static int epoll_ctl_sock(bbus_pollset* pset, int op, int sock,
+				void* ptr, uint32_t extra)
 {
-	bbus_server* srv;
-	int sock;
+	struct epoll_event ev;
 	int ret;
 
-	sock = __bbus_sock_un_mksocket();
-	if (sock < 0)
-		goto err;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | extra;
+	ev.data.ptr = ptr;
+	ret = epoll_ctl(pset->epfd, op, sock, &ev);
+	if (ret < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
 
-	ret = __bbus_sock_un_bind(sock, bbus_prot_getsockpath());
-	if (ret < 0)
-		goto err;
+	return 0;
+}
 
-	srv = bbus_malloc(sizeof(struct __bbus_server));
-	if (srv == NULL)
-		goto err;
+int bbus_pollset_addsrv(bbus_pollset* pset, bbus_server* srv)
+{
+	int ret;
 
-	srv->sock = sock;
-	return srv;
+	if (pollset_srvfull(pset))
+		return -1;
 
-err:
-	__bbus_sock_close(sock);
-	return NULL;
+#ifdef POLL_URING
+	if (pset->ring)
+		ret = ring_polladd(pset, srv->sock,
+					URING_SRV(pset->numsrvs), POLLIN);
+	else
+#endif /* POLL_URING */
+	ret = epoll_ctl_sock(pset, EPOLL_CTL_ADD, srv->sock, srv, 0);
+	if (ret < 0)
+		return -1;
+	pset->srvs[pset->numsrvs++] = srv;
+
+	return 0;
 }
 
-int bbus_srv_listen(bbus_server* srv)
+int bbus_pollset_addcli(bbus_pollset* pset, bbus_client* cli)
 {
-	return __bbus_sock_listen(srv->sock, DEF_LISTEN_QUEUE);
+	int ret;
+
+#ifdef POLL_URING
+	if (pset->ring)
+		return ring_addcli(pset, cli);
+#endif /* POLL_URING */
+
+	cli->wrwatch = __bbus_iobuf_used(&cli->wrbuf) > 0;
+	ret = epoll_ctl_sock(pset, EPOLL_CTL_ADD, cli->sock, cli,
+					cli->wrwatch ? EPOLLOUT : 0);
+	if (ret < 0)
+		return -1;
+	cli->pset = pset;
+
+	return 0;
 }
 
-int bbus_srv_clientpending(bbus_server* srv)
+static void pollset_setwrite(bbus_pollset* pset, bbus_client* cli, int on)
 {
-	struct bbus_timeval tv;
+	/* Every flush lands here - skip the syscall if nothing changes. */
+	if (cli->wrwatch == on)
+		return;
 
-	memset(&tv, 0, sizeof(struct bbus_timeval));
-	tv.sec = 0;
-	tv.usec = 0;
+#ifdef POLL_URING
+	if (pset->ring) {
+		ring_setwrite(pset, cli, on);
+		return;
+	}
+#endif /* POLL_URING */
 
-	return __bbus_sock_rdready(srv->sock, &tv);
+	(void)epoll_ctl_sock(pset, EPOLL_CTL_MOD, cli->sock,
+					cli, on ? EPOLLOUT : 0);
+	cli->wrwatch = on;
 }
 
-bbus_client* bbus_srv_accept(bbus_server* srv,
-				const struct bbus_accept_callbacks* funcs)
+void bbus_pollset_rmcli(bbus_pollset* pset, bbus_client* cli)
 {
-	char addrbuf[128]; /* FIXME Should be a constant, not a magic value. */
-	char clinamebuf[BBUS_CLIENT_MAXNAMESIZE];
-	size_t addrsize;
-	int sock;
+	int i;
+
+#ifdef POLL_URING
+	if (pset->ring)
+		ring_rmcli(pset, cli);
+	else
+#endif /* POLL_URING */
+	(void)epoll_ctl(pset->epfd, EPOLL_CTL_DEL, cli->sock, NULL);
+	unmark_dirty(pset, cli);
+	cli->pset = NULL;
+	/* Make sure we won't return this client if it's already been polled. */
+	for (i = pset->curevent; i < pset->numevents; ++i) {
+		if (pset->events[i].data.ptr == cli)
+			pset->events[i].data.ptr = NULL;
+	}
+}
+
+int bbus_poll(bbus_pollset* pset, struct bbus_timeval* tv)
+{
+	int timeout;
 	int ret;
-	bbus_client* cli;
-	unsigned char buf[sizeof(struct bbus_msg)];
-	struct bbus_msg* msg = (struct bbus_msg*)buf;
-	struct bbus_msg_hdr* hdr = &msg->hdr;
-	int clitype;
-	struct bbus_client_cred cred;
+	int ind;
+	int i;
 
-	sock = __bbus_sock_un_accept(srv->sock, addrbuf,
-					sizeof(addrbuf), &addrsize);
-	if (sock < 0)
-		return NULL;
+	pset->srvready = 0;
+	pset->woken = 0;
+	pset->numevents = 0;
+	pset->curevent = 0;
 
-	ret = __bbus_cred_get(sock, &cred);
-	if (ret < 0)
-		goto errout;
+#ifdef POLL_URING
+	if (pset->ring)
+		return ring_poll(pset, tv);
+#endif /* POLL_URING */
 
-	if (funcs && funcs->auth) {
-		ret = funcs->auth(&cred);
-		if (ret == BBUS_SRV_AUTHERR) {
-			__bbus_seterr(BBUS_ECLIUNAUTH);
-			goto errout;
+	timeout = tv == NULL ? -1 : (int)(tv->sec * 1000 + tv->usec / 1000);
+	ret = epoll_wait(pset->epfd, pset->events, POLL_MAXEVENTS, timeout);
+	if (ret < 0) {
+		__bbus_seterr(errno == EINTR ? BBUS_EPOLLINTR : errno);
+		return -1;
+	}
+
+	pset->numevents = ret;
+	for (i = 0; i < ret; ++i) {
+		ind = pollset_srvind(pset, pset->events[i].data.ptr);
+		if (ind >= 0) {
+			pset->srvready |= 1U << ind;
+			pset->events[i].data.ptr = NULL;
+		} else
+		if (pset->events[i].data.ptr == pset->wakefd) {
+			wake_drain(pset);
+			pset->events[i].data.ptr = NULL;
 		}
 	}
 
-	memset(hdr, 0, sizeof(struct bbus_msg_hdr));
-	memset(clinamebuf, 0, BBUS_CLIENT_MAXNAMESIZE);
-	ret = __bbus_prot_recvvmsg(sock, hdr, clinamebuf,
-					BBUS_CLIENT_MAXNAMESIZE);
-	if (ret < 0)
-		goto errout;
-	if (hdr->msgtype != BBUS_MSGTYPE_SO)
-		goto errout;
+	return ret;
+}
 
-	if (funcs && funcs->rcvd)
-		funcs->rcvd(msg);
+int bbus_pollset_cliisset(bbus_pollset* pset, bbus_client* cli)
+{
+	int i;
 
-	/* TODO Small function to do the convertion. */
-	switch (hdr->sotype) {
-	case BBUS_SOTYPE_MTHCL: clitype = BBUS_CLIENT_CALLER; break;
-	case BBUS_SOTYPE_SRVPRV: clitype = BBUS_CLIENT_SERVICE; break;
-	case BBUS_SOTYPE_MON: clitype = BBUS_CLIENT_MON; break;
-	case BBUS_SOTYPE_CTL: clitype = BBUS_CLIENT_CTL; break;
-	default: goto errout; break;
+	for (i = 0; i < pset->numevents; ++i) {
+		if (pset->events[i].data.ptr == cli)
+			return 1;
 	}
 
-	hdr->msgtype = BBUS_MSGTYPE_SOOK;
-	hdr->psize = 0;
-	hdr->flags = 0;
-	ret = __bbus_prot_sendvmsg(sock, hdr, NULL, NULL, 0);
-	if (ret < 0)
-		goto errout;
+	return 0;
+}
 
-	if (funcs && funcs->sent)
-		funcs->sent(hdr, NULL, NULL);
+const char* bbus_pollset_backend(bbus_pollset* pset)
+{
+#ifdef POLL_URING
+	if (pset->ring)
+		return "io_uring";
+#endif /* POLL_URING */
+	(void)pset;
+	return "epoll";
+}
 
-	cli = bbus_malloc(sizeof(struct __bbus_client));
-	if (cli == NULL)
-		goto errout;
-	cli->sock = sock;
-	cli->token = 0;
-	cli->type = clitype;
-	__bbus_cred_copy(&cli->cred, &cred);
-	cli->name = bbus_str_build("%s", strlen(clinamebuf) == 0
-					? "<unknown>" : clinamebuf);
-	if (cli->name == NULL)
-		goto errout;
+bbus_client* bbus_pollset_nextcli(bbus_pollset* pset)
+{
+	bbus_client* cli;
 
-	return cli;
+	while (pset->curevent < pset->numevents) {
+		cli = pset->events[pset->curevent++].data.ptr;
+		if (cli != NULL)
+			return cli;
+	}
 
-errout:
-	__bbus_sock_close(sock);
 	return NULL;
 }
 
-int bbus_srv_close(bbus_server* srv)
+void bbus_pollset_free(bbus_pollset* pset)
 {
-	return __bbus_sock_close(srv->sock);
+	if (pset) {
+#ifdef POLL_URING
+		if (pset->ring)
+			ring_free(pset);
+		else
+#endif /* POLL_URING */
+		close(pset->epfd);
+		wake_close(pset);
+		bbus_free(pset->dirty.clients);
+		bbus_free(pset);
+	}
 }
 
-void bbus_srv_free(bbus_server* srv)
+#else /* POLL_EPOLL */
+
+#define POLL_CLIBASE 32
+
+static int select_add(bbus_pollset* pset, int sock)
 {
-	bbus_free(srv);
+	if (sock >= FD_SETSIZE) {
+		__bbus_seterr(EINVAL);
+		return -1;
+	}
+
+	FD_SET(sock, &pset->fdset);
+	if (pset->highsock < (sock+1))
+		pset->highsock = sock+1;
+
+	return 0;
 }
 
 bbus_pollset* bbus_pollset_make(void)
@@ -229,6 +1965,11 @@ bbus_pollset* bbus_pollset_make(void)
 	pset = bbus_malloc0(sizeof(struct __bbus_pollset));
 	if (pset == NULL)
 		return NULL;
+
+	if (wake_init(pset) < 0) {
+		bbus_free(pset);
+		return NULL;
+	}
 	bbus_pollset_clear(pset);
 
 	return pset;
@@ -237,60 +1978,164 @@ bbus_pollset* bbus_pollset_make(void)
 void bbus_pollset_clear(bbus_pollset* pset)
 {
 	FD_ZERO(&pset->fdset);
+	FD_ZERO(&pset->rdset);
+	FD_ZERO(&pset->wrfdset);
+	FD_ZERO(&pset->wrset);
+	clear_dirty(pset);
 	pset->highsock = 0;
+	pset->numsrvs = 0;
+	pset->srvready = 0;
+	pset->woken = 0;
+	pset->numclients = 0;
+	pset->curclient = 0;
+	(void)select_add(pset, pset->wakefd[0]);
 }
 
-static inline void update_highsock(bbus_pollset* pset, int sock)
+int bbus_pollset_addsrv(bbus_pollset* pset, bbus_server* srv)
 {
-	if (pset->highsock < (sock+1))
-		pset->highsock = sock+1;
+	int ret;
+
+	if (pollset_srvfull(pset))
+		return -1;
+
+	ret = select_add(pset, srv->sock);
+	if (ret < 0)
+		return -1;
+	pset->srvs[pset->numsrvs++] = srv;
+
+	return 0;
+}
+
+int bbus_pollset_addcli(bbus_pollset* pset, bbus_client* cli)
+{
+	bbus_client** newcli;
+	size_t newmax;
+	int ret;
+
+	if (pset->numclients == pset->maxclients) {
+		newmax = pset->maxclients ? 2*pset->maxclients : POLL_CLIBASE;
+		newcli = bbus_realloc(pset->clients,
+					newmax * sizeof(bbus_client*));
+		if (newcli == NULL)
+			return -1;
+		pset->clients = newcli;
+		pset->maxclients = newmax;
+	}
+
+	ret = select_add(pset, cli->sock);
+	if (ret < 0)
+		return -1;
+	pset->clients[pset->numclients++] = cli;
+	cli->pset = pset;
+	if (__bbus_iobuf_used(&cli->wrbuf) > 0)
+		pollset_setwrite(pset, cli, 1);
+
+	return 0;
 }
 
-void bbus_pollset_addsrv(bbus_pollset* pset, bbus_server* src)
+static void pollset_setwrite(bbus_pollset* pset, bbus_client* cli, int on)
 {
-	FD_SET(src->sock, &pset->fdset);
-	update_highsock(pset, src->sock);
+	if (on)
+		FD_SET(cli->sock, &pset->wrfdset);
+	else
+		FD_CLR(cli->sock, &pset->wrfdset);
 }
 
-void bbus_pollset_addcli(bbus_pollset* pset, bbus_client* cli)
+void bbus_pollset_rmcli(bbus_pollset* pset, bbus_client* cli)
 {
-	FD_SET(cli->sock, &pset->fdset);
-	update_highsock(pset, cli->sock);
+	size_t i;
+
+	FD_CLR(cli->sock, &pset->fdset);
+	FD_CLR(cli->sock, &pset->rdset);
+	FD_CLR(cli->sock, &pset->wrfdset);
+	FD_CLR(cli->sock, &pset->wrset);
+	unmark_dirty(pset, cli);
+	cli->pset = NULL;
+	for (i = 0; i < pset->numclients; ++i) {
+		if (pset->clients[i] == cli) {
+			memmove(&pset->clients[i], &pset->clients[i+1],
+				(pset->numclients-i-1) * sizeof(bbus_client*));
+			--pset->numclients;
+			if (pset->curclient > i)
+				--pset->curclient;
+			break;
+		}
+	}
 }
 
 int bbus_poll(bbus_pollset* pset, struct bbus_timeval* tv)
 {
 	struct timeval stv;
+	unsigned i;
 	int ret;
 
+	pset->srvready = 0;
+	pset->woken = 0;
+	pset->curclient = 0;
+	memcpy(&pset->rdset, &pset->fdset, sizeof(fd_set));
+	memcpy(&pset->wrset, &pset->wrfdset, sizeof(fd_set));
 	memset(&stv, 0, sizeof(struct timeval));
-	stv.tv_sec = tv->sec;
-	stv.tv_usec = tv->usec;
+	if (tv != NULL) {
+		stv.tv_sec = tv->sec;
+		stv.tv_usec = tv->usec;
+	}
 
-	ret = select(pset->highsock, &pset->fdset, NULL, NULL, &stv);
-	tv->sec = stv.tv_sec;
-	tv->usec = stv.tv_usec;
+	ret = select(pset->highsock, &pset->rdset, &pset->wrset, NULL,
+						tv == NULL ? NULL : &stv);
+	if (tv != NULL) {
+		tv->sec = stv.tv_sec;
+		tv->usec = stv.tv_usec;
+	}
 
 	if (ret < 0) {
+		FD_ZERO(&pset->rdset);
+		FD_ZERO(&pset->wrset);
 		__bbus_seterr(errno == EINTR ? BBUS_EPOLLINTR : errno);
 		return -1;
 	}
 
+	for (i = 0; i < pset->numsrvs; ++i) {
+		if (FD_ISSET(pset->srvs[i]->sock, &pset->rdset))
+			pset->srvready |= 1U << i;
+	}
+	if (FD_ISSET(pset->wakefd[0], &pset->rdset))
+		wake_drain(pset);
+
 	return ret;
 }
 
-int bbus_pollset_srvisset(bbus_pollset* pset, bbus_server* srv)
+int bbus_pollset_cliisset(bbus_pollset* pset, bbus_client* cli)
 {
-	return FD_ISSET(srv->sock, &pset->fdset);
+	return FD_ISSET(cli->sock, &pset->rdset)
+			|| FD_ISSET(cli->sock, &pset->wrset);
 }
 
-int bbus_pollset_cliisset(bbus_pollset* pset, bbus_client* cli)
+const char* bbus_pollset_backend(bbus_pollset* pset BBUS_UNUSED)
+{
+	return "select";
+}
+
+bbus_client* bbus_pollset_nextcli(bbus_pollset* pset)
 {
-	return FD_ISSET(cli->sock, &pset->fdset);
+	bbus_client* cli;
+
+	while (pset->curclient < pset->numclients) {
+		cli = pset->clients[pset->curclient++];
+		if (bbus_pollset_cliisset(pset, cli))
+			return cli;
+	}
+
+	return NULL;
 }
 
 void bbus_pollset_free(bbus_pollset* pset)
 {
-	bbus_free(pset);
+	if (pset) {
+		wake_close(pset);
+		bbus_free(pset->clients);
+		bbus_free(pset->dirty.clients);
+		bbus_free(pset);
+	}
 }
 
+#endif /* POLL_EPOLL */
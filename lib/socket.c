@@ -18,19 +18,226 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <linux/vm_sockets.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 
 #define SAUN_PATHLEN (sizeof(((struct sockaddr_un*)0)->sun_path))
 #define SAUN_FAMLEN (sizeof(((struct sockaddr_un*)0)->sun_family))
 
-int __bbus_sock_un_mksocket(void)
+struct transport
+{
+	const char* prefix;
+	int (*parse)(const char* str, struct __bbus_sockaddr* addr);
+	/* Called before binding the socket, may be NULL. */
+	int (*prebind)(int sock, const struct __bbus_sockaddr* addr);
+	/* Called for every connected socket, may be NULL. */
+	int (*setup)(int sock);
+};
+
+static int invalid_addr(void)
+{
+	__bbus_seterr(BBUS_EINVALADDR);
+	return -1;
+}
+
+static int unix_parse(const char* str, struct __bbus_sockaddr* addr)
+{
+	struct sockaddr_un* un = (struct sockaddr_un*)&addr->addr;
+	size_t len;
+
+	len = strlen(str);
+	if ((len == 0) || (len > SAUN_PATHLEN))
+		return invalid_addr();
+
+	un->sun_family = AF_UNIX;
+	memcpy(un->sun_path, str, len);
+	addr->len = SAUN_FAMLEN + len;
+
+	return 0;
+}
+
+static int unix_prebind(int sock BBUS_UNUSED,
+				const struct __bbus_sockaddr* addr)
+{
+	const struct sockaddr_un* un = (const struct sockaddr_un*)&addr->addr;
+	int r;
+
+	r = unlink(un->sun_path);
+	if ((r < 0) && (errno != ENOENT)) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tcp_parse(const char* str, struct __bbus_sockaddr* addr)
+{
+	char host[BBUS_PROT_SOCKPATHMAX];
+	struct addrinfo hints;
+	struct addrinfo* res;
+	const char* port;
+	size_t hostlen;
+	int r;
+
+	port = rindex(str, ':');
+	if ((port == NULL) || (port[1] == '\0'))
+		return invalid_addr();
+
+	hostlen = port - str;
+	++port;
+	/* IPv6 addresses are given in brackets. */
+	if ((hostlen >= 2) && (str[0] == '[') && (str[hostlen - 1] == ']')) {
+		++str;
+		hostlen -= 2;
+	}
+	if (hostlen >= sizeof(host))
+		return invalid_addr();
+	memcpy(host, str, hostlen);
+	host[hostlen] = '\0';
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	/* No host means all local addresses. */
+	hints.ai_flags = AI_NUMERICSERV | (hostlen == 0 ? AI_PASSIVE : 0);
+	r = getaddrinfo(hostlen == 0 ? NULL : host, port, &hints, &res);
+	if (r != 0)
+		return invalid_addr();
+
+	memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+	addr->len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+static int tcp_prebind(int sock, const struct __bbus_sockaddr* addr BBUS_UNUSED)
+{
+	int on = 1;
+	int r;
+
+	/* Let a restarted daemon listen again right away. */
+	r = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (r < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tcp_setup(int sock)
+{
+	int on = 1;
+	int r;
+
+	/*
+	 * Every message, or every batch of messages of a corked client,
+	 * goes out in a single write - Nagle would only add latency.
+	 */
+	r = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (r < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_uint(const char* str, const char* endchars,
+					unsigned* val, const char** end)
+{
+	unsigned long num;
+	char* numend;
+
+	errno = 0;
+	num = strtoul(str, &numend, 10);
+	if ((numend == str) || (errno != 0) || (num > UINT_MAX)
+				|| (index(endchars, *numend) == NULL))
+		return -1;
+
+	*val = num;
+	if (end != NULL)
+		*end = numend;
+
+	return 0;
+}
+
+static int vsock_parse(const char* str, struct __bbus_sockaddr* addr)
+{
+	struct sockaddr_vm* vm = (struct sockaddr_vm*)&addr->addr;
+	const char* port;
+	unsigned cid;
+
+	if (strncmp(str, "any:", 4) == 0) {
+		cid = VMADDR_CID_ANY;
+		port = str + 3;
+	} else
+	if (parse_uint(str, ":", &cid, &port) < 0) {
+		return invalid_addr();
+	}
+
+	vm->svm_family = AF_VSOCK;
+	vm->svm_cid = cid;
+	/* The terminating null is in the set of allowed end characters. */
+	if (parse_uint(port + 1, "", &vm->svm_port, NULL) < 0)
+		return invalid_addr();
+	addr->len = sizeof(struct sockaddr_vm);
+
+	return 0;
+}
+
+static const struct transport transports[] = {
+	[__BBUS_TRANSPORT_UNIX] = {
+		.prefix = "unix:",
+		.parse = unix_parse,
+		.prebind = unix_prebind,
+	},
+	[__BBUS_TRANSPORT_TCP] = {
+		.prefix = "tcp:",
+		.parse = tcp_parse,
+		.prebind = tcp_prebind,
+		.setup = tcp_setup,
+	},
+	[__BBUS_TRANSPORT_VSOCK] = {
+		.prefix = "vsock:",
+		.parse = vsock_parse,
+	},
+};
+
+int __bbus_sock_parseaddr(const char* str, struct __bbus_sockaddr* addr)
+{
+	size_t len;
+	int i;
+
+	memset(addr, 0, sizeof(struct __bbus_sockaddr));
+	for (i = 0; i < (int)BBUS_ARRAY_SIZE(transports); ++i) {
+		len = strlen(transports[i].prefix);
+		if (strncmp(str, transports[i].prefix, len) == 0) {
+			addr->transport = i;
+			return transports[i].parse(str + len, addr);
+		}
+	}
+
+	/* Plain paths are unix sockets. */
+	addr->transport = __BBUS_TRANSPORT_UNIX;
+	return unix_parse(str, addr);
+}
+
+int __bbus_sock_mksocket(const struct __bbus_sockaddr* addr)
 {
 	int s;
 
-	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	s = socket(addr->addr.ss_family, SOCK_STREAM, 0);
 	if (s < 0) {
 		__bbus_seterr(errno);
 		return -1;
@@ -39,63 +246,79 @@ int __bbus_sock_un_mksocket(void)
 	return s;
 }
 
-int __bbus_sock_un_bind(int sock, const char* path)
+int __bbus_sock_bind(int sock, const struct __bbus_sockaddr* addr)
 {
+	const struct transport* trans = &transports[addr->transport];
 	int r;
-	socklen_t addrlen;
-	struct sockaddr_un addr;
 
-	r = unlink(path);
-	if ((r < 0) && (errno != ENOENT)) {
+	if (trans->prebind && (trans->prebind(sock, addr) < 0))
+		return -1;
+
+	r = bind(sock, (const struct sockaddr*)&addr->addr, addr->len);
+	if (r < 0) {
 		__bbus_seterr(errno);
 		return -1;
 	}
 
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, path, SAUN_PATHLEN);
-	addrlen = SAUN_FAMLEN + strnlen(addr.sun_path, SAUN_PATHLEN);
-	r = bind(sock, (struct sockaddr*)&addr, addrlen);
+	return 0;
+}
+
+int __bbus_sock_connect(int sock, const struct __bbus_sockaddr* addr)
+{
+	const struct transport* trans = &transports[addr->transport];
+	int r;
+
+	r = connect(sock, (const struct sockaddr*)&addr->addr, addr->len);
 	if (r < 0) {
 		__bbus_seterr(errno);
 		return -1;
 	}
 
-	return 0;
+	return trans->setup ? trans->setup(sock) : 0;
 }
 
-int __bbus_sock_un_accept(int sock, char* pathbuf,
-		size_t bufsize, size_t* pathsize)
+int __bbus_sock_accept(int sock, const struct __bbus_sockaddr* addr,
+								int flags)
 {
+	const struct transport* trans = &transports[addr->transport];
 	int s;
-	struct sockaddr_un addr;
-	socklen_t addrlen;
 
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-	memset(&addrlen, 0, sizeof(socklen_t));
-	s = accept(sock, (struct sockaddr*)&addr, &addrlen);
+	s = accept4(sock, NULL, NULL, flags);
 	if (s < 0) {
 		__bbus_seterr(errno);
 		return -1;
 	}
 
-	strncpy(pathbuf, addr.sun_path, bufsize);
-	*pathsize = (size_t)addrlen;
+	if (trans->setup && (trans->setup(s) < 0)) {
+		close(s);
+		return -1;
+	}
 
 	return s;
 }
 
-int __bbus_sock_un_connect(int sock, const char* path)
+int __bbus_sock_islocal(int sock)
 {
+	socklen_t len = sizeof(int);
+	int domain;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+		return 0;
+
+	return domain == AF_UNIX;
+}
+
+int __bbus_sock_settimeout(int sock, unsigned ms)
+{
+	struct timeval tv;
 	int r;
-	struct sockaddr_un addr;
-	socklen_t addrlen;
-
-	memset(&addr, 0, sizeof(struct sockaddr_un));
-	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, path, SAUN_PATHLEN);
-	addrlen = SAUN_FAMLEN + strnlen(addr.sun_path, SAUN_PATHLEN);
-	r = connect(sock, (struct sockaddr*)&addr, addrlen);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	/* The send timeout applies to connect() too. */
+	r = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (r == 0)
+		r = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 	if (r < 0) {
 		__bbus_seterr(errno);
 		return -1;
@@ -138,6 +361,26 @@ int __bbus_sock_close(int sock)
 	return 0;
 }
 
+int __bbus_sock_setnonblock(int sock)
+{
+	int flags;
+	int r;
+
+	flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	r = fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+	if (r < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 0;
+}
+
 static inline void prepare_msghdr(struct msghdr* hdr,
 				const struct iovec* iov, int numiov)
 {
@@ -180,12 +423,91 @@ ssize_t __bbus_sock_recv(int sock, struct iovec* iov, int numiov)
 	return b;
 }
 
+ssize_t __bbus_sock_sendfd(int sock, const struct iovec* iov,
+						int numiov, int fd)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctrl;
+	struct cmsghdr* cmsg;
+	struct msghdr hdr;
+	ssize_t b;
+
+	prepare_msghdr(&hdr, iov, numiov);
+	memset(&ctrl, 0, sizeof(ctrl));
+	hdr.msg_control = ctrl.buf;
+	hdr.msg_controllen = sizeof(ctrl.buf);
+	cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	b = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+	if (b < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return b;
+}
+
+ssize_t __bbus_sock_recvfds(int sock, struct iovec* iov, int numiov,
+						int* fds, int* numfds)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(__BBUS_SOCK_MAXFDS * sizeof(int))];
+	} ctrl;
+	struct cmsghdr* cmsg;
+	struct msghdr hdr;
+	ssize_t b;
+	int maxfds;
+	int num;
+	int i;
+	int fd;
+
+	maxfds = *numfds;
+	*numfds = 0;
+	prepare_msghdr(&hdr, iov, numiov);
+	hdr.msg_control = ctrl.buf;
+	hdr.msg_controllen = sizeof(ctrl.buf);
+	b = recvmsg(sock, &hdr, MSG_NOSIGNAL | MSG_CMSG_CLOEXEC);
+	if (b < 0) {
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+				cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET)
+				|| (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < num; ++i) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+							sizeof(int));
+			/* Never leak descriptors we have no room for. */
+			if (*numfds < maxfds)
+				fds[(*numfds)++] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	return b;
+}
+
 #define SELECT_INIT(FDSET, SOCK, TV, BBTV)				\
 	do {								\
 		FD_ZERO(&(FDSET));					\
 		FD_SET((SOCK), &(FDSET));				\
-		(TV).tv_sec = (BBTV)->sec;				\
-		(TV).tv_usec = (BBTV)->usec;				\
+		if ((BBTV) != NULL) {					\
+			(TV).tv_sec = (BBTV)->sec;			\
+			(TV).tv_usec = (BBTV)->usec;			\
+		}							\
 	} while (0)
 
 #define SELECT_CHECKERR(RETVAL)						\
@@ -199,10 +521,15 @@ ssize_t __bbus_sock_recv(int sock, struct iovec* iov, int numiov)
 
 #define SELECT_COPYTV(TV, BBTV)						\
 	do {								\
-		(BBTV)->sec = (TV).tv_sec;				\
-		(BBTV)->usec = (TV).tv_usec;				\
+		if ((BBTV) != NULL) {					\
+			(BBTV)->sec = (TV).tv_sec;			\
+			(BBTV)->usec = (TV).tv_usec;			\
+		}							\
 	} while (0)
 
+/* A NULL timeout means waiting indefinitely. */
+#define SELECT_TIMEOUT(TV, BBTV) ((BBTV) != NULL ? &(TV) : NULL)
+
 int __bbus_sock_wrready(int sock, struct bbus_timeval* tv)
 {
 	fd_set wr_set;
@@ -210,7 +537,8 @@ int __bbus_sock_wrready(int sock, struct bbus_timeval* tv)
 	int r;
 
 	SELECT_INIT(wr_set, sock, timeout, tv);
-	r = select(sock+1, NULL, &wr_set, NULL, &timeout);
+	r = select(sock+1, NULL, &wr_set, NULL,
+			SELECT_TIMEOUT(timeout, tv));
 	SELECT_CHECKERR(r);
 	SELECT_COPYTV(timeout, tv);
 	return r;
@@ -223,9 +551,30 @@ int __bbus_sock_rdready(int sock, struct bbus_timeval* tv)
 	int r;
 
 	SELECT_INIT(rd_set, sock, timeout, tv);
-	r = select(sock+1, &rd_set, NULL, NULL, &timeout);
+	r = select(sock+1, &rd_set, NULL, NULL,
+			SELECT_TIMEOUT(timeout, tv));
 	SELECT_CHECKERR(r);
 	SELECT_COPYTV(timeout, tv);
 	return r;
 }
 
+
+int __bbus_sock_haspending(int sock)
+{
+	char c;
+	ssize_t r;
+
+	/*
+	 * A zero return value means the peer has hung up - report it as
+	 * pending too, so that the caller tries to read and notices it.
+	 */
+	r = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (r < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		__bbus_seterr(errno);
+		return -1;
+	}
+
+	return 1;
+}
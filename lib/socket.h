@@ -18,21 +18,63 @@
 #include <busybus.h>
 #include <stdlib.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+
+/* Maximum number of descriptors accepted with a single receive. */
+#define __BBUS_SOCK_MAXFDS 4
+
+/*
+ * Transports the bus can run on, chosen by the prefix of the address:
+ * 'unix:PATH' (or just a path), 'tcp:HOST:PORT' and 'vsock:CID:PORT'.
+ */
+#define __BBUS_TRANSPORT_UNIX	0
+#define __BBUS_TRANSPORT_TCP	1
+#define __BBUS_TRANSPORT_VSOCK	2
+
+struct __bbus_sockaddr
+{
+	int transport;
+	socklen_t len;
+	struct sockaddr_storage addr;
+};
+
+/* Sets BBUS_EINVALADDR if the address can't be parsed or resolved. */
+int __bbus_sock_parseaddr(const char* str, struct __bbus_sockaddr* addr);
+int __bbus_sock_mksocket(const struct __bbus_sockaddr* addr);
+/* Stale unix sockets are removed, TCP addresses can be reused at once. */
+int __bbus_sock_bind(int sock, const struct __bbus_sockaddr* addr);
+int __bbus_sock_connect(int sock, const struct __bbus_sockaddr* addr);
+/* Flags are those of accept4(), the accepted socket is set up already. */
+int __bbus_sock_accept(int sock, const struct __bbus_sockaddr* addr,
+								int flags);
+/*
+ * Only sockets of local transports pass descriptors and credentials
+ * and may use host byte order objects.
+ */
+int __bbus_sock_islocal(int sock);
+/* Limits blocking connects, sends and receives, 0 means no limit. */
+int __bbus_sock_settimeout(int sock, unsigned ms);
 
 /* Unix domain specific functions. */
-int __bbus_sock_un_mksocket(void);
-int __bbus_sock_un_bind(int sock, const char* path);
-int __bbus_sock_un_accept(int sock, char* pathbuf,
-		size_t bufsize, size_t* pathsize);
-int __bbus_sock_un_connect(int sock, const char* path);
 int __bbus_sock_un_rm(const char* path);
 
 /* Common socket functions. */
 int __bbus_sock_listen(int sock, int backlog);
 int __bbus_sock_close(int sock);
+int __bbus_sock_setnonblock(int sock);
 ssize_t __bbus_sock_send(int sock, const struct iovec* iov, int numiov);
 ssize_t __bbus_sock_recv(int sock, struct iovec* iov, int numiov);
+/* Sends the data with 'fd' attached as SCM_RIGHTS ancillary data. */
+ssize_t __bbus_sock_sendfd(int sock, const struct iovec* iov,
+						int numiov, int fd);
+/*
+ * Receives the data and up to *numfds attached descriptors. On return
+ * *numfds contains the number of descriptors stored in 'fds'.
+ */
+ssize_t __bbus_sock_recvfds(int sock, struct iovec* iov, int numiov,
+						int* fds, int* numfds);
 int __bbus_sock_wrready(int sock, struct bbus_timeval* tv);
 int __bbus_sock_rdready(int sock, struct bbus_timeval* tv);
+int __bbus_sock_haspending(int sock);
 
 #endif /* __BBUS_SOCKET__ */
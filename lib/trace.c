@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include <busybus.h>
+#include "error.h"
+#include "protocol.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct __bbus_trace
+{
+	const char* base;
+	size_t size;
+	size_t pos;
+};
+
+#define TRACE_FIRSTREC sizeof(struct bbus_trace_filehdr)
+
+static size_t align_rec(size_t size)
+{
+	return (size + BBUS_TRACE_ALIGN - 1) & ~(size_t)(BBUS_TRACE_ALIGN - 1);
+}
+
+bbus_trace* bbus_trace_open(const char* path)
+{
+	const struct bbus_trace_filehdr* filehdr;
+	struct __bbus_trace* trace;
+	struct stat st;
+	void* addr;
+	int fd;
+	int r;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		__bbus_seterr(errno);
+		return NULL;
+	}
+
+	r = fstat(fd, &st);
+	if (r < 0) {
+		__bbus_seterr(errno);
+		goto err_close;
+	}
+
+	if ((size_t)st.st_size < TRACE_FIRSTREC) {
+		__bbus_seterr(BBUS_EINVALARG);
+		goto err_close;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		__bbus_seterr(errno);
+		goto err_close;
+	}
+	close(fd);
+
+	filehdr = addr;
+	if ((memcmp(filehdr->magic, BBUS_TRACE_MAGIC,
+				sizeof(filehdr->magic)) != 0)
+			|| (filehdr->byteorder != BBUS_TRACE_BYTEORDER)) {
+		__bbus_seterr(BBUS_EINVALARG);
+		goto err_unmap;
+	}
+
+	trace = bbus_malloc(sizeof(struct __bbus_trace));
+	if (trace == NULL)
+		goto err_unmap;
+
+	(void)madvise(addr, st.st_size, MADV_SEQUENTIAL);
+	trace->base = addr;
+	trace->size = st.st_size;
+	trace->pos = TRACE_FIRSTREC;
+
+	return trace;
+
+err_unmap:
+	munmap(addr, st.st_size);
+	return NULL;
+
+err_close:
+	close(fd);
+	return NULL;
+}
+
+int bbus_trace_next(bbus_trace* trace, struct bbus_trace_event* event)
+{
+	const struct bbus_trace_rechdr* rec;
+	const char* data;
+	const char* end;
+	size_t hdrsize;
+	size_t psize;
+
+	if (trace->size - trace->pos < sizeof(struct bbus_trace_rechdr))
+		return 0;
+
+	rec = (const struct bbus_trace_rechdr*)(trace->base + trace->pos);
+	if (rec->size > trace->size - trace->pos
+				- sizeof(struct bbus_trace_rechdr))
+		return 0;
+
+	data = (const char*)(rec + 1);
+	end = data + rec->size;
+	if ((rec->size < BBUS_MSGHDR_REALSIZE)
+			|| (rec->size < __bbus_prot_wirehdrsize(data)))
+		goto err_inval;
+
+	hdrsize = __bbus_prot_wirehdrsize(data);
+	bbus_hdr_unpack(&event->hdr, data);
+	psize = bbus_hdr_getpsize(&event->hdr);
+	data += hdrsize;
+	if (psize != (size_t)(end - data))
+		goto err_inval;
+
+	event->tstamp = rec->tstamp;
+	event->direction = rec->direction;
+	event->shard = rec->shard;
+	event->meta = NULL;
+	event->obj = NULL;
+	event->objsize = 0;
+
+	if (event->hdr.flags & BBUS_PROT_HASMETA) {
+		if (memchr(data, '\0', psize) == NULL)
+			goto err_inval;
+		event->meta = data;
+		data += strlen(data) + 1;
+	}
+
+	if ((event->hdr.flags & BBUS_PROT_HASOBJECT)
+			&& !(event->hdr.flags & BBUS_PROT_HASFD)) {
+		event->obj = data;
+		event->objsize = end - data;
+	}
+
+	trace->pos += align_rec(sizeof(struct bbus_trace_rechdr) + rec->size);
+	if (trace->pos > trace->size)
+		trace->pos = trace->size;
+
+	return 1;
+
+err_inval:
+	__bbus_seterr(BBUS_EINVALARG);
+	return -1;
+}
+
+void bbus_trace_rewind(bbus_trace* trace)
+{
+	trace->pos = TRACE_FIRSTREC;
+}
+
+void bbus_trace_close(bbus_trace* trace)
+{
+	munmap((void*)trace->base, trace->size);
+	bbus_free(trace);
+}
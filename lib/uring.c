@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "uring.h"
+#include "error.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Kernel features the pollset can't do without. */
+#define URING_FEATURES	(IORING_FEAT_SINGLE_MMAP			\
+			| IORING_FEAT_NODROP				\
+			| IORING_FEAT_EXT_ARG				\
+			| IORING_FEAT_RSRC_TAGS)
+
+struct __bbus_uring
+{
+	int fd;
+	void* rings;
+	size_t ringsize;
+	struct io_uring_sqe* sqes;
+	size_t sqessize;
+	/* Submission queue. */
+	unsigned* sqhead;
+	unsigned* sqtail;
+	unsigned sqmask;
+	unsigned sqentries;
+	/* Completion queue. */
+	unsigned* cqhead;
+	unsigned* cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe* cqes;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params* params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned tosubmit, unsigned minwait,
+			unsigned flags, void* arg, size_t argsize)
+{
+	return syscall(__NR_io_uring_enter, fd, tosubmit, minwait,
+						flags, arg, argsize);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned numargs)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, numargs);
+}
+
+static int ops_supported(int fd)
+{
+	static const int needed[] = {
+		IORING_OP_POLL_ADD,
+		IORING_OP_POLL_REMOVE,
+		IORING_OP_SEND,
+	};
+	struct io_uring_probe* probe;
+	size_t size;
+	unsigned i;
+	int ret;
+
+	size = sizeof(struct io_uring_probe)
+			+ IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	probe = bbus_malloc0(size);
+	if (probe == NULL)
+		return 0;
+
+	ret = sys_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+	if (ret < 0) {
+		bbus_free(probe);
+		return 0;
+	}
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(needed); ++i) {
+		if ((needed[i] > probe->last_op) || !(probe->ops[needed[i]].flags
+						& IO_URING_OP_SUPPORTED)) {
+			bbus_free(probe);
+			return 0;
+		}
+	}
+
+	bbus_free(probe);
+	return 1;
+}
+
+struct __bbus_uring* __bbus_uring_new(unsigned entries)
+{
+	struct __bbus_uring* ring;
+	struct io_uring_params params;
+	char* base;
+	unsigned* array;
+	unsigned i;
+
+	ring = bbus_malloc0(sizeof(struct __bbus_uring));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(struct io_uring_params));
+	ring->fd = sys_setup(entries, &params);
+	if (ring->fd < 0) {
+		__bbus_seterr(errno);
+		goto errout;
+	}
+
+	if (((params.features & URING_FEATURES) != URING_FEATURES)
+					|| !ops_supported(ring->fd)) {
+		__bbus_seterr(ENOSYS);
+		goto errout_close;
+	}
+
+	/* With IORING_FEAT_SINGLE_MMAP both rings share the mapping. */
+	ring->ringsize = params.sq_off.array
+				+ params.sq_entries * sizeof(unsigned);
+	if (ring->ringsize < params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe))
+		ring->ringsize = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings = mmap(NULL, ring->ringsize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		__bbus_seterr(errno);
+		goto errout_close;
+	}
+
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd,
+				IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		__bbus_seterr(errno);
+		goto errout_unmap;
+	}
+
+	base = ring->rings;
+	ring->sqhead = (unsigned*)(base + params.sq_off.head);
+	ring->sqtail = (unsigned*)(base + params.sq_off.tail);
+	ring->sqmask = *(unsigned*)(base + params.sq_off.ring_mask);
+	ring->sqentries = params.sq_entries;
+	ring->cqhead = (unsigned*)(base + params.cq_off.head);
+	ring->cqtail = (unsigned*)(base + params.cq_off.tail);
+	ring->cqmask = *(unsigned*)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+	/* Entries are always submitted in order - map them one to one. */
+	array = (unsigned*)(base + params.sq_off.array);
+	for (i = 0; i < params.sq_entries; ++i)
+		array[i] = i;
+
+	return ring;
+
+errout_unmap:
+	munmap(ring->rings, ring->ringsize);
+errout_close:
+	close(ring->fd);
+errout:
+	bbus_free(ring);
+	return NULL;
+}
+
+void __bbus_uring_free(struct __bbus_uring* ring)
+{
+	if (ring) {
+		munmap(ring->sqes, ring->sqessize);
+		munmap(ring->rings, ring->ringsize);
+		close(ring->fd);
+		bbus_free(ring);
+	}
+}
+
+static unsigned sq_pending(struct __bbus_uring* ring)
+{
+	return *ring->sqtail - __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe* __bbus_uring_getsqe(struct __bbus_uring* ring)
+{
+	struct io_uring_sqe* sqe;
+	unsigned tail;
+	int ret;
+
+	while (sq_pending(ring) >= ring->sqentries) {
+		ret = sys_enter(ring->fd, sq_pending(ring), 0, 0, NULL, 0);
+		if ((ret < 0) && (errno != EINTR)) {
+			__bbus_seterr(errno);
+			return NULL;
+		}
+	}
+
+	tail = *ring->sqtail;
+	sqe = &ring->sqes[tail & ring->sqmask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+int __bbus_uring_enter(struct __bbus_uring* ring, unsigned minwait,
+				struct bbus_timeval* tv)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int ret;
+
+	memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+	if (minwait > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+	if (tv != NULL) {
+		ts.tv_sec = tv->sec;
+		ts.tv_nsec = tv->usec * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+
+	ret = sys_enter(ring->fd, sq_pending(ring), minwait, flags,
+				&arg, sizeof(struct io_uring_getevents_arg));
+	if (ret < 0) {
+		if (errno == ETIME)
+			return 0;
+		__bbus_seterr(errno == EINTR ? BBUS_EPOLLINTR : errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+int __bbus_uring_getcqe(struct __bbus_uring* ring, struct io_uring_cqe* cqe)
+{
+	unsigned head;
+
+	head = *ring->cqhead;
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	memcpy(cqe, &ring->cqes[head & ring->cqmask],
+					sizeof(struct io_uring_cqe));
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
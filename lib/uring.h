@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_URING__
+#define __BBUS_URING__
+
+#include <busybus.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper used by the pollset. Only a single thread may
+ * use a ring at a time.
+ */
+struct __bbus_uring;
+
+/*
+ * Returns NULL if the kernel doesn't support everything the pollset needs:
+ * multishot polls with event updates, sends and waiting with a timeout.
+ */
+struct __bbus_uring* __bbus_uring_new(unsigned entries);
+void __bbus_uring_free(struct __bbus_uring* ring);
+/* Zeroed entry, pending submissions are sent first if the queue is full. */
+struct io_uring_sqe* __bbus_uring_getsqe(struct __bbus_uring* ring);
+/*
+ * Submits all prepared entries and waits for at least 'minwait'
+ * completions, at most 'tv' if it's not NULL. Returns 0 on success or on
+ * timeout, -1 on error - BBUS_EPOLLINTR if interrupted by a signal.
+ */
+int __bbus_uring_enter(struct __bbus_uring* ring, unsigned minwait,
+				struct bbus_timeval* tv);
+/* Copies out the next completion, returns 0 if there are none. */
+int __bbus_uring_getcqe(struct __bbus_uring* ring, struct io_uring_cqe* cqe);
+
+#endif /* __BBUS_URING__ */
@@ -0,0 +1,693 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Load generator for a real bus: starts a private bbusd, a number of echo
+ * services and callers, each keeping a number of calls in flight for the
+ * given time, and prints the throughput and latency percentiles as a
+ * single JSON line.
+ */
+
+#include <busybus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define MAXPROCS	256
+#define MAXINFLIGHT	1024
+/* Leaves room for the header, the method name and the string marshalling. */
+#define MAXSIZE		(BBUS_MAXPLOADSIZE - 64)
+
+/*
+ * Log-linear latency histogram in nanoseconds - every power of two is
+ * split into 2^SUBBITS buckets.
+ */
+#define SUBBITS		4
+#define NUMBUCKETS	((64 - SUBBITS + 1) << SUBBITS)
+
+enum target
+{
+	TARGET_REMOTE = 0,
+	TARGET_LOCAL,
+	TARGET_MIXED,
+};
+
+static const char* const targetnames[] = { "remote", "local", "mixed" };
+
+static const char* bbusdpath = "./bbusd";
+static unsigned numcallers = 1;
+static unsigned numservices = 1;
+static unsigned numthreads = 1;
+static unsigned inflight = 1;
+static unsigned size = 64;
+static unsigned duration = 3;
+static enum target target = TARGET_REMOTE;
+
+struct result
+{
+	unsigned long calls;
+	unsigned long errors;
+	uint64_t elapsed;
+	uint64_t maxns;
+	unsigned long buckets[NUMBUCKETS];
+};
+
+struct slot
+{
+	unsigned callid;
+	uint64_t start;
+};
+
+static void BBUS_PRINTF_FUNC(1, 2) BBUS_NORETURN die(const char* format, ...)
+{
+	va_list va;
+
+	va_start(va, format);
+	vfprintf(stderr, format, va);
+	va_end(va);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned parse_num(const char* num, const char* what,
+					unsigned min, unsigned max)
+{
+	char* end;
+	long val;
+
+	val = strtol(num, &end, 10);
+	if ((*end != '\0') || (val < (long)min) || (val > (long)max))
+		die("Number of %s must be between %u and %u\n",
+						what, min, max);
+
+	return (unsigned)val;
+}
+
+static void opt_setbbusd(const char* path)
+{
+	bbusdpath = path;
+}
+
+static void opt_setcallers(const char* num)
+{
+	numcallers = parse_num(num, "callers", 1, MAXPROCS);
+}
+
+static void opt_setservices(const char* num)
+{
+	numservices = parse_num(num, "services", 1, MAXPROCS);
+}
+
+static void opt_setthreads(const char* num)
+{
+	numthreads = parse_num(num, "bbusd threads", 1, 64);
+}
+
+static void opt_setinflight(const char* num)
+{
+	inflight = parse_num(num, "calls in flight", 1, MAXINFLIGHT);
+}
+
+static void opt_setsize(const char* num)
+{
+	size = parse_num(num, "payload bytes", 0, MAXSIZE);
+}
+
+static void opt_setduration(const char* num)
+{
+	duration = parse_num(num, "seconds", 1, 3600);
+}
+
+static void opt_settarget(const char* name)
+{
+	unsigned i;
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(targetnames); ++i) {
+		if (strcmp(name, targetnames[i]) == 0) {
+			target = (enum target)i;
+			return;
+		}
+	}
+
+	die("Target must be 'remote', 'local' or 'mixed'\n");
+}
+
+static struct bbus_option cmdopts[] = {
+	{
+		.shortopt = 0,
+		.longopt = "bbusd",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setbbusd,
+		.descr = "path to the bbusd binary (default: ./bbusd)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "callers",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setcallers,
+		.descr = "number of caller processes (default: 1)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "services",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setservices,
+		.descr = "number of echo service processes (default: 1)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "threads",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setthreads,
+		.descr = "number of bbusd reactor threads (default: 1)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "inflight",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setinflight,
+		.descr = "calls kept in flight by every caller (default: 1)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "size",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setsize,
+		.descr = "bytes of the echoed string (default: 64)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "duration",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_setduration,
+		.descr = "seconds to run for (default: 3)",
+	},
+	{
+		.shortopt = 0,
+		.longopt = "target",
+		.hasarg = BBUS_OPT_ARGREQ,
+		.action = BBUS_OPTACT_CALLFUNC,
+		.actdata = &opt_settarget,
+		.descr = "methods called: 'remote' echo services, 'local' "
+			 "bbus.bbusd.echo or 'mixed' (default: remote)",
+	}
+};
+
+static struct bbus_opt_list optlist = {
+	.opts = cmdopts,
+	.numopts = BBUS_ARRAY_SIZE(cmdopts),
+	.progname = "Busybus",
+	.version = "ALPHA",
+	.progdescr = "bbus-bench - busybus load generator"
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned bucket_of(uint64_t ns)
+{
+	unsigned msb;
+
+	if (ns < (1 << SUBBITS))
+		return (unsigned)ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - SUBBITS + 1) << SUBBITS)
+			+ ((ns >> (msb - SUBBITS)) & ((1 << SUBBITS) - 1));
+}
+
+/* Upper bound of the values falling into the bucket. */
+static uint64_t bucket_max(unsigned bucket)
+{
+	unsigned shift;
+	uint64_t base;
+
+	if (bucket < (1 << SUBBITS))
+		return bucket;
+
+	shift = (bucket >> SUBBITS) - 1;
+	base = (uint64_t)((1 << SUBBITS) | (bucket & ((1 << SUBBITS) - 1)));
+	return ((base + 1) << shift) - 1;
+}
+
+static uint64_t percentile(const struct result* res, double pct)
+{
+	unsigned long want;
+	unsigned long seen = 0;
+	unsigned i;
+
+	if (res->calls == 0)
+		return 0;
+
+	want = (unsigned long)(res->calls * pct / 100.0);
+	if (want >= res->calls)
+		want = res->calls - 1;
+
+	for (i = 0; i < NUMBUCKETS; ++i) {
+		seen += res->buckets[i];
+		if (seen > want)
+			return bucket_max(i) < res->maxns
+					? bucket_max(i) : res->maxns;
+	}
+
+	return res->maxns;
+}
+
+static const char* pick_method(unsigned long num)
+{
+	switch (target) {
+	case TARGET_LOCAL:
+		return "bbus.bbusd.echo";
+	case TARGET_MIXED:
+		return num % 2 ? "bbus.bbusd.echo" : "bbus.bench.echo";
+	case TARGET_REMOTE:
+	default:
+		return "bbus.bench.echo";
+	}
+}
+
+static bbus_object* srvc_echo(bbus_object* arg)
+{
+	char* msg;
+
+	if (bbus_obj_parse(arg, "s", &msg) < 0)
+		return NULL;
+
+	return bbus_obj_build("s", msg);
+}
+
+static struct bbus_method echo_method = {
+	.name = "echo",
+	.argdscr = "s",
+	.retdscr = "s",
+	.func = srvc_echo,
+};
+
+static void BBUS_NORETURN service_main(void)
+{
+	bbus_service_connection* conn;
+	struct bbus_timeval tv;
+
+	conn = bbus_srvc_connect("bench");
+	if (conn == NULL)
+		die("Error connecting the service: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	if (bbus_srvc_regmethod(conn, &echo_method) < 0)
+		die("Error registering the method: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	/* Runs until killed. */
+	for (;;) {
+		tv.sec = 1;
+		tv.usec = 0;
+		if (bbus_srvc_listencalls(conn, &tv) < 0)
+			die("Error handling a call: %s\n",
+				bbus_strerror(bbus_lasterror()));
+	}
+}
+
+static int take_slot(struct slot* slots, unsigned num, unsigned callid)
+{
+	unsigned i;
+
+	for (i = 0; i < num; ++i) {
+		if (slots[i].callid == callid)
+			return (int)i;
+	}
+
+	return -1;
+}
+
+static void run_caller(bbus_client_connection* conn, bbus_object* arg,
+						struct result* res)
+{
+	struct slot slots[MAXINFLIGHT];
+	struct bbus_timeval tv;
+	bbus_object* ret;
+	unsigned outstanding = 0;
+	unsigned long sent = 0;
+	uint64_t start;
+	uint64_t end;
+	uint64_t now;
+	uint64_t lat;
+	unsigned callid;
+	int i;
+	int r;
+
+	start = now_ns();
+	end = start + (uint64_t)duration * 1000000000ULL;
+	for (;;) {
+		now = now_ns();
+		while ((now < end) && (outstanding < inflight)) {
+			r = bbus_call_async(conn, pick_method(sent++), arg,
+						&slots[outstanding].callid);
+			if (r < 0)
+				die("Error sending a call: %s\n",
+					bbus_strerror(bbus_lasterror()));
+			slots[outstanding++].start = now;
+		}
+
+		if (outstanding == 0)
+			break;
+
+		tv.sec = 1;
+		tv.usec = 0;
+		r = bbus_call_poll(conn, &tv, &callid, &ret);
+		if (r < 0)
+			die("Error waiting for a reply: %s\n",
+					bbus_strerror(bbus_lasterror()));
+		else if (r == 0)
+			die("Timed out waiting for a reply\n");
+
+		i = take_slot(slots, outstanding, callid);
+		if (i < 0)
+			die("Reply to an unknown call\n");
+
+		lat = now_ns() - slots[i].start;
+		slots[i] = slots[--outstanding];
+		if (ret == NULL) {
+			++res->errors;
+			continue;
+		}
+
+		bbus_obj_free(ret);
+		++res->calls;
+		++res->buckets[bucket_of(lat)];
+		if (lat > res->maxns)
+			res->maxns = lat;
+	}
+
+	res->elapsed = now_ns() - start;
+}
+
+static int write_all(int fd, const void* buf, size_t size)
+{
+	const char* pos = buf;
+	ssize_t r;
+
+	while (size > 0) {
+		r = write(fd, pos, size);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void* buf, size_t size)
+{
+	char* pos = buf;
+	ssize_t r;
+
+	while (size > 0) {
+		r = read(fd, pos, size);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (r == 0) {
+			return -1;
+		}
+		pos += r;
+		size -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * Callers connect right away, but wait for the start byte so that they
+ * all put the bus under load at the same time.
+ */
+static void BBUS_NORETURN caller_main(int startfd, int resfd)
+{
+	bbus_client_connection* conn;
+	struct result* res;
+	bbus_object* arg;
+	char* payload;
+	char go;
+
+	res = bbus_malloc0(sizeof(struct result));
+	payload = bbus_malloc(size + 1);
+	if ((res == NULL) || (payload == NULL))
+		die("Out of memory\n");
+	memset(payload, 'x', size);
+	payload[size] = '\0';
+
+	arg = bbus_obj_build("s", payload);
+	if (arg == NULL)
+		die("Error building the argument: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	conn = bbus_connect("bench-caller");
+	if (conn == NULL)
+		die("Error connecting the caller: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	if (read_all(startfd, &go, 1) < 0)
+		die("Error waiting for the start\n");
+
+	run_caller(conn, arg, res);
+	if (write_all(resfd, res, sizeof(struct result)) < 0)
+		die("Error passing the results: %s\n", strerror(errno));
+
+	bbus_closeconn(conn);
+	bbus_obj_free(arg);
+	bbus_free(payload);
+	bbus_free(res);
+	exit(EXIT_SUCCESS);
+}
+
+static pid_t start_bbusd(const char* sockpath)
+{
+	char sockopt[256];
+	char threadopt[32];
+	pid_t pid;
+	int fd;
+
+	snprintf(sockopt, sizeof(sockopt), "--sockpath=%s", sockpath);
+	snprintf(threadopt, sizeof(threadopt), "--threads=%u", numthreads);
+
+	pid = fork();
+	if (pid < 0)
+		die("fork: %s\n", strerror(errno));
+	if (pid > 0)
+		return pid;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	execl(bbusdpath, bbusdpath, sockopt, threadopt, (char*)NULL);
+	_exit(127);
+}
+
+/* Retries 'method' until it succeeds, for at most five seconds. */
+static void wait_for(const char* method)
+{
+	bbus_client_connection* conn = NULL;
+	bbus_object* arg;
+	bbus_object* ret;
+	unsigned i;
+
+	arg = bbus_obj_build("s", "ping");
+	if (arg == NULL)
+		die("Error building the argument: %s\n",
+				bbus_strerror(bbus_lasterror()));
+
+	for (i = 0; i < 500; ++i) {
+		if (conn == NULL)
+			conn = bbus_connect("bench-probe");
+		if (conn != NULL) {
+			ret = bbus_callmethod(conn, method, arg);
+			if (ret != NULL) {
+				bbus_obj_free(ret);
+				bbus_closeconn(conn);
+				bbus_obj_free(arg);
+				return;
+			}
+		}
+		usleep(10000);
+	}
+
+	die("'%s' not available: %s\n", method,
+				bbus_strerror(bbus_lasterror()));
+}
+
+static pid_t spawn(void (*func)(void))
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork: %s\n", strerror(errno));
+	if (pid == 0)
+		func();
+
+	return pid;
+}
+
+static void report(const struct result* res)
+{
+	double secs;
+
+	secs = res->elapsed / 1e9;
+	printf("{\"target\":\"%s\",\"callers\":%u,\"services\":%u,"
+		"\"threads\":%u,\"inflight\":%u,\"size\":%u,"
+		"\"seconds\":%.3f,\"calls\":%lu,\"errors\":%lu,"
+		"\"calls_per_sec\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+		"\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+		targetnames[target], numcallers,
+		target == TARGET_LOCAL ? 0 : numservices, numthreads,
+		inflight, size, secs, res->calls, res->errors,
+		secs > 0 ? res->calls / secs : 0.0,
+		percentile(res, 50.0) / 1e3, percentile(res, 99.0) / 1e3,
+		percentile(res, 99.9) / 1e3, res->maxns / 1e3);
+}
+
+int main(int argc, char** argv)
+{
+	pid_t services[MAXPROCS];
+	pid_t callers[MAXPROCS];
+	struct result* total;
+	struct result* res;
+	int respipes[MAXPROCS];
+	char sockpath[64];
+	int startpipe[2];
+	int respipe[2];
+	pid_t bbusd;
+	unsigned i;
+	unsigned j;
+	int ret;
+
+	ret = bbus_parse_args(argc, argv, &optlist, NULL);
+	if (ret == BBUS_ARGS_HELP)
+		return EXIT_SUCCESS;
+	else if (ret == BBUS_ARGS_ERR)
+		return EXIT_FAILURE;
+
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	snprintf(sockpath, sizeof(sockpath), "/tmp/bbus-bench.%d.sock",
+							(int)getpid());
+	bbus_prot_setsockpath(sockpath);
+	bbusd = start_bbusd(sockpath);
+	wait_for("bbus.bbusd.echo");
+
+	if (target != TARGET_LOCAL) {
+		for (i = 0; i < numservices; ++i)
+			services[i] = spawn(service_main);
+		wait_for("bbus.bench.echo");
+	}
+
+	if (pipe(startpipe) < 0)
+		die("pipe: %s\n", strerror(errno));
+
+	/* Results are bigger than PIPE_BUF - every caller has its own pipe. */
+	for (i = 0; i < numcallers; ++i) {
+		if (pipe(respipe) < 0)
+			die("pipe: %s\n", strerror(errno));
+
+		callers[i] = fork();
+		if (callers[i] < 0)
+			die("fork: %s\n", strerror(errno));
+		if (callers[i] == 0) {
+			close(startpipe[1]);
+			close(respipe[0]);
+			caller_main(startpipe[0], respipe[1]);
+		}
+
+		close(respipe[1]);
+		respipes[i] = respipe[0];
+	}
+	close(startpipe[0]);
+
+	for (i = 0; i < numcallers; ++i) {
+		if (write_all(startpipe[1], "", 1) < 0)
+			die("Error starting the callers: %s\n",
+							strerror(errno));
+	}
+
+	total = bbus_malloc0(sizeof(struct result));
+	res = bbus_malloc(sizeof(struct result));
+	if ((total == NULL) || (res == NULL))
+		die("Out of memory\n");
+
+	ret = EXIT_SUCCESS;
+	for (i = 0; i < numcallers; ++i) {
+		if (read_all(respipes[i], res, sizeof(struct result)) < 0) {
+			fprintf(stderr, "A caller failed\n");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		total->calls += res->calls;
+		total->errors += res->errors;
+		if (res->elapsed > total->elapsed)
+			total->elapsed = res->elapsed;
+		if (res->maxns > total->maxns)
+			total->maxns = res->maxns;
+		for (j = 0; j < NUMBUCKETS; ++j)
+			total->buckets[j] += res->buckets[j];
+	}
+
+	if (ret == EXIT_SUCCESS)
+		report(total);
+
+	for (i = 0; i < numcallers; ++i)
+		(void)waitpid(callers[i], NULL, 0);
+	if (target != TARGET_LOCAL) {
+		for (i = 0; i < numservices; ++i) {
+			kill(services[i], SIGTERM);
+			(void)waitpid(services[i], NULL, 0);
+		}
+	}
+	kill(bbusd, SIGTERM);
+	(void)waitpid(bbusd, NULL, 0);
+	unlink(sockpath);
+
+	close(startpipe[1]);
+	for (i = 0; i < numcallers; ++i)
+		close(respipes[i]);
+	bbus_free(total);
+	bbus_free(res);
+
+	return ret;
+}
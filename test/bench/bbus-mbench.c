@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Iterations are doubled until a warm-up run takes this long. */
+#define WARMUP_NS	(20 * 1000000ULL)
+/* Then every repetition is sized to take about this long. */
+#define REP_NS		(50 * 1000000ULL)
+#define NUMREPS		7
+
+struct benchlist
+{
+	struct bbusbench_listelem* head;
+	struct bbusbench_listelem* tail;
+};
+
+static struct benchlist benchmarks;
+static unsigned benchmarks_registered = 0;
+
+/* Every heap allocation made by the library goes through this allocator. */
+static int counting;
+static unsigned long numallocs;
+static unsigned long numbytes;
+
+static void* count_malloc(size_t size, void* priv BBUS_UNUSED)
+{
+	if (counting) {
+		++numallocs;
+		numbytes += size;
+	}
+
+	return malloc(size);
+}
+
+static void* count_realloc(void* ptr, size_t size, void* priv BBUS_UNUSED)
+{
+	if (counting) {
+		++numallocs;
+		numbytes += size;
+	}
+
+	return realloc(ptr, size);
+}
+
+static void count_free(void* ptr, void* priv BBUS_UNUSED)
+{
+	free(ptr);
+}
+
+static const struct bbus_allocator count_allocator = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = count_free,
+	.priv = NULL,
+};
+
+/* Installed before anything is allocated. */
+static BBUS_ATSTART_FIRST void allocator_init(void)
+{
+	bbus_set_allocator(&count_allocator);
+}
+
+static BBUS_ATSTART_FIRST void benchlist_init(void)
+{
+	benchmarks.head = NULL;
+	benchmarks.tail = NULL;
+}
+
+void bbusbench_register(struct bbusbench_listelem* bench)
+{
+	bench->next = NULL;
+	if (benchmarks.tail == NULL) {
+		benchmarks.head = benchmarks.tail = bench;
+	} else {
+		benchmarks.tail->next = bench;
+		benchmarks.tail = bench;
+	}
+	++benchmarks_registered;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bbusbench_start(struct bbusbench_ctx* ctx)
+{
+	ctx->i = 0;
+	numallocs = 0;
+	numbytes = 0;
+	counting = 1;
+	ctx->start = now_ns();
+}
+
+void bbusbench_stop(struct bbusbench_ctx* ctx)
+{
+	ctx->elapsed = now_ns() - ctx->start;
+	counting = 0;
+	ctx->allocs = numallocs;
+	ctx->bytes = numbytes;
+}
+
+static int run(struct bbusbench_listelem* bench, struct bbusbench_ctx* ctx,
+						unsigned long iters)
+{
+	memset(ctx, 0, sizeof(struct bbusbench_ctx));
+	ctx->iters = iters;
+	bench->benchfunc(ctx);
+	if (ctx->failed != NULL) {
+		fprintf(stderr, "%s: %s\n", bench->name, ctx->failed);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int cmp_double(const void* p1, const void* p2)
+{
+	double d1 = *(const double*)p1;
+	double d2 = *(const double*)p2;
+
+	return d1 < d2 ? -1 : d1 > d2;
+}
+
+static int measure(struct bbusbench_listelem* bench)
+{
+	struct bbusbench_ctx ctx;
+	double nsperop[NUMREPS];
+	unsigned long iters = 1;
+	unsigned i;
+
+	do {
+		if (run(bench, &ctx, iters) < 0)
+			return -1;
+		iters *= 2;
+	} while (ctx.elapsed < WARMUP_NS);
+
+	iters = (unsigned long)(ctx.iters * (double)REP_NS
+				/ (ctx.elapsed > 0 ? ctx.elapsed : 1));
+	if (iters == 0)
+		iters = 1;
+
+	for (i = 0; i < NUMREPS; ++i) {
+		if (run(bench, &ctx, iters) < 0)
+			return -1;
+		nsperop[i] = (double)ctx.elapsed / iters;
+	}
+	qsort(nsperop, NUMREPS, sizeof(double), cmp_double);
+
+	printf("%-24s %10.1f ns/op (min %8.1f) %8.2f allocs/op "
+		"%10.1f B/op\n", bench->name, nsperop[NUMREPS / 2],
+		nsperop[0], (double)ctx.allocs / iters,
+		(double)ctx.bytes / iters);
+
+	return 0;
+}
+
+/* Only the benchmarks containing the first argument in their name run. */
+int main(int argc, char** argv)
+{
+	struct bbusbench_listelem* el;
+	unsigned failed = 0;
+
+	for (el = benchmarks.head; el != NULL; el = el->next) {
+		if ((argc > 1) && (strstr(el->name, argv[1]) == NULL))
+			continue;
+
+		if (measure(el) < 0)
+			++failed;
+	}
+
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __BBUS_MBENCH__
+#define __BBUS_MBENCH__
+
+#include <busybus.h>
+
+/*
+ * Micro-benchmarks of the library hot paths, registered the same way as
+ * the unit tests. The body of a benchmark does its setup, then runs the
+ * measured operation in BBUSBENCH_LOOP and cleans up afterwards - only
+ * the loop is timed and its heap allocations counted. The harness picks
+ * the number of iterations after a warm-up run.
+ */
+
+struct bbusbench_ctx
+{
+	unsigned long iters;
+	unsigned long i;
+	uint64_t start;
+	uint64_t elapsed;
+	unsigned long allocs;
+	unsigned long bytes;
+	const char* failed;
+};
+
+typedef void (*bbusbench_func)(struct bbusbench_ctx*);
+
+struct bbusbench_listelem
+{
+	struct bbusbench_listelem* next;
+	const char* name;
+	bbusbench_func benchfunc;
+};
+
+void bbusbench_register(struct bbusbench_listelem* bench);
+void bbusbench_start(struct bbusbench_ctx* ctx);
+void bbusbench_stop(struct bbusbench_ctx* ctx);
+
+static inline int bbusbench_next(struct bbusbench_ctx* ctx)
+{
+	if (BBUS_LIKELY(ctx->i++ < ctx->iters))
+		return 1;
+
+	bbusbench_stop(ctx);
+	return 0;
+}
+
+#define BBUSBENCH_DEFINE(NAME)						\
+	static void __##NAME##_bench(struct bbusbench_ctx*);		\
+	static struct bbusbench_listelem __##NAME##_elem = {		\
+		.name = #NAME,						\
+		.benchfunc = __##NAME##_bench,				\
+	};								\
+	static void BBUS_ATSTART_LAST __##NAME##_register(void)		\
+	{								\
+		bbusbench_register(&__##NAME##_elem);			\
+	}								\
+	static void __##NAME##_bench(					\
+			struct bbusbench_ctx* __bench_ctx BBUS_UNUSED)
+
+#define BBUSBENCH_LOOP							\
+	for (bbusbench_start(__bench_ctx); bbusbench_next(__bench_ctx); )
+
+/* Aborts the benchmark, must be followed by the cleanup and a return. */
+#define BBUSBENCH_FAIL(MSG)						\
+	do {								\
+		__bench_ctx->failed = (MSG);				\
+	} while (0)
+
+/* Makes the compiler believe the value is used. */
+#define BBUSBENCH_KEEP(VAL)						\
+	do {								\
+		__asm__ __volatile__("" : : "g"(VAL) : "memory");	\
+	} while (0)
+
+#endif /* __BBUS_MBENCH__ */
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Compares the throughput of the available crc32 implementations.
+ */
+
+#include <busybus.h>
+#include "../../lib/crc32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BUFSIZE		(1024 * 1024)
+#define ITERATIONS	256
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t run(const char* name, __bbus_crc32_func func,
+					const unsigned char* buf)
+{
+	double start;
+	double elapsed;
+	uint32_t crc = 0;
+	unsigned i;
+
+	start = now();
+	for (i = 0; i < ITERATIONS; ++i)
+		crc = func(0xffffffff, buf, BUFSIZE) ^ 0xffffffff;
+	elapsed = now() - start;
+
+	printf("%-10s %10.1f MB/s  crc: 0x%08x\n", name,
+		(double)BUFSIZE * ITERATIONS / elapsed / (1024 * 1024), crc);
+
+	return crc;
+}
+
+int main(void)
+{
+	unsigned char* buf;
+	uint32_t expected;
+	int ret = EXIT_SUCCESS;
+	unsigned i;
+
+	buf = bbus_malloc(BUFSIZE);
+	if (buf == NULL)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < BUFSIZE; ++i)
+		buf[i] = rand();
+
+	expected = run("bytewise", __bbus_crc32_update_bytewise, buf);
+	if (run("slice-by-8", __bbus_crc32_update_slice8, buf) != expected)
+		ret = EXIT_FAILURE;
+	if (__bbus_crc32_hwfunc() != NULL) {
+		if (run("hardware", __bbus_crc32_hwfunc(), buf) != expected)
+			ret = EXIT_FAILURE;
+	} else {
+		printf("hardware   not supported on this cpu\n");
+	}
+
+	if (ret != EXIT_SUCCESS)
+		fprintf(stderr, "Checksums differ!\n");
+
+	bbus_free(buf);
+	return ret;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Measures the cost of receiving small messages with and without zeroing
+ * the receive buffer beforehand, as bbusd used to do for every message.
+ */
+
+#include <busybus.h>
+#include "../../lib/protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define ITERATIONS	200000
+#define ZEROSIZE	(2*BBUS_MAXPLOADSIZE)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char* name, int* socks, struct bbus_msg** buf,
+					size_t* bufsize, int zero)
+{
+	struct bbus_msg_hdr hdr;
+	bbus_object* obj;
+	double start;
+	double elapsed;
+	unsigned i;
+	int r;
+
+	obj = bbus_obj_build("s", "ping");
+	if (obj == NULL)
+		return -1;
+
+	bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&hdr, sizeof("bbus.bbusd.echo") +
+						bbus_obj_rawsize(obj));
+
+	start = now();
+	for (i = 0; i < ITERATIONS; ++i) {
+		r = __bbus_prot_sendvmsg(socks[0], &hdr, "bbus.bbusd.echo",
+						bbus_obj_rawdata(obj),
+						bbus_obj_rawsize(obj));
+		if (r < 0)
+			goto err;
+
+		if (zero)
+			memset(*buf, 0, ZEROSIZE);
+
+		r = __bbus_prot_recvmsgdyn(socks[1], buf, bufsize, NULL);
+		if (r < 0)
+			goto err;
+	}
+	elapsed = now() - start;
+
+	printf("%-10s %8.1f ns/msg\n", name, elapsed * 1e9 / ITERATIONS);
+	bbus_obj_free(obj);
+
+	return 0;
+
+err:
+	bbus_obj_free(obj);
+	return -1;
+}
+
+int main(void)
+{
+	struct bbus_msg* buf;
+	size_t bufsize;
+	int socks[2];
+	int ret = EXIT_SUCCESS;
+	int r;
+
+	r = socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+	if (r < 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+
+	bufsize = ZEROSIZE;
+	buf = bbus_malloc(bufsize);
+	if (buf == NULL)
+		return EXIT_FAILURE;
+
+	if ((run("zeroed", socks, &buf, &bufsize, 1) < 0)
+			|| (run("as-is", socks, &buf, &bufsize, 0) < 0)) {
+		fprintf(stderr, "Error passing messages: %s\n",
+				bbus_strerror(bbus_lasterror()));
+		ret = EXIT_FAILURE;
+	}
+
+	bbus_free(buf);
+	close(socks[0]);
+	close(socks[1]);
+
+	return ret;
+}
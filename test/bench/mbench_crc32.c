@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include <string.h>
+
+static unsigned char buf[BBUS_MAXPLOADSIZE];
+
+static void run_crc32(struct bbusbench_ctx* __bench_ctx, size_t size)
+{
+	uint32_t crc;
+
+	memset(buf, 0xa5, sizeof(buf));
+	BBUSBENCH_LOOP {
+		crc = bbus_crc32(buf, size);
+		BBUSBENCH_KEEP(crc);
+	}
+}
+
+BBUSBENCH_DEFINE(crc32_64)
+{
+	run_crc32(__bench_ctx, 64);
+}
+
+BBUSBENCH_DEFINE(crc32_4k)
+{
+	run_crc32(__bench_ctx, BBUS_MAXPLOADSIZE);
+}
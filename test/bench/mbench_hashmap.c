@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include <stdio.h>
+
+#define NUMKEYS		1024
+
+static char keys[NUMKEYS][32];
+
+static bbus_hashmap* make_map(void)
+{
+	bbus_hashmap* hmap;
+	unsigned i;
+
+	hmap = bbus_hmap_create(BBUS_HMAP_KEYSTR);
+	if (hmap == NULL)
+		return NULL;
+
+	for (i = 0; i < NUMKEYS; ++i) {
+		snprintf(keys[i], sizeof(keys[i]), "bbus.service%u.method", i);
+		if (bbus_hmap_setstr(hmap, keys[i], keys[i]) < 0) {
+			bbus_hmap_free(hmap);
+			return NULL;
+		}
+	}
+
+	return hmap;
+}
+
+/* Replaces existing entries - the map doesn't grow during the loop. */
+BBUSBENCH_DEFINE(hmap_setstr)
+{
+	bbus_hashmap* hmap;
+	unsigned i = 0;
+
+	hmap = make_map();
+	if (hmap == NULL) {
+		BBUSBENCH_FAIL("Error creating the hashmap");
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		(void)bbus_hmap_setstr(hmap, keys[i], keys[i]);
+		i = (i + 1) % NUMKEYS;
+	}
+
+	bbus_hmap_free(hmap);
+}
+
+BBUSBENCH_DEFINE(hmap_findstr)
+{
+	bbus_hashmap* hmap;
+	unsigned i = 0;
+	void* val;
+
+	hmap = make_map();
+	if (hmap == NULL) {
+		BBUSBENCH_FAIL("Error creating the hashmap");
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		val = bbus_hmap_findstr(hmap, keys[i]);
+		BBUSBENCH_KEEP(val);
+		i = (i + 1) % NUMKEYS;
+	}
+
+	bbus_hmap_free(hmap);
+}
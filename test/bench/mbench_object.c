@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include "../../lib/object.h"
+
+BBUSBENCH_DEFINE(obj_build)
+{
+	bbus_object* obj;
+
+	BBUSBENCH_LOOP {
+		obj = bbus_obj_build("sui", "bbus.bbusd.echo", 42, -1);
+		BBUSBENCH_KEEP(obj);
+		bbus_obj_free(obj);
+	}
+}
+
+BBUSBENCH_DEFINE(obj_parse)
+{
+	bbus_object* obj;
+	bbus_uint32 u;
+	bbus_int32 i;
+	char* s;
+
+	obj = bbus_obj_build("sui", "bbus.bbusd.echo", 42, -1);
+	if (obj == NULL) {
+		BBUSBENCH_FAIL("Error building the object");
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		bbus_obj_rewind(obj);
+		(void)bbus_obj_parse(obj, "sui", &s, &u, &i);
+		BBUSBENCH_KEEP(s);
+	}
+
+	bbus_obj_free(obj);
+}
+
+BBUSBENCH_DEFINE(obj_insint32v)
+{
+	static bbus_int32 vals[1024];
+	bbus_object* obj;
+
+	obj = bbus_obj_alloc();
+	if (obj == NULL) {
+		BBUSBENCH_FAIL("Error allocating the object");
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		bbus_obj_reset(obj);
+		(void)bbus_obj_insint32v(obj, vals, BBUS_ARRAY_SIZE(vals));
+		BBUSBENCH_KEEP(obj);
+	}
+
+	bbus_obj_free(obj);
+}
+
+BBUSBENCH_DEFINE(obj_compress)
+{
+	static bbus_uint32 vals[1024];
+	bbus_object* obj;
+	size_t size;
+	unsigned i;
+	void* buf;
+
+	for (i = 0; i < BBUS_ARRAY_SIZE(vals); ++i)
+		vals[i] = i % 100;
+
+	obj = bbus_obj_alloc();
+	if ((obj == NULL) || (bbus_obj_insuint32v(obj, vals,
+				BBUS_ARRAY_SIZE(vals)) < 0)) {
+		BBUSBENCH_FAIL("Error building the object");
+		bbus_obj_free(obj);
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		buf = __bbus_obj_compress(obj, &size);
+		BBUSBENCH_KEEP(buf);
+		bbus_free(buf);
+	}
+
+	bbus_obj_free(obj);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include <string.h>
+
+BBUSBENCH_DEFINE(prot_extractobj)
+{
+	char msgbuf[BBUS_MAXMSGSIZE];
+	struct bbus_msg* msg = (struct bbus_msg*)msgbuf;
+	bbus_object* arg;
+	bbus_object* obj;
+
+	arg = bbus_obj_build("sui", "bbus.bbusd.echo", 42, -1);
+	if (arg == NULL) {
+		BBUSBENCH_FAIL("Error building the object");
+		return;
+	}
+
+	bbus_hdr_build(&msg->hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+	BBUS_HDR_SETFLAG(&msg->hdr, BBUS_PROT_HASMETA);
+	BBUS_HDR_SETFLAG(&msg->hdr, BBUS_PROT_HASOBJECT);
+	bbus_hdr_setpsize(&msg->hdr, sizeof("bbus.bbusd.echo")
+					+ bbus_obj_rawsize(arg));
+	memcpy(msg->payload, "bbus.bbusd.echo", sizeof("bbus.bbusd.echo"));
+	memcpy(msg->payload + sizeof("bbus.bbusd.echo"),
+			bbus_obj_rawdata(arg), bbus_obj_rawsize(arg));
+	bbus_obj_free(arg);
+
+	BBUSBENCH_LOOP {
+		obj = bbus_prot_extractobj(msg);
+		BBUSBENCH_KEEP(obj);
+		bbus_obj_free(obj);
+	}
+}
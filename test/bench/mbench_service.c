@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-mbench.h"
+#include "../../bin/bbusd/service.h"
+#include "../../bin/bbusd/shard.h"
+#include <stdio.h>
+
+#define NUMSERVICES	64
+#define NUMMETHODS	8
+
+static struct bbusd_local_method methods[NUMSERVICES * NUMMETHODS];
+static char paths[NUMSERVICES * NUMMETHODS][64];
+
+/* The service map of bbusd's first shard, filled once. */
+static int init_map(void)
+{
+	static int done;
+	unsigned i;
+
+	if (done)
+		return 0;
+
+	bbusd_shards_init(1);
+	bbusd_init_service_map(NUMSERVICES * NUMMETHODS);
+	for (i = 0; i < NUMSERVICES * NUMMETHODS; ++i) {
+		snprintf(paths[i], sizeof(paths[i]), "bbus.service%u.method%u",
+					i / NUMMETHODS, i % NUMMETHODS);
+		methods[i].type = BBUSD_METHOD_LOCAL;
+		if (bbusd_insert_method(paths[i],
+				(struct bbusd_method*)&methods[i]) < 0)
+			return -1;
+	}
+
+	done = 1;
+	return 0;
+}
+
+BBUSBENCH_DEFINE(locate_method)
+{
+	struct bbusd_method* mthd;
+	unsigned i = 0;
+
+	if (init_map() < 0) {
+		BBUSBENCH_FAIL("Error filling the service map");
+		return;
+	}
+
+	BBUSBENCH_LOOP {
+		mthd = bbusd_locate_method(paths[i]);
+		BBUSBENCH_KEEP(mthd);
+		i = (i + 37) % (NUMSERVICES * NUMMETHODS);
+	}
+	bbusd_quiesce_service_map();
+}
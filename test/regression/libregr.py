@@ -70,7 +70,8 @@ class Process(subprocess.Popen):
 		subprocess.Popen.__init__(self, [prog] + args,
 						shell=False,
 						stdout=subprocess.PIPE,
-						stderr=subprocess.PIPE)
+						stderr=subprocess.PIPE,
+						universal_newlines=True)
 
 	def __del__(self):
 		try:
@@ -0,0 +1,23 @@
+# Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+
+"""
+Test calling a method run by bbusd itself with a compressed argument.
+"""
+
+import libregr
+
+def run():
+	arg = 'a' * 256
+	libregr.callExpect('call', ['--compress=16', 'bbus.bbusd.echo',
+					's', arg],
+				stdout='bbus_object\\(\'{0}\'\\)\n'.format(arg))
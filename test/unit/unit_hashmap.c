@@ -197,3 +197,200 @@ BBUSUNIT_DEFINE_TEST(hashmap_reset)
 	BBUSUNIT_ENDTEST;
 }
 
+
+BBUSUNIT_DEFINE_TEST(hashmap_dup)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_hashmap* hmap;
+		bbus_hashmap* copy = NULL;
+		int r;
+		long val1;
+		long val2;
+
+		hmap = bbus_hmap_create(BBUS_HMAP_KEYSTR);
+		BBUSUNIT_ASSERT_NOTNULL(hmap);
+		val1 = 123;
+		val2 = 456;
+		r = bbus_hmap_setstr(hmap, "foo", &val1);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		copy = bbus_hmap_dup(hmap);
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		r = bbus_hmap_setstr(copy, "bar", &val2);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		BBUSUNIT_ASSERT_EQ(&val1, bbus_hmap_findstr(copy, "foo"));
+		BBUSUNIT_ASSERT_EQ(&val2, bbus_hmap_findstr(copy, "bar"));
+		/* The original must not see changes made to the copy. */
+		BBUSUNIT_ASSERT_NULL(bbus_hmap_findstr(hmap, "bar"));
+
+	BBUSUNIT_FINALLY;
+
+		bbus_hmap_free(copy);
+		bbus_hmap_free(hmap);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(hashmap_findstrn)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_hashmap* hmap;
+		int r;
+		long val1;
+		long val2;
+		static const char path[] = "bbus.foo.foobar";
+
+		hmap = bbus_hmap_create(BBUS_HMAP_KEYSTR);
+		BBUSUNIT_ASSERT_NOTNULL(hmap);
+		val1 = 123;
+		val2 = 456;
+		r = bbus_hmap_setstr(hmap, "bbus.foo", &val1);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		r = bbus_hmap_setstr(hmap, "bbus.foo.foobar", &val2);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		BBUSUNIT_ASSERT_EQ(&val1, bbus_hmap_findstrn(hmap, path, 8));
+		BBUSUNIT_ASSERT_EQ(&val2, bbus_hmap_findstrn(hmap, path,
+							sizeof(path)-1));
+		/* Neither prefixes nor extensions of a key may match. */
+		BBUSUNIT_ASSERT_NULL(bbus_hmap_findstrn(hmap, path, 7));
+		BBUSUNIT_ASSERT_NULL(bbus_hmap_findstrn(hmap, path, 12));
+		BBUSUNIT_ASSERT_NULL(bbus_hmap_findstr(hmap, "bbus.foo.foobarbaz"));
+
+	BBUSUNIT_FINALLY;
+
+		bbus_hmap_free(hmap);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(hashmap_grow_and_remove)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_hashmap* hmap;
+		int r;
+		long i;
+
+		hmap = bbus_hmap_create(BBUS_HMAP_KEYUINT);
+		BBUSUNIT_ASSERT_NOTNULL(hmap);
+
+		/* Enough to trigger several incremental migrations. */
+		for (i = 1; i <= 5000; ++i) {
+			r = bbus_hmap_setuint(hmap, i, (void*)i);
+			BBUSUNIT_ASSERT_EQ(0, r);
+		}
+
+		for (i = 2; i <= 5000; i += 2)
+			BBUSUNIT_ASSERT_EQ(i, (long)bbus_hmap_rmuint(hmap, i));
+
+		for (i = 1; i <= 5000; ++i) {
+			if (i % 2)
+				BBUSUNIT_ASSERT_EQ(i,
+					(long)bbus_hmap_finduint(hmap, i));
+			else
+				BBUSUNIT_ASSERT_NULL(
+					bbus_hmap_finduint(hmap, i));
+		}
+
+	BBUSUNIT_FINALLY;
+
+		bbus_hmap_free(hmap);
+
+	BBUSUNIT_ENDTEST;
+}
+
+static int sum_keys(const void* key, size_t keysize BBUS_UNUSED,
+						void* val, void* arg)
+{
+	unsigned k;
+
+	memcpy(&k, key, sizeof(unsigned));
+	if (k != (unsigned)(long)val)
+		return -1;
+
+	*(long*)arg += k;
+	return 0;
+}
+
+BBUSUNIT_DEFINE_TEST(hashmap_foreach)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_hashmap* hmap;
+		long sum = 0;
+		int r;
+		long i;
+
+		hmap = bbus_hmap_create(BBUS_HMAP_KEYUINT);
+		BBUSUNIT_ASSERT_NOTNULL(hmap);
+
+		/* Some entries are still in the old table while growing. */
+		for (i = 1; i <= 1000; ++i) {
+			r = bbus_hmap_setuint(hmap, i, (void*)i);
+			BBUSUNIT_ASSERT_EQ(0, r);
+		}
+
+		r = bbus_hmap_foreach(hmap, sum_keys, &sum);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		BBUSUNIT_ASSERT_EQ(1000 * 1001 / 2, sum);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_hmap_free(hmap);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(hashmap_sized)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_hashmap* hmap;
+		bbus_hashmap* copy = NULL;
+		long sum = 0;
+		int r;
+		long i;
+
+		hmap = bbus_hmap_create_sized(BBUS_HMAP_KEYUINT, 1);
+		BBUSUNIT_ASSERT_NOTNULL(hmap);
+
+		/* Tiny maps still grow when needed. */
+		for (i = 1; i <= 100; ++i) {
+			r = bbus_hmap_setuint(hmap, i, (void*)i);
+			BBUSUNIT_ASSERT_EQ(0, r);
+		}
+
+		copy = bbus_hmap_dup(hmap);
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		BBUSUNIT_ASSERT_EQ(77, (long)bbus_hmap_finduint(copy, 77));
+		r = bbus_hmap_foreach(copy, sum_keys, &sum);
+		BBUSUNIT_ASSERT_EQ(0, r);
+		BBUSUNIT_ASSERT_EQ(100 * 101 / 2, sum);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_hmap_free(copy);
+		bbus_hmap_free(hmap);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(hashmap_hash)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char data[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+		uint32_t hash;
+
+		hash = bbus_hmap_hash(data, sizeof(data));
+		BBUSUNIT_ASSERT_EQ(hash, bbus_hmap_hash(data, sizeof(data)));
+		/* The length and every byte count, even past sixteen bytes. */
+		BBUSUNIT_ASSERT_NOTEQ(hash,
+				bbus_hmap_hash(data, sizeof(data) - 1));
+		BBUSUNIT_ASSERT_NOTEQ(bbus_hmap_hash(data, 20),
+				bbus_hmap_hash(data + 1, 20));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
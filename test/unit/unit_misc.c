@@ -42,6 +42,34 @@ BBUSUNIT_DEFINE_TEST(crc32_emptybuf)
 	BBUSUNIT_ENDTEST;
 }
 
+BBUSUNIT_DEFINE_TEST(crc32_streaming)
+{
+	BBUSUNIT_BEGINTEST;
+
+		/* Long enough for every accelerated code path. */
+		static const uint32_t proper = 0x45406DEAU;
+		unsigned char data[1000];
+		uint32_t crc;
+		size_t i;
+		size_t split;
+
+		for (i = 0; i < sizeof(data); ++i)
+			data[i] = (i * 31 + 7) & 0xff;
+
+		BBUSUNIT_ASSERT_EQ(proper, bbus_crc32(data, sizeof(data)));
+
+		for (split = 0; split < sizeof(data); split += 73) {
+			crc = bbus_crc32_init();
+			crc = bbus_crc32_update(crc, data, split);
+			crc = bbus_crc32_update(crc, data + split,
+						sizeof(data) - split);
+			BBUSUNIT_ASSERT_EQ(proper, bbus_crc32_final(crc));
+		}
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
 BBUSUNIT_DEFINE_TEST(memdup)
 {
 	BBUSUNIT_BEGINTEST;
@@ -13,8 +13,13 @@
  */
 
 #include "bbus-unit.h"
+#include "../../lib/object.h"
 #include <busybus.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
 
 /*
  * We assert, that bbus_obj_rawdata() and bbus_obj_rawsize() work as
@@ -429,3 +434,544 @@ BBUSUNIT_DEFINE_TEST(object_build_empty_string)
 	BBUSUNIT_ENDTEST;
 }
 
+
+BBUSUNIT_DEFINE_TEST(object_fd_roundtrip)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char* const str = "shared memory";
+
+		bbus_object* obj = NULL;
+		bbus_object* mapped = NULL;
+		char* outstr;
+		int fd;
+		int ret;
+
+		obj = bbus_obj_build("su", str, 1234);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		fd = bbus_obj_tofd(obj);
+		BBUSUNIT_ASSERT_TRUE(fd >= 0);
+		mapped = bbus_obj_fromfd(fd);
+		close(fd);
+		BBUSUNIT_ASSERT_NOTNULL(mapped);
+		BBUSUNIT_ASSERT_EQ(bbus_obj_rawsize(obj), bbus_obj_rawsize(mapped));
+		ret = bbus_obj_parse(mapped, "s", &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+		/* Modifying a mapped object moves it to the heap. */
+		ret = bbus_obj_insstr(mapped, str);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		bbus_obj_rewind(mapped);
+		ret = bbus_obj_parse(mapped, "s", &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+		bbus_obj_free(mapped);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_fd_unsealed)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char data[] = "\x00\x00\x00\x01";
+
+		bbus_object* mapped = NULL;
+		int fd;
+
+		fd = memfd_create("bbus-unit", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		BBUSUNIT_ASSERT_TRUE(fd >= 0);
+		BBUSUNIT_ASSERT_EQ((ssize_t)sizeof(data),
+				write(fd, data, sizeof(data)));
+
+		/* The sender could still shrink it under the mapping. */
+		mapped = bbus_obj_fromfd(fd);
+		BBUSUNIT_ASSERT_NULL(mapped);
+		BBUSUNIT_ASSERT_EQ(BBUS_EOBJINVFMT, bbus_lasterror());
+
+		BBUSUNIT_ASSERT_EQ(0, fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK));
+		mapped = bbus_obj_fromfd(fd);
+		BBUSUNIT_ASSERT_NULL(mapped);
+
+		BBUSUNIT_ASSERT_EQ(0, fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE));
+		mapped = bbus_obj_fromfd(fd);
+		BBUSUNIT_ASSERT_NOTNULL(mapped);
+		BBUSUNIT_ASSERT_EQ(sizeof(data), bbus_obj_rawsize(mapped));
+
+	BBUSUNIT_FINALLY;
+
+		if (fd >= 0)
+			close(fd);
+		bbus_obj_free(mapped);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_pool_reuse)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char* const str = "pooled object";
+
+		bbus_obj_pool* pool = NULL;
+		bbus_object* obj = NULL;
+		bbus_object* copy = NULL;
+		bbus_object* first;
+		bbus_uint32 val;
+		char* outstr;
+		int ret;
+		int i;
+
+		pool = bbus_obj_pool_create();
+		BBUSUNIT_ASSERT_NOTNULL(pool);
+		obj = bbus_obj_alloc_from(pool);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		/* Grow through all the size classes and beyond. */
+		for (i = 0; i < 2048; ++i) {
+			ret = bbus_obj_insuint(obj, i);
+			BBUSUNIT_ASSERT_EQ(0, ret);
+		}
+		ret = bbus_obj_insstr(obj, str);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+
+		copy = bbus_obj_frombuf_from(pool, bbus_obj_rawdata(obj),
+						bbus_obj_rawsize(obj));
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		for (i = 0; i < 2048; ++i) {
+			ret = bbus_obj_extruint(copy, &val);
+			BBUSUNIT_ASSERT_EQ(0, ret);
+			BBUSUNIT_ASSERT_EQ((bbus_uint32)i, val);
+		}
+		ret = bbus_obj_extrstr(copy, &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+		/* Freed objects are handed out again. */
+		first = obj;
+		bbus_obj_free(obj);
+		obj = bbus_obj_alloc_from(pool);
+		BBUSUNIT_ASSERT_EQ(first, obj);
+		BBUSUNIT_ASSERT_EQ(0, bbus_obj_rawsize(obj));
+		ret = bbus_obj_insstr(obj, str);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = bbus_obj_parse(obj, "s", &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+		bbus_obj_free(copy);
+		bbus_obj_pool_free(pool);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_build_from_pool)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_obj_pool* pool = NULL;
+		bbus_object* obj = NULL;
+		bbus_object* first;
+		bbus_uint32 val;
+		char* str;
+		int ret;
+
+		pool = bbus_obj_pool_create();
+		BBUSUNIT_ASSERT_NOTNULL(pool);
+		obj = bbus_obj_build_from(pool, "us", 42, "built");
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ret = bbus_obj_parse(obj, "us", &val, &str);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(42, val);
+		BBUSUNIT_ASSERT_STREQ("built", str);
+
+		first = obj;
+		bbus_obj_free(obj);
+		obj = bbus_obj_build_from(pool, "u", 7);
+		BBUSUNIT_ASSERT_EQ(first, obj);
+		BBUSUNIT_ASSERT_NULL(bbus_obj_build_from(pool, "u(", 7));
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+		bbus_obj_pool_free(pool);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_host_order)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_object* obj = NULL;
+		bbus_object* copy = NULL;
+		bbus_uint32 raw;
+		bbus_uint32 val;
+		bbus_int32 ival;
+		int ret;
+
+		obj = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		BBUSUNIT_ASSERT_EQ(BBUS_OBJ_NETORDER, bbus_obj_getorder(obj));
+		bbus_obj_setorder(obj, BBUS_OBJ_HOSTORDER);
+		ret = bbus_obj_insuint(obj, 0x01020304);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = bbus_obj_insint(obj, -2);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+
+		/* Stored as is. */
+		memcpy(&raw, bbus_obj_rawdata(obj), sizeof(raw));
+		BBUSUNIT_ASSERT_EQ(0x01020304, raw);
+
+		/* Receivers must be told the order of the sender. */
+		copy = bbus_obj_frombuf(bbus_obj_rawdata(obj),
+						bbus_obj_rawsize(obj));
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		ret = bbus_obj_extruint(copy, &val);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(htonl(0x01020304), val);
+		bbus_obj_rewind(copy);
+		bbus_obj_setorder(copy, BBUS_OBJ_HOSTORDER);
+		ret = bbus_obj_parse(copy, "ui", &val, &ival);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(0x01020304, val);
+		BBUSUNIT_ASSERT_EQ(-2, ival);
+		bbus_obj_free(copy);
+		copy = NULL;
+
+		/* New objects use the default order. */
+		bbus_obj_setdefaultorder(BBUS_OBJ_HOSTORDER);
+		copy = bbus_obj_build("u", 0x01020304);
+		bbus_obj_setdefaultorder(BBUS_OBJ_NETORDER);
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		BBUSUNIT_ASSERT_EQ(BBUS_OBJ_HOSTORDER, bbus_obj_getorder(copy));
+		memcpy(&raw, bbus_obj_rawdata(copy), sizeof(raw));
+		BBUSUNIT_ASSERT_EQ(0x01020304, raw);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+		bbus_obj_free(copy);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_bulk_arrays)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const bbus_int32 vals[] = { 1, -2, 0x01020304, -0x7fff };
+
+		bbus_object* obj = NULL;
+		bbus_int32 out[4];
+		bbus_int32 small[2];
+		bbus_size arrsize;
+		bbus_int32 ival;
+		const void* ptr;
+		size_t num;
+		size_t size;
+		int ret;
+
+		obj = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ret = bbus_obj_insint32v(obj, vals, BBUS_ARRAY_SIZE(vals));
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = bbus_obj_insbytes(obj, "\x01\x02\x03", 3);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+
+		/* Same wire format as element by element. */
+		ret = bbus_obj_parse(obj, "A(i)", &arrsize, &ival, &ival,
+							&ival, &ival);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(4, arrsize);
+		BBUSUNIT_ASSERT_EQ(-0x7fff, ival);
+		bbus_obj_rewind(obj);
+
+		num = BBUS_ARRAY_SIZE(small);
+		ret = bbus_obj_extrint32v(obj, small, &num);
+		BBUSUNIT_ASSERT_EQ(-1, ret);
+		BBUSUNIT_ASSERT_EQ(BBUS_ENOSPACE, bbus_lasterror());
+		num = BBUS_ARRAY_SIZE(out);
+		ret = bbus_obj_extrint32v(obj, out, &num);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(4, num);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(vals, out, sizeof(vals)));
+
+		ret = bbus_obj_extrbytes_ref(obj, &ptr, &size);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(3, size);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(ptr, "\x01\x02\x03", 3));
+		ret = bbus_obj_extrint(obj, &ival);
+		BBUSUNIT_ASSERT_EQ(-1, ret);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_index)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_object* obj = NULL;
+		bbus_obj_index* idx = NULL;
+		bbus_uint32 u;
+		size_t len;
+		char* str;
+		int ret;
+
+		obj = bbus_obj_build("sA(us)b", "head", 3, 1, "one", 2, "two",
+							3, "three", 0x42);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		idx = bbus_obj_mkindex(obj, "sA(us)b");
+		BBUSUNIT_ASSERT_NOTNULL(idx);
+		BBUSUNIT_ASSERT_EQ(9, bbus_obj_index_size(idx));
+
+		ret = bbus_obj_index_getstr(obj, idx, 7, &str, &len);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ("three", str);
+		BBUSUNIT_ASSERT_EQ(5, len);
+		ret = bbus_obj_index_getstr(obj, idx, 6, &str, NULL);
+		BBUSUNIT_ASSERT_EQ(-1, ret);
+		ret = bbus_obj_index_getstr(obj, idx, 9, &str, NULL);
+		BBUSUNIT_ASSERT_EQ(-1, ret);
+		BBUSUNIT_ASSERT_EQ(BBUS_EINVALARG, bbus_lasterror());
+
+		/* Extraction goes on sequentially after a seek. */
+		ret = bbus_obj_seek(obj, idx, 4);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = bbus_obj_parse(obj, "usus", &u, &str, &u, &str);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(3, u);
+		BBUSUNIT_ASSERT_STREQ("three", str);
+
+		bbus_obj_index_free(idx);
+		idx = bbus_obj_mkindex(obj, "sA(us)bs");
+		BBUSUNIT_ASSERT_NULL(idx);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_index_free(idx);
+		bbus_obj_free(obj);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_compression)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static bbus_uint32 vals[2048];
+
+		bbus_object* obj = NULL;
+		bbus_object* copy = NULL;
+		bbus_uint32 out[2048];
+		char* zbuf = NULL;
+		size_t zsize;
+		size_t num;
+		unsigned i;
+		int ret;
+
+		for (i = 0; i < BBUS_ARRAY_SIZE(vals); ++i)
+			vals[i] = i % 100;
+
+		obj = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ret = bbus_obj_insuint32v(obj, vals, BBUS_ARRAY_SIZE(vals));
+		BBUSUNIT_ASSERT_EQ(0, ret);
+
+		zbuf = __bbus_obj_compress(obj, &zsize);
+		BBUSUNIT_ASSERT_NOTNULL(zbuf);
+		BBUSUNIT_ASSERT_TRUE(zsize < bbus_obj_rawsize(obj) / 4);
+
+		copy = __bbus_obj_decompress(NULL, zbuf, zsize);
+		BBUSUNIT_ASSERT_NOTNULL(copy);
+		BBUSUNIT_ASSERT_EQ(bbus_obj_rawsize(obj), bbus_obj_rawsize(copy));
+		num = BBUS_ARRAY_SIZE(out);
+		ret = bbus_obj_extruint32v(copy, out, &num);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(vals, out, sizeof(vals)));
+		bbus_obj_free(copy);
+
+		/* Corrupted data must never decompress. */
+		zbuf[zsize / 2] ^= 0xff;
+		copy = __bbus_obj_decompress(NULL, zbuf, zsize);
+		if (copy != NULL)
+			BBUSUNIT_ASSERT_NOTEQ(0, memcmp(bbus_obj_rawdata(obj),
+						bbus_obj_rawdata(copy),
+						bbus_obj_rawsize(obj)));
+		bbus_obj_free(copy);
+		copy = __bbus_obj_decompress(NULL, zbuf, zsize - 1);
+		BBUSUNIT_ASSERT_NULL(copy);
+
+		/* Incompressible data is left alone. */
+		bbus_obj_reset(obj);
+		ret = bbus_obj_insstr(obj, "abcdefgh");
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_NULL(__bbus_obj_compress(obj, &zsize));
+
+	BBUSUNIT_FINALLY;
+
+		bbus_free(zbuf);
+		bbus_obj_free(copy);
+		bbus_obj_free(obj);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_view_borrows_buffer)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char* const str = "borrowed";
+
+		bbus_object* src = NULL;
+		bbus_object* view = NULL;
+		char buf[64];
+		size_t size;
+		char* outstr;
+		int ret;
+
+		src = bbus_obj_build("s", str);
+		BBUSUNIT_ASSERT_NOTNULL(src);
+		size = bbus_obj_rawsize(src);
+		memcpy(buf, bbus_obj_rawdata(src), size);
+
+		view = bbus_obj_view(buf, size);
+		BBUSUNIT_ASSERT_NOTNULL(view);
+		BBUSUNIT_ASSERT_EQ(buf, bbus_obj_rawdata(view));
+		ret = bbus_obj_parse(view, "s", &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+		/* Resetting and inserting must never touch the viewed buffer. */
+		bbus_obj_reset(view);
+		ret = bbus_obj_insstr(view, "other");
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_FALSE(buf == bbus_obj_rawdata(view));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(buf, bbus_obj_rawdata(src), size));
+		bbus_obj_free(view);
+
+		view = bbus_obj_view(buf, size);
+		BBUSUNIT_ASSERT_NOTNULL(view);
+		ret = bbus_obj_detach(view);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		memset(buf, 0, sizeof(buf));
+		ret = bbus_obj_parse(view, "s", &outstr);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_STREQ(str, outstr);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(src);
+		bbus_obj_free(view);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_compiled_descr)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char* const descr = "A(us)(u(bb))";
+		static const char* const proprepr =
+			"bbus_object(A[(287454020, 'oneone')(1432778632, "
+			"'twotwo')](2864434397, (0xf0, 0x58)))";
+
+		bbus_obj_prog* prog = NULL;
+		bbus_object* obj = NULL;
+		bbus_object* ref = NULL;
+		char buf[256];
+		bbus_size arrsize;
+		bbus_uint32 au1;
+		bbus_uint32 au2;
+		char* as1;
+		char* as2;
+		bbus_uint32 su;
+		bbus_byte sb1;
+		bbus_byte sb2;
+		int ret;
+
+		BBUSUNIT_ASSERT_NULL(bbus_obj_compile("A"));
+		BBUSUNIT_ASSERT_NULL(bbus_obj_compile("(u"));
+		BBUSUNIT_ASSERT_NULL(bbus_obj_compile("()"));
+		BBUSUNIT_ASSERT_NULL(bbus_obj_compile("u)"));
+
+		prog = bbus_obj_compile(descr);
+		BBUSUNIT_ASSERT_NOTNULL(prog);
+		obj = bbus_obj_build_prog(prog, 2,
+				0x11223344u, "oneone",
+				0x55667788u, "twotwo",
+				0xaabbccddu, 0xf0, 0x58);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ref = bbus_obj_build(descr, 2,
+				0x11223344u, "oneone",
+				0x55667788u, "twotwo",
+				0xaabbccddu, 0xf0, 0x58);
+		BBUSUNIT_ASSERT_NOTNULL(ref);
+		BBUSUNIT_ASSERT_EQ(bbus_obj_rawsize(ref), bbus_obj_rawsize(obj));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(bbus_obj_rawdata(ref),
+				bbus_obj_rawdata(obj), bbus_obj_rawsize(obj)));
+
+		ret = bbus_obj_parse_prog(obj, prog, &arrsize, &au1, &as1,
+					&au2, &as2, &su, &sb1, &sb2);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(2, arrsize);
+		BBUSUNIT_ASSERT_EQ(0x55667788, au2);
+		BBUSUNIT_ASSERT_STREQ("twotwo", as2);
+		BBUSUNIT_ASSERT_EQ(0xAABBCCDD, su);
+		BBUSUNIT_ASSERT_EQ(0x58, sb2);
+
+		ret = bbus_obj_repr_prog(obj, prog, buf, sizeof(buf));
+		BBUSUNIT_ASSERT_EQ(strlen(proprepr), (size_t)ret);
+		BBUSUNIT_ASSERT_STREQ(proprepr, buf);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+		bbus_obj_free(ref);
+		bbus_obj_prog_free(prog);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(object_reserve)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_object* obj = NULL;
+		void* data;
+		int ret;
+		int i;
+
+		obj = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ret = bbus_obj_reserve(obj, 1000 * sizeof(bbus_uint32));
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = bbus_obj_insuint(obj, 0);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		data = bbus_obj_rawdata(obj);
+		/* No reallocation within the reserved space. */
+		for (i = 1; i < 1000; ++i) {
+			ret = bbus_obj_insuint(obj, i);
+			BBUSUNIT_ASSERT_EQ(0, ret);
+		}
+		BBUSUNIT_ASSERT_EQ(data, bbus_obj_rawdata(obj));
+		BBUSUNIT_ASSERT_EQ(1000 * sizeof(bbus_uint32),
+						bbus_obj_rawsize(obj));
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+
+	BBUSUNIT_ENDTEST;
+}
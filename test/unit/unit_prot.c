@@ -13,9 +13,15 @@
  */
 
 #include "bbus-unit.h"
+#include "../../lib/socket.h"
+#include "../../lib/protocol.h"
 #include <busybus.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/vm_sockets.h>
 
 #define MKMSG(MSG, MSGTYPE, SOTYPE, ERR, TOKEN, PSIZE, FLAGS, PLOAD)	\
 	do {								\
@@ -117,6 +123,33 @@ BBUSUNIT_DEFINE_TEST(prot_extract_meta_and_obj)
 	BBUSUNIT_ENDTEST;
 }
 
+BBUSUNIT_DEFINE_TEST(prot_extract_raw_obj)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char payload[] =	"meta string\0"
+						"\x11\x22\x33\x44";
+		static const size_t payloadsize = sizeof(payload)-1;
+
+		char msgbuf[BBUS_MSGHDR_SIZE + payloadsize];
+		struct bbus_msg* msg = (struct bbus_msg*)msgbuf;
+		const void* obj;
+		size_t objsize = 0;
+
+		MKMSG(msg, BBUS_MSGTYPE_SO, BBUS_SOTYPE_NONE,
+			BBUS_PROT_EGOOD, 0, payloadsize,
+			BBUS_PROT_HASMETA | BBUS_PROT_HASOBJECT, payload);
+
+		obj = bbus_prot_extractrawobj(msg, &objsize);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		BBUSUNIT_ASSERT_EQ(sizeof(bbus_uint32), objsize);
+		/* Must point inside the message, not to a copy. */
+		BBUSUNIT_ASSERT_EQ(msg->payload + sizeof("meta string"), obj);
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
 BBUSUNIT_DEFINE_TEST(prot_extract_invalid_meta)
 {
 	BBUSUNIT_BEGINTEST;
@@ -205,9 +238,325 @@ BBUSUNIT_DEFINE_TEST(prot_set_psize_gtmax)
 
 		memset(&hdr, 0, sizeof(struct bbus_msg_hdr));
 		bbus_hdr_setpsize(&hdr, size);
-		BBUSUNIT_ASSERT_EQ(UINT16_MAX, bbus_hdr_getpsize(&hdr));
+		BBUSUNIT_ASSERT_EQ(size, bbus_hdr_getpsize(&hdr));
+		BBUSUNIT_ASSERT_TRUE(BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_LARGE));
+
+		bbus_hdr_setpsize(&hdr, 16);
+		BBUSUNIT_ASSERT_EQ(16, bbus_hdr_getpsize(&hdr));
+		BBUSUNIT_ASSERT_FALSE(BBUS_HDR_ISFLAGSET(&hdr, BBUS_PROT_LARGE));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+
+BBUSUNIT_DEFINE_TEST(prot_hdr_pack)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char expected[] =	"\xBB\xC5"		/* magic */
+						"\x07"			/* msgtype */
+						"\x00"			/* sotype */
+						"\x02"			/* errcode */
+						"\x11\x22\x33\x44"	/* token */
+						"\x01\x02"		/* psize */
+						"\x03";			/* flags */
+
+		struct bbus_msg_hdr hdr;
+		char buf[BBUS_MSGHDR_MAXWIRESIZE];
+
+		BBUSUNIT_ASSERT_EQ(sizeof(expected)-1, BBUS_MSGHDR_REALSIZE);
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL,
+					BBUS_PROT_EMETHODERR);
+		bbus_hdr_settoken(&hdr, 0x11223344);
+		bbus_hdr_setpsize(&hdr, 0x0102);
+		hdr.flags = BBUS_PROT_HASMETA | BBUS_PROT_HASOBJECT;
+		BBUSUNIT_ASSERT_EQ(BBUS_MSGHDR_REALSIZE,
+					bbus_hdr_pack(&hdr, buf));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(expected, buf,
+						BBUS_MSGHDR_REALSIZE));
 
 	BBUSUNIT_FINALLY;
 	BBUSUNIT_ENDTEST;
 }
 
+BBUSUNIT_DEFINE_TEST(prot_hdr_pack_large)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char expected[] =	"\xBB\xC5"		/* magic */
+						"\x07"			/* msgtype */
+						"\x00"			/* sotype */
+						"\x00"			/* errcode */
+						"\x00\x00\x00\x01"	/* token */
+						"\x00\x00"		/* psize */
+						"\x06"			/* flags */
+						"\x00\x12\x34\x56";	/* xpsize */
+
+		struct bbus_msg_hdr hdr;
+		struct bbus_msg_hdr unpacked;
+		char buf[BBUS_MSGHDR_MAXWIRESIZE];
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+		bbus_hdr_settoken(&hdr, 1);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		bbus_hdr_setpsize(&hdr, 0x123456);
+		BBUSUNIT_ASSERT_EQ(sizeof(expected)-1,
+					bbus_hdr_pack(&hdr, buf));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(expected, buf,
+						sizeof(expected)-1));
+
+		bbus_hdr_unpack(&unpacked, buf);
+		BBUSUNIT_ASSERT_EQ(0x123456, bbus_hdr_getpsize(&unpacked));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_hdr_pack_timeout)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char expected[] =	"\xBB\xC5"		/* magic */
+						"\x07"			/* msgtype */
+						"\x00"			/* sotype */
+						"\x00"			/* errcode */
+						"\x00\x00\x00\x01"	/* token */
+						"\x00\x00"		/* psize */
+						"\x16"			/* flags */
+						"\x00\x12\x34\x56"	/* xpsize */
+						"\x00\x00\x05\xDC";	/* timeout */
+
+		struct bbus_msg_hdr hdr;
+		struct bbus_msg_hdr unpacked;
+		char buf[BBUS_MSGHDR_MAXWIRESIZE];
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+		bbus_hdr_settoken(&hdr, 1);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		bbus_hdr_setpsize(&hdr, 0x123456);
+		bbus_hdr_settimeout(&hdr, 1500);
+		BBUSUNIT_ASSERT_EQ(sizeof(expected)-1,
+					bbus_hdr_pack(&hdr, buf));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(expected, buf,
+						sizeof(expected)-1));
+
+		bbus_hdr_unpack(&unpacked, buf);
+		BBUSUNIT_ASSERT_EQ(0x123456, bbus_hdr_getpsize(&unpacked));
+		BBUSUNIT_ASSERT_EQ(1500, bbus_hdr_gettimeout(&unpacked));
+
+		bbus_hdr_settimeout(&unpacked, 0);
+		BBUSUNIT_ASSERT_FALSE(BBUS_HDR_ISFLAGSET(&unpacked,
+						BBUS_PROT_HASTIMEOUT));
+		BBUSUNIT_ASSERT_EQ(0, bbus_hdr_gettimeout(&unpacked));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_hdr_pack_route)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char expected[] =	"\xBB\xC5"		/* magic */
+						"\x07"			/* msgtype */
+						"\x00"			/* sotype */
+						"\x00"			/* errcode */
+						"\x00\x00\x00\x01"	/* token */
+						"\x00\x04"		/* psize */
+						"\x32"			/* flags */
+						"\x00\x00\x00\x0A"	/* timeout */
+						"\x00\x01\x00\x07";	/* route */
+
+		struct bbus_msg_hdr hdr;
+		struct bbus_msg_hdr unpacked;
+		char buf[BBUS_MSGHDR_MAXWIRESIZE];
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+		bbus_hdr_settoken(&hdr, 1);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		bbus_hdr_setpsize(&hdr, 4);
+		bbus_hdr_settimeout(&hdr, 10);
+		bbus_hdr_setroute(&hdr, 0x10007);
+		BBUSUNIT_ASSERT_EQ(sizeof(expected)-1,
+					bbus_hdr_pack(&hdr, buf));
+		BBUSUNIT_ASSERT_EQ(0, memcmp(expected, buf,
+						sizeof(expected)-1));
+
+		bbus_hdr_unpack(&unpacked, buf);
+		BBUSUNIT_ASSERT_EQ(10, bbus_hdr_gettimeout(&unpacked));
+		BBUSUNIT_ASSERT_EQ(0x10007, bbus_hdr_getroute(&unpacked));
+
+		bbus_hdr_setroute(&unpacked, 0);
+		BBUSUNIT_ASSERT_FALSE(BBUS_HDR_ISFLAGSET(&unpacked,
+						BBUS_PROT_HASROUTE));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_hdr_unpack)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char wire[] =	"\xBB\xC5\x01\x03\x00"
+						"\xAA\xBB\xCC\xDD"
+						"\x00\x20\x01";
+
+		struct bbus_msg_hdr hdr;
+		char buf[BBUS_MSGHDR_MAXWIRESIZE];
+
+		bbus_hdr_unpack(&hdr, wire);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(BBUS_MAGIC, &hdr.magic,
+						BBUS_MAGIC_SIZE));
+		BBUSUNIT_ASSERT_EQ(BBUS_MSGTYPE_SO, hdr.msgtype);
+		BBUSUNIT_ASSERT_EQ(BBUS_SOTYPE_MON, hdr.sotype);
+		BBUSUNIT_ASSERT_EQ(BBUS_PROT_EGOOD, hdr.errcode);
+		BBUSUNIT_ASSERT_EQ(0xAABBCCDD, bbus_hdr_gettoken(&hdr));
+		BBUSUNIT_ASSERT_EQ(0x20, bbus_hdr_getpsize(&hdr));
+		BBUSUNIT_ASSERT_EQ(BBUS_PROT_HASMETA, hdr.flags);
+
+		/* Packing it again must give us the same bytes. */
+		bbus_hdr_pack(&hdr, buf);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(wire, buf, BBUS_MSGHDR_REALSIZE));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_check_so_compressed)
+{
+	BBUSUNIT_BEGINTEST;
+
+		struct bbus_msg_hdr hdr;
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_SO, BBUS_PROT_EGOOD);
+		hdr.flags = BBUS_PROT_HOSTORDER;
+		bbus_hdr_settoken(&hdr, BBUS_SO_BUSYPOLL);
+		BBUSUNIT_ASSERT_EQ(0, __bbus_prot_checkhdr(&hdr, 0));
+
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_COMPRESSED);
+		BBUSUNIT_ASSERT_EQ(-1, __bbus_prot_checkhdr(&hdr, 0));
+		BBUSUNIT_ASSERT_EQ(BBUS_EMSGINVFMT, bbus_lasterror());
+
+		/* Anywhere else it just tells the object is compressed. */
+		hdr.msgtype = BBUS_MSGTYPE_CLICALL;
+		BBUSUNIT_ASSERT_EQ(0, __bbus_prot_checkhdr(&hdr, 0));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_parse_addr)
+{
+	BBUSUNIT_BEGINTEST;
+
+		struct __bbus_sockaddr addr;
+		struct sockaddr_in* in = (struct sockaddr_in*)&addr.addr;
+		struct sockaddr_vm* vm = (struct sockaddr_vm*)&addr.addr;
+
+		BBUSUNIT_ASSERT_EQ(0, __bbus_sock_parseaddr("/tmp/bbus.sock",
+									&addr));
+		BBUSUNIT_ASSERT_EQ(__BBUS_TRANSPORT_UNIX, addr.transport);
+		BBUSUNIT_ASSERT_EQ(AF_UNIX, addr.addr.ss_family);
+
+		BBUSUNIT_ASSERT_EQ(0, __bbus_sock_parseaddr("tcp:127.0.0.1:8080",
+									&addr));
+		BBUSUNIT_ASSERT_EQ(__BBUS_TRANSPORT_TCP, addr.transport);
+		BBUSUNIT_ASSERT_EQ(AF_INET, addr.addr.ss_family);
+		BBUSUNIT_ASSERT_EQ(htons(8080), in->sin_port);
+
+		BBUSUNIT_ASSERT_EQ(0, __bbus_sock_parseaddr("vsock:any:1234",
+									&addr));
+		BBUSUNIT_ASSERT_EQ(__BBUS_TRANSPORT_VSOCK, addr.transport);
+		BBUSUNIT_ASSERT_EQ(VMADDR_CID_ANY, vm->svm_cid);
+		BBUSUNIT_ASSERT_EQ(1234, vm->svm_port);
+
+		BBUSUNIT_ASSERT_EQ(-1, __bbus_sock_parseaddr("tcp:127.0.0.1",
+									&addr));
+		BBUSUNIT_ASSERT_EQ(BBUS_EINVALADDR, bbus_lasterror());
+		BBUSUNIT_ASSERT_EQ(-1, __bbus_sock_parseaddr("vsock:x:1",
+									&addr));
+		BBUSUNIT_ASSERT_EQ(-1, __bbus_sock_parseaddr("unix:", &addr));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(prot_trace_read)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char meta[] = "bbus.echod.echo";
+
+		struct bbus_trace_filehdr filehdr;
+		struct bbus_trace_rechdr rec;
+		struct bbus_trace_event ev;
+		struct bbus_msg_hdr hdr;
+		char wire[BBUS_MSGHDR_MAXWIRESIZE];
+		char path[] = "/tmp/bbus-unit-trace-XXXXXX";
+		bbus_trace* trace = NULL;
+		size_t wiresize;
+		int fd;
+
+		fd = mkstemp(path);
+		BBUSUNIT_ASSERT_TRUE(fd >= 0);
+
+		memset(&filehdr, 0, sizeof(filehdr));
+		memcpy(filehdr.magic, BBUS_TRACE_MAGIC, sizeof(filehdr.magic));
+		filehdr.byteorder = BBUS_TRACE_BYTEORDER;
+		BBUSUNIT_ASSERT_EQ((ssize_t)sizeof(filehdr),
+				write(fd, &filehdr, sizeof(filehdr)));
+
+		bbus_hdr_build(&hdr, BBUS_MSGTYPE_CLICALL, BBUS_PROT_EGOOD);
+		bbus_hdr_settoken(&hdr, 42);
+		bbus_hdr_setpsize(&hdr, sizeof(meta) + 4);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASMETA);
+		BBUS_HDR_SETFLAG(&hdr, BBUS_PROT_HASOBJECT);
+		wiresize = bbus_hdr_pack(&hdr, wire);
+
+		memset(&rec, 0, sizeof(rec));
+		rec.tstamp = 123456789;
+		rec.size = wiresize + sizeof(meta) + 4;
+		rec.direction = BBUS_TRACE_SENT;
+		rec.shard = 2;
+		BBUSUNIT_ASSERT_EQ((ssize_t)sizeof(rec),
+				write(fd, &rec, sizeof(rec)));
+		BBUSUNIT_ASSERT_EQ((ssize_t)wiresize,
+				write(fd, wire, wiresize));
+		BBUSUNIT_ASSERT_EQ((ssize_t)sizeof(meta),
+				write(fd, meta, sizeof(meta)));
+		/* Already aligned to BBUS_TRACE_ALIGN - no padding needed. */
+		BBUSUNIT_ASSERT_EQ(4, write(fd, "\x00\x00\x00\x05", 4));
+
+		/* Record cut short by an interrupted capture. */
+		BBUSUNIT_ASSERT_EQ((ssize_t)sizeof(rec),
+				write(fd, &rec, sizeof(rec)));
+		close(fd);
+
+		trace = bbus_trace_open(path);
+		BBUSUNIT_ASSERT_NOTNULL(trace);
+		BBUSUNIT_ASSERT_EQ(1, bbus_trace_next(trace, &ev));
+		BBUSUNIT_ASSERT_EQ(123456789, ev.tstamp);
+		BBUSUNIT_ASSERT_EQ(BBUS_TRACE_SENT, ev.direction);
+		BBUSUNIT_ASSERT_EQ(2, ev.shard);
+		BBUSUNIT_ASSERT_EQ(BBUS_MSGTYPE_CLICALL, ev.hdr.msgtype);
+		BBUSUNIT_ASSERT_EQ(42, bbus_hdr_gettoken(&ev.hdr));
+		BBUSUNIT_ASSERT_STREQ(meta, ev.meta);
+		BBUSUNIT_ASSERT_EQ(4, ev.objsize);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(ev.obj, "\x00\x00\x00\x05", 4));
+		BBUSUNIT_ASSERT_EQ(0, bbus_trace_next(trace, &ev));
+
+		bbus_trace_rewind(trace);
+		BBUSUNIT_ASSERT_EQ(1, bbus_trace_next(trace, &ev));
+		BBUSUNIT_ASSERT_EQ(42, bbus_hdr_gettoken(&ev.hdr));
+
+	BBUSUNIT_FINALLY;
+
+		if (trace != NULL)
+			bbus_trace_close(trace);
+		unlink(path);
+
+	BBUSUNIT_ENDTEST;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-unit.h"
+#include "../../bin/bbusd/replycache.h"
+#include "../../bin/bbusd/shard.h"
+#include <busybus.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * Only the reply cache is linked in from bbusd - these stand in for the
+ * rest of the daemon.
+ */
+static uint64_t fakenow = 1;
+
+uint64_t bbusd_stats_now(void)
+{
+	return fakenow;
+}
+
+void bbusd_count(enum bbusd_counter cnt BBUS_UNUSED, long delta BBUS_UNUSED)
+{
+
+}
+
+void bbusd_method_get(struct bbusd_method* mthd)
+{
+	mthd->refs++;
+}
+
+void bbusd_method_put(struct bbusd_method* mthd)
+{
+	mthd->refs--;
+}
+
+void bbusd_die(const char* format BBUS_UNUSED, ...)
+{
+	abort();
+}
+
+static void init_method(struct bbusd_remote_method* mthd)
+{
+	memset(mthd, 0, sizeof(struct bbusd_remote_method));
+	mthd->type = BBUSD_METHOD_REMOTE;
+	mthd->refs = 1;
+	mthd->cachettl = 100;
+}
+
+BBUSUNIT_DEFINE_TEST(rcache_inflight_fill)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char arg[] = "argument";
+		static const char reply[] = "reply";
+		struct bbusd_remote_method mthd;
+		const void* obj;
+		size_t objsize = 0;
+		int objflags = 0;
+		uint32_t hash1;
+		uint32_t hash2;
+		unsigned ticket1;
+		unsigned ticket2;
+
+		init_method(&mthd);
+		bbusd_init_rcache(4);
+
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash1, &ticket1);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_NOTEQ(0, ticket1);
+
+		/* The second call goes through, but can't take the ticket. */
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash2, &ticket2);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_EQ(0, ticket2);
+
+		bbusd_rcache_fill(hash1, ticket1, reply, sizeof(reply), 0);
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash2, &ticket2);
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		BBUSUNIT_ASSERT_EQ(sizeof(reply), objsize);
+		BBUSUNIT_ASSERT_EQ(0, memcmp(obj, reply, sizeof(reply)));
+
+		/* Other arguments aren't answered with the same reply. */
+		obj = bbusd_rcache_lookup(&mthd, reply, sizeof(reply), 0,
+				&objsize, &objflags, &hash2, &ticket2);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_NOTEQ(0, ticket2);
+
+	BBUSUNIT_FINALLY;
+
+		bbusd_free_rcache();
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(rcache_stale)
+{
+	BBUSUNIT_BEGINTEST;
+
+		static const char arg[] = "argument";
+		static const char reply[] = "reply";
+		struct bbusd_remote_method mthd;
+		const void* obj;
+		size_t objsize = 0;
+		int objflags = 0;
+		uint32_t hash;
+		unsigned ticket;
+
+		init_method(&mthd);
+		bbusd_init_rcache(4);
+
+		/* A ticket never used is given up after the ttl. */
+		(void)bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash, &ticket);
+		fakenow += 100 * 1000000ULL;
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash, &ticket);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_NOTEQ(0, ticket);
+
+		/* Invalidated replies are never used. */
+		bbusd_rcache_fill(hash, ticket, reply, sizeof(reply), 0);
+		mthd.cachegen++;
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash, &ticket);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_NOTEQ(0, ticket);
+
+		/* Neither are expired ones. */
+		bbusd_rcache_fill(hash, ticket, reply, sizeof(reply), 0);
+		fakenow += 100 * 1000000ULL;
+		obj = bbusd_rcache_lookup(&mthd, arg, sizeof(arg), 0,
+				&objsize, &objflags, &hash, &ticket);
+		BBUSUNIT_ASSERT_NULL(obj);
+		BBUSUNIT_ASSERT_NOTEQ(0, ticket);
+
+		/* The cache's references are all gone. */
+		bbusd_free_rcache();
+		BBUSUNIT_ASSERT_EQ(1, mthd.refs);
+
+	BBUSUNIT_FINALLY;
+
+		bbusd_free_rcache();
+
+	BBUSUNIT_ENDTEST;
+}
@@ -14,6 +14,7 @@
 
 #include "bbus-unit.h"
 #include <busybus.h>
+#include <stdio.h>
 
 BBUSUNIT_DEFINE_TEST(regex_match)
 {
@@ -43,3 +44,45 @@ BBUSUNIT_DEFINE_TEST(regex_invalid_pattern)
 	BBUSUNIT_FINALLY;
 	BBUSUNIT_ENDTEST;
 }
+
+BBUSUNIT_DEFINE_TEST(regex_compiled)
+{
+	BBUSUNIT_BEGINTEST;
+
+		bbus_regex* regex = NULL;
+
+		regex = bbus_regex_compile("^bbus\\.[a-z]+\\.echo$");
+		BBUSUNIT_ASSERT_NOTNULL(regex);
+		BBUSUNIT_ASSERT_EQ(BBUS_TRUE,
+				bbus_regex_exec(regex, "bbus.echod.echo"));
+		BBUSUNIT_ASSERT_EQ(BBUS_FALSE,
+				bbus_regex_exec(regex, "bbus.echod.other"));
+		BBUSUNIT_ASSERT_NULL(bbus_regex_compile("[(-"));
+		BBUSUNIT_ASSERT_EQ(BBUS_EREGEXPTRN, bbus_lasterror());
+
+	BBUSUNIT_FINALLY;
+
+		bbus_regex_free(regex);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(regex_cache_eviction)
+{
+	BBUSUNIT_BEGINTEST;
+
+		char pattern[16];
+		unsigned i;
+
+		/* Cycle through more patterns than the cache can hold. */
+		for (i = 0; i < 2 * BBUS_REGEX_CACHESIZE; ++i) {
+			snprintf(pattern, sizeof(pattern), "^a{%u}$", i + 1);
+			BBUSUNIT_ASSERT_EQ(BBUS_FALSE,
+					bbus_regex_match(pattern, ""));
+		}
+		BBUSUNIT_ASSERT_EQ(BBUS_TRUE, bbus_regex_match("^a{3}$", "aaa"));
+		BBUSUNIT_ASSERT_EQ(BBUS_FALSE, bbus_regex_match("^a{3}$", "aa"));
+
+	BBUSUNIT_FINALLY;
+	BBUSUNIT_ENDTEST;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2013 Bartosz Golaszewski <bartekgola@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ */
+
+#include "bbus-unit.h"
+#include <busybus.h>
+
+#define BBUS_STUB_PREFIX	unit
+#define BBUS_STUB_SERVICE	"unit"
+#define BBUS_STUB_SERVER
+#define BBUS_STUB_METHODS(METHOD)					\
+	METHOD(mix, mix_args, mix_ret)					\
+	METHOD(ping, ping_args, ping_ret)
+#define mix_args(FIELD)							\
+	FIELD(INT, num)							\
+	FIELD(STR, name)						\
+	FIELD(BYTE, flag)
+#define mix_ret(FIELD)							\
+	FIELD(UINT, len)						\
+	FIELD(STR, name)
+#define ping_args(FIELD)
+#define ping_ret(FIELD)		FIELD(UINT, pong)
+#include <busybus-stub.h>
+
+int unit_mix_impl(const struct unit_mix_args* args, struct unit_mix_ret* ret)
+{
+	if (args->flag == 0)
+		return -1;
+
+	ret->len = strlen(args->name) + args->num;
+	ret->name = args->name;
+
+	return 0;
+}
+
+int unit_ping_impl(const struct unit_ping_args* args BBUS_UNUSED,
+						struct unit_ping_ret* ret)
+{
+	ret->pong = 1234;
+
+	return 0;
+}
+
+BBUSUNIT_DEFINE_TEST(stub_codec_roundtrip)
+{
+	BBUSUNIT_BEGINTEST;
+
+		struct unit_mix_args args = {
+			.num = -5,
+			.name = "stub",
+			.flag = 1,
+		};
+		struct unit_mix_args dec;
+		bbus_object* obj = NULL;
+		bbus_int32 num;
+		char* name;
+		bbus_byte flag;
+		int ret;
+
+		obj = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(obj);
+		ret = unit_mix_encargs(obj, &args);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+
+		/* Same wire format as the interpreted functions. */
+		ret = bbus_obj_parse(obj, "isb", &num, &name, &flag);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(-5, num);
+		BBUSUNIT_ASSERT_STREQ("stub", name);
+		BBUSUNIT_ASSERT_EQ(1, flag);
+
+		ret = unit_mix_decargs(obj, &dec);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		BBUSUNIT_ASSERT_EQ(-5, dec.num);
+		BBUSUNIT_ASSERT_STREQ("stub", dec.name);
+		BBUSUNIT_ASSERT_EQ(1, dec.flag);
+
+		/* Truncated objects are rejected. */
+		bbus_obj_reset(obj);
+		ret = bbus_obj_insint(obj, 3);
+		BBUSUNIT_ASSERT_EQ(0, ret);
+		ret = unit_mix_decargs(obj, &dec);
+		BBUSUNIT_ASSERT_EQ(-1, ret);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(obj);
+
+	BBUSUNIT_ENDTEST;
+}
+
+BBUSUNIT_DEFINE_TEST(stub_skeleton)
+{
+	BBUSUNIT_BEGINTEST;
+
+		struct unit_mix_args args = {
+			.num = 2,
+			.name = "skeleton",
+			.flag = 1,
+		};
+		struct unit_mix_ret ret;
+		struct unit_ping_ret pong;
+		bbus_object* arg = NULL;
+		bbus_object* retobj = NULL;
+
+		BBUSUNIT_ASSERT_EQ(2, BBUS_ARRAY_SIZE(unit_methods));
+		BBUSUNIT_ASSERT_STREQ("mix", unit_methods[0].name);
+		BBUSUNIT_ASSERT_STREQ("isb", unit_methods[0].argdscr);
+		BBUSUNIT_ASSERT_STREQ("us", unit_methods[0].retdscr);
+		BBUSUNIT_ASSERT_STREQ("", unit_methods[1].argdscr);
+		BBUSUNIT_ASSERT_STREQ("u", unit_methods[1].retdscr);
+
+		arg = bbus_obj_alloc();
+		BBUSUNIT_ASSERT_NOTNULL(arg);
+		BBUSUNIT_ASSERT_EQ(0, unit_mix_encargs(arg, &args));
+		retobj = unit_methods[0].func(arg);
+		BBUSUNIT_ASSERT_NOTNULL(retobj);
+		BBUSUNIT_ASSERT_EQ(0, unit_mix_decret(retobj, &ret));
+		BBUSUNIT_ASSERT_EQ(10, ret.len);
+		BBUSUNIT_ASSERT_STREQ("skeleton", ret.name);
+		bbus_obj_free(retobj);
+		retobj = NULL;
+
+		/* Errors returned by the implementation fail the call. */
+		args.flag = 0;
+		bbus_obj_reset(arg);
+		BBUSUNIT_ASSERT_EQ(0, unit_mix_encargs(arg, &args));
+		BBUSUNIT_ASSERT_NULL(unit_methods[0].func(arg));
+
+		bbus_obj_reset(arg);
+		retobj = unit_methods[1].func(arg);
+		BBUSUNIT_ASSERT_NOTNULL(retobj);
+		BBUSUNIT_ASSERT_EQ(0, unit_ping_decret(retobj, &pong));
+		BBUSUNIT_ASSERT_EQ(1234, pong.pong);
+
+	BBUSUNIT_FINALLY;
+
+		bbus_obj_free(arg);
+		bbus_obj_free(retobj);
+
+	BBUSUNIT_ENDTEST;
+}